@@ -0,0 +1,28 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * bench.h - Shared pieces of the *-bench timing tools
+ *
+ * A wall clock in microseconds, and the formats the benches use to
+ * print what they measured with it, eg.
+ *
+ *   fprintf(stdout, "%-10s " BENCH_SECONDS "\n", name, BENCH_SECONDS_ARGS(elapsed));
+ */
+#pragma once
+
+#include <stdint.h>
+#include <sys/time.h>
+
+static inline uint64_t now_us(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+#define BENCH_SECONDS "%4llu.%03llus"
+#define BENCH_SECONDS_ARGS(us) (unsigned long long)((us) / 1000000), (unsigned long long)((us) / 1000 % 1000)
+
+#define BENCH_MILLIS "%6llu.%03llums"
+#define BENCH_MILLIS_ARGS(us) (unsigned long long)((us) / 1000), (unsigned long long)((us) % 1000)
@@ -0,0 +1,140 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * bim-bench - time how long bim takes to open a large file
+ *
+ * Writes out a large C source file (or uses the one given), then
+ * starts bim on it with --first-paint, which exits as soon as the
+ * first screen has been drawn, and reports how long that took from
+ * fork to exit. It does this with syntax highlighting both on and
+ * off, so the difference is what highlighting costs at startup, and
+ * once more with large file mode turned off. Files of 16MiB or more
+ * (-l 1000000 makes one) are opened in large file mode by default.
+ * Run it from a terminal; bim draws to it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+static int generate(char * path, int lines) {
+	FILE * f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "bim-bench: %s: could not create\n", path);
+		return 1;
+	}
+
+	/* A bit of everything the C highlighter cares about */
+	for (int i = 0; i < lines; i += 10) {
+		fprintf(f,
+			"/**\n"
+			" * Function number %d, with a block comment.\n"
+			" */\n"
+			"static int function_%d(const char * str, int count) {\n"
+			"\tint total = 0x%x; // line comment\n"
+			"\tfor (int i = 0; i < count; ++i) total += str[i] == '\\n';\n"
+			"\tif (total > %d) printf(\"%%s: %%d\\n\", \"function_%d\", total);\n"
+			"#ifdef DEBUG\n"
+			"\treturn -1;\n"
+			"#endif\n"
+			"\treturn total; }\n", i, i, i, i, i);
+	}
+
+	fclose(f);
+	return 0;
+}
+
+static const char * modes[] = {"nosyntax", "cansyntax", "nolarge"};
+#define MODES (sizeof(modes) / sizeof(*modes))
+
+static uint64_t run(char * path, const char * mode) {
+	uint64_t start = now_us();
+	pid_t child = fork();
+	if (!child) {
+		char * args[] = {"bim", "-O", (char *)mode, "--first-paint", path, NULL};
+		execvp(args[0], args);
+		exit(127);
+	}
+	int status;
+	waitpid(child, &status, 0);
+	return now_us() - start;
+}
+
+static void report(const char * name, uint64_t best, uint64_t total, int runs) {
+	uint64_t avg = total / runs;
+	fprintf(stdout, "%-10s best " BENCH_MILLIS "  average " BENCH_MILLIS "\n", name,
+		BENCH_MILLIS_ARGS(best), BENCH_MILLIS_ARGS(avg));
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-l LINES] [-r RUNS] [-k] [FILE]\n"
+			"\n"
+			" -l     \033[3mlines in the generated file (default 200000)\033[0m\n"
+			" -r     \033[3mtimes to start bim each way (default 3)\033[0m\n"
+			" -k     \033[3mkeep the generated file\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int lines = 200000;
+	int runs = 3;
+	int keep = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "?l:r:k")) != -1) {
+		switch (opt) {
+			case 'l':
+				lines = atoi(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	if (runs < 1) return usage(argv);
+
+	char * path = "/tmp/bim-bench.c";
+	int generated = 0;
+	if (optind < argc) {
+		path = argv[optind];
+	} else {
+		if (generate(path, lines)) return 1;
+		generated = 1;
+	}
+
+	uint64_t best[MODES], total[MODES];
+	for (size_t m = 0; m < MODES; ++m) {
+		best[m] = UINT64_MAX;
+		total[m] = 0;
+	}
+	for (int i = 0; i < runs; ++i) {
+		for (size_t m = 0; m < MODES; ++m) {
+			uint64_t t = run(path, modes[m]);
+			if (t < best[m]) best[m] = t;
+			total[m] += t;
+		}
+	}
+
+	for (size_t m = 0; m < MODES; ++m) {
+		report(modes[m], best[m], total[m], runs);
+	}
+
+	if (generated && !keep) unlink(path);
+
+	return 0;
+}
@@ -77,6 +77,8 @@ global_config_t global_config = {
 	.search_wraps = 1,
 	.had_error = 0,
 	.use_biminfo = 1,
+	.screen_diff = 1,
+	.large_files = 1,
 	/* Integer config values */
 	.cursor_padding = 4,
 	.split_percent = 50,
@@ -137,6 +139,8 @@ struct SyntaxState {
 };
 
 static void schedule_complete_recalc(void);
+static void schedule_syntax_pass(void);
+static void syntax_prepare(int line_no);
 
 /**
  * Theming data
@@ -241,8 +245,11 @@ void bim_unget(int c) {
 }
 
 void redraw_statusbar(void);
+void screen_flush(void);
+void screen_suspend(void);
+void screen_resume(void);
 int bim_getch_timeout(int timeout) {
-	fflush(stdout);
+	screen_flush();
 	if (_bim_unget != -1) {
 		int out = _bim_unget;
 		_bim_unget = -1;
@@ -646,7 +653,7 @@ int fetch_from_biminfo(buffer_t * buf) {
 			sscanf(line+1+strlen(tmp_path)+21,"%d",&buf->col_no);
 
 			if (buf->line_no > buf->line_count) buf->line_no = buf->line_count;
-			if (buf->col_no > buf->lines[buf->line_no-1]->actual) buf->col_no = buf->lines[buf->line_no-1]->actual;
+			if (buf->col_no > buffer_line(buf, buf->line_no-1)->actual) buf->col_no = buffer_line(buf, buf->line_no-1)->actual;
 			try_to_center();
 
 			fclose(biminfo);
@@ -758,10 +765,12 @@ buffer_t * buffer_close(buffer_t * buf) {
 
 	/* Clean up lines used by old buffer */
 	for (int i = 0; i < buf->line_count; ++i) {
-		free(buf->lines[i]);
+		if (!LINE_IS_PENDING(buf->lines[i])) free(buf->lines[i]);
 	}
 
 	free(buf->lines);
+	free(buf->source);
+	search_cache_drop(buf);
 
 	if (buf->file_name) {
 		free(buf->file_name);
@@ -933,11 +942,137 @@ void add_syntax(struct syntax_definition def) {
 }
 
 void redraw_all(void);
+void redraw_line(int x);
+
+/**
+ * Run the highlighter over one line, starting from its stored
+ * initial state, and return the state the next line should start in.
+ *
+ * If the highlighter fails, it is disabled for this environment
+ * and `env->syntax` will be NULL when we return.
+ */
+static int syntax_run(line_t * line, int line_no) {
+	for (int i = 0; i < line->actual; ++i) {
+		line->text[i].flags = line->text[i].flags & (3 << 5);
+	}
+
+	if (!env->syntax) {
+		if (line_no != -1) rehighlight_search(line);
+		return -1;
+	}
+
+	/* Start from the line's stored in initial state */
+	struct SyntaxState * s = (void*)krk_newInstance(env->syntax->krkClass);
+	s->state.env = env;
+	s->state.line = line;
+	s->state.line_no = line_no;
+	s->state.state = line->istate;
+	s->state.i = 0;
+
+	while (1) {
+		ptrdiff_t before = krk_currentThread.stackTop - krk_currentThread.stack;
+		krk_push(OBJECT_VAL(env->syntax->krkFunc));
+		krk_push(OBJECT_VAL(s));
+		KrkValue result = krk_callStack(1);
+		krk_currentThread.stackTop = krk_currentThread.stack + before;
+		if (IS_NONE(result) && (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION)) {
+			render_error("Exception occurred in plugin: %s", AS_INSTANCE(krk_currentThread.currentException)->_class->name->chars);
+			render_commandline_message("\n");
+			screen_suspend();
+			krk_dumpTraceback();
+			goto _syntaxError;
+		} else if (!IS_NONE(result) && !IS_INTEGER(result)) {
+			render_error("Instead of an integer, got %s", krk_typeName(result));
+			render_commandline_message("\n");
+			goto _syntaxError;
+		}
+		s->state.state = IS_NONE(result) ? -1 : AS_INTEGER(result);
+
+		if (s->state.state != 0) {
+			if (line_no != -1) {
+				rehighlight_search(line);
+				line->highlighted = 1;
+			}
+			return s->state.state;
+		}
+	}
+
+_syntaxError:
+	krk_resetStack();
+	screen_suspend();
+	fprintf(stderr,"This syntax highlighter will be disabled in this environment.");
+	env->syntax = NULL;
+	cancel_background_tasks(env);
+	pause_for_key();
+	redraw_all();
+	return -1;
+}
+
+/**
+ * Give the line after `line_no` the state that line ended in.
+ * Returns 1 if that changed its state, and so it needs to be
+ * highlighted again.
+ */
+static int syntax_carry(int line_no, int state) {
+	if (line_no + 1 >= env->line_count) return 0;
+	line_t * next = buffer_line(env, line_no+1);
+	if (next->istate == state) return 0;
+	next->istate = state;
+	next->highlighted = 0;
+	if (line_no + 1 < env->syntax_frontier) env->syntax_frontier = line_no + 1;
+	return 1;
+}
+
+/**
+ * Note that a line's text (or the line before it) has changed,
+ * so its highlighting is no longer valid. Normally the caller
+ * recalculates it right away; if it can't, the background pass will.
+ * Any search matches we had counted on it are forgotten, too.
+ */
+static void syntax_invalidate(line_t * line, int line_no) {
+	if (!LINE_IS_PENDING(line)) line->highlighted = 0;
+	if (line_no < 0) return;
+	if (env->search_counts) env->search_counts[line_no] = -1;
+	if (line_no < env->syntax_frontier) env->syntax_frontier = line_no;
+	if (env->loading || env->slowop) schedule_syntax_pass();
+}
+
+/**
+ * The search match cache has an entry for every line, so it has to
+ * follow lines as they are added and removed.
+ */
+static void search_cache_insert(int offset) {
+	if (!env->search_counts) return;
+	if (env->line_count > env->search_avail) {
+		env->search_avail = env->line_avail;
+		env->search_counts = realloc(env->search_counts, sizeof(int) * env->search_avail);
+	}
+	memmove(&env->search_counts[offset+1], &env->search_counts[offset], sizeof(int) * (env->line_count - 1 - offset));
+	env->search_counts[offset] = -1;
+}
+
+static void search_cache_remove(int offset) {
+	if (!env->search_counts) return;
+	memmove(&env->search_counts[offset], &env->search_counts[offset+1], sizeof(int) * (env->line_count - offset));
+}
+
+void search_cache_drop(buffer_t * buf) {
+	free(buf->search_counts);
+	free(buf->search_pattern);
+	buf->search_counts = NULL;
+	buf->search_pattern = NULL;
+	buf->search_avail = 0;
+}
 
 /**
  * Calculate syntax highlighting for the given line, and lines after
  * if their initial syntax state has changed by this recalculation.
  *
+ * Only lines that are on screen are done right away; if the change
+ * carries on past the bottom of the screen, the rest is left to the
+ * background pass (see `syntax_pass`), so that typing an open comment
+ * at the top of a large file doesn't have to highlight all of it.
+ *
  * If `line_no` is -1, this line is taken to be a special line and not
  * part of a buffer; search highlighting will not be processed and syntax
  * highlighting will halt after the line is finished.
@@ -946,72 +1081,23 @@ void redraw_all(void);
  */
 void recalculate_syntax(line_t * line, int line_no) {
 	if (env->slowop) return;
-	/* Clear syntax for this line first */
 	int is_original = 1;
 	while (1) {
-		for (int i = 0; i < line->actual; ++i) {
-			line->text[i].flags = line->text[i].flags & (3 << 5);
+		int state = syntax_run(line, line_no);
+		if (line_no == -1 || !env->syntax) return;
+		if (!is_original) {
+			redraw_line(line_no);
 		}
-
-		if (!env->syntax) {
-			if (line_no != -1) rehighlight_search(line);
+		if (!syntax_carry(line_no, state)) return;
+		if (env->loading) return;
+		line_no++;
+		if (line_no - env->offset < 0 || line_no - env->offset > global_config.term_height - global_config.bottom_size - 1 - global_config.tabs_visible) {
+			schedule_syntax_pass();
 			return;
 		}
-
-		/* Start from the line's stored in initial state */
-		struct SyntaxState * s = (void*)krk_newInstance(env->syntax->krkClass);
-		s->state.env = env;
-		s->state.line = line;
-		s->state.line_no = line_no;
-		s->state.state = line->istate;
-		s->state.i = 0;
-
-		while (1) {
-			ptrdiff_t before = krk_currentThread.stackTop - krk_currentThread.stack;
-			krk_push(OBJECT_VAL(env->syntax->krkFunc));
-			krk_push(OBJECT_VAL(s));
-			KrkValue result = krk_callStack(1);
-			krk_currentThread.stackTop = krk_currentThread.stack + before;
-			if (IS_NONE(result) && (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION)) {
-				render_error("Exception occurred in plugin: %s", AS_INSTANCE(krk_currentThread.currentException)->_class->name->chars);
-				render_commandline_message("\n");
-				krk_dumpTraceback();
-				goto _syntaxError;
-			} else if (!IS_NONE(result) && !IS_INTEGER(result)) {
-				render_error("Instead of an integer, got %s", krk_typeName(result));
-				render_commandline_message("\n");
-				goto _syntaxError;
-			}
-			s->state.state = IS_NONE(result) ? -1 : AS_INTEGER(result);
-
-			if (s->state.state != 0) {
-				if (line_no == -1) return;
-				rehighlight_search(line);
-				if (!is_original) {
-					redraw_line(line_no);
-				}
-				if (line_no + 1 < env->line_count && env->lines[line_no+1]->istate != s->state.state) {
-					line_no++;
-					line = env->lines[line_no];
-					line->istate = s->state.state;
-					if (env->loading) return;
-					is_original = 0;
-					goto _next;
-				}
-				return;
-			}
-		}
-_next:
-		(void)0;
+		line = buffer_line(env, line_no);
+		is_original = 0;
 	}
-
-_syntaxError:
-	krk_resetStack();
-	fprintf(stderr,"This syntax highlighter will be disabled in this environment.");
-	env->syntax = NULL;
-	cancel_background_tasks(env);
-	pause_for_key();
-	redraw_all();
 }
 
 /**
@@ -1041,6 +1127,9 @@ void recalculate_tabs(line_t * line) {
  * At the moment, primitives and most other functions do not take the current
  * buffer (environment) as an argument and instead rely on a global variable;
  * this should definitely be fixed at some point...
+ *
+ * Primitives work on the `lines` array directly, so they first decode any
+ * pending lines of a large file that they are going to look inside.
  */
 
 /**
@@ -1123,7 +1212,7 @@ void set_history_break(void) {
  * to grow, then it will be reallocated, so the return value of the new line
  * must ALWAYS be used. This primitive will NOT automatically update the
  * buffer with the new pointer, so if you are calling insert on a buffer you
- * MUST update env->lines[lineno-1] yourself.
+ * MUST update buffer_line(env, lineno-1) yourself.
  */
 __attribute__((warn_unused_result)) line_t * line_insert(line_t * line, char_t c, int offset, int lineno) {
 
@@ -1158,6 +1247,8 @@ __attribute__((warn_unused_result)) line_t * line_insert(line_t * line, char_t c
 	/* There is one new character in the line */
 	line->actual += 1;
 
+	syntax_invalidate(line, lineno);
+
 	if (!env->loading) {
 		line->rev_status = 2; /* Modified */
 		recalculate_tabs(line);
@@ -1199,6 +1290,7 @@ void line_delete(line_t * line, int offset, int lineno) {
 	line->actual -= 1;
 	line->rev_status = 2;
 
+	syntax_invalidate(line, lineno);
 	recalculate_tabs(line);
 	recalculate_syntax(line, lineno);
 }
@@ -1225,6 +1317,8 @@ void line_replace(line_t * line, char_t _c, int offset, int lineno) {
 
 	line->text[offset] = _c;
 
+	syntax_invalidate(line, lineno);
+
 	if (!env->loading) {
 		line->rev_status = 2; /* Modified */
 		recalculate_tabs(line);
@@ -1244,6 +1338,8 @@ void line_replace(line_t * line, char_t _c, int offset, int lineno) {
  */
 line_t ** remove_line(line_t ** lines, int offset) {
 
+	buffer_line(env, offset);
+
 	/* If there is only one line, clear it instead of removing it. */
 	if (env->line_count == 1) {
 		while (lines[offset]->actual > 0) {
@@ -1274,6 +1370,17 @@ line_t ** remove_line(line_t ** lines, int offset) {
 
 	/* There is one less line */
 	env->line_count -= 1;
+	search_cache_remove(offset);
+
+	/* Whatever follows now follows a different line */
+	if (offset > 0) {
+		syntax_invalidate(lines[offset-1], offset-1);
+		if (!env->loading) recalculate_syntax(buffer_line(env, offset-1), offset-1);
+	} else {
+		buffer_line(env, 0)->istate = 0;
+		syntax_invalidate(lines[0], 0);
+		if (!env->loading) recalculate_syntax(lines[0], 0);
+	}
 	return lines;
 }
 
@@ -1315,13 +1422,19 @@ line_t ** add_line(line_t ** lines, int offset) {
 	/* There is one new line */
 	env->line_count += 1;
 	env->lines = lines;
+	search_cache_insert(offset);
 
 	if (!env->loading) {
 		lines[offset]->rev_status = 2; /* Modified */
 	}
 
+	syntax_invalidate(lines[offset], offset);
+	if (offset > 0) syntax_invalidate(lines[offset-1], offset-1);
+
 	if (offset > 0 && !env->loading) {
-		recalculate_syntax(lines[offset-1],offset-1);
+		recalculate_syntax(buffer_line(env, offset-1),offset-1);
+	} else if (!env->loading) {
+		recalculate_syntax(lines[offset],offset);
 	}
 	return lines;
 }
@@ -1334,6 +1447,8 @@ line_t ** add_line(line_t ** lines, int offset) {
  */
 void replace_line(line_t ** lines, int offset, line_t * replacement) {
 
+	buffer_line(env, offset);
+
 	if (!env->loading && global_config.history_enabled) {
 		history_t * e = malloc(sizeof(history_t));
 		e->type = HISTORY_REPLACE_LINE;
@@ -1352,6 +1467,8 @@ void replace_line(line_t ** lines, int offset, line_t * replacement) {
 	lines[offset]->actual = replacement->actual;
 	memcpy(&lines[offset]->text, &replacement->text, sizeof(char_t) * replacement->actual);
 
+	syntax_invalidate(lines[offset], offset);
+
 	if (!env->loading) {
 		lines[offset]->rev_status = 2;
 		recalculate_syntax(lines[offset],offset);
@@ -1373,11 +1490,14 @@ line_t ** merge_lines(line_t ** lines, int lineb) {
 	/* linea is the line immediately before lineb */
 	int linea = lineb - 1;
 
+	buffer_line(env, linea);
+	buffer_line(env, lineb);
+
 	if (!env->loading && global_config.history_enabled) {
 		history_t * e = malloc(sizeof(history_t));
 		e->type = HISTORY_MERGE_LINES;
 		e->contents.add_merge_split_lines.lineno = lineb;
-		e->contents.add_merge_split_lines.split = env->lines[linea]->actual;
+		e->contents.add_merge_split_lines.split = buffer_line(env, linea)->actual;
 		HIST_APPEND(e);
 	}
 
@@ -1400,12 +1520,6 @@ line_t ** merge_lines(line_t ** lines, int lineb) {
 	/* The first line is now longer */
 	lines[linea]->actual = lines[linea]->actual + lines[lineb]->actual;
 
-	if (!env->loading) {
-		lines[linea]->rev_status = 2;
-		recalculate_tabs(lines[linea]);
-		recalculate_syntax(lines[linea], linea);
-	}
-
 	/* Remove the second line */
 	free(lines[lineb]);
 
@@ -1417,6 +1531,16 @@ line_t ** merge_lines(line_t ** lines, int lineb) {
 
 	/* There is one less line */
 	env->line_count -= 1;
+	search_cache_remove(lineb);
+
+	syntax_invalidate(lines[linea], linea);
+
+	if (!env->loading) {
+		lines[linea]->rev_status = 2;
+		recalculate_tabs(lines[linea]);
+		recalculate_syntax(lines[linea], linea);
+	}
+
 	return lines;
 }
 
@@ -1434,6 +1558,8 @@ line_t ** split_line(line_t ** lines, int line, int split) {
 		return add_line(lines, line);
 	}
 
+	buffer_line(env, line);
+
 	if (!env->loading && global_config.history_enabled) {
 		history_t * e = malloc(sizeof(history_t));
 		e->type = HISTORY_SPLIT_LINE;
@@ -1478,6 +1604,14 @@ line_t ** split_line(line_t ** lines, int line, int split) {
 	memmove(lines[line+1]->text, &lines[line]->text[split], sizeof(char_t) * remaining);
 	lines[line]->actual = split;
 
+	/* There is one new line */
+	env->line_count += 1;
+	env->lines = lines;
+	search_cache_insert(line+1);
+
+	syntax_invalidate(lines[line], line);
+	syntax_invalidate(lines[line+1], line+1);
+
 	if (!env->loading) {
 		lines[line]->rev_status = 2;
 		lines[line+1]->rev_status = 2;
@@ -1487,9 +1621,6 @@ line_t ** split_line(line_t ** lines, int line, int split) {
 		recalculate_syntax(lines[line+1], line+1);
 	}
 
-	/* There is one new line */
-	env->line_count += 1;
-
 	/* We may have reallocated lines */
 	return lines;
 }
@@ -1556,7 +1687,7 @@ int line_is_comment(line_t * line) {
 int find_brace_line_start(int line, int col) {
 	int ncol = col - 1;
 	while (ncol > 0) {
-		if (env->lines[line-1]->text[ncol-1].codepoint == ')') {
+		if (buffer_line(env, line-1)->text[ncol-1].codepoint == ')') {
 			int t_line_no = env->line_no;
 			int t_col_no = env->col_no;
 			env->line_no = line;
@@ -1571,7 +1702,7 @@ int find_brace_line_start(int line, int col) {
 			env->line_no = t_line_no;
 			env->col_no = t_col_no;
 			break;
-		} else if (env->lines[line-1]->text[ncol-1].codepoint == ' ') {
+		} else if (buffer_line(env, line-1)->text[ncol-1].codepoint == ' ') {
 			ncol--;
 		} else {
 			break;
@@ -1590,32 +1721,32 @@ int find_brace_line_start(int line, int col) {
 void add_indent(int new_line, int old_line, int ignore_brace) {
 	if (env->indent) {
 		int changed = 0;
-		if (old_line < new_line && line_is_comment(env->lines[new_line])) {
-			for (int i = 0; i < env->lines[old_line]->actual; ++i) {
-				if (env->lines[old_line]->text[i].codepoint == '/') {
-					if (env->lines[old_line]->text[i+1].codepoint == '*') {
+		if (old_line < new_line && line_is_comment(buffer_line(env, new_line))) {
+			for (int i = 0; i < buffer_line(env, old_line)->actual; ++i) {
+				if (buffer_line(env, old_line)->text[i].codepoint == '/') {
+					if (buffer_line(env, old_line)->text[i+1].codepoint == '*') {
 						/* Insert ' * ' */
 						char_t space = {1,FLAG_COMMENT,' '};
 						char_t asterisk = {1,FLAG_COMMENT,'*'};
-						env->lines[new_line] = line_insert(env->lines[new_line],space,i,new_line);
-						env->lines[new_line] = line_insert(env->lines[new_line],asterisk,i+1,new_line);
-						env->lines[new_line] = line_insert(env->lines[new_line],space,i+2,new_line);
+						env->lines[new_line] = line_insert(buffer_line(env, new_line),space,i,new_line);
+						env->lines[new_line] = line_insert(buffer_line(env, new_line),asterisk,i+1,new_line);
+						env->lines[new_line] = line_insert(buffer_line(env, new_line),space,i+2,new_line);
 						env->col_no += 3;
 					}
 					break;
-				} else if (env->lines[old_line]->text[i].codepoint == ' ' && env->lines[old_line]->text[i+1].codepoint == '*') {
+				} else if (buffer_line(env, old_line)->text[i].codepoint == ' ' && buffer_line(env, old_line)->text[i+1].codepoint == '*') {
 					/* Insert ' * ' */
 					char_t space = {1,FLAG_COMMENT,' '};
 					char_t asterisk = {1,FLAG_COMMENT,'*'};
-					env->lines[new_line] = line_insert(env->lines[new_line],space,i,new_line);
-					env->lines[new_line] = line_insert(env->lines[new_line],asterisk,i+1,new_line);
-					env->lines[new_line] = line_insert(env->lines[new_line],space,i+2,new_line);
+					env->lines[new_line] = line_insert(buffer_line(env, new_line),space,i,new_line);
+					env->lines[new_line] = line_insert(buffer_line(env, new_line),asterisk,i+1,new_line);
+					env->lines[new_line] = line_insert(buffer_line(env, new_line),space,i+2,new_line);
 					env->col_no += 3;
 					break;
-				} else if (env->lines[old_line]->text[i].codepoint == ' ' ||
-					env->lines[old_line]->text[i].codepoint == '\t' ||
-					env->lines[old_line]->text[i].codepoint == '*') {
-					env->lines[new_line] = line_insert(env->lines[new_line],env->lines[old_line]->text[i],i,new_line);
+				} else if (buffer_line(env, old_line)->text[i].codepoint == ' ' ||
+					buffer_line(env, old_line)->text[i].codepoint == '\t' ||
+					buffer_line(env, old_line)->text[i].codepoint == '*') {
+					env->lines[new_line] = line_insert(buffer_line(env, new_line),buffer_line(env, old_line)->text[i],i,new_line);
 					env->col_no++;
 					changed = 1;
 				} else {
@@ -1627,19 +1758,19 @@ void add_indent(int new_line, int old_line, int ignore_brace) {
 			int col;
 			if (old_line < new_line &&
 				!ignore_brace &&
-				(col = line_ends_with_brace(env->lines[old_line])) &&
-				env->lines[old_line]->text[col-1].codepoint == '{') {
+				(col = line_ends_with_brace(buffer_line(env, old_line))) &&
+				buffer_line(env, old_line)->text[col-1].codepoint == '{') {
 				line_to_copy_from = find_brace_line_start(old_line+1, col)-1;
 			}
-			for (int i = 0; i < env->lines[line_to_copy_from]->actual; ++i) {
-				if (line_to_copy_from < new_line && i == env->lines[line_to_copy_from]->actual - 3 &&
-					env->lines[line_to_copy_from]->text[i].codepoint == ' ' &&
-					env->lines[line_to_copy_from]->text[i+1].codepoint == '*' &&
-					env->lines[line_to_copy_from]->text[i+2].codepoint == '/') {
+			for (int i = 0; i < buffer_line(env, line_to_copy_from)->actual; ++i) {
+				if (line_to_copy_from < new_line && i == buffer_line(env, line_to_copy_from)->actual - 3 &&
+					buffer_line(env, line_to_copy_from)->text[i].codepoint == ' ' &&
+					buffer_line(env, line_to_copy_from)->text[i+1].codepoint == '*' &&
+					buffer_line(env, line_to_copy_from)->text[i+2].codepoint == '/') {
 					break;
-				} else if (env->lines[line_to_copy_from]->text[i].codepoint == ' ' ||
-					env->lines[line_to_copy_from]->text[i].codepoint == '\t') {
-					env->lines[new_line] = line_insert(env->lines[new_line],env->lines[line_to_copy_from]->text[i],i,new_line);
+				} else if (buffer_line(env, line_to_copy_from)->text[i].codepoint == ' ' ||
+					buffer_line(env, line_to_copy_from)->text[i].codepoint == '\t') {
+					env->lines[new_line] = line_insert(buffer_line(env, new_line),buffer_line(env, line_to_copy_from)->text[i],i,new_line);
 					env->col_no++;
 					changed = 1;
 				} else {
@@ -1647,12 +1778,12 @@ void add_indent(int new_line, int old_line, int ignore_brace) {
 				}
 			}
 		}
-		if (old_line < new_line && !ignore_brace && line_ends_with_brace(env->lines[old_line])) {
+		if (old_line < new_line && !ignore_brace && line_ends_with_brace(buffer_line(env, old_line))) {
 			if (env->tabs) {
 				char_t c = {0};
 				c.codepoint = '\t';
 				c.display_width = env->tabstop;
-				env->lines[new_line] = line_insert(env->lines[new_line], c, env->col_no-1, new_line);
+				env->lines[new_line] = line_insert(buffer_line(env, new_line), c, env->col_no-1, new_line);
 				env->col_no++;
 				changed = 1;
 			} else {
@@ -1660,27 +1791,27 @@ void add_indent(int new_line, int old_line, int ignore_brace) {
 					char_t c = {0};
 					c.codepoint = ' ';
 					c.display_width = 1;
-					env->lines[new_line] = line_insert(env->lines[new_line], c, env->col_no-1, new_line);
+					env->lines[new_line] = line_insert(buffer_line(env, new_line), c, env->col_no-1, new_line);
 					env->col_no++;
 				}
 				changed = 1;
 			}
 		}
 		int was_whitespace = 1;
-		for (int i = 0; i < env->lines[old_line]->actual; ++i) {
-			if (env->lines[old_line]->text[i].codepoint != ' ' &&
-				env->lines[old_line]->text[i].codepoint != '\t') {
+		for (int i = 0; i < buffer_line(env, old_line)->actual; ++i) {
+			if (buffer_line(env, old_line)->text[i].codepoint != ' ' &&
+				buffer_line(env, old_line)->text[i].codepoint != '\t') {
 				was_whitespace = 0;
 				break;
 			}
 		}
 		if (was_whitespace) {
-			while (env->lines[old_line]->actual) {
-				line_delete(env->lines[old_line], env->lines[old_line]->actual, old_line);
+			while (buffer_line(env, old_line)->actual) {
+				line_delete(buffer_line(env, old_line), buffer_line(env, old_line)->actual, old_line);
 			}
 		}
 		if (changed) {
-			recalculate_syntax(env->lines[new_line],new_line);
+			recalculate_syntax(buffer_line(env, new_line),new_line);
 		}
 	}
 }
@@ -1694,9 +1825,12 @@ void setup_buffer(buffer_t * env) {
 	/* If this buffer was already initialized, clear out its line data */
 	if (env->lines) {
 		for (int i = 0; i < env->line_count; ++i) {
-			free(env->lines[i]);
+			if (!LINE_IS_PENDING(env->lines[i])) free(env->lines[i]);
 		}
 		free(env->lines);
+		free(env->source);
+		env->source = NULL;
+		search_cache_drop(env);
 	}
 
 	/* Default state parameters */
@@ -1802,19 +1936,767 @@ int codepoint_width(wchar_t codepoint) {
 		/* Non-breaking space _ */
 		return 1;
 	}
-	/* Skip wcwidth for anything under 256 */
-	if (codepoint > 127) {
-		if (global_config.can_unicode) {
-			/* Higher codepoints may be wider (eg. Japanese) */
-			int out = wcwidth(codepoint);
-			if (out >= 1) return out;
+	/* Skip wcwidth for anything under 256 */
+	if (codepoint > 127) {
+		if (global_config.can_unicode) {
+			/* Higher codepoints may be wider (eg. Japanese) */
+			int out = wcwidth(codepoint);
+			if (out >= 1) return out;
+		}
+		/* Invalid character, render as [U+ABCD] or [U+ABCDEF] */
+		return (codepoint < 0x10000) ? 8 : 10;
+	}
+	return 1;
+}
+
+/**
+ * Virtual screen
+ *
+ * Everything we draw goes through screen_printf, which interprets the
+ * same escape sequences a terminal would and keeps a copy of what the
+ * screen should look like. Just before we wait for input, screen_flush
+ * compares that with what we last sent and writes out only the cells
+ * that changed, with as little cursor movement and as few color changes
+ * as it can manage, in a single write. If most of the screen has moved
+ * up or down, the terminal is asked to scroll it first.
+ *
+ * Output that doesn't come from us (the shell, tracebacks from plugins)
+ * can't be tracked, so anything that lets it through suspends the
+ * screen first and resumes it once we're back in control; after that
+ * we only trust cells we have redrawn since.
+ */
+#define SCREEN_BOLD      0x01
+#define SCREEN_ITALIC    0x02
+#define SCREEN_UNDERLINE 0x04
+
+#define SCREEN_UNKNOWN 0xFFFFFFFF /* We can't vouch for what this cell shows */
+#define SCREEN_WIDE    0xFFFFFFFE /* Right half of a wide character */
+
+/* Colors are stored as a kind and a value, so they can be compared */
+#define SCREEN_COLOR_DEFAULT 0
+#define SCREEN_COLOR_16(n)   ((1 << 24) | (n))
+#define SCREEN_COLOR_256(n)  ((2 << 24) | (n))
+#define SCREEN_COLOR_RGB(r,g,b) ((3U << 24) | ((r) << 16) | ((g) << 8) | (b))
+
+typedef struct {
+	uint32_t codepoint;
+	uint32_t fg, bg;
+	uint32_t attr;
+} screen_cell_t;
+
+enum {
+	SCREEN_GROUND,
+	SCREEN_ESCAPE,
+	SCREEN_CSI,
+	SCREEN_OSC,
+};
+
+static struct {
+	int width, height;
+	screen_cell_t * back;  /* What we have drawn */
+	screen_cell_t * front; /* What the terminal is showing */
+
+	/* Interpreter state for the back buffer */
+	int x, y;
+	int saved_x, saved_y;
+	int cursor_visible;
+	screen_cell_t pen;
+	int parse_state;
+	char seq[128];
+	int seq_len;
+	uint32_t utf8_state, utf8_codepoint;
+
+	/* What we know about the real terminal; -1 when we don't */
+	int term_x, term_y;
+	int term_cursor_visible;
+	int term_pen_known;
+	screen_cell_t term_pen;
+
+	int suspended;
+
+	char * out;
+	size_t out_len, out_size;
+
+	/* For :renderstats */
+	uint64_t frames;
+	uint64_t raw_bytes, sent_bytes;
+	uint64_t frame_raw, frame_start;
+	uint64_t last_raw, last_sent, last_us;
+} screen = { .cursor_visible = 1, .term_x = -1, .term_y = -1, .term_cursor_visible = -1 };
+
+static uint64_t screen_now(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static int screen_active(void) {
+	return global_config.has_terminal && global_config.screen_diff && !screen.suspended;
+}
+
+static screen_cell_t screen_blank(uint32_t bg) {
+	return (screen_cell_t){' ', SCREEN_COLOR_DEFAULT, bg, 0};
+}
+
+static screen_cell_t screen_unknown(void) {
+	return (screen_cell_t){SCREEN_UNKNOWN, 0, 0, 0};
+}
+
+static void screen_fill(screen_cell_t * cells, int count, screen_cell_t cell) {
+	for (int i = 0; i < count; ++i) cells[i] = cell;
+}
+
+/**
+ * Forget everything, as if the terminal could be showing anything and
+ * we hadn't drawn anything yet. Cells are only sent again once we draw
+ * over them.
+ */
+static void screen_forget(void) {
+	int cells = screen.width * screen.height;
+	screen_fill(screen.back, cells, screen_unknown());
+	screen_fill(screen.front, cells, screen_unknown());
+	screen.term_x = -1;
+	screen.term_y = -1;
+	screen.term_cursor_visible = -1;
+	screen.term_pen_known = 0;
+}
+
+/**
+ * Assume nothing about what the terminal shows, so the next
+ * flush sends everything we have drawn.
+ */
+void screen_invalidate(void) {
+	screen_fill(screen.front, screen.width * screen.height, screen_unknown());
+	screen.term_x = -1;
+	screen.term_y = -1;
+	screen.term_cursor_visible = -1;
+	screen.term_pen_known = 0;
+}
+
+static void screen_check_size(void) {
+	if (screen.width == global_config.term_width && screen.height == global_config.term_height) return;
+	screen.width = global_config.term_width;
+	screen.height = global_config.term_height;
+	size_t size = sizeof(screen_cell_t) * screen.width * screen.height;
+	screen.back = realloc(screen.back, size);
+	screen.front = realloc(screen.front, size);
+	if (screen.x >= screen.width) screen.x = screen.width ? screen.width - 1 : 0;
+	if (screen.y >= screen.height) screen.y = screen.height ? screen.height - 1 : 0;
+	screen_forget();
+}
+
+#define BACK(x,y) screen.back[(y) * screen.width + (x)]
+#define FRONT(x,y) screen.front[(y) * screen.width + (x)]
+
+/* Move rows [top,bottom] of a buffer by count lines, up if count is positive */
+static void screen_shift(screen_cell_t * cells, int top, int bottom, int count, screen_cell_t fill) {
+	int w = screen.width;
+	int rows = bottom - top + 1;
+	if (count >= rows || -count >= rows) {
+		screen_fill(&cells[top * w], rows * w, fill);
+		return;
+	}
+	if (count > 0) {
+		memmove(&cells[top * w], &cells[(top + count) * w], sizeof(screen_cell_t) * w * (rows - count));
+		screen_fill(&cells[(bottom - count + 1) * w], count * w, fill);
+	} else if (count < 0) {
+		count = -count;
+		memmove(&cells[(top + count) * w], &cells[top * w], sizeof(screen_cell_t) * w * (rows - count));
+		screen_fill(&cells[top * w], count * w, fill);
+	}
+}
+
+static void screen_line_feed(void) {
+	if (screen.y == screen.height - 1) {
+		screen_shift(screen.back, 0, screen.height - 1, 1, screen_blank(screen.pen.bg));
+	} else {
+		screen.y++;
+	}
+}
+
+static void screen_put(uint32_t codepoint) {
+	if (!screen.width || !screen.height) return;
+	int w = (codepoint > 127) ? wcwidth(codepoint) : 1;
+	if (w < 1) w = 1;
+
+	/* Writing past the last column wraps, like the terminal would */
+	if (screen.x + w > screen.width) {
+		screen.x = 0;
+		screen_line_feed();
+		if (w > screen.width) return;
+	}
+
+	/* Don't leave half of a wide character behind */
+	if (BACK(screen.x, screen.y).codepoint == SCREEN_WIDE && screen.x > 0) {
+		BACK(screen.x - 1, screen.y).codepoint = ' ';
+	}
+	if (screen.x + w < screen.width && BACK(screen.x + w, screen.y).codepoint == SCREEN_WIDE) {
+		BACK(screen.x + w, screen.y).codepoint = ' ';
+	}
+
+	screen_cell_t cell = screen.pen;
+	cell.codepoint = codepoint;
+	if (codepoint == ' ' && !(cell.attr & SCREEN_UNDERLINE)) {
+		/* Only the background of a space matters */
+		cell = screen_blank(cell.bg);
+	}
+	BACK(screen.x, screen.y) = cell;
+	if (w == 2) {
+		cell.codepoint = SCREEN_WIDE;
+		BACK(screen.x + 1, screen.y) = cell;
+	}
+	screen.x += w;
+}
+
+static void screen_out(const char * data, size_t len) {
+	if (screen.out_len + len > screen.out_size) {
+		while (screen.out_len + len > screen.out_size) {
+			screen.out_size = screen.out_size ? screen.out_size * 2 : 4096;
+		}
+		screen.out = realloc(screen.out, screen.out_size);
+	}
+	memcpy(screen.out + screen.out_len, data, len);
+	screen.out_len += len;
+}
+
+static void screen_outf(const char * fmt, ...) {
+	char tmp[64];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	va_end(args);
+	screen_out(tmp, len);
+}
+
+/* Parse the parameters of a CSI sequence; empty ones are 0 */
+static int screen_params(const char * seq, int * params, int max) {
+	int count = 0;
+	params[0] = 0;
+	for (const char * c = seq; *c; ++c) {
+		if (*c >= '0' && *c <= '9') {
+			params[count] = params[count] * 10 + (*c - '0');
+		} else if (*c == ';') {
+			if (count + 1 == max) break;
+			params[++count] = 0;
+		}
+	}
+	return count + 1;
+}
+
+static uint32_t screen_extended_color(int * params, int count, int * i) {
+	if (*i + 2 < count && params[*i + 1] == 5) {
+		*i += 2;
+		return SCREEN_COLOR_256(params[*i] & 0xFF);
+	} else if (*i + 4 < count && params[*i + 1] == 2) {
+		*i += 4;
+		return SCREEN_COLOR_RGB(params[*i - 2] & 0xFF, params[*i - 1] & 0xFF, params[*i] & 0xFF);
+	}
+	*i = count;
+	return SCREEN_COLOR_DEFAULT;
+}
+
+static void screen_sgr(int * params, int count) {
+	for (int i = 0; i < count; ++i) {
+		int p = params[i];
+		if (p == 0) {
+			screen.pen.fg = SCREEN_COLOR_DEFAULT;
+			screen.pen.bg = SCREEN_COLOR_DEFAULT;
+			screen.pen.attr = 0;
+		}
+		else if (p == 1) screen.pen.attr |= SCREEN_BOLD;
+		else if (p == 3) screen.pen.attr |= SCREEN_ITALIC;
+		else if (p == 4) screen.pen.attr |= SCREEN_UNDERLINE;
+		else if (p == 22) screen.pen.attr &= ~SCREEN_BOLD;
+		else if (p == 23) screen.pen.attr &= ~SCREEN_ITALIC;
+		else if (p == 24) screen.pen.attr &= ~SCREEN_UNDERLINE;
+		else if (p >= 30 && p <= 37) screen.pen.fg = SCREEN_COLOR_16(p - 30);
+		else if (p == 38) screen.pen.fg = screen_extended_color(params, count, &i);
+		else if (p == 39) screen.pen.fg = SCREEN_COLOR_DEFAULT;
+		else if (p >= 40 && p <= 47) screen.pen.bg = SCREEN_COLOR_16(p - 40);
+		else if (p == 48) screen.pen.bg = screen_extended_color(params, count, &i);
+		else if (p == 49) screen.pen.bg = SCREEN_COLOR_DEFAULT;
+		else if (p >= 90 && p <= 97) screen.pen.fg = SCREEN_COLOR_16(p - 90 + 8);
+		else if (p >= 100 && p <= 107) screen.pen.bg = SCREEN_COLOR_16(p - 100 + 8);
+	}
+}
+
+static void screen_csi(char final) {
+	int params[16];
+	int private = screen.seq[0] == '?';
+	int count = screen_params(screen.seq, params, 16);
+	int n = params[0] ? params[0] : 1;
+	int w = screen.width, h = screen.height;
+
+	if (private) {
+		if (params[0] == 25 && (final == 'h' || final == 'l')) {
+			screen.cursor_visible = final == 'h';
+			return;
+		}
+		/* Other modes are passed straight along */
+		screen_outf("\033[%s%c", screen.seq, final);
+		if (params[0] == 1049) {
+			/* Switching screens; who knows what's there now */
+			screen_forget();
+		}
+		return;
+	}
+
+	switch (final) {
+		case 'H':
+		case 'f':
+			screen.y = params[0] ? params[0] - 1 : 0;
+			screen.x = (count > 1 && params[1]) ? params[1] - 1 : 0;
+			break;
+		case 'A': screen.y -= n; break;
+		case 'B': screen.y += n; break;
+		case 'C': screen.x += n; break;
+		case 'D': screen.x -= n; break;
+		case 'G': screen.x = n - 1; break;
+		case 'J':
+			if (params[0] == 2) {
+				screen_fill(screen.back, w * h, screen_blank(screen.pen.bg));
+			} else if (params[0] == 0 && screen.y < h) {
+				screen_fill(&BACK(0, screen.y) + screen.x, w * (h - screen.y) - screen.x, screen_blank(screen.pen.bg));
+			}
+			break;
+		case 'K':
+			if (screen.y >= h) break;
+			if (params[0] == 0) {
+				if (screen.x < w) screen_fill(&BACK(screen.x, screen.y), w - screen.x, screen_blank(screen.pen.bg));
+			} else if (params[0] == 1) {
+				screen_fill(&BACK(0, screen.y), (screen.x < w ? screen.x + 1 : w), screen_blank(screen.pen.bg));
+			} else if (params[0] == 2) {
+				screen_fill(&BACK(0, screen.y), w, screen_blank(screen.pen.bg));
+			}
+			break;
+		case 'S':
+			screen_shift(screen.back, 0, h - 1, n, screen_blank(screen.pen.bg));
+			break;
+		case 'T':
+			screen_shift(screen.back, 0, h - 1, -n, screen_blank(screen.pen.bg));
+			break;
+		case 'L':
+			if (screen.y < h) screen_shift(screen.back, screen.y, h - 1, -n, screen_blank(screen.pen.bg));
+			break;
+		case 'M':
+			if (screen.y < h) screen_shift(screen.back, screen.y, h - 1, n, screen_blank(screen.pen.bg));
+			break;
+		case 'm':
+			screen_sgr(params, count);
+			break;
+		default:
+			screen_outf("\033[%s%c", screen.seq, final);
+			break;
+	}
+
+	if (screen.x < 0) screen.x = 0;
+	if (screen.y < 0) screen.y = 0;
+	if (screen.x >= w) screen.x = w ? w - 1 : 0;
+	if (screen.y >= h) screen.y = h ? h - 1 : 0;
+}
+
+/**
+ * Interpret output as the terminal would, updating the back buffer.
+ */
+static void screen_write(const char * data, size_t len) {
+	screen_check_size();
+	if (!screen.frame_raw) screen.frame_start = screen_now();
+	screen.frame_raw += len;
+
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = data[i];
+		switch (screen.parse_state) {
+			case SCREEN_GROUND:
+				if (c == '\033') {
+					screen.parse_state = SCREEN_ESCAPE;
+				} else if (c == '\r') {
+					screen.x = 0;
+				} else if (c == '\n') {
+					screen.x = 0;
+					screen_line_feed();
+				} else if (c == '\b') {
+					if (screen.x > 0) screen.x--;
+				} else if (c == '\t') {
+					screen.x = (screen.x + 8) & ~7;
+					if (screen.x >= screen.width) screen.x = screen.width - 1;
+				} else if (c == '\007') {
+					screen_out("\007", 1);
+				} else if (c >= 32) {
+					if (!decode(&screen.utf8_state, &screen.utf8_codepoint, c)) {
+						screen_put(screen.utf8_codepoint);
+					} else if (screen.utf8_state == UTF8_REJECT) {
+						screen.utf8_state = 0;
+					}
+				}
+				break;
+			case SCREEN_ESCAPE:
+				screen.parse_state = SCREEN_GROUND;
+				if (c == '[') {
+					screen.parse_state = SCREEN_CSI;
+					screen.seq_len = 0;
+				} else if (c == ']') {
+					screen.parse_state = SCREEN_OSC;
+					screen_out("\033]", 2);
+				} else if (c == '7') {
+					screen.saved_x = screen.x;
+					screen.saved_y = screen.y;
+				} else if (c == '8') {
+					screen.x = screen.saved_x;
+					screen.y = screen.saved_y;
+				} else {
+					char seq[2] = {'\033', c};
+					screen_out(seq, 2);
+				}
+				break;
+			case SCREEN_CSI:
+				if (c >= 0x40 && c <= 0x7E) {
+					screen.seq[screen.seq_len] = '\0';
+					screen.parse_state = SCREEN_GROUND;
+					screen_csi(c);
+				} else if (screen.seq_len < (int)sizeof(screen.seq) - 1) {
+					screen.seq[screen.seq_len++] = c;
+				}
+				break;
+			case SCREEN_OSC:
+				/* Titles and such aren't part of the screen */
+				screen_out((char *)&c, 1);
+				if (c == '\007' || c == '\\') screen.parse_state = SCREEN_GROUND;
+				break;
+		}
+	}
+}
+
+int screen_vprintf(const char * fmt, va_list args) {
+	if (!screen_active()) {
+		int len = vprintf(fmt, args);
+		if (global_config.has_terminal && !screen.suspended && len > 0) {
+			if (!screen.frame_raw) screen.frame_start = screen_now();
+			screen.frame_raw += len;
+		}
+		return len;
+	}
+
+	char tmp[512];
+	va_list copy;
+	va_copy(copy, args);
+	int len = vsnprintf(tmp, sizeof(tmp), fmt, args);
+	if (len >= (int)sizeof(tmp)) {
+		char * big = malloc(len + 1);
+		vsnprintf(big, len + 1, fmt, copy);
+		screen_write(big, len);
+		free(big);
+	} else if (len > 0) {
+		screen_write(tmp, len);
+	}
+	va_end(copy);
+	return len;
+}
+
+int screen_printf(const char * fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = screen_vprintf(fmt, args);
+	va_end(args);
+	return len;
+}
+
+static void screen_color(int base, uint32_t color) {
+	switch (color >> 24) {
+		case 0:
+			screen_outf("%d;", base + 9);
+			break;
+		case 1:
+			if ((color & 0xFF) < 8) screen_outf("%d;", base + (color & 0xFF));
+			else screen_outf("%d;", base + 60 + (color & 0xFF) - 8);
+			break;
+		case 2:
+			screen_outf("%d;5;%d;", base + 8, color & 0xFF);
+			break;
+		case 3:
+			screen_outf("%d;2;%d;%d;%d;", base + 8, (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
+			break;
+	}
+}
+
+/* Get the terminal's attributes to where they need to be to draw this cell */
+static void screen_set_pen(screen_cell_t * cell) {
+	screen_cell_t * pen = &screen.term_pen;
+	int blank = cell->codepoint == ' ' && !(cell->attr & SCREEN_UNDERLINE);
+
+	if (screen.term_pen_known && pen->bg == cell->bg) {
+		if (blank && !(pen->attr & SCREEN_UNDERLINE)) return;
+		if (pen->fg == cell->fg && pen->attr == cell->attr) return;
+	}
+
+	size_t start = screen.out_len;
+	screen_out("\033[", 2);
+	if (!screen.term_pen_known) {
+		screen_out("0;", 2);
+		*pen = screen_blank(SCREEN_COLOR_DEFAULT);
+		screen.term_pen_known = 1;
+	}
+
+	uint32_t attr = blank ? (pen->attr & ~SCREEN_UNDERLINE) : cell->attr;
+	uint32_t off = pen->attr & ~attr, on = attr & ~pen->attr;
+	if (off & SCREEN_BOLD) screen_out("22;", 3);
+	if (off & SCREEN_ITALIC) screen_out("23;", 3);
+	if (off & SCREEN_UNDERLINE) screen_out("24;", 3);
+	if (on & SCREEN_BOLD) screen_out("1;", 2);
+	if (on & SCREEN_ITALIC) screen_out("3;", 2);
+	if (on & SCREEN_UNDERLINE) screen_out("4;", 2);
+	pen->attr = attr;
+
+	if (!blank && pen->fg != cell->fg) {
+		screen_color(30, cell->fg);
+		pen->fg = cell->fg;
+	}
+	if (pen->bg != cell->bg) {
+		screen_color(40, cell->bg);
+		pen->bg = cell->bg;
+	}
+
+	if (screen.out_len == start + 2) {
+		screen.out_len = start;
+	} else {
+		screen.out[screen.out_len - 1] = 'm';
+	}
+}
+
+static int screen_cell_matches(screen_cell_t * a, screen_cell_t * b) {
+	return !memcmp(a, b, sizeof(screen_cell_t));
+}
+
+/* Could this cell be redrawn as-is with the terminal's current attributes? */
+static int screen_cell_reprintable(screen_cell_t * cell) {
+	if (!screen.term_pen_known || cell->codepoint > 127) return 0;
+	if (cell->bg != screen.term_pen.bg) return 0;
+	if (cell->codepoint == ' ' && !(cell->attr & SCREEN_UNDERLINE)) return !(screen.term_pen.attr & SCREEN_UNDERLINE);
+	return cell->fg == screen.term_pen.fg && cell->attr == screen.term_pen.attr;
+}
+
+static void screen_move(int x, int y) {
+	if (screen.term_y == y && screen.term_x == x) return;
+
+	if (screen.term_y == y && screen.term_x >= 0 && x > screen.term_x) {
+		int gap = x - screen.term_x;
+		/* Reprinting a few cells is cheaper than an escape sequence */
+		if (gap <= 3) {
+			int ok = 1;
+			for (int i = screen.term_x; i < x; ++i) {
+				if (!screen_cell_reprintable(&FRONT(i, y))) ok = 0;
+			}
+			if (ok) {
+				for (int i = screen.term_x; i < x; ++i) {
+					char c = FRONT(i, y).codepoint;
+					screen_out(&c, 1);
+				}
+				screen.term_x = x;
+				return;
+			}
+		}
+		if (gap == 1) screen_out("\033[C", 3);
+		else screen_outf("\033[%dC", gap);
+	} else if (x == 0 && screen.term_y == y) {
+		screen_out("\r", 1);
+	} else if (x == 0 && screen.term_y >= 0 && y == screen.term_y + 1) {
+		screen_out("\r\n", 2);
+	} else if (x == 0) {
+		screen_outf("\033[%dH", y + 1);
+	} else {
+		screen_outf("\033[%d;%dH", y + 1, x + 1);
+	}
+	screen.term_x = x;
+	screen.term_y = y;
+}
+
+static uint32_t screen_row_hash(screen_cell_t * row) {
+	uint32_t h = 2166136261U;
+	for (int x = 0; x < screen.width; ++x) {
+		if (row[x].codepoint == SCREEN_UNKNOWN) return 0;
+		h = (h ^ row[x].codepoint) * 16777619U;
+		h = (h ^ row[x].fg) * 16777619U;
+		h = (h ^ row[x].bg) * 16777619U;
+		h = (h ^ row[x].attr) * 16777619U;
+	}
+	return h ? h : 1;
+}
+
+/**
+ * If the back buffer looks like the front buffer moved up or down,
+ * have the terminal scroll so those rows don't need to be resent.
+ */
+static void screen_scroll(void) {
+	if (!global_config.can_scroll && !global_config.can_insert) return;
+
+	int h = screen.height;
+	uint32_t * back = malloc(sizeof(uint32_t) * h * 2);
+	uint32_t * front = back + h;
+	for (int y = 0; y < h; ++y) {
+		back[y] = screen_row_hash(&BACK(0, y));
+		front[y] = screen_row_hash(&FRONT(0, y));
+	}
+
+	int still = 0;
+	for (int y = 0; y < h; ++y) {
+		if (back[y] && back[y] == front[y]) still++;
+	}
+
+	int best = 0, best_matches = still;
+	for (int k = 1 - h; k < h; ++k) {
+		if (!k) continue;
+		int matches = 0;
+		for (int y = (k < 0 ? -k : 0); y < h && y + k < h; ++y) {
+			if (back[y] && back[y] == front[y + k]) matches++;
+		}
+		if (matches > best_matches) {
+			best = k;
+			best_matches = matches;
+		}
+	}
+	free(back);
+
+	/* Only worth it if it saves redrawing a few rows */
+	if (best_matches - still < 3) return;
+
+	if (global_config.can_scroll) {
+		screen_outf("\033[%d%c", best > 0 ? best : -best, best > 0 ? 'S' : 'T');
+	} else {
+		screen_outf("\033[H\033[%d%c", best > 0 ? best : -best, best > 0 ? 'M' : 'L');
+		screen.term_x = 0;
+		screen.term_y = 0;
+	}
+	screen_shift(screen.front, 0, h - 1, best, screen_unknown());
+}
+
+/**
+ * Bring the terminal up to date with everything we have drawn.
+ */
+void screen_flush(void) {
+	if (!screen_active()) {
+		fflush(stdout);
+		if (global_config.has_terminal && !screen.suspended && screen.frame_raw) {
+			/* Not diffing; everything drawn was sent as-is */
+			screen.frames++;
+			screen.last_raw = screen.last_sent = screen.frame_raw;
+			screen.last_us = screen_now() - screen.frame_start;
+			screen.raw_bytes += screen.frame_raw;
+			screen.sent_bytes += screen.frame_raw;
+			screen.frame_raw = 0;
+		}
+		return;
+	}
+
+	/* Anything that went straight to stdout goes before us */
+	fflush(stdout);
+	screen_check_size();
+
+	if (!screen.frame_raw && !screen.out_len) return;
+
+	screen_scroll();
+
+	int w = screen.width;
+	for (int y = 0; y < screen.height; ++y) {
+		if (!memcmp(&BACK(0, y), &FRONT(0, y), sizeof(screen_cell_t) * w)) continue;
+
+		for (int x = 0; x < w; ++x) {
+			screen_cell_t * cell = &BACK(x, y);
+			if (cell->codepoint == SCREEN_UNKNOWN || screen_cell_matches(cell, &FRONT(x, y))) continue;
+
+			/* Changed the right half of a wide character; redraw the whole thing */
+			if (cell->codepoint == SCREEN_WIDE) {
+				if (!x) continue;
+				cell = &BACK(--x, y);
+			}
+
+			if (screen.term_cursor_visible != 0) {
+				screen_out("\033[?25l", 6);
+				screen.term_cursor_visible = 0;
+			}
+
+			/* If the rest of the line is blank, clear it instead */
+			if (global_config.can_bce && cell->codepoint == ' ' && !(cell->attr & SCREEN_UNDERLINE) && w - x > 4) {
+				int end = x + 1;
+				while (end < w && screen_cell_matches(&BACK(end, y), cell)) end++;
+				if (end == w) {
+					screen_move(x, y);
+					screen_set_pen(cell);
+					screen_out("\033[K", 3);
+					screen_fill(&FRONT(x, y), w - x, *cell);
+					break;
+				}
+			}
+
+			screen_move(x, y);
+			screen_set_pen(cell);
+
+			char tmp[7];
+			int len = to_eight(cell->codepoint, tmp);
+			screen_out(tmp, len);
+			FRONT(x, y) = *cell;
+
+			int width = (x + 1 < w && BACK(x + 1, y).codepoint == SCREEN_WIDE) ? 2 : 1;
+			if (width == 2) {
+				FRONT(x + 1, y) = BACK(x + 1, y);
+				x++;
+			}
+
+			screen.term_x += width;
+			/* The cursor sits in limbo after the last column; don't trust it */
+			if (screen.term_x >= w) screen.term_x = -1;
+		}
+	}
+
+	/* Leave the cursor where we last put it */
+	if (screen.cursor_visible) {
+		screen_move(screen.x, screen.y);
+		if (screen.term_cursor_visible != 1) {
+			screen_out("\033[?25h", 6);
+			screen.term_cursor_visible = 1;
 		}
-		/* Invalid character, render as [U+ABCD] or [U+ABCDEF] */
-		return (codepoint < 0x10000) ? 8 : 10;
+	} else if (screen.term_cursor_visible != 0) {
+		screen_out("\033[?25l", 6);
+		screen.term_cursor_visible = 0;
 	}
-	return 1;
+
+	size_t written = 0;
+	while (written < screen.out_len) {
+		ssize_t r = write(STDOUT_FILENO, screen.out + written, screen.out_len - written);
+		if (r <= 0) break;
+		written += r;
+	}
+
+	screen.frames++;
+	screen.last_raw = screen.frame_raw;
+	screen.last_sent = screen.out_len;
+	screen.last_us = screen_now() - screen.frame_start;
+	screen.raw_bytes += screen.frame_raw;
+	screen.sent_bytes += screen.out_len;
+	screen.frame_raw = 0;
+	screen.out_len = 0;
 }
 
+/**
+ * Send what we have and then get out of the way, for when
+ * something else is about to write to the terminal.
+ */
+void screen_suspend(void) {
+	if (screen.suspended) return;
+	screen_flush();
+	screen.suspended = 1;
+}
+
+/**
+ * Take the terminal back after screen_suspend.
+ */
+void screen_resume(void) {
+	if (!screen.suspended) return;
+	screen.suspended = 0;
+	if (screen.back) screen_forget();
+}
+
+#undef BACK
+#undef FRONT
+
 /**
  * The following section contains methods for crafting terminal escapes
  * for rendering the display. We do not use curses or any similar
@@ -1826,7 +2708,7 @@ int codepoint_width(wchar_t codepoint) {
  * Move the terminal cursor
  */
 void place_cursor(int x, int y) {
-	printf("\033[%d;%dH", y, x);
+	screen_printf("\033[%d;%dH", y, x);
 }
 
 /**
@@ -1871,7 +2753,7 @@ char * color_string(const char * fg, const char * bg) {
  * color modes.
  */
 void set_colors(const char * fg, const char * bg) {
-	printf("%s", color_string(fg, bg));
+	screen_printf("%s", color_string(fg, bg));
 }
 
 /**
@@ -1880,16 +2762,16 @@ void set_colors(const char * fg, const char * bg) {
  * (See set_colors above)
  */
 void set_fg_color(const char * fg) {
-	printf("\033[22;23;24;");
+	screen_printf("\033[22;23;24;");
 	if (*fg == '@') {
 		int _fg = atoi(fg+1);
 		if (_fg < 10) {
-			printf("3%dm", _fg);
+			screen_printf("3%dm", _fg);
 		} else {
-			printf("9%dm", _fg-10);
+			screen_printf("9%dm", _fg-10);
 		}
 	} else {
-		printf("38;%sm", fg);
+		screen_printf("38;%sm", fg);
 	}
 }
 
@@ -1898,7 +2780,7 @@ void set_fg_color(const char * fg) {
  */
 void clear_to_end(void) {
 	if (global_config.can_bce) {
-		printf("\033[K");
+		screen_printf("\033[K");
 	}
 }
 
@@ -1910,9 +2792,9 @@ void paint_line(const char * bg) {
 	if (!global_config.can_bce) {
 		set_colors(COLOR_FG, bg);
 		for (int i = 0; i < global_config.term_width; ++i) {
-			printf(" ");
+			screen_printf(" ");
 		}
-		printf("\r");
+		screen_printf("\r");
 	}
 }
 
@@ -1920,42 +2802,42 @@ void paint_line(const char * bg) {
  * Enable bold text display
  */
 void set_bold(void) {
-	printf("\033[1m");
+	screen_printf("\033[1m");
 }
 
 /**
  * Disable bold
  */
 void unset_bold(void) {
-	printf("\033[22m");
+	screen_printf("\033[22m");
 }
 
 /**
  * Enable underlined text display
  */
 void set_underline(void) {
-	printf("\033[4m");
+	screen_printf("\033[4m");
 }
 
 /**
  * Disable underlined text display
  */
 void unset_underline(void) {
-	printf("\033[24m");
+	screen_printf("\033[24m");
 }
 
 /**
  * Reset text display attributes
  */
 void reset(void) {
-	printf("\033[0m");
+	screen_printf("\033[0m");
 }
 
 /**
  * Clear the entire screen
  */
 void clear_screen(void) {
-	printf("\033[H\033[2J");
+	screen_printf("\033[H\033[2J");
 }
 
 /**
@@ -1963,7 +2845,7 @@ void clear_screen(void) {
  */
 void hide_cursor(void) {
 	if (global_config.can_hideshow) {
-		printf("\033[?25l");
+		screen_printf("\033[?25l");
 	}
 }
 
@@ -1972,7 +2854,7 @@ void hide_cursor(void) {
  */
 void show_cursor(void) {
 	if (global_config.can_hideshow) {
-		printf("\033[?25h");
+		screen_printf("\033[?25h");
 	}
 }
 
@@ -1980,14 +2862,14 @@ void show_cursor(void) {
  * Store the cursor position
  */
 void store_cursor(void) {
-	printf("\0337");
+	screen_printf("\0337");
 }
 
 /**
  * Restore the cursor position.
  */
 void restore_cursor(void) {
-	printf("\0338");
+	screen_printf("\0338");
 }
 
 /**
@@ -1995,9 +2877,9 @@ void restore_cursor(void) {
  */
 void mouse_enable(void) {
 	if (global_config.can_mouse) {
-		printf("\033[?1000h");
+		screen_printf("\033[?1000h");
 		if (global_config.can_sgrmouse) {
-			printf("\033[?1006h");
+			screen_printf("\033[?1006h");
 		}
 	}
 }
@@ -2008,9 +2890,9 @@ void mouse_enable(void) {
 void mouse_disable(void) {
 	if (global_config.can_mouse) {
 		if (global_config.can_sgrmouse) {
-			printf("\033[?1006l");
+			screen_printf("\033[?1006l");
 		}
-		printf("\033[?1000l");
+		screen_printf("\033[?1000l");
 	}
 }
 
@@ -2018,24 +2900,24 @@ void mouse_disable(void) {
  * Shift the screen up one line
  */
 void shift_up(int amount) {
-	printf("\033[%dS", amount);
+	screen_printf("\033[%dS", amount);
 }
 
 /**
  * Shift the screen down one line.
  */
 void shift_down(int amount) {
-	printf("\033[%dT", amount);
+	screen_printf("\033[%dT", amount);
 }
 
 void insert_lines_at(int line, int count) {
 	place_cursor(1, line);
-	printf("\033[%dL", count);
+	screen_printf("\033[%dL", count);
 }
 
 void delete_lines_at(int line, int count) {
 	place_cursor(1, line);
-	printf("\033[%dM", count);
+	screen_printf("\033[%dM", count);
 }
 
 /**
@@ -2043,7 +2925,7 @@ void delete_lines_at(int line, int count) {
  */
 void set_alternate_screen(void) {
 	if (global_config.can_altscreen) {
-		printf("\033[?1049h");
+		screen_printf("\033[?1049h");
 	}
 }
 
@@ -2052,7 +2934,7 @@ void set_alternate_screen(void) {
  */
 void unset_alternate_screen(void) {
 	if (global_config.can_altscreen) {
-		printf("\033[?1049l");
+		screen_printf("\033[?1049l");
 	}
 }
 
@@ -2061,7 +2943,7 @@ void unset_alternate_screen(void) {
  */
 void set_bracketed_paste(void) {
 	if (global_config.can_bracketedpaste) {
-		printf("\033[?2004h");
+		screen_printf("\033[?2004h");
 	}
 }
 
@@ -2070,7 +2952,7 @@ void set_bracketed_paste(void) {
  */
 void unset_bracketed_paste(void) {
 	if (global_config.can_bracketedpaste) {
-		printf("\033[?2004l");
+		screen_printf("\033[?2004l");
 	}
 }
 
@@ -2174,7 +3056,7 @@ void redraw_tabbar(void) {
 
 	if (global_config.tab_offset) {
 		set_colors(COLOR_NUMBER_FG, COLOR_NUMBER_BG);
-		printf("<");
+		screen_printf("<");
 		offset++;
 	}
 
@@ -2213,17 +3095,17 @@ void redraw_tabbar(void) {
 
 		if (filled) {
 			offset += size;
-			printf("%s", title);
+			screen_printf("%s", title);
 			set_colors(COLOR_NUMBER_FG, COLOR_NUMBER_BG);
 			while (offset != global_config.term_width - 1) {
-				printf(" ");
+				screen_printf(" ");
 				offset++;
 			}
-			printf(">");
+			screen_printf(">");
 			break;
 		}
 
-		printf("%s", title);
+		screen_printf("%s", title);
 
 		offset += size;
 	}
@@ -2285,7 +3167,7 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 			if (j >= offset) {
 				/* Fill remainder with -'s */
 				set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("-");
+				screen_printf("-");
 				set_colors(COLOR_FG, line->is_current ? COLOR_ALT_BG : COLOR_BG);
 			}
 
@@ -2321,12 +3203,12 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 
 				/* If it's wide, draw ---> as needed */
 				while (j - offset < width - 1) {
-					printf("-");
+					screen_printf("-");
 					j++;
 				}
 
 				/* End the line with a > to show it overflows */
-				printf(">");
+				screen_printf(">");
 				set_colors(COLOR_FG, COLOR_BG);
 				return;
 			}
@@ -2371,54 +3253,54 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 			/* Render special characters */
 			if (c.codepoint == '\t') {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("%s", global_config.tab_indicator);
+				screen_printf("%s", global_config.tab_indicator);
 				for (int i = 1; i < c.display_width; ++i) {
-					printf("%s" ,global_config.space_indicator);
+					screen_printf("%s" ,global_config.space_indicator);
 				}
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint < 32) {
 				/* Codepoints under 32 to get converted to ^@ escapes */
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^%c", '@' + c.codepoint);
+				screen_printf("^%c", '@' + c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0x7f) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("^?");
+				screen_printf("^?");
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint > 0x7f && c.codepoint < 0xa0) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("<%2x>", c.codepoint);
+				screen_printf("<%2x>", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == 0xa0) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("_");
+				screen_printf("_");
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 8) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%04x]", c.codepoint);
+				screen_printf("[U+%04x]", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.display_width == 10) {
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("[U+%06x]", c.codepoint);
+				screen_printf("[U+%06x]", c.codepoint);
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (i > 0 && is_spaces && c.codepoint == ' ' && !(i % env->tabstop)) {
 				_set_colors(COLOR_ALT_FG, COLOR_BG); /* Normal background so this is more subtle */
 				if (global_config.can_unicode) {
-					printf("▏");
+					screen_printf("▏");
 				} else {
-					printf("|");
+					screen_printf("|");
 				}
 				_set_colors(last_color ? last_color : COLOR_FG, COLOR_BG);
 			} else if (c.codepoint == ' ' && i == line->actual - 1) {
 				/* Special case: space at end of line */
 				_set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-				printf("%s",global_config.space_indicator);
+				screen_printf("%s",global_config.space_indicator);
 				_set_colors(COLOR_FG, COLOR_BG);
 			} else {
 				/* Normal characters get output */
 				char tmp[7]; /* Max six bytes, use 7 to ensure last is always nil */
 				to_eight(c.codepoint, tmp);
-				printf("%s", tmp);
+				screen_printf("%s", tmp);
 			}
 
 			/* Advance the terminal cell offset by the render width of this character */
@@ -2478,11 +3360,11 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 		env->sel_col < width) {
 		set_colors(COLOR_FG, COLOR_BG);
 		while (j < env->sel_col) {
-			printf(" ");
+			screen_printf(" ");
 			j++;
 		}
 		set_colors(COLOR_SELECTFG, COLOR_SELECTBG);
-		printf(" ");
+		screen_printf(" ");
 		j++;
 		set_colors(COLOR_FG, COLOR_BG);
 	}
@@ -2496,7 +3378,7 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 		/* Fill out the normal background */
 		if (j < offset) j = offset;
 		for (; j < width + offset && j < env->maxcolumn; ++j) {
-			printf(" ");
+			screen_printf(" ");
 		}
 
 		/* Draw the line */
@@ -2504,9 +3386,9 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 			j++;
 			set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
 			if (global_config.can_unicode) {
-				printf("▏"); /* Should this be configurable? */
+				screen_printf("▏"); /* Should this be configurable? */
 			} else {
-				printf("|");
+				screen_printf("|");
 			}
 		}
 
@@ -2525,7 +3407,7 @@ void render_line(line_t * line, int width, int offset, int line_no) {
 		/* Paint the rest of the line */
 		if (j < offset) j = offset;
 		for (; j < width + offset; ++j) {
-			printf(" ");
+			screen_printf(" ");
 		}
 	}
 }
@@ -2553,7 +3435,7 @@ int gutter_width(void) {
 void draw_line_number(int x) {
 	if (!env->numbers) return;
 	/* Draw the line number */
-	if (env->lines[x]->is_current) {
+	if (buffer_line(env, x)->is_current) {
 		set_colors(COLOR_NUMBER_BG, COLOR_NUMBER_FG);
 	} else {
 		set_colors(COLOR_NUMBER_FG, COLOR_NUMBER_BG);
@@ -2564,9 +3446,9 @@ void draw_line_number(int x) {
 	}
 	int num_size = num_width() - 2; /* Padding */
 	for (int y = 0; y < num_size - log_base_10(x + 1); ++y) {
-		printf(" ");
+		screen_printf(" ");
 	}
-	printf("%d%c", x + 1, ((x+1 == env->line_no || global_config.horizontal_shift_scrolling) && env->coffset > 0) ? '<' : ' ');
+	screen_printf("%d%c", x + 1, ((x+1 == env->line_no || global_config.horizontal_shift_scrolling) && env->coffset > 0) ? '<' : ' ');
 }
 
 /**
@@ -2576,12 +3458,13 @@ void recalculate_current_line(void) {
 	int something_changed = 0;
 	if (global_config.highlight_current_line) {
 		for (int i = 0; i < env->line_count; ++i) {
-			if (env->lines[i]->is_current && i != env->line_no-1) {
-				env->lines[i]->is_current = 0;
+			if (LINE_IS_PENDING(env->lines[i]) && i != env->line_no-1) continue;
+			if (buffer_line(env, i)->is_current && i != env->line_no-1) {
+				buffer_line(env, i)->is_current = 0;
 				something_changed = 1;
 				redraw_line(i);
-			} else if (i == env->line_no-1 && !env->lines[i]->is_current) {
-				env->lines[i]->is_current = 1;
+			} else if (i == env->line_no-1 && !buffer_line(env, i)->is_current) {
+				buffer_line(env, i)->is_current = 1;
 				something_changed = 1;
 				redraw_line(i);
 			}
@@ -2611,6 +3494,9 @@ void redraw_line(int x) {
 		return;
 	}
 
+	/* Off-screen lines are highlighted lazily, so this one may not be yet */
+	syntax_prepare(x);
+
 	/* Calculate offset in screen */
 	int j = x - env->offset;
 
@@ -2622,30 +3508,30 @@ void redraw_line(int x) {
 
 	/* Draw a gutter on the left. */
 	if (env->gutter) {
-		switch (env->lines[x]->rev_status) {
+		switch (buffer_line(env, x)->rev_status) {
 			case 1:
 				set_colors(COLOR_NUMBER_FG, COLOR_GREEN);
-				printf(" ");
+				screen_printf(" ");
 				break;
 			case 2:
 				set_colors(COLOR_NUMBER_FG, global_config.color_gutter ? COLOR_SEARCH_BG : COLOR_ALT_FG);
-				printf(" ");
+				screen_printf(" ");
 				break;
 			case 3:
 				set_colors(COLOR_NUMBER_FG, COLOR_KEYWORD);
-				printf(" ");
+				screen_printf(" ");
 				break;
 			case 4:
 				set_colors(COLOR_ALT_FG, COLOR_RED);
-				printf("▆");
+				screen_printf("▆");
 				break;
 			case 5:
 				set_colors(COLOR_KEYWORD, COLOR_RED);
-				printf("▆");
+				screen_printf("▆");
 				break;
 			default:
 				set_colors(COLOR_NUMBER_FG, COLOR_ALT_FG);
-				printf(" ");
+				screen_printf(" ");
 				break;
 		}
 	}
@@ -2663,7 +3549,7 @@ void redraw_line(int x) {
 	 * If this is the active line, the current character cell offset should be used.
 	 * (Non-active lines are not shifted and always render from the start of the line)
 	 */
-	render_line(env->lines[x], env->width - gutter_width() - num_width(), should_shift ? env->coffset : 0, x+1);
+	render_line(buffer_line(env, x), env->width - gutter_width() - num_width(), should_shift ? env->coffset : 0, x+1);
 
 }
 
@@ -2674,13 +3560,13 @@ void draw_excess_line(int j) {
 	place_cursor(1+env->left,1 + global_config.tabs_visible + j);
 	paint_line(COLOR_ALT_BG);
 	set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-	printf("~");
+	screen_printf("~");
 	if (env->left + env->width == global_config.term_width && global_config.can_bce) {
 		clear_to_end();
 	} else {
 		/* Paint the rest of the line */
 		for (int x = 1; x < env->width; ++x) {
-			printf(" ");
+			screen_printf(" ");
 		}
 	}
 }
@@ -2907,13 +3793,13 @@ void redraw_statusbar(void) {
 		}
 		if (is_chopped) {
 			set_colors(COLOR_ALT_FG, COLOR_STATUS_BG);
-			printf("<");
+			screen_printf("<");
 		}
 		set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
-		printf("%s ", file_name);
+		screen_printf("%s ", file_name);
 	}
 
-	printf("%s", status_bits);
+	screen_printf("%s", status_bits);
 
 	/* Clear the rest of the status bar */
 	clear_to_end();
@@ -2921,7 +3807,7 @@ void redraw_statusbar(void) {
 	/* Move the cursor appropriately to draw it */
 	place_cursor(global_config.term_width - right_width, global_config.term_height - 1);
 	set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
-	printf("%s",right_hand);
+	screen_printf("%s",right_hand);
 }
 
 /**
@@ -2932,7 +3818,7 @@ void redraw_nav_buffer() {
 	if (nav_buffer) {
 		store_cursor();
 		place_cursor(global_config.term_width - nav_buffer - 2, global_config.term_height);
-		printf("%s", nav_buf);
+		screen_printf("%s", nav_buf);
 		clear_to_end();
 		restore_cursor();
 	}
@@ -2961,12 +3847,12 @@ void redraw_commandline(void) {
 	/* If we are in an edit mode, note that. */
 	if (env->mode == MODE_INSERT) {
 		set_bold();
-		printf("-- INSERT --");
+		screen_printf("-- INSERT --");
 		clear_to_end();
 		unset_bold();
 	} else if (env->mode == MODE_LINE_SELECTION) {
 		set_bold();
-		printf("-- LINE SELECTION -- (%d:%d)",
+		screen_printf("-- LINE SELECTION -- (%d:%d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line
 		);
@@ -2974,7 +3860,7 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_COL_SELECTION) {
 		set_bold();
-		printf("-- COL SELECTION -- (%d:%d %d)",
+		screen_printf("-- COL SELECTION -- (%d:%d %d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line,
 			(env->sel_col)
@@ -2983,7 +3869,7 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_COL_INSERT) {
 		set_bold();
-		printf("-- COL INSERT -- (%d:%d %d)",
+		screen_printf("-- COL INSERT -- (%d:%d %d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line,
 			(env->sel_col)
@@ -2992,17 +3878,17 @@ void redraw_commandline(void) {
 		unset_bold();
 	} else if (env->mode == MODE_REPLACE) {
 		set_bold();
-		printf("-- REPLACE --");
+		screen_printf("-- REPLACE --");
 		clear_to_end();
 		unset_bold();
 	} else if (env->mode == MODE_CHAR_SELECTION) {
 		set_bold();
-		printf("-- CHAR SELECTION -- ");
+		screen_printf("-- CHAR SELECTION -- ");
 		clear_to_end();
 		unset_bold();
 	} else if (env->mode == MODE_DIRECTORY_BROWSE) {
 		set_bold();
-		printf("-- DIRECTORY BROWSE --");
+		screen_printf("-- DIRECTORY BROWSE --");
 		clear_to_end();
 		unset_bold();
 	} else {
@@ -3030,7 +3916,7 @@ void render_commandline_message(char * message, ...) {
 	paint_line(COLOR_BG);
 	set_colors(COLOR_FG, COLOR_BG);
 
-	vprintf(message, args);
+	screen_vprintf(message, args);
 	va_end(args);
 
 	/* Clear the rest of the status bar */
@@ -3057,10 +3943,18 @@ BIM_ACTION(redraw_all, 0,
 	}
 }
 
+BIM_ACTION(repaint_screen, 0,
+	"Forget what the terminal is showing and repaint all of it."
+)(void) {
+	screen_invalidate();
+	redraw_all();
+}
+
 void pause_for_key(void) {
 	int c;
 	while ((c = bim_getch())== -1);
 	bim_unget(c);
+	screen_resume();
 	redraw_all();
 }
 
@@ -3102,7 +3996,7 @@ void update_title(void) {
 	getcwd(cwd, 1024);
 
 	for (int i = 1; i < 3; ++i) {
-		printf("\033]%d;%s%s (%s) - Bim\007", i, env->file_name ? env->file_name : "[No Name]", env->modified ? " +" : "", cwd);
+		screen_printf("\033]%d;%s%s (%s) - Bim\007", i, env->file_name ? env->file_name : "[No Name]", env->modified ? " +" : "", cwd);
 	}
 }
 
@@ -3143,7 +4037,7 @@ void render_status_message(char * message, ...) {
 	set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
 
 	/* Process format string */
-	vprintf(message, args);
+	screen_vprintf(message, args);
 	va_end(args);
 
 	/* Clear the rest of the status bar */
@@ -3169,7 +4063,7 @@ void render_error(char * message, ...) {
 		set_colors(COLOR_ERROR_FG, COLOR_ERROR_BG);
 
 		/* Draw the message */
-		vprintf(message, args);
+		screen_vprintf(message, args);
 		va_end(args);
 		global_config.had_error = 1;
 	} else {
@@ -3194,12 +4088,12 @@ int is_paren(int c) {
 
 #define _rehighlight_parens() do { \
 	if (i < 0 || i >= env->line_count) break; \
-	for (int j = 0; j < env->lines[i]->actual; ++j) { \
+	for (int j = 0; j < buffer_line(env, i)->actual; ++j) { \
 		if (i == line-1 && j == col-1) { \
-			env->lines[line-1]->text[col-1].flags |= FLAG_SELECT; \
+			buffer_line(env, line-1)->text[col-1].flags |= FLAG_SELECT; \
 			continue; \
 		} else { \
-			env->lines[i]->text[j].flags &= (~FLAG_SELECT); \
+			buffer_line(env, i)->text[j].flags &= (~FLAG_SELECT); \
 		} \
 	} \
 	redraw_line(i); \
@@ -3216,10 +4110,10 @@ void highlight_matching_paren(void) {
 	if (env->mode == MODE_LINE_SELECTION || env->mode == MODE_CHAR_SELECTION) return;
 	if (!global_config.highlight_parens) return;
 	int line = -1, col = -1;
-	if (env->line_no <= env->line_count && env->col_no <= env->lines[env->line_no-1]->actual &&
-		is_paren(env->lines[env->line_no-1]->text[env->col_no-1].codepoint)) {
+	if (env->line_no <= env->line_count && env->col_no <= buffer_line(env, env->line_no-1)->actual &&
+		is_paren(buffer_line(env, env->line_no-1)->text[env->col_no-1].codepoint)) {
 		find_matching_paren(&line, &col, 1);
-	} else if (env->line_no <= env->line_count && env->col_no > 1 && is_paren(env->lines[env->line_no-1]->text[env->col_no-2].codepoint)) {
+	} else if (env->line_no <= env->line_count && env->col_no > 1 && is_paren(buffer_line(env, env->line_no-1)->text[env->col_no-2].codepoint)) {
 		find_matching_paren(&line, &col, 2);
 	}
 	if (env->highlighting_paren == -1 && line == -1) return;
@@ -3241,8 +4135,9 @@ void highlight_matching_paren(void) {
 void unhighlight_matching_paren(void) {
 	if (env->highlighting_paren > 0 && env->highlighting_paren <= env->line_count) {
 		for (int i = 0; i < env->line_count; i++) {
-			for (int j = 0; j < env->lines[i]->actual; ++j) {
-				env->lines[i]->text[j].flags &= ~(FLAG_SELECT);
+			if (LINE_IS_PENDING(env->lines[i])) continue;
+			for (int j = 0; j < buffer_line(env, i)->actual; ++j) {
+				buffer_line(env, i)->text[j].flags &= ~(FLAG_SELECT);
 			}
 		}
 		env->highlighting_paren = -1;
@@ -3268,7 +4163,7 @@ void place_cursor_actual(void) {
 
 	/* Determine where the cursor is physically */
 	for (int i = 0; i < env->col_no - 1; ++i) {
-		char_t * c = &env->lines[env->line_no-1]->text[i];
+		char_t * c = &buffer_line(env, env->line_no-1)->text[i];
 		x += c->display_width;
 	}
 
@@ -3382,6 +4277,7 @@ void SIGWINCH_handler(int sig) {
  */
 void SIGTSTP_handler(int sig) {
 	(void)sig;
+	screen_suspend();
 	mouse_disable();
 	set_buffered();
 	reset();
@@ -3402,6 +4298,7 @@ void SIGCONT_handler(int sig) {
 	set_unbuffered();
 	update_screen_size();
 	mouse_enable();
+	screen_resume();
 	redraw_all();
 	update_title();
 	signal(SIGCONT, SIGCONT_handler);
@@ -3462,8 +4359,8 @@ void add_buffer(uint8_t * buf, int size) {
 		if (!decode(&state, &codepoint_r, buf[i])) {
 			uint32_t c = codepoint_r;
 			if (c == '\n') {
-				if (!env->crnl && env->lines[env->line_no-1]->actual && env->lines[env->line_no-1]->text[env->lines[env->line_no-1]->actual-1].codepoint == '\r') {
-					env->lines[env->line_no-1]->actual--;
+				if (!env->crnl && buffer_line(env, env->line_no-1)->actual && buffer_line(env, env->line_no-1)->text[buffer_line(env, env->line_no-1)->actual-1].codepoint == '\r') {
+					buffer_line(env, env->line_no-1)->actual--;
 					env->crnl = 1;
 				}
 				env->lines = add_line(env->lines, env->line_no);
@@ -3476,7 +4373,7 @@ void add_buffer(uint8_t * buf, int size) {
 				_c.codepoint = (uint32_t)c;
 				_c.flags = 0;
 				_c.display_width = codepoint_width((wchar_t)c);
-				line_t * line  = env->lines[env->line_no - 1];
+				line_t * line  = buffer_line(env, env->line_no - 1);
 				line_t * nline = line_insert(line, _c, env->col_no - 1, env->line_no-1);
 				if (line != nline) {
 					env->lines[env->line_no - 1] = nline;
@@ -3489,6 +4386,112 @@ void add_buffer(uint8_t * buf, int size) {
 	}
 }
 
+/**
+ * Where the line of a large file starting at `start` ends.
+ */
+size_t source_line_end(buffer_t * buf, size_t start) {
+	uint8_t * end = memchr(buf->source + start, '\n', buf->source_size - start);
+	return end ? (size_t)(end - buf->source) : buf->source_size;
+}
+
+/**
+ * Decode bytes `start` to `end` of a large file into `line`, which
+ * must have room for at least that many characters. This is add_buffer
+ * for one line, except that it can't lean on recalculate_tabs (which
+ * does nothing while loading, and works on `env`) to size tabs.
+ */
+void decode_source(buffer_t * buf, size_t start, size_t end, line_t * line) {
+	uint32_t dstate = 0, c = 0;
+	int j = 0;
+	line->actual = 0;
+	for (uint8_t * p = buf->source + start; p < buf->source + end; ++p) {
+		if (!decode(&dstate, &c, *p)) {
+			if (c == '\r' && buf->source_crnl) continue;
+			line->text[line->actual].codepoint = c;
+			line->text[line->actual].flags = 0;
+			line->text[line->actual].display_width = (c == '\t') ? buf->tabstop - (j % buf->tabstop) : codepoint_width((wchar_t)c);
+			j += line->text[line->actual].display_width;
+			line->actual++;
+		} else if (dstate == UTF8_REJECT) {
+			dstate = 0;
+		}
+	}
+}
+
+/**
+ * Decode a pending line of a large file and put it in its place.
+ */
+line_t * decode_line(buffer_t * buf, int i) {
+	size_t start = LINE_PENDING_OFFSET(buf->lines[i]);
+	size_t end = source_line_end(buf, start);
+
+	int available = 32;
+	while ((size_t)available < end - start) available *= 2;
+
+	line_t * line = calloc(sizeof(line_t) + sizeof(char_t) * available, 1);
+	line->available = available;
+	decode_source(buf, start, end, line);
+
+	rehighlight_search(line);
+	buf->lines[i] = line;
+	return line;
+}
+
+/**
+ * Large files are read in one go and only split into lines: each
+ * line starts out as a pending entry holding its offset into the
+ * file, and is decoded when something first looks at it. If the
+ * file can't be read this way, the caller falls back to add_buffer.
+ *
+ * The file is copied rather than mapped with mapfile(): that wants a
+ * fixed address picked by the caller and can't be undone when the
+ * buffer is closed, and its pages are shared with the file itself,
+ * which output_file truncates and rewrites from this copy on save.
+ */
+int read_large_file(FILE * f, size_t size) {
+	uint8_t * source = malloc(size);
+	if (!source) return 1;
+	if (fread(source, 1, size, f) != size) {
+		free(source);
+		rewind(f);
+		return 1;
+	}
+
+	int count = 1;
+	for (uint8_t * p = source; (p = memchr(p, '\n', source + size - p)); ++p) {
+		if (p + 1 < source + size) count++;
+	}
+
+	line_t ** lines = malloc(sizeof(line_t *) * count);
+	if (!lines) {
+		free(source);
+		rewind(f);
+		return 1;
+	}
+
+	free(env->lines[0]);
+	free(env->lines);
+
+	int i = 0;
+	lines[i++] = LINE_PENDING_AT(0);
+	for (uint8_t * p = source; (p = memchr(p, '\n', source + size - p)); ++p) {
+		if (p + 1 < source + size) lines[i++] = LINE_PENDING_AT(p + 1 - source);
+	}
+
+	uint8_t * first = memchr(source, '\n', size);
+	env->crnl = first && first > source && first[-1] == '\r';
+
+	env->lines       = lines;
+	env->line_count  = count;
+	env->line_avail  = count;
+	env->source      = source;
+	env->source_size = size;
+	env->source_crnl = env->crnl;
+	env->line_no     = 1;
+	env->col_no      = 1;
+	return 0;
+}
+
 /**
  * Add a raw string to a buffer. Convenience wrapper
  * for add_buffer for nil-terminated strings.
@@ -3529,9 +4532,10 @@ struct syntax_definition * match_syntax(char * file) {
 void set_syntax_by_name(const char * name) {
 	if (!strcmp(name,"none")) {
 		for (int i = 0; i < env->line_count; ++i) {
-			env->lines[i]->istate = -1;
-			for (int j = 0; j < env->lines[i]->actual; ++j) {
-				env->lines[i]->text[j].flags &= (3 << 5);
+			if (LINE_IS_PENDING(env->lines[i])) continue;
+			buffer_line(env, i)->istate = -1;
+			for (int j = 0; j < buffer_line(env, i)->actual; ++j) {
+				buffer_line(env, i)->text[j].flags &= (3 << 5);
 			}
 		}
 		env->syntax = NULL;
@@ -3542,7 +4546,8 @@ void set_syntax_by_name(const char * name) {
 		if (!strcmp(name,s->name)) {
 			env->syntax = s;
 			for (int i = 0; i < env->line_count; ++i) {
-				env->lines[i]->istate = -1;
+				if (LINE_IS_PENDING(env->lines[i])) continue;
+				buffer_line(env, i)->istate = -1;
 			}
 			schedule_complete_recalc();
 			redraw_all();
@@ -3643,18 +4648,18 @@ void read_directory_into_buffer(char * file) {
 BIM_ACTION(open_file_from_line, 0,
 	"When browsing a directory, open the file under the cursor."
 )(void) {
-	if (env->lines[env->line_no-1]->actual < 1) return;
-	if (env->lines[env->line_no-1]->text[0].codepoint != 'd' &&
-	    env->lines[env->line_no-1]->text[0].codepoint != 'f') return;
+	if (buffer_line(env, env->line_no-1)->actual < 1) return;
+	if (buffer_line(env, env->line_no-1)->text[0].codepoint != 'd' &&
+	    buffer_line(env, env->line_no-1)->text[0].codepoint != 'f') return;
 	/* Collect file name */
-	char * tmp = malloc(strlen(env->file_name) + 1 + env->lines[env->line_no-1]->actual * 7); /* Should be enough */
-	memset(tmp, 0, strlen(env->file_name) + 1 + env->lines[env->line_no-1]->actual * 7);
+	char * tmp = malloc(strlen(env->file_name) + 1 + buffer_line(env, env->line_no-1)->actual * 7); /* Should be enough */
+	memset(tmp, 0, strlen(env->file_name) + 1 + buffer_line(env, env->line_no-1)->actual * 7);
 	char * t = tmp;
 	/* Start by copying the filename */
 	t += sprintf(t, "%s/", env->file_name);
 	/* Start from character 2 to skip d/f and space */
-	for (int i = 2; i < env->lines[env->line_no-1]->actual; ++i) {
-		t += to_eight(env->lines[env->line_no-1]->text[i].codepoint, t);
+	for (int i = 2; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+		t += to_eight(buffer_line(env, env->line_no-1)->text[i].codepoint, t);
 	}
 	*t = '\0';
 	/* Normalize */
@@ -3710,46 +4715,139 @@ void run_onload(buffer_t * env) {
 	}
 }
 
-static void render_syntax_async(background_task_t * task) {
+/**
+ * Syntax highlighting for large buffers is done lazily.
+ *
+ * Everything before `env->syntax_frontier` is known to be right. Past
+ * that, lines are highlighted when they are about to be drawn, and a
+ * background pass walks the frontier forward in steps of SYNTAX_STEP
+ * lines between keystrokes. Every line keeps the state it starts in,
+ * so the frontier is where the pass picks up again; an edit above it
+ * just moves it back, abandoning whatever the pass had done past that.
+ */
+#define SYNTAX_STEP 256
+
+/**
+ * Is there a key waiting? The background pass stops early if so.
+ */
+static int syntax_input_pending(void) {
+	struct pollfd fds[1];
+	fds[0].fd = global_config.tty_in;
+	fds[0].events = POLLIN;
+	return poll(fds,1,0) > 0 && (fds[0].revents & POLLIN);
+}
+
+/**
+ * Move the frontier forward until it reaches `until`, highlighting
+ * at most `budget` lines (or any number, if `budget` is -1).
+ */
+static void syntax_advance(int until, int budget, int redraw) {
+	int done = 0;
+	while (env->syntax && env->syntax_frontier < until && env->syntax_frontier < env->line_count) {
+		int line_no = env->syntax_frontier;
+		line_t * line = buffer_line(env, line_no);
+		if (!line->highlighted) {
+			if (budget != -1 && done == budget) return;
+			if (budget != -1 && (done & 31) == 31 && syntax_input_pending()) return;
+			int state = syntax_run(line, line_no);
+			if (!env->syntax) return;
+			syntax_carry(line_no, state);
+			if (redraw) redraw_line(line_no);
+			done++;
+		}
+		env->syntax_frontier = line_no + 1;
+	}
+}
+
+/**
+ * Make sure a line is highlighted before it is drawn.
+ *
+ * If the line is close enough to the frontier, bring the frontier up
+ * to it. Otherwise, highlight it starting from the state it had last
+ * time, which is usually right; the background pass will fix it up
+ * when it gets there if it wasn't.
+ */
+static void syntax_prepare(int line_no) {
+	if (!env->syntax || env->slowop || buffer_line(env, line_no)->highlighted) return;
+
+	if (line_no - env->syntax_frontier < SYNTAX_STEP) {
+		syntax_advance(line_no + 1, -1, 0);
+	}
+
+	if (env->syntax && !buffer_line(env, line_no)->highlighted) {
+		int state = syntax_run(buffer_line(env, line_no), line_no);
+		if (env->syntax) syntax_carry(line_no, state);
+	}
+
+	schedule_syntax_pass();
+}
+
+static void syntax_pass(background_task_t * task) {
 	buffer_t * old_env = env;
 	env = task->env;
-	int line_no = task->_private_i;
 
-	if (env->line_count && line_no < env->line_count) {
-		int tmp = env->loading;
-		env->loading = 1;
-		recalculate_syntax(env->lines[line_no], line_no);
-		env->loading = tmp;
-		if (env == old_env) {
-			redraw_line(line_no);
-		}
+	if (env->syntax && !env->slowop) {
+		syntax_advance(env->line_count, SYNTAX_STEP, env == old_env);
+		schedule_syntax_pass();
 	}
+
 	env = old_env;
 }
 
+/**
+ * Make sure a background pass is queued for this buffer, if there is
+ * anything left for one to do.
+ */
+static void schedule_syntax_pass(void) {
+	if (!env->syntax || env->syntax_frontier >= env->line_count) return;
+
+	/* That would decode all of a large file; only highlight what gets drawn */
+	if (env->source) return;
+
+	for (background_task_t * t = global_config.background_task; t; t = t->next) {
+		if (t->env == env && t->func == syntax_pass) return;
+	}
+
+	background_task_t * task = malloc(sizeof(background_task_t));
+	task->env  = env;
+	task->_private_i = 0;
+	task->func = syntax_pass;
+	task->next = NULL;
+	if (global_config.tail_task) {
+		global_config.tail_task->next = task;
+	}
+	global_config.tail_task = task;
+	if (!global_config.background_task) {
+		global_config.background_task = task;
+	}
+}
+
+/**
+ * Throw away all highlighting and start again from the top.
+ * Small buffers are done right away; anything bigger is done lazily.
+ */
 static void schedule_complete_recalc(void) {
-	if (env->line_count < 1000) {
+	for (int i = 0; i < env->line_count; ++i) {
+		if (LINE_IS_PENDING(env->lines[i])) continue;
+		buffer_line(env, i)->highlighted = 0;
+	}
+	env->syntax_frontier = 0;
+
+	if (!env->syntax) {
+		/* Still need to clear out old highlighting */
 		for (int i = 0; i < env->line_count; ++i) {
-			recalculate_syntax(env->lines[i], i);
+			if (LINE_IS_PENDING(env->lines[i])) continue;
+			syntax_run(buffer_line(env, i), i);
 		}
 		return;
 	}
 
-	/* TODO see if there's already a redraw scheduled */
-	for (int i = 0; i < env->line_count; ++i) {
-		background_task_t * task = malloc(sizeof(background_task_t));
-		task->env  = env;
-		task->_private_i = i;
-		task->func = render_syntax_async;
-		task->next = NULL;
-		if (global_config.tail_task) {
-			global_config.tail_task->next = task;
-		}
-		global_config.tail_task = task;
-		if (!global_config.background_task) {
-			global_config.background_task = task;
-		}
+	if (env->line_count < 1000) {
+		syntax_advance(env->line_count, -1, 0);
+		return;
 	}
+
+	schedule_syntax_pass();
 	redraw_statusbar();
 }
 
@@ -3832,35 +4930,42 @@ void open_file(char * file) {
 		return;
 	}
 
-	uint8_t buf[BLOCK_SIZE];
+	struct stat statbuf;
+	if (global_config.large_files && f != stdin && !fstat(fileno(f), &statbuf) &&
+		S_ISREG(statbuf.st_mode) && statbuf.st_size >= LARGE_FILE_SIZE &&
+		!read_large_file(f, statbuf.st_size)) {
+		/* Lines will be decoded as they are needed */
+	} else {
+		uint8_t buf[BLOCK_SIZE];
 
-	state = 0;
+		state = 0;
 
-	while (!feof(f) && !ferror(f)) {
-		size_t r = fread(buf, 1, BLOCK_SIZE, f);
-		add_buffer(buf, r);
-	}
+		while (!feof(f) && !ferror(f)) {
+			size_t r = fread(buf, 1, BLOCK_SIZE, f);
+			add_buffer(buf, r);
+		}
 
-	if (ferror(f)) {
-		env->loading = 0;
-		return;
-	}
+		if (ferror(f)) {
+			env->loading = 0;
+			return;
+		}
 
-	if (env->line_no && env->lines[env->line_no-1] && env->lines[env->line_no-1]->actual == 0) {
-		/* Remove blank line from end */
-		env->lines = remove_line(env->lines, env->line_no-1);
+		if (env->line_no && buffer_line(env, env->line_no-1) && buffer_line(env, env->line_no-1)->actual == 0) {
+			/* Remove blank line from end */
+			env->lines = remove_line(env->lines, env->line_no-1);
+		}
 	}
 
 	if (global_config.highlight_on_open) {
 		env->syntax = match_syntax(file);
 		if (!env->syntax) {
-			if (line_matches(env->lines[0], "<?xml")) set_syntax_by_name("xml");
-			else if (line_matches(env->lines[0], "<!doctype")) set_syntax_by_name("xml");
-			else if (line_matches(env->lines[0], "#!/usr/bin/env bash")) set_syntax_by_name("bash");
-			else if (line_matches(env->lines[0], "#!/bin/bash")) set_syntax_by_name("bash");
-			else if (line_matches(env->lines[0], "#!/bin/sh")) set_syntax_by_name("bash");
-			else if (line_matches(env->lines[0], "#!/usr/bin/env python")) set_syntax_by_name("py");
-			else if (line_matches(env->lines[0], "#!/usr/bin/env groovy")) set_syntax_by_name("groovy");
+			if (line_matches(buffer_line(env, 0), "<?xml")) set_syntax_by_name("xml");
+			else if (line_matches(buffer_line(env, 0), "<!doctype")) set_syntax_by_name("xml");
+			else if (line_matches(buffer_line(env, 0), "#!/usr/bin/env bash")) set_syntax_by_name("bash");
+			else if (line_matches(buffer_line(env, 0), "#!/bin/bash")) set_syntax_by_name("bash");
+			else if (line_matches(buffer_line(env, 0), "#!/bin/sh")) set_syntax_by_name("bash");
+			else if (line_matches(buffer_line(env, 0), "#!/usr/bin/env python")) set_syntax_by_name("py");
+			else if (line_matches(buffer_line(env, 0), "#!/usr/bin/env groovy")) set_syntax_by_name("groovy");
 		}
 		if (!env->syntax && global_config.syntax_fallback) {
 			set_syntax_by_name(global_config.syntax_fallback);
@@ -3868,13 +4973,14 @@ void open_file(char * file) {
 		schedule_complete_recalc();
 	}
 
-	/* Try to automatically figure out tabs vs. spaces */
+	/* Try to automatically figure out tabs vs. spaces; for large files, from a sample */
+	int sample = env->source ? (env->line_count < LARGE_FILE_SAMPLE ? env->line_count : LARGE_FILE_SAMPLE) : env->line_count;
 	int tabs = 0, spaces = 0;
-	for (int i = 0; i < env->line_count; ++i) {
-		if (env->lines[i]->actual > 1) { /* Make sure line has at least some text on it */
-			if (env->lines[i]->text[0].codepoint == '\t') tabs++;
-			if (env->lines[i]->text[0].codepoint == ' ' &&
-				env->lines[i]->text[1].codepoint == ' ') /* Ignore spaces at the start of asterisky C comments */
+	for (int i = 0; i < sample; ++i) {
+		if (buffer_line(env, i)->actual > 1) { /* Make sure line has at least some text on it */
+			if (buffer_line(env, i)->text[0].codepoint == '\t') tabs++;
+			if (buffer_line(env, i)->text[0].codepoint == ' ' &&
+				buffer_line(env, i)->text[1].codepoint == ' ') /* Ignore spaces at the start of asterisky C comments */
 				spaces++;
 		}
 	}
@@ -3887,11 +4993,11 @@ void open_file(char * file) {
 	if (spaces > tabs) {
 		int one = 0, two = 0, three = 0, four = 0; /* If you use more than that, I don't like you. */
 		int lastCount = 0;
-		for (int i = 0; i < env->line_count; ++i) {
-			if (env->lines[i]->actual > 1 && !line_is_comment(env->lines[i])) {
+		for (int i = 0; i < sample; ++i) {
+			if (buffer_line(env, i)->actual > 1 && !line_is_comment(buffer_line(env, i))) {
 				/* Count spaces at beginning */
 				int c = 0, diff = 0;
-				while (c < env->lines[i]->actual && env->lines[i]->text[c].codepoint == ' ') c++;
+				while (c < buffer_line(env, i)->actual && buffer_line(env, i)->text[c].codepoint == ' ') c++;
 				if (c > lastCount) {
 					diff = c - lastCount;
 				} else if (c < lastCount) {
@@ -3923,7 +5029,8 @@ void open_file(char * file) {
 	}
 
 	for (int i = 0; i < env->line_count; ++i) {
-		recalculate_tabs(env->lines[i]);
+		if (LINE_IS_PENDING(env->lines[i])) continue;
+		recalculate_tabs(buffer_line(env, i));
 	}
 
 	if (global_config.go_to_line) {
@@ -3950,6 +5057,7 @@ void open_file(char * file) {
  * Clean up the terminal and exit the editor.
  */
 void quit(const char * message) {
+	screen_suspend();
 	mouse_disable();
 	set_buffered();
 	reset();
@@ -4097,7 +5205,7 @@ int git_examine(char * filename) {
 				if (from_count == 0 && to_count > 0) {
 					/* No -, all + means all of to_count is green */
 					for (int i = 0; i < to_count; ++i) {
-						env->lines[to_line+i-1]->rev_status = 1; /* Green */
+						buffer_line(env, to_line+i-1)->rev_status = 1; /* Green */
 					}
 				} else if (from_count > 0 && to_count == 0) {
 					/*
@@ -4105,25 +5213,25 @@ int git_examine(char * filename) {
 					 * Note that to_line is one lower than the affected line, so we don't need to mess with indexes.
 					 */
 					if (to_line >= env->line_count) continue;
-					env->lines[to_line]->rev_status = 4; /* Red */
+					buffer_line(env, to_line)->rev_status = 4; /* Red */
 				} else if (from_count > 0 && from_count == to_count) {
 					/* from = to, all modified */
 					for (int i = 0; i < to_count; ++i) {
-						env->lines[to_line+i-1]->rev_status = 3; /* Blue */
+						buffer_line(env, to_line+i-1)->rev_status = 3; /* Blue */
 					}
 				} else if (from_count > 0 && from_count < to_count) {
 					/* from < to, some modified, some added */
 					for (int i = 0; i < from_count; ++i) {
-						env->lines[to_line+i-1]->rev_status = 3; /* Blue */
+						buffer_line(env, to_line+i-1)->rev_status = 3; /* Blue */
 					}
 					for (int i = from_count; i < to_count; ++i) {
-						env->lines[to_line+i-1]->rev_status = 1; /* Green */
+						buffer_line(env, to_line+i-1)->rev_status = 1; /* Green */
 					}
 				} else if (to_count > 0 && from_count > to_count) {
 					/* from > to, we deleted but also modified some lines */
-					env->lines[to_line-1]->rev_status = 5; /* Red + Blue */
+					buffer_line(env, to_line-1)->rev_status = 5; /* Red + Blue */
 					for (int i = 1; i < to_count; ++i) {
-						env->lines[to_line+i-1]->rev_status = 3; /* Blue */
+						buffer_line(env, to_line+i-1)->rev_status = 3; /* Blue */
 					}
 				}
 			}
@@ -4147,7 +5255,28 @@ int git_examine(char * filename) {
 void output_file(buffer_t * env, FILE * f) {
 	int i, j;
 	for (i = 0; i < env->line_count; ++i) {
-		line_t * line = env->lines[i];
+		if (LINE_IS_PENDING(env->lines[i]) && env->crnl == env->source_crnl) {
+			/* Untouched lines of a large file go back out as they came in, in runs */
+			size_t start = LINE_PENDING_OFFSET(env->lines[i]);
+			size_t end = start;
+			while (1) {
+				uint8_t * nl = memchr(env->source + end, '\n', env->source_size - end);
+				end = nl ? (size_t)(nl - env->source) + 1 : env->source_size;
+				if (i + 1 < env->line_count && LINE_IS_PENDING(env->lines[i+1]) &&
+					LINE_PENDING_OFFSET(env->lines[i+1]) == end) {
+					i++;
+					continue;
+				}
+				break;
+			}
+			fwrite(env->source + start, end - start, 1, f);
+			if (env->source[end-1] != '\n') {
+				if (env->crnl) fputc('\r', f);
+				fputc('\n', f);
+			}
+			continue;
+		}
+		line_t * line = buffer_line(env, i);
 		line->rev_status = 0;
 		for (j = 0; j < line->actual; j++) {
 			char_t c = line->text[j];
@@ -4259,8 +5388,8 @@ void close_buffer(void) {
  */
 void set_preferred_column(void) {
 	int c = 0;
-	for (int i = 0; i < env->lines[env->line_no-1]->actual && i < env->col_no-1; ++i) {
-		c += env->lines[env->line_no-1]->text[i].display_width;
+	for (int i = 0; i < buffer_line(env, env->line_no-1)->actual && i < env->col_no-1; ++i) {
+		c += buffer_line(env, env->line_no-1)->text[i].display_width;
 	}
 	env->preferred_column = c;
 }
@@ -4276,8 +5405,8 @@ BIM_ACTION(cursor_down, 0,
 
 		/* Try to place the cursor horizontally at the preferred column */
 		int _x = 0;
-		for (int i = 0; i < env->lines[env->line_no-1]->actual; ++i) {
-			char_t * c = &env->lines[env->line_no-1]->text[i];
+		for (int i = 0; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+			char_t * c = &buffer_line(env, env->line_no-1)->text[i];
 			_x += c->display_width;
 			env->col_no = i+1;
 			if (_x > env->preferred_column) {
@@ -4286,7 +5415,7 @@ BIM_ACTION(cursor_down, 0,
 		}
 
 		if (env->mode == MODE_INSERT && _x <= env->preferred_column) {
-			env->col_no = env->lines[env->line_no-1]->actual + 1;
+			env->col_no = buffer_line(env, env->line_no-1)->actual + 1;
 		}
 
 		/*
@@ -4295,8 +5424,8 @@ BIM_ACTION(cursor_down, 0,
 		 *
 		 * If we're in insert mode, we can go one cell beyond the end of the line
 		 */
-		if (env->col_no > env->lines[env->line_no-1]->actual + (env->mode == MODE_INSERT)) {
-			env->col_no = env->lines[env->line_no-1]->actual + (env->mode == MODE_INSERT);
+		if (env->col_no > buffer_line(env, env->line_no-1)->actual + (env->mode == MODE_INSERT)) {
+			env->col_no = buffer_line(env, env->line_no-1)->actual + (env->mode == MODE_INSERT);
 			if (env->col_no == 0) env->col_no = 1;
 		}
 
@@ -4366,8 +5495,8 @@ BIM_ACTION(cursor_up, 0,
 
 		/* Try to place the cursor horizontally at the preferred column */
 		int _x = 0;
-		for (int i = 0; i < env->lines[env->line_no-1]->actual; ++i) {
-			char_t * c = &env->lines[env->line_no-1]->text[i];
+		for (int i = 0; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+			char_t * c = &buffer_line(env, env->line_no-1)->text[i];
 			_x += c->display_width;
 			env->col_no = i+1;
 			if (_x > env->preferred_column) {
@@ -4376,7 +5505,7 @@ BIM_ACTION(cursor_up, 0,
 		}
 
 		if (env->mode == MODE_INSERT && _x <= env->preferred_column) {
-			env->col_no = env->lines[env->line_no-1]->actual + 1;
+			env->col_no = buffer_line(env, env->line_no-1)->actual + 1;
 		}
 
 		/*
@@ -4385,8 +5514,8 @@ BIM_ACTION(cursor_up, 0,
 		 *
 		 * If we're in insert mode, we can go one cell beyond the end of the line
 		 */
-		if (env->col_no > env->lines[env->line_no-1]->actual + (env->mode == MODE_INSERT)) {
-			env->col_no = env->lines[env->line_no-1]->actual + (env->mode == MODE_INSERT);
+		if (env->col_no > buffer_line(env, env->line_no-1)->actual + (env->mode == MODE_INSERT)) {
+			env->col_no = buffer_line(env, env->line_no-1)->actual + (env->mode == MODE_INSERT);
 			if (env->col_no == 0) env->col_no = 1;
 		}
 
@@ -4465,7 +5594,7 @@ BIM_ACTION(cursor_right, 0,
 )(void) {
 
 	/* If this isn't already the rightmost column we can reach on this line in this mode... */
-	if (env->col_no < env->lines[env->line_no-1]->actual + !!(env->mode == MODE_INSERT)) {
+	if (env->col_no < buffer_line(env, env->line_no-1)->actual + !!(env->mode == MODE_INSERT)) {
 		env->col_no += 1;
 
 		/* Update the status bar */
@@ -4495,7 +5624,7 @@ BIM_ACTION(cursor_home, 0,
 BIM_ACTION(cursor_end, 0,
 	"Move the cursor to the end of the line, or past the end in insert mode."
 )(void) {
-	env->col_no = env->lines[env->line_no-1]->actual+!!(env->mode == MODE_INSERT);
+	env->col_no = buffer_line(env, env->line_no-1)->actual+!!(env->mode == MODE_INSERT);
 	set_history_break();
 	set_preferred_column();
 
@@ -4509,8 +5638,8 @@ BIM_ACTION(cursor_end, 0,
 BIM_ACTION(leave_insert, 0,
 	"Leave insert modes and return to normal mode."
 )(void) {
-	if (env->col_no > env->lines[env->line_no-1]->actual) {
-		env->col_no = env->lines[env->line_no-1]->actual;
+	if (env->col_no > buffer_line(env, env->line_no-1)->actual) {
+		env->col_no = buffer_line(env, env->line_no-1)->actual;
 		if (env->col_no == 0) env->col_no = 1;
 		set_preferred_column();
 	}
@@ -4609,7 +5738,7 @@ int subsearch_matches(line_t * line, int j, uint32_t * needle, int ignorecase, i
  * Replace text on a given line with other text.
  */
 void perform_replacement(int line_no, uint32_t * needle, uint32_t * replacement, int col, int ignorecase, int *out_col) {
-	line_t * line = env->lines[line_no-1];
+	line_t * line = buffer_line(env, line_no-1);
 	int j = col;
 	while (j < line->actual + 1) {
 		int match_len;
@@ -4865,8 +5994,8 @@ int convert_to_html(void) {
 		int last_flag = -1;
 		int opened = 0;
 		int all_spaces = 1;
-		for (int j = 0; j < old->lines[i]->actual; ++j) {
-			char_t c = old->lines[i]->text[j];
+		for (int j = 0; j < buffer_line(old, i)->actual; ++j) {
+			char_t c = buffer_line(old, i)->text[j];
 
 			if (c.codepoint != ' ') all_spaces = 0;
 
@@ -4919,7 +6048,8 @@ int convert_to_html(void) {
 		env->file_name = tmp;
 	}
 	for (int i = 0; i < env->line_count; ++i) {
-		recalculate_tabs(env->lines[i]);
+		if (LINE_IS_PENDING(env->lines[i])) continue;
+		recalculate_tabs(buffer_line(env, i));
 	}
 	env->syntax = match_syntax(".htm");
 	schedule_complete_recalc();
@@ -4972,7 +6102,7 @@ int _prefix_command_run_script(char * cmd) {
 		/* Write lines to child process */
 		FILE * f = fdopen(in[1],"w");
 		for (int i = range_top; i <= range_bot; ++i) {
-			line_t * line = env->lines[i-1];
+			line_t * line = buffer_line(env, i-1);
 			for (int j = 0; j < line->actual; j++) {
 				char_t c = line->text[j];
 				if (c.codepoint == 0) {
@@ -5001,7 +6131,7 @@ int _prefix_command_run_script(char * cmd) {
 			size_t r = fread(buf, 1, BLOCK_SIZE, result);
 			add_buffer(buf, r);
 		}
-		if (env->line_no && env->lines[env->line_no-1] && env->lines[env->line_no-1]->actual == 0) {
+		if (env->line_no && buffer_line(env, env->line_no-1) && buffer_line(env, env->line_no-1)->actual == 0) {
 			env->lines = remove_line(env->lines, env->line_no-1);
 		}
 		fclose(result);
@@ -5017,8 +6147,8 @@ int _prefix_command_run_script(char * cmd) {
 		for (int i = 0; i < new->line_count; ++i) {
 			/* Add the new lines */
 			env->lines = add_line(env->lines, range_top + i - 1);
-			replace_line(env->lines, range_top + i - 1, new->lines[i]);
-			recalculate_tabs(env->lines[range_top+i-1]);
+			replace_line(env->lines, range_top + i - 1, buffer_line(new, i));
+			recalculate_tabs(buffer_line(env, range_top+i-1));
 		}
 
 		env->modified = 1;
@@ -5026,9 +6156,10 @@ int _prefix_command_run_script(char * cmd) {
 		/* Close the temporary buffer */
 		buffer_close(new);
 	} else {
-		/* Reset and draw some line feeds */
+		/* Hand the terminal over; reset and draw some line feeds */
+		screen_suspend();
 		reset();
-		printf("\n\n");
+		screen_printf("\n\n");
 
 		/* Set buffered for shell application */
 		set_buffered();
@@ -5038,11 +6169,12 @@ int _prefix_command_run_script(char * cmd) {
 
 		/* Return to the editor, wait for user to press enter. */
 		set_unbuffered();
-		printf("\n\nPress ENTER to continue.");
+		screen_printf("\n\nPress ENTER to continue.");
 		int c;
 		while ((c = bim_getch(), c != ENTER_KEY && c != LINE_FEED));
 
 		/* Redraw the screen */
+		screen_resume();
 		redraw_all();
 	}
 
@@ -5183,6 +6315,10 @@ BIM_COMMAND(e,"e","Open a file") {
 		SWAP(int, env->line_count, new_env->line_count);
 		SWAP(int, env->line_avail, new_env->line_avail);
 		SWAP(history_t *, env->history, new_env->history);
+		SWAP(uint8_t *, env->source, new_env->source);
+		SWAP(size_t, env->source_size, new_env->source_size);
+		SWAP(int, env->source_crnl, new_env->source_crnl);
+		search_cache_drop(env);
 
 		buffer_close(new_env); /* Should probably also free, this needs editing. */
 		schedule_complete_recalc();
@@ -5430,8 +6566,9 @@ BIM_COMMAND(noh,"noh","Clear search term") {
 		free(global_config.search);
 		global_config.search = NULL;
 		for (int i = 0; i < env->line_count; ++i) {
-			for (int j = 0; j < env->lines[i]->actual; ++j) {
-				env->lines[i]->text[j].flags &= ~(FLAG_SEARCH);
+			if (LINE_IS_PENDING(env->lines[i])) continue;
+			for (int j = 0; j < buffer_line(env, i)->actual; ++j) {
+				buffer_line(env, i)->text[j].flags &= ~(FLAG_SEARCH);
 			}
 		}
 		redraw_text();
@@ -5508,9 +6645,11 @@ BIM_COMMAND(theme,"theme","Set color theme") {
 				krk_currentThread.stackTop = krk_currentThread.stack + before;
 				if (IS_NONE(result) && (krk_currentThread.flags & KRK_THREAD_HAS_EXCEPTION)) {
 					render_error("Exception occurred in theme: %s", AS_INSTANCE(krk_currentThread.currentException)->_class->name->chars);
+					screen_suspend();
 					krk_dumpTraceback();
 					int key = 0;
 					while ((key = bim_getkey(DEFAULT_KEY_WAIT)) == KEY_TIMEOUT);
+					screen_resume();
 				}
 				redraw_all();
 				return 0;
@@ -5603,7 +6742,8 @@ BIM_COMMAND(tabstop,"tabstop","Show or set the tabstop (width of an indentation
 		if (t > 0 && t < 12) {
 			env->tabstop = t;
 			for (int i = 0; i < env->line_count; ++i) {
-				recalculate_tabs(env->lines[i]);
+				if (LINE_IS_PENDING(env->lines[i])) continue;
+				recalculate_tabs(buffer_line(env, i));
 			}
 			redraw_all();
 		} else {
@@ -5673,8 +6813,9 @@ BIM_COMMAND(hlparen,"hlparen","Show or set the configuration option to highlight
 		global_config.highlight_parens = atoi(argv[1]);
 		if (env) {
 			for (int i = 0; i < env->line_count; ++i) {
-				for (int j = 0; j < env->lines[i]->actual; ++j) {
-					env->lines[i]->text[j].flags &= (~FLAG_SELECT);
+				if (LINE_IS_PENDING(env->lines[i])) continue;
+				for (int j = 0; j < buffer_line(env, i)->actual; ++j) {
+					buffer_line(env, i)->text[j].flags &= (~FLAG_SELECT);
 				}
 			}
 			redraw_text();
@@ -5692,7 +6833,8 @@ BIM_COMMAND(hlcurrent,"hlcurrent","Show or set the configuration option to highl
 		if (env) {
 			if (!global_config.highlight_current_line) {
 				for (int i = 0; i < env->line_count; ++i) {
-					env->lines[i]->is_current = 0;
+					if (LINE_IS_PENDING(env->lines[i])) continue;
+					buffer_line(env, i)->is_current = 0;
 				}
 			}
 			redraw_text();
@@ -5780,7 +6922,8 @@ BIM_COMMAND(relativenumbers,"relativenumbers","Show or set the display of relati
 		if (env) {
 			if (!global_config.relative_lines) {
 				for (int i = 0; i < env->line_count; ++i) {
-					env->lines[i]->is_current = 0;
+					if (LINE_IS_PENDING(env->lines[i])) continue;
+					buffer_line(env, i)->is_current = 0;
 				}
 			}
 			redraw_text();
@@ -6463,16 +7606,16 @@ void render_command_input_buffer(void) {
 	/* If there's a mode name to render, draw it first */
 	int _left_gutter = 0;
 	if (env->mode == MODE_LINE_SELECTION) {
-		_left_gutter = printf("(LINE %d:%d)",
+		_left_gutter = screen_printf("(LINE %d:%d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line);
 	} else if (env->mode == MODE_COL_SELECTION) {
-		_left_gutter = printf("(COL %d:%d %d)",
+		_left_gutter = screen_printf("(COL %d:%d %d)",
 			(env->start_line < env->line_no) ? env->start_line : env->line_no,
 			(env->start_line < env->line_no) ? env->line_no : env->start_line,
 			(env->sel_col));
 	} else if (env->mode == MODE_CHAR_SELECTION) {
-		_left_gutter = printf("(CHAR)");
+		_left_gutter = screen_printf("(CHAR)");
 	}
 
 	/* Figure out the cursor position and adjust the offset if necessary */
@@ -6495,16 +7638,16 @@ void render_command_input_buffer(void) {
 	/* If the input buffer is horizontally shifted because it's too long, indicate that. */
 	if (global_config.command_offset) {
 		set_colors(COLOR_ALT_FG, COLOR_ALT_BG);
-		printf("<");
+		screen_printf("<");
 	} else {
 		/* Otherwise indicate buffer mode (search / ?, or command :) */
 		set_colors(COLOR_FG, COLOR_BG);
 		if (global_config.overlay_mode == OVERLAY_MODE_SEARCH) {
-			printf(global_config.search_direction == 0 ? "?" : "/");
+			screen_printf(global_config.search_direction == 0 ? "?" : "/");
 		} else if (global_config.overlay_mode == OVERLAY_MODE_FILESEARCH) {
-			printf("_");
+			screen_printf("_");
 		} else {
-			printf(":");
+			screen_printf(":");
 		}
 	}
 
@@ -6526,10 +7669,11 @@ BIM_ACTION(command_discard, 0,
 		env->col_no  = global_config.prev_col;
 		/* Unhighlight search matches */
 		for (int i = 0; i < env->line_count; ++i) {
-			for (int j = 0; j < env->lines[i]->actual; ++j) {
-				env->lines[i]->text[j].flags &= (~FLAG_SEARCH);
+			if (LINE_IS_PENDING(env->lines[i])) continue;
+			for (int j = 0; j < buffer_line(env, i)->actual; ++j) {
+				buffer_line(env, i)->text[j].flags &= (~FLAG_SEARCH);
 			}
-			rehighlight_search(env->lines[i]);
+			rehighlight_search(buffer_line(env, i));
 		}
 	}
 	global_config.overlay_mode = OVERLAY_MODE_NONE;
@@ -6773,30 +7917,217 @@ int smart_case(uint32_t * str) {
 	return 1;
 }
 
+/**
+ * A search string, looked over once before searching with it.
+ *
+ * Most columns of most lines can't start a match, and we can tell
+ * that from the first character of the pattern alone, so scans skip
+ * straight to the columns that have that character (or, in lines of
+ * large files that haven't been decoded, to the bytes that encode it)
+ * and only try the full pattern there.
+ */
+struct search_pattern {
+	uint32_t * needle;
+	int ignorecase;
+	int anchored;       /* Only matches at the start of a line */
+	uint32_t first;     /* What every match starts with (lowered if ignoring case), or 0 */
+	char first_utf8[8]; /* ... and its UTF-8, for searching raw file bytes */
+	int first_len;
+	char first_upper;   /* The other case of an ASCII letter, when ignoring case */
+};
+
+static void search_compile(struct search_pattern * pat, uint32_t * needle) {
+	uint32_t * match = needle;
+	pat->needle = needle;
+	pat->ignorecase = smart_case(needle);
+	pat->anchored = 0;
+	pat->first = 0;
+	pat->first_len = 0;
+	pat->first_upper = 0;
+
+	if (*match == '^') {
+		pat->anchored = 1;
+		match++;
+	}
+
+	/* See subsearch_matches for what these mean */
+	if (*match == '\\' && (match[1] == '$' || match[1] == '^' || match[1] == '/' || match[1] == '\\' || match[1] == '.')) {
+		pat->first = match[1];
+	} else if (*match == '\\' && match[1] == 't') {
+		pat->first = '\t';
+	} else if (*match && *match != '.' && *match != '$') {
+		pat->first = pat->ignorecase ? (uint32_t)tolower(*match) : *match;
+	}
+
+	if (!pat->first) return;
+
+	pat->first_len = to_eight(pat->first, pat->first_utf8);
+	if (pat->ignorecase && pat->first >= 'a' && pat->first <= 'z') {
+		pat->first_upper = toupper(pat->first);
+	}
+}
+
+static inline int search_could_start(struct search_pattern * pat, line_t * line, int j) {
+	if (!pat->first) return 1;
+	uint32_t c = line->text[j].codepoint;
+	return (pat->ignorecase ? (uint32_t)tolower(c) : c) == pat->first;
+}
+
+/**
+ * Count the matches starting in a line, and optionally mark them.
+ * If `index` is given, it gets which match (counting from 1) starts
+ * at column `at`, if one does.
+ */
+static int search_line(line_t * line, struct search_pattern * pat, int mark, int at, int * index) {
+	if (mark) {
+		for (int j = 0; j < line->actual; ++j) {
+			line->text[j].flags &= ~(FLAG_SEARCH);
+		}
+	}
+
+	int count = 0;
+	int last = pat->anchored ? 0 : line->actual;
+	for (int j = 0; j <= last; ++j) {
+		if (pat->first) {
+			while (j < line->actual && !search_could_start(pat, line, j)) j++;
+			if (j >= line->actual || j > last) break;
+		}
+		int matchlen = 0;
+		if (!subsearch_matches(line, j, pat->needle, pat->ignorecase, &matchlen)) continue;
+		count++;
+		if (index && j == at) *index = count;
+		if (mark) {
+			for (int i = j; matchlen > 0; ++i, matchlen--) {
+				line->text[i].flags |= FLAG_SEARCH;
+			}
+		}
+	}
+	return count;
+}
+
+/**
+ * Could this line of a large file, which hasn't been decoded, hold a match?
+ */
+static int search_source_could_match(struct search_pattern * pat, size_t start, size_t end) {
+	if (!pat->first || (pat->first == '\r' && env->source_crnl)) return 1;
+
+	char * from = (char *)env->source + start;
+	size_t len = end - start;
+	if (pat->anchored) {
+		return (len >= (size_t)pat->first_len && !memcmp(from, pat->first_utf8, pat->first_len)) ||
+			(pat->first_upper && len && *from == pat->first_upper);
+	}
+
+	if (pat->first_upper && memchr(from, pat->first_upper, len)) return 1;
+
+	char * p = from;
+	while ((p = memchr(p, pat->first_utf8[0], from + len - p))) {
+		if ((size_t)(from + len - p) >= (size_t)pat->first_len && !memcmp(p, pat->first_utf8, pat->first_len)) return 1;
+		p++;
+	}
+	return 0;
+}
+
+/**
+ * Get a line to search. Lines of large files that haven't been decoded
+ * yet are decoded into a scratch line rather than kept, or skipped
+ * entirely (NULL) if their bytes show there can't be a match in them.
+ */
+static line_t * search_view(struct search_pattern * pat, int i) {
+	static line_t * scratch = NULL;
+
+	if (!LINE_IS_PENDING(env->lines[i])) return env->lines[i];
+
+	size_t start = LINE_PENDING_OFFSET(env->lines[i]);
+	size_t end = source_line_end(env, start);
+	if (!search_source_could_match(pat, start, end)) return NULL;
+
+	if (!scratch || (size_t)scratch->available < end - start) {
+		int available = scratch ? scratch->available : 32;
+		while ((size_t)available < end - start) available *= 2;
+		free(scratch);
+		scratch = calloc(sizeof(line_t) + sizeof(char_t) * available, 1);
+		scratch->available = available;
+	}
+
+	decode_source(env, start, end, scratch);
+	return scratch;
+}
+
+/**
+ * Make sure the buffer's match cache is for `needle`.
+ *
+ * When the search string has only grown by some plain characters, as it
+ * does while it is being typed, lines that had no match before still
+ * don't, so those are kept; otherwise we start over.
+ */
+static void search_cache_use(uint32_t * needle) {
+	int ignorecase = smart_case(needle);
+
+	if (!env->search_counts) {
+		env->search_avail = env->line_avail;
+		env->search_counts = malloc(sizeof(int) * env->search_avail);
+		for (int i = 0; i < env->line_count; ++i) env->search_counts[i] = -1;
+	} else if (env->search_pattern) {
+		uint32_t * a = env->search_pattern, * b = needle;
+		while (*a && *a == *b) a++, b++;
+		if (!*a && !*b && ignorecase == env->search_ignorecase) return;
+
+		int grown = !*a && a != env->search_pattern && a[-1] != '\\' &&
+			(ignorecase == env->search_ignorecase || !ignorecase);
+		for (uint32_t * c = b; grown && *c; ++c) {
+			if (*c == '.' || *c == '*' || *c == '?' || *c == '$' || *c == '^' || *c == '\\') grown = 0;
+		}
+
+		for (int i = 0; i < env->line_count; ++i) {
+			if (!grown || env->search_counts[i] != 0) env->search_counts[i] = -1;
+		}
+	}
+
+	free(env->search_pattern);
+	size_t len = 0;
+	while (needle[len]) len++;
+	env->search_pattern = malloc(sizeof(uint32_t) * (len + 1));
+	memcpy(env->search_pattern, needle, sizeof(uint32_t) * (len + 1));
+	env->search_ignorecase = ignorecase;
+}
+
 /**
  * Search forward from the given cursor position
  * to find a basic search match.
- *
- * This could be more complicated...
  */
 void find_match(int from_line, int from_col, int * out_line, int * out_col, uint32_t * str, int * matchlen) {
-	int col = from_col;
-
-	int ignorecase = smart_case(str);
+	struct search_pattern pat;
+	search_compile(&pat, str);
+	search_cache_use(str);
 
 	for (int i = from_line; i <= env->line_count; ++i) {
-		line_t * line = env->lines[i - 1];
+		int j = (i == from_line) ? from_col - 1 : 0;
+		if (env->search_counts[i-1] == 0) continue;
+
+		line_t * line = search_view(&pat, i - 1);
+		if (!line) {
+			env->search_counts[i-1] = 0;
+			continue;
+		}
 
-		int j = col - 1;
+		if (j < 0) j = 0;
+		if (pat.anchored && j > 0) continue;
 		while (j < line->actual + 1) {
-			if (subsearch_matches(line, j, str, ignorecase, matchlen)) {
+			if (pat.first) {
+				while (j < line->actual && !search_could_start(&pat, line, j)) j++;
+				if (j >= line->actual) break;
+			}
+			if (subsearch_matches(line, j, str, pat.ignorecase, matchlen)) {
 				*out_line = i;
 				*out_col = j + 1;
 				return;
 			}
 			j++;
 		}
-		col = 0;
+
+		/* We looked at all of it, so we know there's nothing here */
+		if (i != from_line || from_col <= 1) env->search_counts[i-1] = 0;
 	}
 }
 
@@ -6804,23 +8135,33 @@ void find_match(int from_line, int from_col, int * out_line, int * out_col, uint
  * Search backwards for matching string.
  */
 void find_match_backwards(int from_line, int from_col, int * out_line, int * out_col, uint32_t * str) {
-	int col = from_col;
-
-	int ignorecase = smart_case(str);
+	struct search_pattern pat;
+	search_compile(&pat, str);
+	search_cache_use(str);
 
 	for (int i = from_line; i >= 1; --i) {
-		line_t * line = env->lines[i-1];
+		if (env->search_counts[i-1] == 0) continue;
 
-		int j = col - 1;
+		line_t * line = search_view(&pat, i - 1);
+		if (!line) {
+			env->search_counts[i-1] = 0;
+			continue;
+		}
+
+		int j = (i == from_line) ? from_col - 1 : line->actual;
+		if (j > line->actual) j = line->actual;
 		while (j > -1) {
-			if (subsearch_matches(line, j, str, ignorecase, NULL)) {
+			if (pat.first) {
+				while (j > -1 && (j == line->actual || !search_could_start(&pat, line, j))) j--;
+				if (j < 0) break;
+			}
+			if (subsearch_matches(line, j, str, pat.ignorecase, NULL)) {
 				*out_line = i;
 				*out_col = j + 1;
 				return;
 			}
 			j--;
 		}
-		col = (i > 1) ? (env->lines[i-2]->actual + 1) : -1;
 	}
 }
 
@@ -6828,70 +8169,63 @@ void find_match_backwards(int from_line, int from_col, int * out_line, int * out
  * Re-mark search matches while editing text.
  * This gets called after recalculate_syntax, so it works as we're typing or
  * whenever syntax calculation would redraw other lines.
- * XXX There's a bunch of code duplication between the (now three) search match functions.
- *     and search should be improved to support regex anyway, so this needs to be fixed.
  */
 void rehighlight_search(line_t * line) {
 	if (!global_config.search) return;
-	int j = 0;
-	while (j < line->actual) {
-		line->text[j].flags &= ~(FLAG_SEARCH);
-		j++;
-	}
-	int ignorecase = smart_case(global_config.search);
-	j = 0;
-	while (j < line->actual) {
-		int matchlen = 0;
-		if (subsearch_matches(line, j, global_config.search, ignorecase, &matchlen)) {
-			for (int i = j; matchlen > 0; ++i, matchlen--) {
-				line->text[i].flags |= FLAG_SEARCH;
-			}
-		}
-		j++;
-	}
+	struct search_pattern pat;
+	search_compile(&pat, global_config.search);
+	search_line(line, &pat, 1, -1, NULL);
 }
 
 /**
  * Draw the matched search result.
+ *
+ * Marks the matches in every line we have decoded and counts them
+ * everywhere, remembering how many each line had so that the next
+ * time (the next 'n', or the next key typed into the search) lines
+ * that haven't changed don't need to be looked at again.
  */
 void draw_search_match(uint32_t * buffer, int redraw_buffer) {
+	struct search_pattern pat;
+	search_compile(&pat, buffer);
+	search_cache_use(buffer);
+
+	int my_index = 0, match_count = 0;
 	for (int i = 0; i < env->line_count; ++i) {
-		for (int j = 0; j < env->lines[i]->actual; ++j) {
-			env->lines[i]->text[j].flags &= (~FLAG_SEARCH);
+		int * count = &env->search_counts[i];
+		if (i == env->line_no - 1) {
+			int index = 0;
+			*count = search_line(buffer_line(env, i), &pat, 1, env->col_no - 1, &index);
+			if (index) my_index = match_count + index;
+		} else if (!LINE_IS_PENDING(env->lines[i])) {
+			if (*count == 0) {
+				for (int j = 0; j < env->lines[i]->actual; ++j) {
+					env->lines[i]->text[j].flags &= ~(FLAG_SEARCH);
+				}
+			} else {
+				*count = search_line(env->lines[i], &pat, 1, -1, NULL);
+			}
+		} else if (*count == -1) {
+			line_t * line = search_view(&pat, i);
+			*count = line ? search_line(line, &pat, 0, -1, NULL) : 0;
 		}
+		match_count += *count;
 	}
-	int my_index = 0, match_count = 0;
-	int line = -1, col = -1, _line = 1, _col = 1;
-	do {
-		int matchlen;
-		find_match(_line, _col, &line, &col, buffer, &matchlen);
-		if (line != -1) {
-			line_t * l = env->lines[line-1];
-			for (int i = col; matchlen > 0; ++i, --matchlen) {
-				l->text[i-1].flags |= FLAG_SEARCH;
-			}
-			match_count += 1;
-			if (col == env->col_no && line == env->line_no) my_index = match_count;
-		}
-		_line = line;
-		_col  = col+1;
-		line  = -1;
-		col   = -1;
-	} while (_line != -1);
+
 	redraw_text();
 	place_cursor_actual();
 	redraw_statusbar();
 	redraw_commandline();
 	set_fg_color(COLOR_ALT_FG);
-	printf("[%d/%d] ", my_index, match_count);
+	screen_printf("[%d/%d] ", my_index, match_count);
 	set_fg_color(COLOR_KEYWORD);
-	printf(redraw_buffer == 1 ? "/" : "?");
+	screen_printf(redraw_buffer == 1 ? "/" : "?");
 	set_fg_color(COLOR_FG);
 	uint32_t * c = buffer;
 	while (*c) {
 		char tmp[7] = {0}; /* Max six bytes, use 7 to ensure last is always nil */
 		to_eight(*c, tmp);
-		printf("%s", tmp);
+		screen_printf("%s", tmp);
 		c++;
 	}
 }
@@ -7038,7 +8372,7 @@ BIM_ACTION(search_next, 0,
 	draw_search_match(global_config.search, 1);
 	if (wrapped) {
 		set_fg_color(COLOR_ALT_FG);
-		printf(" (search wrapped to top)");
+		screen_printf(" (search wrapped to top)");
 	}
 }
 
@@ -7055,7 +8389,7 @@ BIM_ACTION(search_prev, 0,
 
 	if (line == -1) {
 		if (!global_config.search_wraps) return;
-		find_match_backwards(env->line_count, env->lines[env->line_count-1]->actual, &line, &col, global_config.search);
+		find_match_backwards(env->line_count, buffer_line(env, env->line_count-1)->actual, &line, &col, global_config.search);
 		if (line == -1) return;
 		wrapped = 1;
 	}
@@ -7066,7 +8400,7 @@ BIM_ACTION(search_prev, 0,
 	draw_search_match(global_config.search, 0);
 	if (wrapped) {
 		set_fg_color(COLOR_ALT_FG);
-		printf(" (search wrapped to bottom)");
+		screen_printf(" (search wrapped to bottom)");
 	}
 }
 
@@ -7081,7 +8415,7 @@ BIM_ACTION(search_prev, 0,
  * match parens outside of strings and so on.
  */
 void find_matching_paren(int * out_line, int * out_col, int in_col) {
-	if (env->col_no - in_col + 1 > env->lines[env->line_no-1]->actual) {
+	if (env->col_no - in_col + 1 > buffer_line(env, env->line_no-1)->actual) {
 		return; /* Invalid cursor position */
 	}
 
@@ -7089,8 +8423,8 @@ void find_matching_paren(int * out_line, int * out_col, int in_col) {
 
 	int paren_match = 0;
 	int direction = 0;
-	int start = env->lines[env->line_no-1]->text[env->col_no-in_col].codepoint;
-	int flags = env->lines[env->line_no-1]->text[env->col_no-in_col].flags & 0x1F;
+	int start = buffer_line(env, env->line_no-1)->text[env->col_no-in_col].codepoint;
+	int flags = buffer_line(env, env->line_no-1)->text[env->col_no-in_col].flags & 0x1F;
 	int count = 0;
 
 	/* TODO what about unicode parens? */
@@ -7109,13 +8443,13 @@ void find_matching_paren(int * out_line, int * out_col, int in_col) {
 	int col  = env->col_no - in_col + 1;
 
 	do {
-		while (col > 0 && col < env->lines[line-1]->actual + 1) {
+		while (col > 0 && col < buffer_line(env, line-1)->actual + 1) {
 			/* Only match on same syntax */
-			if ((env->lines[line-1]->text[col-1].flags & 0x1F) == flags) {
+			if ((buffer_line(env, line-1)->text[col-1].flags & 0x1F) == flags) {
 				/* Count up on same direction */
-				if (env->lines[line-1]->text[col-1].codepoint == start) count++;
+				if (buffer_line(env, line-1)->text[col-1].codepoint == start) count++;
 				/* Count down on opposite direction */
-				if (env->lines[line-1]->text[col-1].codepoint == paren_match) {
+				if (buffer_line(env, line-1)->text[col-1].codepoint == paren_match) {
 					count--;
 					/* When count == 0 we have a match */
 					if (count == 0) goto _match_found;
@@ -7135,7 +8469,7 @@ void find_matching_paren(int * out_line, int * out_col, int in_col) {
 		if (direction > 0) {
 			col = 1;
 		} else {
-			col = env->lines[line-1]->actual;
+			col = buffer_line(env, line-1)->actual;
 		}
 	} while (1);
 
@@ -7333,8 +8667,8 @@ void handle_common_mouse(int buttons, int x, int y) {
 		int _x = num_size - (line_no == env->line_no ? env->coffset : 0);
 
 		/* Determine where the cursor is physically */
-		for (int i = 0; i < env->lines[line_no-1]->actual; ++i) {
-			char_t * c = &env->lines[line_no-1]->text[i];
+		for (int i = 0; i < buffer_line(env, line_no-1)->actual; ++i) {
+			char_t * c = &buffer_line(env, line_no-1)->text[i];
 			_x += c->display_width;
 			if (_x > x-1) {
 				col_no = i+1;
@@ -7342,8 +8676,8 @@ void handle_common_mouse(int buttons, int x, int y) {
 			}
 		}
 
-		if (col_no == -1 || col_no > env->lines[line_no-1]->actual) {
-			col_no = env->lines[line_no-1]->actual;
+		if (col_no == -1 || col_no > buffer_line(env, line_no-1)->actual) {
+			col_no = buffer_line(env, line_no-1)->actual;
 		}
 
 		env->line_no = line_no;
@@ -7435,7 +8769,7 @@ BIM_ACTION(insert_char, ARG_IS_INPUT | ACTION_IS_RW,
 	_c.codepoint = c;
 	_c.flags = 0;
 	_c.display_width = codepoint_width(c);
-	line_t * line  = env->lines[env->line_no - 1];
+	line_t * line  = buffer_line(env, env->line_no - 1);
 	line_t * nline = line_insert(line, _c, env->col_no - 1, env->line_no - 1);
 	if (line != nline) {
 		env->lines[env->line_no - 1] = nline;
@@ -7448,7 +8782,7 @@ BIM_ACTION(insert_char, ARG_IS_INPUT | ACTION_IS_RW,
 BIM_ACTION(replace_char, ARG_IS_PROMPT | ACTION_IS_RW,
 	"Replace a single character."
 )(unsigned int c) {
-	if (env->col_no < 1 || env->col_no > env->lines[env->line_no-1]->actual) return;
+	if (env->col_no < 1 || env->col_no > buffer_line(env, env->line_no-1)->actual) return;
 
 	if (c >= KEY_ESCAPE) {
 		render_error("Invalid key for replacement");
@@ -7460,7 +8794,7 @@ BIM_ACTION(replace_char, ARG_IS_PROMPT | ACTION_IS_RW,
 	_c.flags = 0;
 	_c.display_width = codepoint_width(c);
 
-	line_replace(env->lines[env->line_no-1], _c, env->col_no-1, env->line_no-1);
+	line_replace(buffer_line(env, env->line_no-1), _c, env->col_no-1, env->line_no-1);
 
 	redraw_line(env->line_no-1);
 	set_modified();
@@ -7490,7 +8824,7 @@ BIM_ACTION(undo_history, ACTION_IS_RW,
 			case HISTORY_INSERT:
 				/* Delete */
 				line_delete(
-						env->lines[e->contents.insert_delete_replace.lineno],
+						buffer_line(env, e->contents.insert_delete_replace.lineno),
 						e->contents.insert_delete_replace.offset+1,
 						e->contents.insert_delete_replace.lineno
 				);
@@ -7500,7 +8834,7 @@ BIM_ACTION(undo_history, ACTION_IS_RW,
 				{
 					char_t _c = {codepoint_width(e->contents.insert_delete_replace.old_codepoint),0,e->contents.insert_delete_replace.old_codepoint};
 					env->lines[e->contents.insert_delete_replace.lineno] = line_insert(
-							env->lines[e->contents.insert_delete_replace.lineno],
+							buffer_line(env, e->contents.insert_delete_replace.lineno),
 							_c,
 							e->contents.insert_delete_replace.offset-1,
 							e->contents.insert_delete_replace.lineno
@@ -7512,7 +8846,7 @@ BIM_ACTION(undo_history, ACTION_IS_RW,
 				{
 					char_t _o = {codepoint_width(e->contents.insert_delete_replace.old_codepoint),0,e->contents.insert_delete_replace.old_codepoint};
 					line_replace(
-							env->lines[e->contents.insert_delete_replace.lineno],
+							buffer_line(env, e->contents.insert_delete_replace.lineno),
 							_o,
 							e->contents.insert_delete_replace.offset,
 							e->contents.insert_delete_replace.lineno
@@ -7558,7 +8892,7 @@ BIM_ACTION(undo_history, ACTION_IS_RW,
 
 	if (env->line_no > env->line_count) env->line_no = env->line_count;
 	if (env->line_no < 1) env->line_no = 1;
-	if (env->col_no > env->lines[env->line_no-1]->actual) env->col_no = env->lines[env->line_no-1]->actual;
+	if (env->col_no > buffer_line(env, env->line_no-1)->actual) env->col_no = buffer_line(env, env->line_no-1)->actual;
 	if (env->col_no < 1) env->col_no = 1;
 
 	env->modified = (env->history != env->last_save_history);
@@ -7566,8 +8900,9 @@ BIM_ACTION(undo_history, ACTION_IS_RW,
 	env->loading = 0;
 
 	for (int i = 0; i < env->line_count; ++i) {
-		env->lines[i]->istate = 0;
-		recalculate_tabs(env->lines[i]);
+		if (LINE_IS_PENDING(env->lines[i])) continue;
+		buffer_line(env, i)->istate = 0;
+		recalculate_tabs(buffer_line(env, i));
 	}
 	schedule_complete_recalc();
 	place_cursor_actual();
@@ -7606,7 +8941,7 @@ BIM_ACTION(redo_history, ACTION_IS_RW,
 				{
 					char_t _c = {codepoint_width(e->contents.insert_delete_replace.codepoint),0,e->contents.insert_delete_replace.codepoint};
 					env->lines[e->contents.insert_delete_replace.lineno] = line_insert(
-							env->lines[e->contents.insert_delete_replace.lineno],
+							buffer_line(env, e->contents.insert_delete_replace.lineno),
 							_c,
 							e->contents.insert_delete_replace.offset,
 							e->contents.insert_delete_replace.lineno
@@ -7617,7 +8952,7 @@ BIM_ACTION(redo_history, ACTION_IS_RW,
 			case HISTORY_DELETE:
 				/* Delete */
 				line_delete(
-						env->lines[e->contents.insert_delete_replace.lineno],
+						buffer_line(env, e->contents.insert_delete_replace.lineno),
 						e->contents.insert_delete_replace.offset,
 						e->contents.insert_delete_replace.lineno
 				);
@@ -7627,7 +8962,7 @@ BIM_ACTION(redo_history, ACTION_IS_RW,
 				{
 					char_t _o = {codepoint_width(e->contents.insert_delete_replace.codepoint),0,e->contents.insert_delete_replace.codepoint};
 					line_replace(
-							env->lines[e->contents.insert_delete_replace.lineno],
+							buffer_line(env, e->contents.insert_delete_replace.lineno),
 							_o,
 							e->contents.insert_delete_replace.offset,
 							e->contents.insert_delete_replace.lineno
@@ -7672,7 +9007,7 @@ BIM_ACTION(redo_history, ACTION_IS_RW,
 
 	if (env->line_no > env->line_count) env->line_no = env->line_count;
 	if (env->line_no < 1) env->line_no = 1;
-	if (env->col_no > env->lines[env->line_no-1]->actual) env->col_no = env->lines[env->line_no-1]->actual;
+	if (env->col_no > buffer_line(env, env->line_no-1)->actual) env->col_no = buffer_line(env, env->line_no-1)->actual;
 	if (env->col_no < 1) env->col_no = 1;
 
 	env->modified = (env->history != env->last_save_history);
@@ -7680,8 +9015,9 @@ BIM_ACTION(redo_history, ACTION_IS_RW,
 	env->loading = 0;
 
 	for (int i = 0; i < env->line_count; ++i) {
-		env->lines[i]->istate = 0;
-		recalculate_tabs(env->lines[i]);
+		if (LINE_IS_PENDING(env->lines[i])) continue;
+		buffer_line(env, i)->istate = 0;
+		recalculate_tabs(buffer_line(env, i));
 	}
 	schedule_complete_recalc();
 	place_cursor_actual();
@@ -7707,21 +9043,21 @@ int is_special(int codepoint) {
 BIM_ACTION(word_left, 0,
 	"Move the cursor left to the previous word."
 )(void) {
-	if (!env->lines[env->line_no-1]) return;
+	if (!buffer_line(env, env->line_no-1)) return;
 
-	while (env->col_no > 1 && is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint)) {
+	while (env->col_no > 1 && is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint)) {
 		env->col_no -= 1;
 	}
 
 	if (env->col_no == 1) {
 		if (env->line_no == 1) goto _place;
 		env->line_no--;
-		env->col_no = env->lines[env->line_no-1]->actual;
+		env->col_no = buffer_line(env, env->line_no-1)->actual;
 		goto _place;
 	}
 
 	int (*inverse_comparator)(int) = is_special;
-	if (env->col_no > 1 && is_special(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint)) {
+	if (env->col_no > 1 && is_special(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint)) {
 		inverse_comparator = is_normal;
 	}
 
@@ -7729,7 +9065,7 @@ BIM_ACTION(word_left, 0,
 		if (env->col_no > 1) {
 			env->col_no -= 1;
 		}
-	} while (env->col_no > 1 && !is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint) && !inverse_comparator(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint));
+	} while (env->col_no > 1 && !is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint) && !inverse_comparator(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint));
 
 _place:
 	set_preferred_column();
@@ -7751,9 +9087,9 @@ BIM_ACTION(big_word_left, 0,
 				set_preferred_column();
 				return;
 			}
-			col_no = env->lines[line_no-1]->actual;
+			col_no = buffer_line(env, line_no-1)->actual;
 		}
-	} while (isspace(env->lines[line_no-1]->text[col_no-1].codepoint));
+	} while (isspace(buffer_line(env, line_no-1)->text[col_no-1].codepoint));
 
 	do {
 		col_no--;
@@ -7765,7 +9101,7 @@ BIM_ACTION(big_word_left, 0,
 			place_cursor_actual();
 			return;
 		}
-	} while (!isspace(env->lines[line_no-1]->text[col_no-1].codepoint));
+	} while (!isspace(buffer_line(env, line_no-1)->text[col_no-1].codepoint));
 
 	env->col_no = col_no;
 	env->line_no = line_no;
@@ -7776,35 +9112,35 @@ BIM_ACTION(big_word_left, 0,
 BIM_ACTION(word_right, 0,
 	"Move the cursor right to the start of the next word."
 )(void) {
-	if (!env->lines[env->line_no-1]) return;
+	if (!buffer_line(env, env->line_no-1)) return;
 
-	if (env->col_no >= env->lines[env->line_no-1]->actual) {
+	if (env->col_no >= buffer_line(env, env->line_no-1)->actual) {
 		/* next line */
 		if (env->line_no == env->line_count) return;
 		env->line_no++;
 		env->col_no = 0;
-		if (env->col_no >= env->lines[env->line_no-1]->actual) {
+		if (env->col_no >= buffer_line(env, env->line_no-1)->actual) {
 			goto _place;
 		}
 	}
 
-	if (env->col_no < env->lines[env->line_no-1]->actual && is_whitespace(env->lines[env->line_no-1]->text[env->col_no - 1].codepoint)) {
-		while (env->col_no < env->lines[env->line_no-1]->actual && is_whitespace(env->lines[env->line_no-1]->text[env->col_no - 1].codepoint)) {
+	if (env->col_no < buffer_line(env, env->line_no-1)->actual && is_whitespace(buffer_line(env, env->line_no-1)->text[env->col_no - 1].codepoint)) {
+		while (env->col_no < buffer_line(env, env->line_no-1)->actual && is_whitespace(buffer_line(env, env->line_no-1)->text[env->col_no - 1].codepoint)) {
 			env->col_no++;
 		}
 		goto _place;
 	}
 
 	int (*inverse_comparator)(int) = is_special;
-	if (is_special(env->lines[env->line_no - 1]->text[env->col_no - 1].codepoint)) {
+	if (is_special(buffer_line(env, env->line_no - 1)->text[env->col_no - 1].codepoint)) {
 		inverse_comparator = is_normal;
 	}
 
-	while (env->col_no < env->lines[env->line_no-1]->actual && !is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 1].codepoint) && !inverse_comparator(env->lines[env->line_no - 1]->text[env->col_no - 1].codepoint)) {
+	while (env->col_no < buffer_line(env, env->line_no-1)->actual && !is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 1].codepoint) && !inverse_comparator(buffer_line(env, env->line_no - 1)->text[env->col_no - 1].codepoint)) {
 		env->col_no++;
 	}
 
-	while (env->col_no < env->lines[env->line_no-1]->actual && is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 1].codepoint)) {
+	while (env->col_no < buffer_line(env, env->line_no-1)->actual && is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 1].codepoint)) {
 		env->col_no++;
 	}
 
@@ -7821,11 +9157,11 @@ BIM_ACTION(big_word_right, 0,
 
 	do {
 		col_no++;
-		if (col_no > env->lines[line_no-1]->actual) {
+		if (col_no > buffer_line(env, line_no-1)->actual) {
 			line_no++;
 			if (line_no > env->line_count) {
 				env->line_no = env->line_count;
-				env->col_no  = env->lines[env->line_no-1]->actual;
+				env->col_no  = buffer_line(env, env->line_no-1)->actual;
 				set_preferred_column();
 				redraw_statusbar();
 				place_cursor_actual();
@@ -7834,14 +9170,14 @@ BIM_ACTION(big_word_right, 0,
 			col_no = 0;
 			break;
 		}
-	} while (!isspace(env->lines[line_no-1]->text[col_no-1].codepoint));
+	} while (!isspace(buffer_line(env, line_no-1)->text[col_no-1].codepoint));
 
 	do {
 		col_no++;
-		while (col_no > env->lines[line_no-1]->actual) {
+		while (col_no > buffer_line(env, line_no-1)->actual) {
 			line_no++;
 			if (line_no >= env->line_count) {
-				env->col_no = env->lines[env->line_count-1]->actual;
+				env->col_no = buffer_line(env, env->line_count-1)->actual;
 				env->line_no = env->line_count;
 				set_preferred_column();
 				redraw_statusbar();
@@ -7850,7 +9186,7 @@ BIM_ACTION(big_word_right, 0,
 			}
 			col_no = 1;
 		}
-	} while (isspace(env->lines[line_no-1]->text[col_no-1].codepoint));
+	} while (isspace(buffer_line(env, line_no-1)->text[col_no-1].codepoint));
 
 	env->col_no = col_no;
 	env->line_no = line_no;
@@ -7864,7 +9200,7 @@ BIM_ACTION(delete_at_cursor, ACTION_IS_RW,
 	"Delete the character at the cursor, or merge with previous line."
 )(void) {
 	if (env->col_no > 1) {
-		line_delete(env->lines[env->line_no - 1], env->col_no - 1, env->line_no - 1);
+		line_delete(buffer_line(env, env->line_no - 1), env->col_no - 1, env->line_no - 1);
 		env->col_no -= 1;
 		if (env->coffset > 0) env->coffset--;
 		redraw_line(env->line_no-1);
@@ -7872,7 +9208,7 @@ BIM_ACTION(delete_at_cursor, ACTION_IS_RW,
 		redraw_statusbar();
 		place_cursor_actual();
 	} else if (env->line_no > 1) {
-		int tmp = env->lines[env->line_no - 2]->actual;
+		int tmp = buffer_line(env, env->line_no - 2)->actual;
 		merge_lines(env->lines, env->line_no - 1);
 		env->line_no -= 1;
 		env->col_no = tmp+1;
@@ -7887,28 +9223,28 @@ BIM_ACTION(delete_at_cursor, ACTION_IS_RW,
 BIM_ACTION(delete_word, ACTION_IS_RW,
 	"Delete the previous word."
 )(void) {
-	if (!env->lines[env->line_no-1]) return;
+	if (!buffer_line(env, env->line_no-1)) return;
 	if (env->col_no > 1) {
 
 		/* Start by deleting whitespace */
-		while (env->col_no > 1 && is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint)) {
-			line_delete(env->lines[env->line_no - 1], env->col_no - 1, env->line_no - 1);
+		while (env->col_no > 1 && is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint)) {
+			line_delete(buffer_line(env, env->line_no - 1), env->col_no - 1, env->line_no - 1);
 			env->col_no -= 1;
 			if (env->coffset > 0) env->coffset--;
 		}
 
 		int (*inverse_comparator)(int) = is_special;
-		if (env->col_no > 1 && is_special(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint)) {
+		if (env->col_no > 1 && is_special(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint)) {
 			inverse_comparator = is_normal;
 		}
 
 		do {
 			if (env->col_no > 1) {
-				line_delete(env->lines[env->line_no - 1], env->col_no - 1, env->line_no - 1);
+				line_delete(buffer_line(env, env->line_no - 1), env->col_no - 1, env->line_no - 1);
 				env->col_no -= 1;
 				if (env->coffset > 0) env->coffset--;
 			}
-		} while (env->col_no > 1 && !is_whitespace(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint) && !inverse_comparator(env->lines[env->line_no - 1]->text[env->col_no - 2].codepoint));
+		} while (env->col_no > 1 && !is_whitespace(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint) && !inverse_comparator(buffer_line(env, env->line_no - 1)->text[env->col_no - 2].codepoint));
 
 		set_preferred_column();
 		redraw_text();
@@ -7922,14 +9258,14 @@ BIM_ACTION(insert_line_feed, ACTION_IS_RW,
 	"Insert a line break, splitting the current line into two."
 )(void) {
 	if (env->indent) {
-		if ((env->lines[env->line_no-1]->text[env->col_no-2].flags & 0x1F) == FLAG_COMMENT &&
-			(env->lines[env->line_no-1]->text[env->col_no-2].codepoint == ' ') &&
+		if ((buffer_line(env, env->line_no-1)->text[env->col_no-2].flags & 0x1F) == FLAG_COMMENT &&
+			(buffer_line(env, env->line_no-1)->text[env->col_no-2].codepoint == ' ') &&
 			(env->col_no > 3) &&
-			(env->lines[env->line_no-1]->text[env->col_no-3].codepoint == '*')) {
+			(buffer_line(env, env->line_no-1)->text[env->col_no-3].codepoint == '*')) {
 			delete_at_cursor();
 		}
 	}
-	if (env->col_no == env->lines[env->line_no - 1]->actual + 1) {
+	if (env->col_no == buffer_line(env, env->line_no - 1)->actual + 1) {
 		env->lines = add_line(env->lines, env->line_no);
 	} else {
 		env->lines = split_line(env->lines, env->line_no-1, env->col_no - 1);
@@ -7971,11 +9307,11 @@ BIM_ACTION(yank_lines, 0,
 	global_config.yank_count = lines_to_yank;
 	global_config.yank_is_full_lines = 1;
 	for (int i = 0; i < lines_to_yank; ++i) {
-		global_config.yanks[i] = malloc(sizeof(line_t) + sizeof(char_t) * (env->lines[start_point+i]->available));
-		global_config.yanks[i]->available = env->lines[start_point+i]->available;
-		global_config.yanks[i]->actual = env->lines[start_point+i]->actual;
+		global_config.yanks[i] = malloc(sizeof(line_t) + sizeof(char_t) * (buffer_line(env, start_point+i)->available));
+		global_config.yanks[i]->available = buffer_line(env, start_point+i)->available;
+		global_config.yanks[i]->actual = buffer_line(env, start_point+i)->actual;
 		global_config.yanks[i]->istate = 0;
-		memcpy(&global_config.yanks[i]->text, &env->lines[start_point+i]->text, sizeof(char_t) * (env->lines[start_point+i]->actual));
+		memcpy(&global_config.yanks[i]->text, &buffer_line(env, start_point+i)->text, sizeof(char_t) * (buffer_line(env, start_point+i)->actual));
 
 		for (int j = 0; j < global_config.yanks[i]->actual; ++j) {
 			global_config.yanks[i]->text[j].flags = 0;
@@ -7987,19 +9323,19 @@ BIM_ACTION(yank_lines, 0,
  * Helper to yank part of a line into a new yank line.
  */
 void yank_partial_line(int yank_no, int line_no, int start_off, int count) {
-	if (start_off + count > env->lines[line_no]->actual) {
-		if (start_off >= env->lines[line_no]->actual) {
-			start_off = env->lines[line_no]->actual;
+	if (start_off + count > buffer_line(env, line_no)->actual) {
+		if (start_off >= buffer_line(env, line_no)->actual) {
+			start_off = buffer_line(env, line_no)->actual;
 			count = 0;
 		} else {
-			count = env->lines[line_no]->actual - start_off;
+			count = buffer_line(env, line_no)->actual - start_off;
 		}
 	}
 	global_config.yanks[yank_no] = malloc(sizeof(line_t) + sizeof(char_t) * (count + 1));
 	global_config.yanks[yank_no]->available = count + 1; /* ensure extra space */
 	global_config.yanks[yank_no]->actual = count;
 	global_config.yanks[yank_no]->istate = 0;
-	memcpy(&global_config.yanks[yank_no]->text, &env->lines[line_no]->text[start_off], sizeof(char_t) * count);
+	memcpy(&global_config.yanks[yank_no]->text, &buffer_line(env, line_no)->text[start_off], sizeof(char_t) * count);
 	for (int i = 0; i < count; ++i) {
 		global_config.yanks[yank_no]->text[i].flags = 0;
 	}
@@ -8023,14 +9359,14 @@ void yank_text(int start_line, int start_col, int end_line, int end_col) {
 	if (lines_to_yank == 1) {
 		yank_partial_line(0, start_point, start_col - 1, (end_col - start_col + 1));
 	} else {
-		yank_partial_line(0, start_point, start_col - 1, (env->lines[start_point]->actual - start_col + 1));
+		yank_partial_line(0, start_point, start_col - 1, (buffer_line(env, start_point)->actual - start_col + 1));
 		/* Yank middle lines */
 		for (int i = 1; i < lines_to_yank - 1; ++i) {
-			global_config.yanks[i] = malloc(sizeof(line_t) + sizeof(char_t) * (env->lines[start_point+i]->available));
-			global_config.yanks[i]->available = env->lines[start_point+i]->available;
-			global_config.yanks[i]->actual = env->lines[start_point+i]->actual;
+			global_config.yanks[i] = malloc(sizeof(line_t) + sizeof(char_t) * (buffer_line(env, start_point+i)->available));
+			global_config.yanks[i]->available = buffer_line(env, start_point+i)->available;
+			global_config.yanks[i]->actual = buffer_line(env, start_point+i)->actual;
 			global_config.yanks[i]->istate = 0;
-			memcpy(&global_config.yanks[i]->text, &env->lines[start_point+i]->text, sizeof(char_t) * (env->lines[start_point+i]->actual));
+			memcpy(&global_config.yanks[i]->text, &buffer_line(env, start_point+i)->text, sizeof(char_t) * (buffer_line(env, start_point+i)->actual));
 
 			for (int j = 0; j < global_config.yanks[i]->actual; ++j) {
 				global_config.yanks[i]->text[j].flags = 0;
@@ -8050,7 +9386,7 @@ BIM_ACTION(delete_at_column, ARG_IS_CUSTOM | ACTION_IS_RW,
 	int s = (env->line_no < env->start_line) ? env->line_no : env->start_line;
 	int e = (env->line_no < env->start_line) ? env->start_line : env->line_no;
 	for (int i = s; i <= e; i++) {
-		line_t * line = env->lines[i - 1];
+		line_t * line = buffer_line(env, i - 1);
 
 		int _x = 0;
 		int col = 1;
@@ -8081,7 +9417,7 @@ BIM_ACTION(delete_at_column, ARG_IS_CUSTOM | ACTION_IS_RW,
 }
 
 void realign_column_cursor(void) {
-	line_t * line = env->lines[env->line_no - 1];
+	line_t * line = buffer_line(env, env->line_no - 1);
 	int _x = 0, col = 1, j = 0;
 	for (; j < line->actual; ++j) {
 		char_t * c = &line->text[j];
@@ -8138,13 +9474,13 @@ uint32_t * get_word_under_cursor(void) {
 	int c_after = 0;
 	int i = env->col_no;
 	while (i > 0) {
-		if (!simple_keyword_qualifier(env->lines[env->line_no-1]->text[i-1].codepoint)) break;
+		if (!simple_keyword_qualifier(buffer_line(env, env->line_no-1)->text[i-1].codepoint)) break;
 		c_before++;
 		i--;
 	}
 	i = env->col_no+1;
-	while (i < env->lines[env->line_no-1]->actual+1) {
-		if (!simple_keyword_qualifier(env->lines[env->line_no-1]->text[i-1].codepoint)) break;
+	while (i < buffer_line(env, env->line_no-1)->actual+1) {
+		if (!simple_keyword_qualifier(buffer_line(env, env->line_no-1)->text[i-1].codepoint)) break;
 		c_after++;
 		i++;
 	}
@@ -8154,13 +9490,13 @@ uint32_t * get_word_under_cursor(void) {
 	uint32_t * out = malloc(sizeof(uint32_t) * (c_before+c_after+1));
 	int j = 0;
 	while (c_before) {
-		out[j] = env->lines[env->line_no-1]->text[env->col_no-c_before].codepoint;
+		out[j] = buffer_line(env, env->line_no-1)->text[env->col_no-c_before].codepoint;
 		c_before--;
 		j++;
 	}
 	int x = 0;
 	while (c_after) {
-		out[j] = env->lines[env->line_no-1]->text[env->col_no+x].codepoint;
+		out[j] = buffer_line(env, env->line_no-1)->text[env->col_no+x].codepoint;
 		j++;
 		x++;
 		c_after--;
@@ -8183,8 +9519,8 @@ BIM_ACTION(search_under_cursor, 0,
 BIM_ACTION(find_character_forward, ARG_IS_PROMPT | ARG_IS_INPUT,
 	"Find a character forward on the current line and place the cursor on (`f`) or before (`t`) it."
 )(int type, int c) {
-	for (int i = env->col_no+1; i <= env->lines[env->line_no-1]->actual; ++i) {
-		if (env->lines[env->line_no-1]->text[i-1].codepoint == c) {
+	for (int i = env->col_no+1; i <= buffer_line(env, env->line_no-1)->actual; ++i) {
+		if (buffer_line(env, env->line_no-1)->text[i-1].codepoint == c) {
 			env->col_no = i - !!(type == 't');
 			place_cursor_actual();
 			set_preferred_column();
@@ -8197,7 +9533,7 @@ BIM_ACTION(find_character_backward, ARG_IS_PROMPT | ARG_IS_INPUT,
 	"Find a character backward on the current line and place the cursor on (`F`) or after (`T`) it."
 )(int type, int c) {
 	for (int i = env->col_no-1; i >= 1; --i) {
-		if (env->lines[env->line_no-1]->text[i-1].codepoint == c) {
+		if (buffer_line(env, env->line_no-1)->text[i-1].codepoint == c) {
 			env->col_no = i + !!(type == 'T');
 			place_cursor_actual();
 			set_preferred_column();
@@ -8272,12 +9608,12 @@ int point_in_range(int start_line, int end_line, int start_col, int end_col, int
 		if ((env->line_no < env->start_line  && ((line) < env->line_no || (line) > env->start_line)) || \
 			(env->line_no > env->start_line  && ((line) > env->line_no || (line) < env->start_line)) || \
 			(env->line_no == env->start_line && (line) != env->start_line)) { \
-			for (int j = 0; j < env->lines[(line)-1]->actual; ++j) { \
-				env->lines[(line)-1]->text[j].flags &= ~(FLAG_SELECT); \
+			for (int j = 0; j < buffer_line(env, (line)-1)->actual; ++j) { \
+				buffer_line(env, (line)-1)->text[j].flags &= ~(FLAG_SELECT); \
 			} \
 		} else { \
-			for (int j = 0; j < env->lines[(line)-1]->actual; ++j) { \
-				env->lines[(line)-1]->text[j].flags |= FLAG_SELECT; \
+			for (int j = 0; j < buffer_line(env, (line)-1)->actual; ++j) { \
+				buffer_line(env, (line)-1)->text[j].flags |= FLAG_SELECT; \
 			} \
 		} \
 		redraw_line((line)-1); \
@@ -8296,18 +9632,18 @@ int point_in_range(int start_line, int end_line, int start_col, int end_col, int
 			(env->line_no > env->start_line  && ((line) > env->line_no || (line) < env->start_line)) || \
 			(env->line_no == env->start_line && (line) != env->start_line)) { \
 			/* Line is completely outside selection */ \
-			for (int j = 0; j < env->lines[(line)-1]->actual; ++j) { \
-				env->lines[(line)-1]->text[j].flags &= ~(FLAG_SELECT); \
+			for (int j = 0; j < buffer_line(env, (line)-1)->actual; ++j) { \
+				buffer_line(env, (line)-1)->text[j].flags &= ~(FLAG_SELECT); \
 			} \
 		} else { \
 			if ((line) == env->start_line || (line) == env->line_no) { \
-				for (int j = 0; j < env->lines[(line)-1]->actual; ++j) { \
-					env->lines[(line)-1]->text[j].flags &= ~(FLAG_SELECT); \
+				for (int j = 0; j < buffer_line(env, (line)-1)->actual; ++j) { \
+					buffer_line(env, (line)-1)->text[j].flags &= ~(FLAG_SELECT); \
 				} \
 			} \
-			for (int j = 0; j < env->lines[(line)-1]->actual; ++j) { \
+			for (int j = 0; j < buffer_line(env, (line)-1)->actual; ++j) { \
 				if (point_in_range(env->start_line, env->line_no,env->start_col, env->col_no, (line), j+1)) { \
-					env->lines[(line)-1]->text[j].flags |= FLAG_SELECT; \
+					buffer_line(env, (line)-1)->text[j].flags |= FLAG_SELECT; \
 				} \
 			} \
 		} \
@@ -8339,21 +9675,21 @@ BIM_ACTION(adjust_indent, ARG_IS_CUSTOM | ACTION_IS_RW,
 		lines_to_cover = env->start_line - env->line_no + 1;
 	}
 	for (int i = 0; i < lines_to_cover; ++i) {
-		if (env->lines[start_point + i]->actual < 1) continue;
+		if (buffer_line(env, start_point + i)->actual < 1) continue;
 		if (direction == -1) {
 			if (env->tabs) {
-				if (env->lines[start_point + i]->text[0].codepoint == '\t') {
-					line_delete(env->lines[start_point + i],1,start_point+i);
+				if (buffer_line(env, start_point + i)->text[0].codepoint == '\t') {
+					line_delete(buffer_line(env, start_point + i),1,start_point+i);
 					_redraw_line(start_point+i+1,1);
 				}
 			} else {
-				if (env->lines[start_point + i]->text[0].codepoint == '\t') {
-					line_delete(env->lines[start_point + i],1,start_point+i);
+				if (buffer_line(env, start_point + i)->text[0].codepoint == '\t') {
+					line_delete(buffer_line(env, start_point + i),1,start_point+i);
 					_redraw_line(start_point+i+1,1);
 				} else {
 					for (int j = 0; j < env->tabstop; ++j) {
-						if (env->lines[start_point + i]->text[0].codepoint == ' ') {
-							line_delete(env->lines[start_point + i],1,start_point+i);
+						if (buffer_line(env, start_point + i)->text[0].codepoint == ' ') {
+							line_delete(buffer_line(env, start_point + i),1,start_point+i);
 						}
 					}
 				}
@@ -8365,21 +9701,21 @@ BIM_ACTION(adjust_indent, ARG_IS_CUSTOM | ACTION_IS_RW,
 				c.codepoint = '\t';
 				c.display_width = env->tabstop;
 				c.flags = FLAG_SELECT;
-				env->lines[start_point + i] = line_insert(env->lines[start_point + i], c, 0, start_point + i);
+				env->lines[start_point + i] = line_insert(buffer_line(env, start_point + i), c, 0, start_point + i);
 			} else {
 				for (int j = 0; j < env->tabstop; ++j) {
 					char_t c;
 					c.codepoint = ' ';
 					c.display_width = 1;
 					c.flags = FLAG_SELECT;
-					env->lines[start_point + i] = line_insert(env->lines[start_point + i], c, 0, start_point + i);
+					env->lines[start_point + i] = line_insert(buffer_line(env, start_point + i), c, 0, start_point + i);
 				}
 			}
 			_redraw_line(start_point+i+1,1);
 		}
 	}
-	if (env->col_no > env->lines[env->line_no-1]->actual) {
-		env->col_no = env->lines[env->line_no-1]->actual;
+	if (env->col_no > buffer_line(env, env->line_no-1)->actual) {
+		env->col_no = buffer_line(env, env->line_no-1)->actual;
 	}
 	set_preferred_column();
 	set_modified();
@@ -8393,8 +9729,8 @@ void recalculate_selected_lines(void) {
 	if (end < 1) end = 1;
 	if (end > env->line_count) end = env->line_count;
 	for (int i = (start > 1) ? (start-1) : (start); i <= end; ++i) {
-		for (int j = 0; j < env->lines[i-1]->actual; j++) {
-			env->lines[i-1]->text[j].flags &= ~(FLAG_SELECT);
+		for (int j = 0; j < buffer_line(env, i-1)->actual; j++) {
+			buffer_line(env, i-1)->text[j].flags &= ~(FLAG_SELECT);
 		}
 	}
 	redraw_all();
@@ -8414,8 +9750,8 @@ BIM_ACTION(enter_line_selection, 0,
 	unhighlight_matching_paren();
 
 	/* Set this line as selected for syntax highlighting */
-	for (int j = 0; j < env->lines[env->line_no-1]->actual; ++j) {
-		env->lines[env->line_no-1]->text[j].flags |= FLAG_SELECT;
+	for (int j = 0; j < buffer_line(env, env->line_no-1)->actual; ++j) {
+		buffer_line(env, env->line_no-1)->text[j].flags |= FLAG_SELECT;
 	}
 
 	/* And redraw it */
@@ -8460,8 +9796,8 @@ BIM_ACTION(delete_and_yank_lines, 0,
 	if (env->line_no > env->line_count) {
 		env->line_no = env->line_count;
 	}
-	if (env->col_no > env->lines[env->line_no-1]->actual) {
-		env->col_no = env->lines[env->line_no-1]->actual;
+	if (env->col_no > buffer_line(env, env->line_no-1)->actual) {
+		env->col_no = buffer_line(env, env->line_no-1)->actual;
 	}
 	set_preferred_column();
 	set_modified();
@@ -8494,8 +9830,8 @@ BIM_ACTION(replace_chars_in_line, ARG_IS_PROMPT | ACTION_IS_RW,
 	int start_point = env->start_line < env->line_no ? env->start_line : env->line_no;
 	int end_point = env->start_line < env->line_no ? env->line_no : env->start_line;
 	for (int line = start_point; line <= end_point; ++line) {
-		for (int i = 0; i < env->lines[line-1]->actual; ++i) {
-			line_replace(env->lines[line-1], _c, i, line-1);
+		for (int i = 0; i < buffer_line(env, line-1)->actual; ++i) {
+			line_replace(buffer_line(env, line-1), _c, i, line-1);
 		}
 	}
 }
@@ -8522,7 +9858,7 @@ BIM_ACTION(insert_char_at_column, ARG_IS_INPUT | ACTION_IS_RW,
 	int s = (env->line_no < env->start_line) ? env->line_no : env->start_line;
 	int e = (env->line_no < env->start_line) ? env->start_line : env->line_no;
 	for (int i = s; i <= e; i++) {
-		line_t * line = env->lines[i - 1];
+		line_t * line = buffer_line(env, i - 1);
 
 		int _x = 0;
 		int col = 1;
@@ -8620,7 +9956,7 @@ BIM_ACTION(delete_and_yank_chars, ACTION_IS_RW,
 		}
 		yank_text(env->start_line, env->start_col, end_line, end_col);
 		for (int i = env->start_col; i <= end_col; ++i) {
-			line_delete(env->lines[env->start_line-1], env->start_col, env->start_line - 1);
+			line_delete(buffer_line(env, env->start_line-1), env->start_col, env->start_line - 1);
 		}
 		env->col_no = env->start_col;
 	} else {
@@ -8639,12 +9975,12 @@ BIM_ACTION(delete_and_yank_chars, ACTION_IS_RW,
 			env->lines = remove_line(env->lines, env->start_line);
 		} /* end_line is no longer valid; should be start_line+1*/
 		/* Delete from env->start_col forward */
-		int tmp = env->lines[env->start_line-1]->actual;
+		int tmp = buffer_line(env, env->start_line-1)->actual;
 		for (int i = env->start_col; i <= tmp; ++i) {
-			line_delete(env->lines[env->start_line-1], env->start_col, env->start_line - 1);
+			line_delete(buffer_line(env, env->start_line-1), env->start_col, env->start_line - 1);
 		}
 		for (int i = 1; i <= end_col; ++i) {
-			line_delete(env->lines[env->start_line], 1, env->start_line);
+			line_delete(buffer_line(env, env->start_line), 1, env->start_line);
 		}
 		/* Merge start and end lines */
 		merge_lines(env->lines, env->start_line);
@@ -8680,33 +10016,33 @@ BIM_ACTION(replace_chars, ARG_IS_PROMPT | ACTION_IS_RW,
 		int s = (env->start_col < env->col_no) ? env->start_col : env->col_no;
 		int e = (env->start_col < env->col_no) ? env->col_no : env->start_col;
 		for (int i = s; i <= e; ++i) {
-			line_replace(env->lines[env->start_line-1], _c, i-1, env->start_line-1);
+			line_replace(buffer_line(env, env->start_line-1), _c, i-1, env->start_line-1);
 		}
 		redraw_text();
 	} else {
 		if (env->start_line < env->line_no) {
-			for (int s = env->start_col-1; s < env->lines[env->start_line-1]->actual; ++s) {
-				line_replace(env->lines[env->start_line-1], _c, s, env->start_line-1);
+			for (int s = env->start_col-1; s < buffer_line(env, env->start_line-1)->actual; ++s) {
+				line_replace(buffer_line(env, env->start_line-1), _c, s, env->start_line-1);
 			}
 			for (int line = env->start_line + 1; line < env->line_no; ++line) {
-				for (int i = 0; i < env->lines[line-1]->actual; ++i) {
-					line_replace(env->lines[line-1], _c, i, line-1);
+				for (int i = 0; i < buffer_line(env, line-1)->actual; ++i) {
+					line_replace(buffer_line(env, line-1), _c, i, line-1);
 				}
 			}
 			for (int s = 0; s < env->col_no; ++s) {
-				line_replace(env->lines[env->line_no-1], _c, s, env->line_no-1);
+				line_replace(buffer_line(env, env->line_no-1), _c, s, env->line_no-1);
 			}
 		} else {
-			for (int s = env->col_no-1; s < env->lines[env->line_no-1]->actual; ++s) {
-				line_replace(env->lines[env->line_no-1], _c, s, env->line_no-1);
+			for (int s = env->col_no-1; s < buffer_line(env, env->line_no-1)->actual; ++s) {
+				line_replace(buffer_line(env, env->line_no-1), _c, s, env->line_no-1);
 			}
 			for (int line = env->line_no + 1; line < env->start_line; ++line) {
-				for (int i = 0; i < env->lines[line-1]->actual; ++i) {
-					line_replace(env->lines[line-1], _c, i, line-1);
+				for (int i = 0; i < buffer_line(env, line-1)->actual; ++i) {
+					line_replace(buffer_line(env, line-1), _c, i, line-1);
 				}
 			}
 			for (int s = 0; s < env->start_col; ++s) {
-				line_replace(env->lines[env->start_line-1], _c, s, env->start_line-1);
+				line_replace(buffer_line(env, env->start_line-1), _c, s, env->start_line-1);
 			}
 		}
 	}
@@ -8726,7 +10062,7 @@ BIM_ACTION(enter_char_selection, 0,
 	unhighlight_matching_paren();
 
 	/* Select single character */
-	env->lines[env->line_no-1]->text[env->col_no-1].flags |= FLAG_SELECT;
+	buffer_line(env, env->line_no-1)->text[env->col_no-1].flags |= FLAG_SELECT;
 	redraw_line(env->line_no-1);
 }
 
@@ -8819,7 +10155,7 @@ void draw_completion_matches(uint32_t * tmp, struct completion_match *matches, i
 
 	/* Determine where the cursor is physically */
 	for (int i = 0; i < env->col_no - 1 - original_length; ++i) {
-		char_t * c = &env->lines[env->line_no-1]->text[i];
+		char_t * c = &buffer_line(env, env->line_no-1)->text[i];
 		x += c->display_width;
 	}
 
@@ -8846,19 +10182,19 @@ void draw_completion_matches(uint32_t * tmp, struct completion_match *matches, i
 		for (int j = 0; j < box_width; ++j) {
 			if (j == original_length) set_colors(i == index ? COLOR_NUMERAL : COLOR_STATUS_FG, COLOR_STATUS_BG);
 			if (j == match_width) set_colors(COLOR_TYPE, COLOR_STATUS_BG);
-			if (j < match_width) printf("%c", matches[i].string[j]);
-			else if (j > match_width && j - match_width - 1 < file_width) printf("%c", matches[i].file[j-match_width-1]);
-			else printf(" ");
+			if (j < match_width) screen_printf("%c", matches[i].string[j]);
+			else if (j > match_width && j - match_width - 1 < file_width) screen_printf("%c", matches[i].file[j-match_width-1]);
+			else screen_printf(" ");
 		}
 	}
 	if (max_count == 0) {
 		place_cursor(box_x + env->left, box_y);
 		set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
-		printf(" (no matches) ");
+		screen_printf(" (no matches) ");
 	} else if (max_count != matches_count) {
 		place_cursor(box_x + env->left, box_y+max_count);
 		set_colors(COLOR_STATUS_FG, COLOR_STATUS_BG);
-		printf(" (%d more) ", matches_count-max_count);
+		screen_printf(" (%d more) ", matches_count-max_count);
 	}
 }
 
@@ -8880,7 +10216,7 @@ int omni_complete(int quit_quietly_on_none) {
 	int c_before = 0;
 	int i = env->col_no-1;
 	while (i > 0) {
-		int c = env->lines[env->line_no-1]->text[i-1].codepoint;
+		int c = buffer_line(env, env->line_no-1)->text[i-1].codepoint;
 		if (!qualifier(c)) break;
 		c_before++;
 		i--;
@@ -8892,7 +10228,7 @@ int omni_complete(int quit_quietly_on_none) {
 	uint32_t * tmp = malloc(sizeof(uint32_t) * (c_before+1));
 	int j = 0;
 	while (c_before) {
-		tmp[j] = env->lines[env->line_no-1]->text[env->col_no-c_before-1].codepoint;
+		tmp[j] = buffer_line(env, env->line_no-1)->text[env->col_no-c_before-1].codepoint;
 		c_before--;
 		j++;
 	}
@@ -9081,7 +10417,7 @@ int read_one_character(char * message) {
 		if (c == KEY_CTRL_V) {
 			if (!global_config.overlay_mode) {
 				render_commandline_message(message);
-				printf(" ^V");
+				screen_printf(" ^V");
 				place_cursor_actual();
 			}
 			while ((c = bim_getch()) == -1);
@@ -9113,7 +10449,7 @@ BIM_ACTION(cursor_left_with_wrap, 0,
 )(void) {
 	if (env->line_no > 1 && env->col_no == 1) {
 		env->line_no--;
-		env->col_no = env->lines[env->line_no-1]->actual;
+		env->col_no = buffer_line(env, env->line_no-1)->actual;
 		set_preferred_column();
 		place_cursor_actual();
 	} else {
@@ -9159,7 +10495,7 @@ BIM_ACTION(append_and_insert, ACTION_IS_RW,
 BIM_ACTION(insert_after_cursor, ACTION_IS_RW,
 	"Place the cursor after the selected character and enter insert mode."
 )(void) {
-	if (env->col_no < env->lines[env->line_no-1]->actual + 1) {
+	if (env->col_no < buffer_line(env, env->line_no-1)->actual + 1) {
 		env->col_no += 1;
 	}
 	enter_insert();
@@ -9168,10 +10504,10 @@ BIM_ACTION(insert_after_cursor, ACTION_IS_RW,
 BIM_ACTION(delete_forward, ACTION_IS_RW,
 	"Delete the character under the cursor."
 )(void) {
-	if (env->col_no <= env->lines[env->line_no-1]->actual) {
-		line_delete(env->lines[env->line_no-1], env->col_no, env->line_no-1);
+	if (env->col_no <= buffer_line(env, env->line_no-1)->actual) {
+		line_delete(buffer_line(env, env->line_no-1), env->col_no, env->line_no-1);
 		redraw_text();
-	} else if (env->col_no == env->lines[env->line_no-1]->actual + 1 && env->line_count > env->line_no) {
+	} else if (env->col_no == buffer_line(env, env->line_no-1)->actual + 1 && env->line_count > env->line_no) {
 		merge_lines(env->lines, env->line_no);
 		redraw_text();
 	}
@@ -9196,8 +10532,8 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 		if (!global_config.yank_is_full_lines) {
 			/* Handle P for paste before, p for past after */
 			int target_column = (direction == -1 ? (env->col_no) : (env->col_no+1));
-			if (target_column > env->lines[env->line_no-1]->actual + 1) {
-				target_column = env->lines[env->line_no-1]->actual + 1;
+			if (target_column > buffer_line(env, env->line_no-1)->actual + 1) {
+				target_column = buffer_line(env, env->line_no-1)->actual + 1;
 			}
 			if (global_config.yank_count > 1) {
 				/* Spit the current line at the current position */
@@ -9205,7 +10541,7 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 			}
 			/* Insert first line at current position */
 			for (int i = 0; i < global_config.yanks[0]->actual; ++i) {
-				env->lines[env->line_no - 1] = line_insert(env->lines[env->line_no - 1], global_config.yanks[0]->text[i], target_column + i - 1, env->line_no - 1); 
+				env->lines[env->line_no - 1] = line_insert(buffer_line(env, env->line_no - 1), global_config.yanks[0]->text[i], target_column + i - 1, env->line_no - 1); 
 			}
 			if (global_config.yank_count > 1) {
 				/* Insert full lines */
@@ -9217,7 +10553,7 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 				}
 				/* Insert characters from last line into (what was) the next line */
 				for (int i = 0; i < global_config.yanks[global_config.yank_count-1]->actual; ++i) {
-					env->lines[env->line_no + global_config.yank_count - 2] = line_insert(env->lines[env->line_no + global_config.yank_count - 2], global_config.yanks[global_config.yank_count-1]->text[i], i, env->line_no + global_config.yank_count - 2);
+					env->lines[env->line_no + global_config.yank_count - 2] = line_insert(buffer_line(env, env->line_no + global_config.yank_count - 2), global_config.yanks[global_config.yank_count-1]->text[i], i, env->line_no + global_config.yank_count - 2);
 				}
 			}
 		} else {
@@ -9230,8 +10566,8 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 			}
 		}
 		env->slowop = 0;
-		schedule_complete_recalc();
-		/* Recalculate whole document syntax */
+		/* Only the pasted lines (and whatever their states carry into) need redoing */
+		schedule_syntax_pass();
 		if (direction == 1) {
 			if (global_config.yank_is_full_lines) {
 				env->line_no += 1;
@@ -9246,8 +10582,8 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 		}
 		if (global_config.yank_is_full_lines) {
 			env->col_no = 1;
-			for (int i = 0; i < env->lines[env->line_no-1]->actual; ++i) {
-				if (!is_whitespace(env->lines[env->line_no-1]->text[i].codepoint)) {
+			for (int i = 0; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+				if (!is_whitespace(buffer_line(env, env->line_no-1)->text[i].codepoint)) {
 					env->col_no = i + 1;
 					break;
 				}
@@ -9262,7 +10598,7 @@ BIM_ACTION(paste, ARG_IS_CUSTOM | ACTION_IS_RW,
 BIM_ACTION(insert_at_end, ACTION_IS_RW,
 	"Move the cursor to the end of the current line and enter insert mode."
 )(void) {
-	env->col_no = env->lines[env->line_no-1]->actual+1;
+	env->col_no = buffer_line(env, env->line_no-1)->actual+1;
 	env->mode = MODE_INSERT;
 	set_history_break();
 }
@@ -9356,7 +10692,7 @@ BIM_ACTION(jump_to_previous_blank, 0,
 	if (env->line_no == 1) return;
 	do {
 		env->line_no--;
-		if (env->lines[env->line_no-1]->actual == 0) break;
+		if (buffer_line(env, env->line_no-1)->actual == 0) break;
 	} while (env->line_no > 1);
 	set_preferred_column();
 	redraw_statusbar();
@@ -9369,7 +10705,7 @@ BIM_ACTION(jump_to_next_blank, 0,
 	if (env->line_no == env->line_count) return;
 	do {
 		env->line_no++;
-		if (env->lines[env->line_no-1]->actual == 0) break;
+		if (buffer_line(env, env->line_no-1)->actual == 0) break;
 	} while (env->line_no < env->line_count);
 	set_preferred_column();
 	redraw_statusbar();
@@ -9378,8 +10714,8 @@ BIM_ACTION(jump_to_next_blank, 0,
 BIM_ACTION(first_non_whitespace, 0,
 	"Jump to the first non-whitespace character in the current line."
 )(void) {
-	for (int i = 0; i < env->lines[env->line_no-1]->actual; ++i) {
-		if (!is_whitespace(env->lines[env->line_no-1]->text[i].codepoint)) {
+	for (int i = 0; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+		if (!is_whitespace(buffer_line(env, env->line_no-1)->text[i].codepoint)) {
 			env->col_no = i + 1;
 			break;
 		}
@@ -9406,7 +10742,7 @@ BIM_ACTION(smart_backspace, ACTION_IS_RW,
 	if (!env->tabs && env->col_no > 1) {
 		int i;
 		for (i = 0; i < env->col_no-1; ++i) {
-			if (!is_whitespace(env->lines[env->line_no-1]->text[i].codepoint)) break;
+			if (!is_whitespace(buffer_line(env, env->line_no-1)->text[i].codepoint)) break;
 		}
 		if (i == env->col_no-1) {
 			/* Backspace until aligned */
@@ -9444,10 +10780,10 @@ BIM_ACTION(smart_comment_end, ARG_IS_INPUT | ACTION_IS_RW,
 )(int c) {
 	/* smart *end* of comment anyway */
 	if (env->indent) {
-		if ((env->lines[env->line_no-1]->text[env->col_no-2].flags & 0x1F) == FLAG_COMMENT &&
-			(env->lines[env->line_no-1]->text[env->col_no-2].codepoint == ' ') &&
+		if ((buffer_line(env, env->line_no-1)->text[env->col_no-2].flags & 0x1F) == FLAG_COMMENT &&
+			(buffer_line(env, env->line_no-1)->text[env->col_no-2].codepoint == ' ') &&
 			(env->col_no > 3) &&
-			(env->lines[env->line_no-1]->text[env->col_no-3].codepoint == '*')) {
+			(buffer_line(env, env->line_no-1)->text[env->col_no-3].codepoint == '*')) {
 			env->col_no--;
 			replace_char('/');
 			env->col_no++;
@@ -9463,9 +10799,9 @@ BIM_ACTION(smart_brace_end, ARG_IS_INPUT | ACTION_IS_RW,
 )(int c) {
 	if (env->indent) {
 		int was_whitespace = 1;
-		for (int i = 0; i < env->lines[env->line_no-1]->actual; ++i) {
-			if (env->lines[env->line_no-1]->text[i].codepoint != ' ' &&
-				env->lines[env->line_no-1]->text[i].codepoint != '\t') {
+		for (int i = 0; i < buffer_line(env, env->line_no-1)->actual; ++i) {
+			if (buffer_line(env, env->line_no-1)->text[i].codepoint != ' ' &&
+				buffer_line(env, env->line_no-1)->text[i].codepoint != '\t') {
 				was_whitespace = 0;
 				break;
 			}
@@ -9477,11 +10813,11 @@ BIM_ACTION(smart_brace_end, ARG_IS_INPUT | ACTION_IS_RW,
 			find_matching_paren(&line,&col, 1);
 			if (line != -1) {
 				line = find_brace_line_start(line, col);
-				while (env->lines[env->line_no-1]->actual) {
-					line_delete(env->lines[env->line_no-1], env->lines[env->line_no-1]->actual, env->line_no-1);
+				while (buffer_line(env, env->line_no-1)->actual) {
+					line_delete(buffer_line(env, env->line_no-1), buffer_line(env, env->line_no-1)->actual, env->line_no-1);
 				}
 				add_indent(env->line_no-1,line-1,1);
-				env->col_no = env->lines[env->line_no-1]->actual + 1;
+				env->col_no = buffer_line(env, env->line_no-1)->actual + 1;
 				insert_char(c);
 			}
 		}
@@ -9530,7 +10866,7 @@ BIM_ACTION(paste_end, 0, "End bracketed paste; restore indentation, completion,
 	if (state_before_paste & 0x02) env->indent = 1;
 	env->slowop = 0;
 	int line_to_recalculate = (line_before_paste > 1 ? line_before_paste - 1 : 0);
-	recalculate_syntax(env->lines[line_to_recalculate], line_to_recalculate);
+	recalculate_syntax(buffer_line(env, line_to_recalculate), line_to_recalculate);
 	redraw_all();
 }
 
@@ -9550,7 +10886,7 @@ struct action_map _NORMAL_MAP[] = {
 	{'A',           insert_at_end, opt_rw, 0},
 	{'u',           undo_history, opt_rw, 0},
 	{KEY_CTRL_R,    redo_history, opt_rw, 0},
-	{KEY_CTRL_L,    redraw_all, 0, 0},
+	{KEY_CTRL_L,    repaint_screen, 0, 0},
 	{KEY_CTRL_G,    goto_definition, 0, 0},
 	{'i',           enter_insert, opt_rw, 0},
 	{'R',           enter_replace, opt_rw, 0},
@@ -9940,7 +11276,7 @@ void normal_mode(void) {
 						} else {
 							find_match_backwards(global_config.prev_line, global_config.prev_col, &line, &col, buffer);
 							if (line == -1 && global_config.search_wraps) {
-								find_match_backwards(env->line_count, env->lines[env->line_count-1]->actual, &line, &col, buffer);
+								find_match_backwards(env->line_count, buffer_line(env, env->line_count-1)->actual, &line, &col, buffer);
 							}
 						}
 
@@ -10014,7 +11350,7 @@ void normal_mode(void) {
 				} else if (!handle_action(ESCAPE_MAP, key)) {
 					/* Perform replacement */
 					if (key < KEY_ESCAPE) {
-						if (env->col_no <= env->lines[env->line_no - 1]->actual) {
+						if (env->col_no <= buffer_line(env, env->line_no - 1)->actual) {
 							replace_char(key);
 							env->col_no += 1;
 						} else {
@@ -10153,7 +11489,9 @@ struct CommandDef {
 
 int process_krk_command(const char * cmd, KrkValue * outVal) {
 	place_cursor(global_config.term_width, global_config.term_height);
-	fprintf(stdout, "\n");
+	screen_printf("\n");
+	/* Commands can print whatever they like, so get out of the way */
+	screen_suspend();
 	/* By resetting, we're at 0 frames. */
 	krk_resetStack();
 	/* Push something so we're not at the bottom of the stack when an
@@ -10202,6 +11540,7 @@ int process_krk_command(const char * cmd, KrkValue * outVal) {
 	if (hadOutput) {
 		int c;
 		while ((c = bim_getch())== -1);
+		screen_resume();
 		if (c != ':') {
 			bim_unget(c);
 		} else {
@@ -10213,6 +11552,7 @@ int process_krk_command(const char * cmd, KrkValue * outVal) {
 		}
 	}
 	global_config.break_from_selection = 1;
+	screen_resume();
 	if (!global_config.had_error) redraw_all();
 	global_config.had_error = 0;
 	return retval;
@@ -10238,6 +11578,8 @@ static void show_usage(char * argv[]) {
 			"        nohistory   " _s "disable undo/redo" _e
 			"        nomouse     " _s "disable mouse support" _e
 			"        cansgrmouse " _s "enable SGR mouse escape sequences" _e
+			"        nodiff      " _s "send every redraw instead of only what changed" _e
+			"        nolarge     " _s "decode large files up front like any other" _e
 			" -c,-C  " _s "print file to stdout with syntax highlighting" _e
 			"        " _s "-C includes line numbers, -c does not" _e
 			" -u     " _s "override bimrc file" _e
@@ -10250,6 +11592,7 @@ static void show_usage(char * argv[]) {
 			" --dump-commands " _s "dump markdown description of all commands" _e
 			" --dump-config   " _s "dump key mappings as a bimscript" _e
 			" --html FILE     " _s "convert FILE to syntax-highlighted HTML" _e
+			" --first-paint   " _s "exit after drawing the screen once and say how long that took" _e
 			"\n", argv[0], argv[0]);
 #undef _e
 #undef _s
@@ -10302,6 +11645,8 @@ int set_capability(char * arg) {
 	else if (!strcmp(argname, "insert")) global_config.can_insert = value;
 	else if (!strcmp(argname, "paste")) global_config.can_bracketedpaste = value;
 	else if (!strcmp(argname, "sgrmouse")) global_config.can_sgrmouse = value;
+	else if (!strcmp(argname, "diff")) global_config.screen_diff = value;
+	else if (!strcmp(argname, "large")) global_config.large_files = value;
 	/* Startup options */
 	else if (!strcmp(argname, "syntax")) global_config.highlight_on_open = value;
 	else if (!strcmp(argname, "history")) global_config.history_enabled = value;
@@ -10319,6 +11664,20 @@ BIM_COMMAND(setcap, "setcap", "Enable or disable quirks/features.") {
 	return 0;
 }
 
+BIM_COMMAND(renderstats, "renderstats", "Show how much terminal output redraws have needed.") {
+	if (!screen.frames) {
+		render_status_message("no frames drawn yet");
+		return 0;
+	}
+	render_status_message("%llu frames, %llu bytes sent for %llu drawn (%llu%%); last %llu/%llu bytes in %llu.%03llums",
+		(unsigned long long)screen.frames,
+		(unsigned long long)screen.sent_bytes, (unsigned long long)screen.raw_bytes,
+		(unsigned long long)(screen.raw_bytes ? screen.sent_bytes * 100 / screen.raw_bytes : 0),
+		(unsigned long long)screen.last_sent, (unsigned long long)screen.last_raw,
+		(unsigned long long)(screen.last_us / 1000), (unsigned long long)(screen.last_us % 1000));
+	return 0;
+}
+
 BIM_COMMAND(quirk,"quirk","Handle quirks based on environment variables") {
 	if (argc < 3) goto _quirk_arg_error;
 	char * varname = argv[1];
@@ -10855,7 +12214,7 @@ static KrkValue krk_bim_getDocumentText(int argc, KrkValue argv[], int hasKw) {
 
 	int i, j;
 	for (i = 0; i < env->line_count; ++i) {
-		line_t * line = env->lines[i];
+		line_t * line = buffer_line(env, i);
 		for (j = 0; j < line->actual; j++) {
 			char_t c = line->text[j];
 			if (c.codepoint == 0) {
@@ -11196,9 +12555,9 @@ BIM_COMMAND(setcolor, "setcolor", "Set colorscheme colors") {
 #define PRINT_COLOR do { \
 	render_commandline_message("%20s = ", c->name); \
 	set_colors(*c->value, *c->value); \
-	printf("   "); \
+	screen_printf("   "); \
 	set_colors(COLOR_FG, COLOR_BG); \
-	printf(" %s\n", *c->value); \
+	screen_printf(" %s\n", *c->value); \
 	} while (0)
 	if (argc < 2) {
 		/* Print colors */
@@ -11467,6 +12826,8 @@ _argument_error:
 }
 
 int main(int argc, char * argv[]) {
+	uint64_t start_time = screen_now();
+	int first_paint = 0;
 	findBim(argv);
 	int opt;
 	while ((opt = getopt(argc, argv, "?c:C:u:RS:O:-:")) != -1) {
@@ -11482,11 +12843,11 @@ int main(int argc, char * argv[]) {
 				global_config.go_to_line = 0;
 				open_file(optarg);
 				for (int i = 0; i < env->line_count; ++i) {
-					recalculate_syntax(env->lines[i], i);
+					recalculate_syntax(buffer_line(env, i), i);
 					if (opt == 'C') {
 						draw_line_number(i);
 					}
-					render_line(env->lines[i], 6 * (env->lines[i]->actual + 1), 0, -1);
+					render_line(buffer_line(env, i), 6 * (buffer_line(env, i)->actual + 1), 0, -1);
 					reset();
 					fprintf(stdout, "\n");
 				}
@@ -11560,12 +12921,14 @@ int main(int argc, char * argv[]) {
 					global_config.go_to_line = 0;
 					open_file(argv[optind]);
 					for (int i = 0; i < env->line_count; ++i) {
-						recalculate_syntax(env->lines[i], i);
+						recalculate_syntax(buffer_line(env, i), i);
 					}
 					convert_to_html();
 					/* write to stdout */
 					output_file(env, stdout);
 					return 0;
+				} else if (!strcmp(optarg,"first-paint")) {
+					first_paint = 1;
 				} else if (!strcmp(optarg,"dump-config")) {
 					initialize();
 					/* Dump a config file representing the current key mappings */
@@ -11609,6 +12972,15 @@ int main(int argc, char * argv[]) {
 	/* Draw the screen once */
 	redraw_all();
 
+	if (first_paint) {
+		screen_flush();
+		uint64_t elapsed = screen_now() - start_time;
+		char msg[100];
+		snprintf(msg, 100, "first paint after %llu.%03llums (%d lines)",
+			(unsigned long long)(elapsed / 1000), (unsigned long long)(elapsed % 1000), env->line_count);
+		quit(msg);
+	}
+
 	/* Start accepting key commands */
 	normal_mode();
 
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <kuroko/vm.h>
 
 #ifdef __DATE__
@@ -40,6 +41,8 @@
 #define BIM_COPYRIGHT "Copyright 2012-2021 K. Lange <\033[3mklange@toaruos.org\033[23m>"
 
 #define BLOCK_SIZE 4096
+#define LARGE_FILE_SIZE   (16 * 1024 * 1024) /* Files at least this big are decoded lazily */
+#define LARGE_FILE_SAMPLE 1000 /* Lines of them to look at to guess indentation */
 #define ENTER_KEY     '\r'
 #define LINE_FEED     '\n'
 #define BACKSPACE_KEY 0x08
@@ -131,6 +134,7 @@ typedef struct {
 	int available;
 	int actual;
 	int istate;
+	int highlighted; /* text[] flags are up to date for istate */
 	int is_current;
 	int rev_status;
 	char_t   text[];
@@ -211,6 +215,8 @@ typedef struct {
 	unsigned int search_wraps:1;
 	unsigned int had_error:1;
 	unsigned int use_biminfo:1;
+	unsigned int screen_diff:1;
+	unsigned int large_files:1;
 
 	int cursor_padding;
 	int split_percent;
@@ -294,6 +300,20 @@ typedef struct _env {
 	int highlighting_paren;
 	int maxcolumn;
 
+	/* Lines before this one are known to be highlighted correctly */
+	int syntax_frontier;
+
+	/* Large files: the file as read, which undecoded lines point into */
+	uint8_t * source;
+	size_t    source_size;
+	int       source_crnl;
+
+	/* Matches on each line for search_pattern, or -1 where not yet known */
+	int      * search_counts;
+	int        search_avail;
+	int        search_ignorecase;
+	uint32_t * search_pattern;
+
 	short  mode;
 	short  tabstop;
 
@@ -320,6 +340,23 @@ typedef struct _env {
 	int prev_line;
 } buffer_t;
 
+/**
+ * Lines of a large file start out as just their byte offset into
+ * `source`, shifted up and tagged in the low bit, and are only decoded
+ * into a line_t when something asks for them. Anything that wants a
+ * line should go through buffer_line(); loops that only update state
+ * kept in decoded lines can skip pending ones.
+ */
+#define LINE_IS_PENDING(l) ((uintptr_t)(l) & 1)
+#define LINE_PENDING_AT(o) ((line_t *)(((uintptr_t)(o) << 1) | 1))
+#define LINE_PENDING_OFFSET(l) ((size_t)((uintptr_t)(l) >> 1))
+
+extern line_t * decode_line(buffer_t * buf, int i);
+
+static inline line_t * buffer_line(buffer_t * buf, int i) {
+	return LINE_IS_PENDING(buf->lines[i]) ? decode_line(buf, i) : buf->lines[i];
+}
+
 struct theme_def {
 	const char * name;
 	void * callable;
@@ -423,6 +460,7 @@ extern void quit(const char * message);
 extern void close_buffer(void);
 extern void set_syntax_by_name(const char * name);
 extern void rehighlight_search(line_t * line);
+extern void search_cache_drop(buffer_t * buf);
 extern void try_to_center();
 extern int read_one_character(char * message);
 extern void bim_unget(int c);
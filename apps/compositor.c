@@ -54,6 +54,24 @@
 #define TRACE(msg,...)
 #endif
 
+/*
+ * For messages where only the latest one matters, a client that is
+ * behind gets just the newest copy. These are how many leading bytes
+ * make two messages "the same": the header, or the header and a wid.
+ */
+#define COALESCE_TYPE   sizeof(yutani_msg_t)
+#define COALESCE_WINDOW (sizeof(yutani_msg_t) + sizeof(yutani_wid_t))
+
+#if YUTANI_DEBUG_OVERLAY
+#include "terminal-font.h"
+#define OVERLAY_CHAR_WIDTH  9
+#define OVERLAY_CHAR_HEIGHT 20
+#define OVERLAY_COLUMNS     48
+#define OVERLAY_LINES       5
+#define OVERLAY_WIDTH  (OVERLAY_COLUMNS * OVERLAY_CHAR_WIDTH + 8)
+#define OVERLAY_HEIGHT (OVERLAY_LINES * OVERLAY_CHAR_HEIGHT + 8)
+#endif
+
 /* Early definitions */
 static void mark_window(yutani_globals_t * yg, yutani_server_window_t * window);
 static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t * w);
@@ -76,11 +94,13 @@ static int usage(char * argv[]) {
 	fprintf(stderr,
 			"Yutani - Window Compositor\n"
 			"\n"
-			"usage: %s [-n [-g WxH]] [-h]\n"
+			"usage: %s [-n [-g WxH]] [-j THREADS] [-b FRAMES] [-h]\n"
 			"\n"
 			" -n --nested     \033[3mRun in a window.\033[0m\n"
 			" -h --help       \033[3mShow this help message.\033[0m\n"
 			" -g --geometry   \033[3mSet the size of the server framebuffer.\033[0m\n"
+			" -j --threads    \033[3mComposite with this many threads (default: one per CPU).\033[0m\n"
+			" -b --bench      \033[3mRender FRAMES synthetic frames, print the frame rate, and exit.\033[0m\n"
 			"\n"
 			"  Yutani is the standard system compositor.\n"
 			"\n",
@@ -95,12 +115,14 @@ static int parse_args(int argc, char * argv[], int * out) {
 	static struct option long_opts[] = {
 		{"nested",     no_argument,       0, 'n'},
 		{"geometry",   required_argument, 0, 'g'},
+		{"threads",    required_argument, 0, 'j'},
+		{"bench",      required_argument, 0, 'b'},
 		{"help",       no_argument,       0, 'h'},
 		{0,0,0,0}
 	};
 
 	int index, c;
-	while ((c = getopt_long(argc, argv, "hg:n", long_opts, &index)) != -1) {
+	while ((c = getopt_long(argc, argv, "hg:nj:b:", long_opts, &index)) != -1) {
 		if (!c) {
 			if (long_opts[index].flag == 0) {
 				c = long_opts[index].val;
@@ -112,6 +134,12 @@ static int parse_args(int argc, char * argv[], int * out) {
 			case 'n':
 				yutani_options.nested = 1;
 				break;
+			case 'j':
+				yutani_options.threads = atoi(optarg);
+				break;
+			case 'b':
+				yutani_options.bench_frames = atoi(optarg);
+				break;
 			case 'g':
 				{
 					char * c = strstr(optarg, "x");
@@ -344,14 +372,14 @@ static void set_focused_window(yutani_globals_t * yg, yutani_server_window_t * w
 		/* Send focus change to old focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, yg->focused_window->wid, 0);
-		pex_send(yg->server, yg->focused_window->owner, response->size, (char *)response);
+		pex_send_coalesce(yg->server, yg->focused_window->owner, COALESCE_WINDOW, response->size, (char *)response);
 	}
 	yg->focused_window = w;
 	if (w) {
 		/* Send focus change to new focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, w->wid, 1);
-		pex_send(yg->server, w->owner, response->size, (char *)response);
+		pex_send_coalesce(yg->server, w->owner, COALESCE_WINDOW, response->size, (char *)response);
 		make_top(yg, w);
 		mark_window(yg, w);
 	} else {
@@ -427,6 +455,12 @@ static yutani_server_window_t * server_window_create(yutani_globals_t * yg, int
 	win->default_mouse = 1;
 	win->server_flags = flags;
 	win->opacity = 255;
+	win->opaque = calloc(height, sizeof(yutani_opaque_span_t));
+	win->opaque_dirty_top = 0;
+	win->opaque_dirty_bottom = 0;
+	win->flips = 0;
+	win->flips_seen = 0;
+	win->flips_presented = 0;
 
 	char key[1024];
 	YUTANI_SHMKEY(yg->server_ident, key, 1024, win);
@@ -511,6 +545,11 @@ static void server_window_resize_finish(yutani_globals_t * yg, yutani_server_win
 	win->newbuffer = NULL;
 	win->newbufid = 0;
 
+	free(win->opaque);
+	win->opaque = calloc(height, sizeof(yutani_opaque_span_t));
+	win->opaque_dirty_top = 0;
+	win->opaque_dirty_bottom = height;
+
 	{
 		char key[1024];
 		YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, oldbufid);
@@ -533,6 +572,20 @@ static void yutani_add_clip(yutani_globals_t * yg, double x, double y, double w,
 	}
 }
 
+/**
+ * Wake the render thread if it is waiting for something to draw.
+ *
+ * Call this after making whatever change needs drawing. It's also
+ * used from the display resize signal handler, so keep it to a write.
+ */
+static void wake_renderer(yutani_globals_t * yg) {
+	__sync_synchronize();
+	if (__sync_lock_test_and_set(&yg->render_idle, 0)) {
+		char c = 0;
+		write(yg->wake_pipe[1], &c, 1);
+	}
+}
+
 /**
  * Mark a screen region as damaged.
  */
@@ -547,6 +600,8 @@ static void mark_screen(yutani_globals_t * yg, int32_t x, int32_t y, int32_t wid
 	spin_lock(&yg->update_list_lock);
 	list_insert(yg->update_list, rect);
 	spin_unlock(&yg->update_list_lock);
+
+	wake_renderer(yg);
 }
 
 /**
@@ -697,12 +752,39 @@ uint32_t yutani_color_for_wid(yutani_wid_t wid) {
 }
 
 /**
- * Blit a window to the framebuffer.
+ * Advance a window's animation for this frame.
+ *
+ * Done once per frame before anything is drawn, so every tile of a
+ * window sees the same animation frame. Returns 0 if the window
+ * finished closing and should not be drawn.
+ */
+static int yutani_window_animation_step(yutani_globals_t * yg, yutani_server_window_t * window) {
+	if (!window->anim_mode) return 1;
+
+	int frame = yutani_time_since(yg, window->anim_start);
+	if (frame >= yutani_animation_lengths[window->anim_mode]) {
+		/* XXX handle animation-end things like cleanup of closing windows */
+		if (yutani_is_closing_animation[window->anim_mode]) {
+			list_insert(yg->windows_to_remove, window);
+			return 0;
+		}
+		window->anim_mode = 0;
+		window->anim_start = 0;
+		return 1;
+	}
+
+	window->anim_frame = frame;
+	return 1;
+}
+
+/**
+ * Blit a window to a context.
  *
  * Applies transformations (rotation, animations) and then renders
- * the window through alpha blitting.
+ * the window through alpha blitting. This only draws; it can be
+ * called for different tiles of the same window at the same time.
  */
-static int yutani_blit_window(yutani_globals_t * yg, yutani_server_window_t * window, int x, int y) {
+static int yutani_blit_window(yutani_globals_t * yg, gfx_context_t * ctx, yutani_server_window_t * window, int x, int y) {
 
 	if (renderer_blit_window) {
 		return renderer_blit_window(yg,window,x,y);
@@ -717,80 +799,68 @@ static int yutani_blit_window(yutani_globals_t * yg, yutani_server_window_t * wi
 	_win_sprite.alpha = ALPHA_EMBEDDED;
 
 	if (window->anim_mode) {
-		int frame = yutani_time_since(yg, window->anim_start);
-		if (frame >= yutani_animation_lengths[window->anim_mode]) {
-			/* XXX handle animation-end things like cleanup of closing windows */
-			if (yutani_is_closing_animation[window->anim_mode]) {
-				list_insert(yg->windows_to_remove, window);
-				goto draw_finish;
-			}
-			window->anim_mode = 0;
-			window->anim_start = 0;
-			goto draw_window;
-		} else {
-			switch (window->anim_mode) {
-				case YUTANI_EFFECT_SQUEEZE_OUT:
-				case YUTANI_EFFECT_FADE_OUT:
-					{
-						frame = yutani_animation_lengths[window->anim_mode] - frame;
-					} /* fallthrough */
-				case YUTANI_EFFECT_SQUEEZE_IN:
-				case YUTANI_EFFECT_FADE_IN:
-					{
-						double time_diff = ((double)frame / (float)yutani_animation_lengths[window->anim_mode]);
-
-						if (window->server_flags & YUTANI_WINDOW_FLAG_DIALOG_ANIMATION) {
-							double x = time_diff;
-							int t_y = (window->height * (1.0 -x)) / 2;
-
-							draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x, window->y + t_y, window->width, window->height * x);
-						} else {
-							double x = 0.75 + time_diff * 0.25;
-							int t_x = (window->width * (1.0 - x)) / 2;
-							int t_y = (window->height * (1.0 - x)) / 2;
+		int frame = window->anim_frame;
+		switch (window->anim_mode) {
+			case YUTANI_EFFECT_SQUEEZE_OUT:
+			case YUTANI_EFFECT_FADE_OUT:
+				{
+					frame = yutani_animation_lengths[window->anim_mode] - frame;
+				} /* fallthrough */
+			case YUTANI_EFFECT_SQUEEZE_IN:
+			case YUTANI_EFFECT_FADE_IN:
+				{
+					double time_diff = ((double)frame / (float)yutani_animation_lengths[window->anim_mode]);
 
-							double opacity = time_diff * (double)(window->opacity) / 255.0;
+					if (window->server_flags & YUTANI_WINDOW_FLAG_DIALOG_ANIMATION) {
+						double x = time_diff;
+						int t_y = (window->height * (1.0 -x)) / 2;
 
-							if (!yutani_window_is_top(yg, window) && !yutani_window_is_bottom(yg, window) &&
-									!(window->server_flags & YUTANI_WINDOW_FLAG_ALT_ANIMATION)) {
-								draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + t_x, window->y + t_y, window->width * x, window->height * x, opacity);
-							} else {
-								draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
-							}
+						draw_sprite_scaled(ctx, &_win_sprite, window->x, window->y + t_y, window->width, window->height * x);
+					} else {
+						double x = 0.75 + time_diff * 0.25;
+						int t_x = (window->width * (1.0 - x)) / 2;
+						int t_y = (window->height * (1.0 - x)) / 2;
+
+						double opacity = time_diff * (double)(window->opacity) / 255.0;
+
+						if (!yutani_window_is_top(yg, window) && !yutani_window_is_bottom(yg, window) &&
+								!(window->server_flags & YUTANI_WINDOW_FLAG_ALT_ANIMATION)) {
+							draw_sprite_scaled_alpha(ctx, &_win_sprite, window->x + t_x, window->y + t_y, window->width * x, window->height * x, opacity);
+						} else {
+							draw_sprite_alpha(ctx, &_win_sprite, window->x, window->y, opacity);
 						}
 					}
-					break;
-				default:
-					goto draw_window;
-					break;
-			}
+				}
+				break;
+			default:
+				goto draw_window;
+				break;
 		}
 	} else {
 draw_window:
 		if (window->opacity != 255) {
 			double opacity = (double)(window->opacity) / 255.0;
 			if (window == yg->resizing_window) {
-				draw_sprite_scaled_alpha(yg->backend_ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h, opacity);
+				draw_sprite_scaled_alpha(ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h, opacity);
 			} else {
 				if (window->rotation) {
-					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, opacity);
+					draw_sprite_rotate(ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, opacity);
 				} else {
-					draw_sprite_alpha(yg->backend_ctx, &_win_sprite, window->x, window->y, opacity);
+					draw_sprite_alpha(ctx, &_win_sprite, window->x, window->y, opacity);
 				}
 			}
 		} else {
 			if (window == yg->resizing_window) {
-				draw_sprite_scaled(yg->backend_ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h);
+				draw_sprite_scaled(ctx, &_win_sprite, window->x + (int)yg->resizing_offset_x, window->y + (int)yg->resizing_offset_y, yg->resizing_w, yg->resizing_h);
 			} else {
 				if (window->rotation) {
-					draw_sprite_rotate(yg->backend_ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, 1.0);
+					draw_sprite_rotate(ctx, &_win_sprite, window->x + window->width / 2, window->y + window->height / 2, (double)window->rotation * M_PI / 180.0, 1.0);
 				} else {
-					draw_sprite(yg->backend_ctx, &_win_sprite, window->x, window->y);
+					draw_sprite(ctx, &_win_sprite, window->x, window->y);
 				}
 			}
 		}
 	}
-draw_finish:
 
 	return 0;
 }
@@ -849,18 +919,355 @@ static void yutani_post_vbox_rects(yutani_globals_t * yg) {
 	write(yg->vbox_rects, tmp, sizeof(tmp));
 }
 
+/**
+ * Rescan the rows of a window that changed since we last looked
+ * and find the longest fully-opaque run in each of them.
+ *
+ * The alpha threshold only describes where a window takes mouse
+ * input, so this looks at the pixels themselves. Clients only
+ * flip the parts they redraw, so this is usually a few rows.
+ */
+static void update_opaque_spans(yutani_globals_t * yg, yutani_server_window_t * window) {
+	spin_lock(&yg->update_list_lock);
+	int32_t top = window->opaque_dirty_top;
+	int32_t bottom = min(window->opaque_dirty_bottom, window->height);
+	window->opaque_dirty_top = 0;
+	window->opaque_dirty_bottom = 0;
+	spin_unlock(&yg->update_list_lock);
+
+	for (int32_t y = top; y < bottom; ++y) {
+		uint32_t * row = &((uint32_t *)window->buffer)[y * window->width];
+		int32_t best_left = 0, best_right = 0;
+		int32_t x = 0;
+		while (x < window->width) {
+			while (x < window->width && _ALP(row[x]) != 255) x++;
+			int32_t left = x;
+			while (x < window->width && _ALP(row[x]) == 255) x++;
+			if (x - left > best_right - best_left) {
+				best_left = left;
+				best_right = x;
+			}
+		}
+		window->opaque[y].left = best_left;
+		window->opaque[y].right = best_right;
+	}
+}
+
+/**
+ * Can this window hide what's below it?
+ *
+ * Only windows drawn 1:1 at full opacity can; anything being animated,
+ * faded, rotated, or scaled for a resize is treated as transparent.
+ */
+static int window_is_occluder(yutani_globals_t * yg, yutani_server_window_t * window) {
+	return !window->anim_mode && window->opacity == 255 && !window->rotation &&
+		window != yg->resizing_window && window->opaque;
+}
+
+/**
+ * The screen-space box a window will draw into this frame.
+ */
+static void window_screen_bounds(yutani_globals_t * yg, yutani_server_window_t * window, int32_t * left, int32_t * top, int32_t * right, int32_t * bottom) {
+	if (window == yg->resizing_window) {
+		*left = window->x + yg->resizing_offset_x;
+		*top  = window->y + yg->resizing_offset_y;
+		*right  = *left + yg->resizing_w;
+		*bottom = *top + yg->resizing_h;
+	} else if (window->rotation) {
+		/* Rotation is about the center; the corners stay within this circle */
+		int32_t r = sqrt((double)window->width * window->width + (double)window->height * window->height) / 2 + 1;
+		int32_t cx = window->x + window->width / 2;
+		int32_t cy = window->y + window->height / 2;
+		*left = cx - r;
+		*top  = cy - r;
+		*right  = cx + r;
+		*bottom = cy + r;
+	} else {
+		*left = window->x;
+		*top  = window->y;
+		*right  = window->x + window->width;
+		*bottom = window->y + window->height;
+	}
+}
+
+/**
+ * Is every pixel of a screen rectangle behind the opaque
+ * parts of the occluding windows in stack[from..count)?
+ */
+static int rect_is_covered(yutani_server_window_t ** stack, char * occluder, int from, int count, int32_t l, int32_t t, int32_t r, int32_t b) {
+	int any = 0;
+	for (int i = from; i < count && !any; ++i) {
+		yutani_server_window_t * w = stack[i];
+		any = occluder[i] && w->x < r && w->x + w->width > l && w->y < b && w->y + w->height > t;
+	}
+	if (!any) return 0;
+
+	for (int32_t y = t; y < b; ++y) {
+		/* Walk x across the row as long as some span covers it */
+		int32_t x = l;
+		int progress = 1;
+		while (x < r && progress) {
+			progress = 0;
+			for (int i = from; i < count; ++i) {
+				yutani_server_window_t * w = stack[i];
+				if (!occluder[i] || y < w->y || y >= w->y + w->height) continue;
+				yutani_opaque_span_t * span = &w->opaque[y - w->y];
+				if (w->x + span->left <= x && w->x + span->right > x) {
+					x = w->x + span->right;
+					progress = 1;
+				}
+			}
+		}
+		if (x < r) return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Tiled composition.
+ *
+ * The damaged part of the screen is cut into bands of TILE_ROWS rows.
+ * The render thread and a pool of workers take bands until none are
+ * left. Each band draws every window that touches it, bottom to top,
+ * through its own clip, so no two bands write the same pixels and the
+ * result is exactly what drawing everything on one thread would give.
+ * The render thread waits for every worker before it draws the cursor
+ * and flips.
+ */
+#define TILE_ROWS 32
+
+static struct {
+	int threads;             /* Including the render thread */
+	int start_pipe[2];       /* One byte per worker starts a frame... */
+	int done_pipe[2];        /* ...and each worker sends one back when it's done */
+	gfx_context_t ** ctxs;   /* Per thread, sharing the backend's buffers */
+
+	/* The frame being drawn */
+	yutani_globals_t * yg;
+	yutani_server_window_t ** windows;
+	int32_t * bounds;        /* top and bottom row of each window */
+	int window_count;
+	int32_t * tiles;         /* top row of each tile with damage */
+	int tile_count;
+	volatile int next_tile;
+} render_pool;
+
+static void render_tiles(gfx_context_t * ctx) {
+	yutani_globals_t * yg = render_pool.yg;
+	int tile;
+
+	while ((tile = __sync_fetch_and_add(&render_pool.next_tile, 1)) < render_pool.tile_count) {
+		int32_t top = render_pool.tiles[tile];
+		int32_t bottom = min(top + TILE_ROWS, yg->height);
+
+		gfx_clear_clip(ctx);
+		foreach (node, yg->frame_damage) {
+			yutani_damage_rect_t * rect = node->value;
+			int32_t t = max(rect->y, top);
+			int32_t b = min(rect->y + rect->height, bottom);
+			if (t < b) gfx_add_clip(ctx, rect->x, t, rect->width, b - t);
+		}
+
+		for (int i = 0; i < render_pool.window_count; ++i) {
+			if (render_pool.bounds[i * 2 + 1] <= top || render_pool.bounds[i * 2] >= bottom) continue;
+			yutani_server_window_t * w = render_pool.windows[i];
+			yutani_blit_window(yg, ctx, w, w->x, w->y);
+		}
+	}
+}
+
+static void * render_worker(void * arg) {
+	sysfunc(TOARU_SYS_FUNC_THREADNAME,(char *[]){"compositor","render worker",NULL});
+
+	gfx_context_t * ctx = arg;
+	char c;
+	while (read(render_pool.start_pipe[0], &c, 1) > 0) {
+		render_tiles(ctx);
+		write(render_pool.done_pipe[1], &c, 1);
+	}
+	return NULL;
+}
+
+/**
+ * Start the composition workers.
+ */
+static void render_pool_init(yutani_globals_t * yg) {
+	int threads = yutani_options.threads ? yutani_options.threads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > 32) threads = 32;
+
+	render_pool.threads = 1;
+	render_pool.ctxs = calloc(threads, sizeof(gfx_context_t *));
+	for (int i = 0; i < threads; ++i) {
+		render_pool.ctxs[i] = calloc(1, sizeof(gfx_context_t));
+	}
+
+	if (threads < 2 || pipe(render_pool.start_pipe) || pipe(render_pool.done_pipe)) return;
+
+	for (int i = 1; i < threads; ++i) {
+		pthread_t worker;
+		if (pthread_create(&worker, NULL, render_worker, render_pool.ctxs[i])) break;
+		render_pool.threads++;
+	}
+	TRACE("Composing with %d threads.", render_pool.threads);
+}
+
+/**
+ * Draw the given windows, bottom to top, into the damaged parts of the screen.
+ */
+static void render_pool_draw(yutani_globals_t * yg, yutani_server_window_t ** windows, int32_t * bounds, int count) {
+	/* Renderer plugins draw through their own state and only on this thread */
+	if (renderer_blit_window || render_pool.threads < 2) {
+		for (int i = 0; i < count; ++i) {
+			yutani_blit_window(yg, yg->backend_ctx, windows[i], windows[i]->x, windows[i]->y);
+		}
+		yg->frame_stats.threads = 1;
+		yg->frame_stats.tiles = 0;
+		return;
+	}
+
+	/* Which tiles have any damage? */
+	int tile_rows = (yg->height + TILE_ROWS - 1) / TILE_ROWS;
+	int32_t * tiles = malloc(sizeof(int32_t) * tile_rows);
+	int tile_count = 0;
+	for (int i = 0; i < tile_rows; ++i) {
+		int32_t top = i * TILE_ROWS;
+		foreach (node, yg->frame_damage) {
+			yutani_damage_rect_t * rect = node->value;
+			if (rect->width > 0 && rect->y < top + TILE_ROWS && (int32_t)(rect->y + rect->height) > top) {
+				tiles[tile_count++] = top;
+				break;
+			}
+		}
+	}
+
+	/* Every thread draws into the backend's buffers through a clip of its own */
+	for (int i = 0; i < render_pool.threads; ++i) {
+		gfx_context_t * ctx = render_pool.ctxs[i];
+		ctx->width      = yg->backend_ctx->width;
+		ctx->height     = yg->backend_ctx->height;
+		ctx->depth      = yg->backend_ctx->depth;
+		ctx->stride     = yg->backend_ctx->stride;
+		ctx->size       = 0;
+		ctx->buffer     = yg->backend_ctx->buffer;
+		ctx->backbuffer = yg->backend_ctx->backbuffer;
+	}
+
+	render_pool.yg = yg;
+	render_pool.windows = windows;
+	render_pool.bounds = bounds;
+	render_pool.window_count = count;
+	render_pool.tiles = tiles;
+	render_pool.tile_count = tile_count;
+	render_pool.next_tile = 0;
+
+	/* Only wake as many workers as there are tiles for */
+	int helpers = min(render_pool.threads - 1, tile_count - 1);
+	if (helpers > 0) {
+		char go[32] = {0};
+		write(render_pool.start_pipe[1], go, helpers);
+	}
+
+	render_tiles(render_pool.ctxs[0]);
+
+	for (int done = 0; done < helpers; ) {
+		char tmp[32];
+		ssize_t r = read(render_pool.done_pipe[0], tmp, helpers - done);
+		if (r <= 0) break;
+		done += r;
+	}
+
+	yg->frame_stats.threads = helpers > 0 ? helpers + 1 : 1;
+	yg->frame_stats.tiles = tile_count;
+	free(tiles);
+}
+
 /**
  * Blit all windows into the given context.
  *
- * This is called for rendering and for screenshots.
+ * Windows that don't touch this frame's damage, or whose damaged
+ * parts are entirely behind opaque windows above them, are skipped.
  */
 static void yutani_blit_windows(yutani_globals_t * yg) {
-	if (yg->bottom_z) yutani_blit_window(yg, yg->bottom_z, yg->bottom_z->x, yg->bottom_z->y);
+	yutani_frame_stats_t * stats = &yg->frame_stats;
+	stats->windows_considered = 0;
+	stats->windows_blitted = 0;
+	stats->windows_skipped = 0;
+	stats->pixels_blended = 0;
+
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
+	int count = 0;
+	yutani_server_window_t ** stack = malloc(sizeof(yutani_server_window_t *) * (yg->mid_zs->length + 2));
+	if (yg->bottom_z) stack[count++] = yg->bottom_z;
 	foreach (node, yg->mid_zs) {
-		yutani_server_window_t * w = node->value;
-		if (w) yutani_blit_window(yg, w, w->x, w->y);
+		if (node->value) stack[count++] = node->value;
+	}
+	if (yg->top_z) stack[count++] = yg->top_z;
+
+	/* Animations move on before anything is drawn; windows that finished closing are dropped */
+	int live = 0;
+	for (int i = 0; i < count; ++i) {
+		if (yutani_window_animation_step(yg, stack[i])) stack[live++] = stack[i];
+	}
+	count = live;
+
+	char * occluder = malloc(count);
+	for (int i = 0; i < count; ++i) {
+		occluder[i] = window_is_occluder(yg, stack[i]);
+		if (occluder[i]) update_opaque_spans(yg, stack[i]);
+	}
+
+	yutani_server_window_t ** draw = malloc(sizeof(yutani_server_window_t *) * (count + 1));
+	int32_t * bounds = malloc(sizeof(int32_t) * 2 * (count + 1));
+	int draw_count = 0;
+
+	for (int i = 0; i < count; ++i) {
+		yutani_server_window_t * w = stack[i];
+		stats->windows_considered++;
+
+		int32_t left, top, right, bottom;
+		window_screen_bounds(yg, w, &left, &top, &right, &bottom);
+		left = max(left, 0);
+		top = max(top, 0);
+		right = min(right, yg->width);
+		bottom = min(bottom, yg->height);
+
+		uint64_t pixels = 0;
+		foreach (node, yg->frame_damage) {
+			yutani_damage_rect_t * rect = node->value;
+			int32_t l = max(left, rect->x);
+			int32_t t = max(top, rect->y);
+			int32_t r = min(right, rect->x + rect->width);
+			int32_t b = min(bottom, rect->y + rect->height);
+			if (l >= r || t >= b) continue;
+			if (rect_is_covered(stack, occluder, i + 1, count, l, t, r, b)) continue;
+			pixels += (uint64_t)(r - l) * (b - t);
+		}
+
+		if (pixels) {
+			draw[draw_count] = w;
+			bounds[draw_count * 2] = top;
+			bounds[draw_count * 2 + 1] = bottom;
+			draw_count++;
+			stats->windows_blitted++;
+			stats->pixels_blended += pixels;
+		} else {
+			stats->windows_skipped++;
+		}
 	}
-	if (yg->top_z) yutani_blit_window(yg, yg->top_z, yg->top_z->x, yg->top_z->y);
+
+	render_pool_draw(yg, draw, bounds, draw_count);
+
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	stats->compose_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+
+	free(bounds);
+	free(draw);
+	free(occluder);
+	free(stack);
 }
 
 /**
@@ -937,12 +1344,90 @@ static void yutani_screenshot(yutani_globals_t * yg) {
 	fclose(f);
 }
 
+#if YUTANI_DEBUG_OVERLAY
+static void debug_overlay_position(yutani_globals_t * yg, int32_t * x, int32_t * y) {
+	*x = 8;
+	*y = yg->height - OVERLAY_HEIGHT - 8;
+}
+
+static void debug_overlay_string(yutani_globals_t * yg, int32_t x, int32_t y, char * str) {
+	for (; *str; str++, x += OVERLAY_CHAR_WIDTH) {
+		uint16_t * c = large_font[(unsigned char)*str < 128 ? *str : '?'];
+		for (int i = 0; i < OVERLAY_CHAR_HEIGHT; ++i) {
+			if (y + i < 0 || y + i >= (int32_t)yg->height) continue;
+			for (int j = 0; j < OVERLAY_CHAR_WIDTH; ++j) {
+				if (x + j < 0 || x + j >= (int32_t)yg->width) continue;
+				if (c[i] & (1 << (15-j))) GFX(yg->backend_ctx, x + j, y + i) = 0xFFFFFFFF;
+			}
+		}
+	}
+}
+
+/**
+ * Draw counters for the frame we just composited.
+ *
+ * Toggled with Super+Shift+O. It's redrawn whenever something else
+ * on screen changes, so it never causes frames of its own.
+ */
+static void draw_debug_overlay(yutani_globals_t * yg) {
+	int32_t x, y;
+	debug_overlay_position(yg, &x, &y);
+	draw_rectangle(yg->backend_ctx, x, y, OVERLAY_WIDTH, OVERLAY_HEIGHT, rgba(0,0,0,200));
+
+	yutani_frame_stats_t * stats = &yg->frame_stats;
+	char line[OVERLAY_COLUMNS + 1];
+
+	snprintf(line, sizeof(line), "windows %d, blitted %d, skipped %d",
+		stats->windows_considered, stats->windows_blitted, stats->windows_skipped);
+	debug_overlay_string(yg, x + 4, y + 4, line);
+
+	snprintf(line, sizeof(line), "blended %llu px", (unsigned long long)stats->pixels_blended);
+	debug_overlay_string(yg, x + 4, y + 4 + OVERLAY_CHAR_HEIGHT, line);
+
+	snprintf(line, sizeof(line), "threads %d, tiles %d, %llu.%03llu ms",
+		stats->threads, stats->tiles,
+		(unsigned long long)(stats->compose_us / 1000), (unsigned long long)(stats->compose_us % 1000));
+	debug_overlay_string(yg, x + 4, y + 4 + OVERLAY_CHAR_HEIGHT * 2, line);
+
+	snprintf(line, sizeof(line), "frame %llu.%03llu ms, %u frames, %u late",
+		(unsigned long long)(stats->frame_us / 1000), (unsigned long long)(stats->frame_us % 1000),
+		stats->frames, stats->frames_late);
+	debug_overlay_string(yg, x + 4, y + 4 + OVERLAY_CHAR_HEIGHT * 3, line);
+
+	/* Frame time histogram: "<2:n <4:n ... >33:n", in milliseconds */
+	static const uint32_t limits[YUTANI_FRAME_BUCKETS] = YUTANI_FRAME_BUCKET_LIMITS;
+	int len = 0;
+	for (int i = 0; i < YUTANI_FRAME_BUCKETS && len < (int)sizeof(line); ++i) {
+		if (i < YUTANI_FRAME_BUCKETS - 1) {
+			len += snprintf(line + len, sizeof(line) - len, "<%u:%u ", limits[i], stats->frame_histogram[i]);
+		} else {
+			len += snprintf(line + len, sizeof(line) - len, ">%u:%u", limits[i-1], stats->frame_histogram[i]);
+		}
+	}
+	debug_overlay_string(yg, x + 4, y + 4 + OVERLAY_CHAR_HEIGHT * 4, line);
+}
+#endif
+
+/**
+ * Add a damage rectangle to the current frame.
+ */
+static void frame_damage_add(yutani_globals_t * yg, int32_t x, int32_t y, int32_t width, int32_t height) {
+	yutani_damage_rect_t * rect = malloc(sizeof(yutani_damage_rect_t));
+	rect->x = x;
+	rect->y = y;
+	rect->width = width;
+	rect->height = height;
+	list_insert(yg->frame_damage, rect);
+	yutani_add_clip(yg, x, y, width, height);
+}
+
 /**
  * Redraw all windows, as well as the mouse cursor.
  *
- * This is the main redraw function.
+ * This is the main redraw function. Returns whether anything
+ * was drawn.
  */
-static void redraw_windows(yutani_globals_t * yg) {
+static int redraw_windows(yutani_globals_t * yg) {
 	int has_updates = 0;
 
 	/* We keep our own temporary mouse coordinates as they may change while we're drawing. */
@@ -974,7 +1459,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 		TRACE("Sending welcome messages...");
 		yutani_msg_buildx_welcome_alloc(response);
 		yutani_msg_buildx_welcome(response, yg->width, yg->height);
-		pex_broadcast(yg->server, response->size, (char *)response);
+		pex_broadcast_coalesce(yg->server, COALESCE_TYPE, response->size, (char *)response);
 		TRACE("Done.");
 
 		spin_unlock(&yg->redraw_lock);
@@ -985,8 +1470,8 @@ static void redraw_windows(yutani_globals_t * yg) {
 	/* If the mouse has moved, that counts as two damage regions */
 	if ((yg->last_mouse_x != tmp_mouse_x) || (yg->last_mouse_y != tmp_mouse_y)) {
 		has_updates = 2;
-		yutani_add_clip(yg, yg->last_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->last_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
-		yutani_add_clip(yg, tmp_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, tmp_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+		frame_damage_add(yg, yg->last_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, yg->last_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
+		frame_damage_add(yg, tmp_mouse_x / MOUSE_SCALE - MOUSE_OFFSET_X, tmp_mouse_y / MOUSE_SCALE - MOUSE_OFFSET_Y, MOUSE_WIDTH, MOUSE_HEIGHT);
 	}
 
 	yg->last_mouse_x = tmp_mouse_x;
@@ -999,6 +1484,14 @@ static void redraw_windows(yutani_globals_t * yg) {
 		if (w && w->anim_mode) mark_window(yg, w);
 	}
 
+	/* Flips are counted after their damage is queued, so everything counted so far is in this frame */
+	if (yg->bottom_z) yg->bottom_z->flips_seen = yg->bottom_z->flips;
+	if (yg->top_z) yg->top_z->flips_seen = yg->top_z->flips;
+	foreach (node, yg->mid_zs) {
+		yutani_server_window_t * w = node->value;
+		if (w) w->flips_seen = w->flips;
+	}
+
 	/* Calculate damage regions from currently queued updates */
 	spin_lock(&yg->update_list_lock);
 	while (yg->update_list->length) {
@@ -1008,11 +1501,18 @@ static void redraw_windows(yutani_globals_t * yg) {
 		/* We add a clip region for each window in the update queue */
 		has_updates = 1;
 		yutani_add_clip(yg, rect->x, rect->y, rect->width, rect->height);
-		free(rect);
-		free(win);
+		list_append(yg->frame_damage, win);
 	}
 	spin_unlock(&yg->update_list_lock);
 
+#if YUTANI_DEBUG_OVERLAY
+	if (has_updates && yg->debug_overlay) {
+		int32_t x, y;
+		debug_overlay_position(yg, &x, &y);
+		frame_damage_add(yg, x, y, OVERLAY_WIDTH, OVERLAY_HEIGHT);
+	}
+#endif
+
 	/* Render */
 	if (has_updates) {
 
@@ -1025,14 +1525,13 @@ static void redraw_windows(yutani_globals_t * yg) {
 
 		yg->windows_to_remove = list_create();
 
-		/*
-		 * In theory, we should restrict this to windows within the clip region,
-		 * but calculating that may be more trouble than it's worth;
-		 * we also need to render windows in stacking order...
-		 */
 		spin_lock(&yg->redraw_lock);
 		yutani_blit_windows(yg);
 
+#if YUTANI_DEBUG_OVERLAY
+		if (yg->debug_overlay) draw_debug_overlay(yg);
+#endif
+
 		/* Send VirtualBox rects */
 		yutani_post_vbox_rects(yg);
 
@@ -1115,6 +1614,11 @@ static void redraw_windows(yutani_globals_t * yg) {
 		}
 		free(yg->windows_to_remove);
 
+		while (yg->frame_damage->length) {
+			node_t * node = list_dequeue(yg->frame_damage);
+			free(node->value);
+			free(node);
+		}
 	}
 
 	if (renderer_pop_state) renderer_pop_state(yg);
@@ -1130,6 +1634,7 @@ static void redraw_windows(yutani_globals_t * yg) {
 		try_load_extensions(yg);
 	}
 
+	return has_updates;
 }
 
 /**
@@ -1139,34 +1644,167 @@ void yutani_clip_init(yutani_globals_t * yg) {
 
 	yg->update_list = list_create();
 	yg->update_list_lock = 0;
+	yg->frame_damage = list_create();
+
+	pipe(yg->wake_pipe);
+	yg->render_idle = 0;
+	yg->frame_callbacks = list_create();
+	yg->frame_callbacks_lock = 0;
+}
+
+static uint64_t render_clock(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+/**
+ * Is there anything for the next frame to do?
+ */
+static int render_has_work(yutani_globals_t * yg) {
+	if (yg->update_list->length) return 1;
+	if (yg->mouse_x != yg->last_mouse_x || yg->mouse_y != yg->last_mouse_y) return 1;
+	if (yg->resize_on_next || yg->screenshot_frame || yg->reload_renderer) return 1;
+
+	/* Animating windows redraw every frame */
+	if (yg->bottom_z && yg->bottom_z->anim_mode) return 1;
+	if (yg->top_z && yg->top_z->anim_mode) return 1;
+	foreach (node, yg->mid_zs) {
+		yutani_server_window_t * w = node->value;
+		if (w && w->anim_mode) return 1;
+	}
+	return 0;
+}
+
+/**
+ * Sleep until there is something to draw.
+ *
+ * We say we're idle before looking for work, and wake_renderer
+ * looks at that after adding work, so one of us always sees the other.
+ */
+static void render_wait(yutani_globals_t * yg) {
+	while (1) {
+		yg->render_idle = 1;
+		__sync_synchronize();
+		if (render_has_work(yg)) break;
+
+		char buf[16];
+		read(yg->wake_pipe[0], buf, sizeof(buf));
+	}
+	yg->render_idle = 0;
+}
+
+static void frame_stats_record(yutani_globals_t * yg, uint64_t elapsed) {
+	static const uint32_t limits[YUTANI_FRAME_BUCKETS] = YUTANI_FRAME_BUCKET_LIMITS;
+	yutani_frame_stats_t * stats = &yg->frame_stats;
+
+	stats->frame_us = elapsed;
+	stats->frames++;
+	if (elapsed > YUTANI_FRAME_INTERVAL) stats->frames_late++;
+
+	int i = 0;
+	while (i < YUTANI_FRAME_BUCKETS - 1 && elapsed >= limits[i] * 1000) i++;
+	stats->frame_histogram[i]++;
+}
+
+static void send_frame_done(yutani_globals_t * yg, yutani_frame_callback_t * callback) {
+	yutani_msg_buildx_frame_done_alloc(response);
+	yutani_msg_buildx_frame_done(response, callback->window->wid, yg->frame_stats.frames, yutani_current_time(yg));
+	pex_send(yg->server, callback->owner, response->size, (char *)response);
+}
+
+static int frame_callback_ready(yutani_frame_callback_t * callback) {
+	return (int32_t)(callback->window->flips_presented - callback->flip) >= 0;
+}
+
+/**
+ * A frame has been presented: tell clients that asked for it that
+ * their window's contents, as of when they asked, are on screen.
+ * Callbacks for windows whose flips haven't been drawn yet wait for
+ * a frame that does draw them.
+ */
+static void send_frame_callbacks(yutani_globals_t * yg) {
+	list_t * presented = list_create();
+
+	spin_lock(&yg->frame_callbacks_lock);
+	if (yg->bottom_z) yg->bottom_z->flips_presented = yg->bottom_z->flips_seen;
+	if (yg->top_z) yg->top_z->flips_presented = yg->top_z->flips_seen;
+	foreach (node, yg->mid_zs) {
+		yutani_server_window_t * w = node->value;
+		if (w) w->flips_presented = w->flips_seen;
+	}
+
+	node_t * node = yg->frame_callbacks->head;
+	while (node) {
+		node_t * next = node->next;
+		if (frame_callback_ready(node->value)) {
+			list_delete(yg->frame_callbacks, node);
+			list_append(presented, node);
+		}
+		node = next;
+	}
+	spin_unlock(&yg->frame_callbacks_lock);
+
+	foreach (node, presented) {
+		send_frame_done(yg, node->value);
+	}
+
+	list_destroy(presented);
+	list_free(presented);
+	free(presented);
+}
+
+/**
+ * Forget the frame callbacks of a window that is going away.
+ */
+static void drop_frame_callbacks(yutani_globals_t * yg, yutani_server_window_t * w) {
+	spin_lock(&yg->frame_callbacks_lock);
+	node_t * node = yg->frame_callbacks->head;
+	while (node) {
+		node_t * next = node->next;
+		yutani_frame_callback_t * callback = node->value;
+		if (callback->window == w) {
+			list_delete(yg->frame_callbacks, node);
+			free(callback);
+			free(node);
+		}
+		node = next;
+	}
+	spin_unlock(&yg->frame_callbacks_lock);
 }
 
 /**
  * Redraw thread.
  *
- * Calls the redraw functions in a loop, with some
- * additional yielding and sleeping.
+ * Sleeps until there is damage, mouse movement, or an animation
+ * running, then draws frames no closer together than
+ * YUTANI_FRAME_INTERVAL. The time a frame took to draw comes out
+ * of the wait for the next one, and a frame that was late is
+ * followed immediately by the next instead of trying to catch up.
  */
 static void * redraw(void * in) {
 
 	sysfunc(TOARU_SYS_FUNC_THREADNAME,(char *[]){"compositor","render thread",NULL});
 
 	yutani_globals_t * yg = in;
+	uint64_t next_frame = 0;
+
 	while (yg->server) {
-		/*
-		 * Perform whatever redraw work is required.
-		 */
-		redraw_windows(yg);
+		render_wait(yg);
 
-		/*
-		 * Attempt to run at about 60fps...
-		 * we should actually see how long it took to render so
-		 * we can sleep *less* if it took a long time to render
-		 * this particular frame. We are definitely not
-		 * going to run at 60fps unless there's nothing to do
-		 * (and even then we've wasted cycles checking).
-		 */
-		usleep(16666);
+		/* After a long idle this is already in the past, and we draw right away. */
+		uint64_t now = render_clock();
+		if (now < next_frame) {
+			usleep(next_frame - now);
+		}
+
+		uint64_t start = render_clock();
+		if (redraw_windows(yg)) {
+			frame_stats_record(yg, render_clock() - start);
+			send_frame_callbacks(yg);
+		}
+
+		next_frame = start + YUTANI_FRAME_INTERVAL;
 	}
 
 	return NULL;
@@ -1231,6 +1869,28 @@ static void mark_window_relative(yutani_globals_t * yg, yutani_server_window_t *
 	spin_lock(&yg->update_list_lock);
 	list_insert(yg->update_list, rect);
 	spin_unlock(&yg->update_list_lock);
+
+	wake_renderer(yg);
+}
+
+/**
+ * Note that a client redrew some rows of a window, so the
+ * opaque spans for those rows need to be rescanned.
+ */
+static void mark_window_contents(yutani_globals_t * yg, yutani_server_window_t * window, int32_t top, int32_t bottom) {
+	top = max(top, 0);
+	bottom = min(bottom, window->height);
+	if (top >= bottom) return;
+
+	spin_lock(&yg->update_list_lock);
+	if (window->opaque_dirty_top >= window->opaque_dirty_bottom) {
+		window->opaque_dirty_top = top;
+		window->opaque_dirty_bottom = bottom;
+	} else {
+		window->opaque_dirty_top = min(window->opaque_dirty_top, top);
+		window->opaque_dirty_bottom = max(window->opaque_dirty_bottom, bottom);
+	}
+	spin_unlock(&yg->update_list_lock);
 }
 
 /**
@@ -1269,6 +1929,9 @@ static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t
 	/* Remove from the wid -> window mapping */
 	hashmap_remove(yg->wids_to_windows, (void *)(uintptr_t)w->wid);
 
+	/* It won't be drawn again, so nobody is getting a frame callback for it */
+	drop_frame_callbacks(yg, w);
+
 	/* Remove from the general list of windows. */
 	list_remove(yg->windows, list_index_of(yg->windows, w));
 
@@ -1299,6 +1962,9 @@ static void window_actually_close(yutani_globals_t * yg, yutani_server_window_t
 		shm_release(key);
 	}
 
+	free(w->opaque);
+	w->opaque = NULL;
+
 	/* Notify subscribers that there are changes to windows */
 	notify_subscribers(yg);
 }
@@ -1342,7 +2008,7 @@ static void notify_subscribers(yutani_globals_t * yg) {
 			}
 			list_insert(remove, node);
 		} else {
-			pex_send(yg->server, subscriber, response->size, (char *)response);
+			pex_send_coalesce(yg->server, subscriber, COALESCE_TYPE, response->size, (char *)response);
 		}
 	}
 	if (remove) {
@@ -1432,7 +2098,7 @@ static void window_tile(yutani_globals_t * yg, yutani_server_window_t * window,
 	window_move(yg, window, _x, _y);
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response, YUTANI_MSG_RESIZE_OFFER, window->wid, w, h, 0, tile);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	pex_send_coalesce(yg->server, window->owner, COALESCE_WINDOW, response->size, (char *)response);
 }
 
 /**
@@ -1443,7 +2109,7 @@ static void window_untile(yutani_globals_t * yg, yutani_server_window_t * window
 
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, window->wid, window->untiled_width, window->untiled_height, 0, 0);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	pex_send_coalesce(yg->server, window->owner, COALESCE_WINDOW, response->size, (char *)response);
 }
 
 /**
@@ -1517,6 +2183,18 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			return;
 		}
 #endif
+#if YUTANI_DEBUG_OVERLAY
+		if ((ke->event.action == KEY_ACTION_DOWN) &&
+			(ke->event.modifiers & KEY_MOD_LEFT_SUPER) &&
+			(ke->event.modifiers & KEY_MOD_LEFT_SHIFT) &&
+			(ke->event.keycode == 'o')) {
+			yg->debug_overlay = (1-yg->debug_overlay);
+			int32_t x, y;
+			debug_overlay_position(yg, &x, &y);
+			mark_screen(yg, x, y, OVERLAY_WIDTH, OVERLAY_HEIGHT);
+			return;
+		}
+#endif
 #if YUTANI_DEBUG_WINDOW_BOUNDS
 		if ((ke->event.action == KEY_ACTION_DOWN) &&
 			(ke->event.modifiers & KEY_MOD_LEFT_SUPER) &&
@@ -1587,11 +2265,13 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			if ((ke->event.modifiers & KEY_MOD_LEFT_CTRL) &&
 				(ke->event.keycode == 's')) {
 				yg->screenshot_frame = YUTANI_SCREENSHOT_FULL;
+				wake_renderer(yg);
 				return;
 			}
 			if ((ke->event.modifiers & KEY_MOD_LEFT_CTRL) &&
 				(ke->event.keycode == 'w')) {
 				yg->screenshot_frame = YUTANI_SCREENSHOT_WINDOW;
+				wake_renderer(yg);
 				return;
 			}
 		}
@@ -1786,6 +2466,8 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 	if (yg->mouse_x > (int)(yg->width) * MOUSE_SCALE) yg->mouse_x = (yg->width) * MOUSE_SCALE;
 	if (yg->mouse_y > (int)(yg->height) * MOUSE_SCALE) yg->mouse_y = (yg->height) * MOUSE_SCALE;
 
+	wake_renderer(yg);
+
 	switch (yg->mouse_state) {
 		case YUTANI_MOUSE_STATE_NORMAL:
 			{
@@ -2037,7 +2719,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 					window_move(yg, yg->resizing_window, x,y);
 					yutani_msg_buildx_window_resize_alloc(response);
 					yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, yg->resizing_window->wid, yg->resizing_w, yg->resizing_h, 0, yg->resizing_window->tiled);
-					pex_send(yg->server, yg->resizing_window->owner, response->size, (char *)response);
+					pex_send_coalesce(yg->server, yg->resizing_window->owner, COALESCE_WINDOW, response->size, (char *)response);
 					yg->resizing_window = NULL;
 					yg->mouse_window = NULL;
 					yg->mouse_state = YUTANI_MOUSE_STATE_NORMAL;
@@ -2051,10 +2733,70 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 }
 
 static yutani_globals_t * _static_yg;
+/**
+ * Benchmark mode.
+ *
+ * Composites a wallpaper and a stack of translucent windows, moving
+ * them and damaging the whole screen every frame, and reports the
+ * frame rate. No clients are involved.
+ */
+static int run_benchmark(yutani_globals_t * yg) {
+	uintptr_t owner = 1; /* Not a real connection; nothing is ever sent to it */
+	hashmap_set(yg->clients_to_windows, (void *)owner, list_create());
+
+	yutani_server_window_t * bg = server_window_create(yg, yg->width, yg->height, owner, 0);
+	bg->anim_mode = 0;
+	for (int y = 0; y < bg->height; ++y) {
+		for (int x = 0; x < bg->width; ++x) {
+			((uint32_t *)bg->buffer)[y * bg->width + x] = rgb(x * 255 / bg->width, y * 255 / bg->height, 128);
+		}
+	}
+	mark_window_contents(yg, bg, 0, bg->height);
+	reorder_window(yg, bg, YUTANI_ZORDER_BOTTOM);
+
+#define BENCH_WINDOWS 8
+	yutani_server_window_t * windows[BENCH_WINDOWS];
+	for (int i = 0; i < BENCH_WINDOWS; ++i) {
+		yutani_server_window_t * w = server_window_create(yg, yg->width / 2, yg->height / 2, owner, 0);
+		w->anim_mode = 0;
+		uint32_t color = premultiply(rgba(40 * i, 255 - 30 * i, 100, 192));
+		for (int p = 0; p < w->width * w->height; ++p) {
+			((uint32_t *)w->buffer)[p] = color;
+		}
+		mark_window_contents(yg, w, 0, w->height);
+		windows[i] = w;
+	}
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	for (int frame = 0; frame < yutani_options.bench_frames; ++frame) {
+		for (int i = 0; i < BENCH_WINDOWS; ++i) {
+			double t = (double)(frame + i * 20) / 60.0;
+			windows[i]->x = (yg->width / 4) + (yg->width / 4) * sin(t + i);
+			windows[i]->y = (yg->height / 4) + (yg->height / 4) * cos(t * 1.3 + i);
+		}
+		mark_screen(yg, 0, 0, yg->width, yg->height);
+		redraw_windows(yg);
+	}
+
+	gettimeofday(&end, NULL);
+	uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+	if (!elapsed) elapsed = 1;
+
+	fprintf(stdout, "%d frames at %dx%d in %llu ms: %.1f fps (%d threads)\n",
+		yutani_options.bench_frames, yg->width, yg->height,
+		(unsigned long long)(elapsed / 1000),
+		(double)yutani_options.bench_frames * 1000000.0 / (double)elapsed,
+		render_pool.threads);
+	return 0;
+}
+
 static void yutani_display_resize_handle(int signum) {
 	(void)signum;
 	TRACE("Display change request, one moment.");
 	_static_yg->resize_on_next = 1;
+	wake_renderer(_static_yg);
 	signal(SIGWINEVENT, yutani_display_resize_handle);
 }
 
@@ -2203,6 +2945,11 @@ int main(int argc, char * argv[]) {
 	try_load_extensions(yg);
 
 	yutani_clip_init(yg);
+	render_pool_init(yg);
+
+	if (yutani_options.bench_frames) {
+		return run_benchmark(yg);
+	}
 
 	pthread_t render_thread;
 
@@ -2288,6 +3035,7 @@ int main(int argc, char * argv[]) {
 								TRACE("Resize request from host compositor for size %dx%d", wr->width, wr->height);
 								yutani_window_resize_accept(yg->host_context, yg->host_window, wr->width, wr->height);
 								yg->resize_on_next = 1;
+								wake_renderer(yg);
 							}
 							break;
 						case YUTANI_MSG_WINDOW_CLOSE:
@@ -2422,7 +3170,9 @@ int main(int argc, char * argv[]) {
 					struct yutani_msg_flip * wf = (void *)m->data;
 					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)(uintptr_t)wf->wid);
 					if (w) {
+						mark_window_contents(yg, w, 0, w->height);
 						mark_window(yg, w);
+						__sync_fetch_and_add(&w->flips, 1);
 					}
 				}
 				break;
@@ -2431,7 +3181,30 @@ int main(int argc, char * argv[]) {
 					struct yutani_msg_flip_region * wf = (void *)m->data;
 					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)(uintptr_t)wf->wid);
 					if (w) {
+						mark_window_contents(yg, w, wf->y, wf->y + wf->height);
 						mark_window_relative(yg, w, wf->x, wf->y, wf->width, wf->height);
+						__sync_fetch_and_add(&w->flips, 1);
+					}
+				}
+				break;
+			case YUTANI_MSG_FRAME_CALLBACK:
+				{
+					struct yutani_msg_frame_callback * fc = (void *)m->data;
+					yutani_server_window_t * w = hashmap_get(yg->wids_to_windows, (void *)(uintptr_t)fc->wid);
+					if (w) {
+						yutani_frame_callback_t * callback = malloc(sizeof(yutani_frame_callback_t));
+						callback->window = w;
+						callback->owner = p->source;
+						callback->flip = w->flips;
+						spin_lock(&yg->frame_callbacks_lock);
+						int ready = frame_callback_ready(callback);
+						if (!ready) list_insert(yg->frame_callbacks, callback);
+						spin_unlock(&yg->frame_callbacks_lock);
+						/* Everything it flipped is already on screen */
+						if (ready) {
+							send_frame_done(yg, callback);
+							free(callback);
+						}
 					}
 				}
 				break;
@@ -2491,7 +3264,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						pex_send_coalesce(server, p->source, COALESCE_WINDOW, response->size, (char *)response);
 					}
 				}
 				break;
@@ -2502,7 +3275,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						pex_send_coalesce(server, p->source, COALESCE_WINDOW, response->size, (char *)response);
 					}
 				}
 				break;
@@ -2704,6 +3477,7 @@ int main(int argc, char * argv[]) {
 						case YUTANI_SPECIAL_REQUEST_RELOAD:
 							{
 								yg->reload_renderer = 1;
+								wake_renderer(yg);
 							}
 							break;
 						default:
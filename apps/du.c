@@ -70,7 +70,12 @@ static uint64_t count_directory(char * source) {
 		}
 		char tmp[strlen(source)+strlen(ent->d_name)+2];
 		sprintf(tmp, "%s/%s", source, ent->d_name);
-		total += count_thing(tmp);
+		if (ent->d_type == DT_DIR) {
+			/* No need to stat directories, we only count their contents */
+			total += count_directory(tmp);
+		} else {
+			total += count_thing(tmp);
+		}
 		ent = readdir(dirp);
 	}
 	closedir(dirp);
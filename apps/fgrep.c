@@ -3,43 +3,622 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2014-2018 K. Lange
  *
- * fgrep - dump grep
+ * fgrep - find fixed strings in files
  *
  * Locates strings in files and prints the lines containing them,
  * with extra color identification if stdout is a tty.
+ *
+ * Files are read in large blocks and searched a block at a time
+ * rather than line by line, so lines can be any length. With one
+ * pattern, we look for its rarest byte with SIMD compares and check
+ * the rest with memcmp; with several, an Aho-Corasick automaton
+ * runs over the text, skipping ahead to bytes that can start a
+ * match whenever it is back at the root.
+ *
+ * With -r, the files found are searched by a pool of threads and
+ * the results are printed in the order the files were found.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
-#define LINE_SIZE 4096
+#ifndef NO_SSE
+#include <emmintrin.h>
+#endif
 
-int main(int argc, char ** argv) {
-	if (argc < 2) {
-		fprintf(stderr, "usage: %s thing-to-grep-for\n", argv[0]);
-		return 1;
-	}
-
-	char * needle = argv[1];
-	char buf[LINE_SIZE];
-	int ret = 1;
-	int is_tty = isatty(STDOUT_FILENO);
-
-	while (fgets(buf, LINE_SIZE, stdin)) {
-		char * found = strstr(buf, needle);
-		if (found) {
-			if (is_tty) {
-				*found = '\0';
-				found += strlen(needle);
-				fprintf(stdout, "%s\033[1;31m%s\033[0m%s", buf, needle, found);
+#define BLOCK_SIZE  (256 * 1024)
+#define FLUSH_SIZE  (64 * 1024)
+#define MAX_THREADS 8
+
+/* Output for one file, flushed as we go unless another thread is printing. */
+struct output {
+	char * data;
+	size_t len;
+	size_t size;
+	int buffered;
+};
+
+/* One input file; with -r these are filled in by workers and printed by the main thread. */
+struct job {
+	char * name;
+	struct output out;
+	int matched;
+	int error;
+	volatile int done;
+};
+
+static char ** patterns = NULL;
+static size_t * pattern_lengths = NULL;
+static int pattern_count = 0;
+static int match_all = 0;
+
+/* Single-pattern search: the rarest byte of the pattern and its offset */
+static unsigned char rare_byte;
+static size_t rare_offset;
+
+/* Multi-pattern search: DFA transitions, and the length of a pattern ending in each state */
+static int * ac_next = NULL;
+static size_t * ac_match = NULL;
+static unsigned char ac_first[256];
+static unsigned char ac_first_bytes[3];
+static int ac_first_count = 0;
+
+static int opt_count = 0;
+static int opt_list = 0;
+static int opt_number = 0;
+static int opt_recursive = 0;
+static int opt_stats = 0;
+static int with_names = 0;
+static int is_tty = 0;
+
+static volatile size_t bytes_scanned = 0;
+static char * argv0;
+
+/* Rough frequency of bytes in text and logs, higher is more common */
+static int byte_frequency(unsigned char c) {
+	if (strchr(" etaoin", c) && c) return 6;
+	if (c >= 'a' && c <= 'z') return 5;
+	if (c >= '0' && c <= '9') return 4;
+	if (c && strchr("\t.,-/:_=", c)) return 3;
+	if (c >= 'A' && c <= 'Z') return 2;
+	if (c >= 0x20 && c < 0x7F) return 1;
+	return 0;
+}
+
+static const char * find_byte(const char * p, const char * end, unsigned char c) {
+#ifndef NO_SSE
+	__m128i needle = _mm_set1_epi8(c);
+	while (end - p >= 16) {
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), needle));
+		if (mask) return p + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	return p < end ? memchr(p, c, end - p) : NULL;
+}
+
+/* Find the next byte that can start a match, for the automaton's root state. */
+static const char * find_first(const char * p, const char * end) {
+#ifndef NO_SSE
+	if (ac_first_count) {
+		__m128i a = _mm_set1_epi8(ac_first_bytes[0]);
+		__m128i b = _mm_set1_epi8(ac_first_bytes[ac_first_count > 1 ? 1 : 0]);
+		__m128i c = _mm_set1_epi8(ac_first_bytes[ac_first_count > 2 ? 2 : 0]);
+		while (end - p >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			__m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)), _mm_cmpeq_epi8(v, c));
+			int mask = _mm_movemask_epi8(eq);
+			if (mask) return p + __builtin_ctz(mask);
+			p += 16;
+		}
+	}
+#endif
+	while (p < end && !ac_first[(unsigned char)*p]) p++;
+	return p < end ? p : NULL;
+}
+
+static size_t count_newlines(const char * p, const char * end) {
+	size_t count = 0;
+#ifndef NO_SSE
+	__m128i nl = _mm_set1_epi8('\n');
+	while (end - p >= 16) {
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl)));
+		p += 16;
+	}
+#endif
+	for (; p < end; ++p) {
+		if (*p == '\n') count++;
+	}
+	return count;
+}
+
+/*
+ * Find the first match in [p, end). Returns where it starts and sets
+ * its length, or returns NULL.
+ */
+static const char * search(const char * p, const char * end, size_t * len) {
+	if (match_all) {
+		*len = 0;
+		return p;
+	}
+
+	if (pattern_count == 1) {
+		size_t plen = pattern_lengths[0];
+		if ((size_t)(end - p) < plen) return NULL;
+		const char * last = end - plen + rare_offset + 1;
+		for (p += rare_offset; p < last; ++p) {
+			p = find_byte(p, last, rare_byte);
+			if (!p) return NULL;
+			if (!memcmp(p - rare_offset, patterns[0], plen)) {
+				*len = plen;
+				return p - rare_offset;
+			}
+		}
+		return NULL;
+	}
+
+	int state = 0;
+	while (p < end) {
+		if (!state) {
+			p = find_first(p, end);
+			if (!p) return NULL;
+		}
+		state = ac_next[state * 256 + (unsigned char)*p++];
+		if (ac_match[state]) {
+			*len = ac_match[state];
+			return p - *len;
+		}
+	}
+	return NULL;
+}
+
+static void prepare_single(void) {
+	size_t len = pattern_lengths[0];
+	rare_offset = len - 1;
+	for (size_t i = 0; i < len; ++i) {
+		if (byte_frequency(patterns[0][i]) < byte_frequency(patterns[0][rare_offset])) rare_offset = i;
+	}
+	rare_byte = patterns[0][rare_offset];
+}
+
+/* Build the Aho-Corasick automaton, with failure links folded into a full transition table. */
+static void prepare_automaton(void) {
+	size_t total = 1;
+	for (int i = 0; i < pattern_count; ++i) total += pattern_lengths[i];
+
+	ac_next = calloc(total * 256, sizeof(int));
+	ac_match = calloc(total, sizeof(size_t));
+	int * fail = calloc(total, sizeof(int));
+	int * queue = malloc(sizeof(int) * total);
+	int states = 1;
+
+	for (int i = 0; i < pattern_count; ++i) {
+		int state = 0;
+		for (size_t j = 0; j < pattern_lengths[i]; ++j) {
+			unsigned char c = patterns[i][j];
+			if (!ac_next[state * 256 + c]) ac_next[state * 256 + c] = states++;
+			state = ac_next[state * 256 + c];
+		}
+		if (!ac_match[state] || ac_match[state] > pattern_lengths[i]) ac_match[state] = pattern_lengths[i];
+		ac_first[(unsigned char)patterns[i][0]] = 1;
+	}
+
+	/* Breadth first, so a state's failure target is finished before it is. */
+	int head = 0, tail = 0;
+	for (int c = 0; c < 256; ++c) {
+		if (ac_next[c]) queue[tail++] = ac_next[c];
+	}
+	while (head < tail) {
+		int state = queue[head++];
+		if (!ac_match[state]) ac_match[state] = ac_match[fail[state]];
+		for (int c = 0; c < 256; ++c) {
+			int next = ac_next[state * 256 + c];
+			if (next) {
+				fail[next] = ac_next[fail[state] * 256 + c];
+				queue[tail++] = next;
 			} else {
-				fprintf(stdout, "%s", buf);
+				ac_next[state * 256 + c] = ac_next[fail[state] * 256 + c];
+			}
+		}
+	}
+
+	for (int c = 0; c < 256; ++c) {
+		if (!ac_first[c]) continue;
+		if (ac_first_count < 3) ac_first_bytes[ac_first_count] = c;
+		ac_first_count++;
+	}
+	if (ac_first_count > 3) ac_first_count = 0;
+
+	free(fail);
+	free(queue);
+}
+
+static void output_write(struct output * out, const char * data, size_t len) {
+	if (out->len + len > out->size) {
+		while (out->len + len > out->size) out->size = out->size ? out->size * 2 : FLUSH_SIZE;
+		out->data = realloc(out->data, out->size);
+	}
+	memcpy(out->data + out->len, data, len);
+	out->len += len;
+}
+
+static void output_str(struct output * out, const char * str) {
+	output_write(out, str, strlen(str));
+}
+
+static void output_flush(struct output * out) {
+	if (out->len) fwrite(out->data, 1, out->len, stdout);
+	out->len = 0;
+}
+
+static void output_line(struct output * out, const char * name, size_t line_no, const char * line, const char * end) {
+	if (with_names) {
+		output_str(out, name);
+		output_str(out, ":");
+	}
+	if (opt_number) {
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%zu:", line_no);
+		output_str(out, tmp);
+	}
+
+	if (is_tty && !match_all) {
+		size_t len;
+		const char * m;
+		while ((m = search(line, end, &len))) {
+			output_write(out, line, m - line);
+			output_str(out, "\033[1;31m");
+			output_write(out, m, len);
+			output_str(out, "\033[0m");
+			line = m + len;
+		}
+	}
+
+	output_write(out, line, end - line);
+	output_str(out, "\n");
+}
+
+/*
+ * Search the complete lines in [p, end); line_no is the number of
+ * the first of them and is advanced past the last.
+ * Returns 1 if we can stop reading this file.
+ */
+static int grep_lines(struct job * job, const char * p, const char * end, size_t * line_no) {
+	const char * counted = p;
+
+	while (p < end) {
+		size_t len;
+		const char * m = search(p, end, &len);
+		if (!m) break;
+
+		const char * line = m;
+		while (line > p && line[-1] != '\n') line--;
+		const char * line_end = memchr(m + len, '\n', end - (m + len));
+		if (!line_end) line_end = end;
+
+		job->matched++;
+		if (opt_list) return 1;
+
+		if (opt_number) {
+			*line_no += count_newlines(counted, line);
+			counted = line;
+		}
+
+		if (!opt_count) {
+			output_line(&job->out, job->name, *line_no, line, line_end);
+			if (!job->out.buffered && job->out.len > FLUSH_SIZE) output_flush(&job->out);
+		}
+
+		p = line_end + 1;
+	}
+
+	if (opt_number) *line_no += count_newlines(counted, end);
+	return 0;
+}
+
+static void grep_fd(struct job * job, int fd) {
+	size_t size = BLOCK_SIZE * 2;
+	size_t len = 0;
+	size_t line_no = 1;
+	char * buf = malloc(size);
+
+	while (1) {
+		if (size - len < BLOCK_SIZE) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+
+		ssize_t r = read(fd, buf + len, size - len);
+		if (r < 0) {
+			fprintf(stderr, "%s: %s: %s\n", argv0, job->name, strerror(errno));
+			job->error = 1;
+			break;
+		}
+		__sync_fetch_and_add(&bytes_scanned, r);
+
+		if (r == 0) {
+			/* Whatever is left is a last line without a newline */
+			if (len) grep_lines(job, buf, buf + len, &line_no);
+			break;
+		}
+		len += r;
+
+		char * last = memrchr(buf, '\n', len);
+		if (!last) continue;
+
+		size_t complete = last - buf + 1;
+		if (grep_lines(job, buf, last, &line_no)) break;
+		line_no++;
+		memmove(buf, buf + complete, len - complete);
+		len -= complete;
+	}
+
+	free(buf);
+
+	if (opt_list && job->matched) {
+		output_str(&job->out, job->name);
+		output_str(&job->out, "\n");
+	} else if (opt_count) {
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "%d\n", job->matched);
+		if (with_names) {
+			output_str(&job->out, job->name);
+			output_str(&job->out, ":");
+		}
+		output_str(&job->out, tmp);
+	}
+}
+
+static void grep_file(struct job * job) {
+	if (!strcmp(job->name, "-")) {
+		grep_fd(job, STDIN_FILENO);
+		return;
+	}
+
+	int fd = open(job->name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, job->name, strerror(errno));
+		job->error = 1;
+		return;
+	}
+
+	struct stat st;
+	if (!fstat(fd, &st) && S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s: %s: Is a directory\n", argv0, job->name);
+		job->error = 1;
+		close(fd);
+		return;
+	}
+
+	grep_fd(job, fd);
+	close(fd);
+}
+
+static struct job * jobs = NULL;
+static size_t job_count = 0;
+static size_t job_size = 0;
+static volatile size_t next_job = 0;
+static volatile int main_waiting = 0;
+static int done_pipe[2]; /* The first worker to finish a job while we wait writes a byte here */
+
+static void add_job(const char * name) {
+	if (job_count == job_size) {
+		job_size = job_size ? job_size * 2 : 64;
+		jobs = realloc(jobs, sizeof(struct job) * job_size);
+	}
+	memset(&jobs[job_count], 0, sizeof(struct job));
+	jobs[job_count].name = strdup(name);
+	job_count++;
+}
+
+/* Add the regular files under a directory; symlinks inside it aren't followed. */
+static void walk(const char * path) {
+	DIR * dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "%s: %s: %s\n", argv0, path, strerror(errno));
+		return;
+	}
+
+	struct dirent * ent;
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+		char * child = malloc(strlen(path) + strlen(ent->d_name) + 2);
+		sprintf(child, "%s%s%s", path, path[strlen(path)-1] == '/' ? "" : "/", ent->d_name);
+
+		struct stat st;
+		if (!lstat(child, &st)) {
+			if (S_ISDIR(st.st_mode)) {
+				walk(child);
+			} else if (S_ISREG(st.st_mode)) {
+				add_job(child);
 			}
-			ret = 0;
 		}
+		free(child);
+	}
+
+	closedir(dir);
+}
+
+static void * worker(void * arg) {
+	(void)arg;
+	while (1) {
+		size_t i = __sync_fetch_and_add(&next_job, 1);
+		if (i >= job_count) break;
+		jobs[i].out.buffered = 1;
+		grep_file(&jobs[i]);
+		__sync_synchronize();
+		jobs[i].done = 1;
+		__sync_synchronize();
+		if (__sync_lock_test_and_set(&main_waiting, 0)) {
+			char c = 0;
+			write(done_pipe[1], &c, 1);
+		}
+	}
+	return NULL;
+}
+
+static void add_pattern(char * arg) {
+	/* Like grep, a pattern with newlines in it is several patterns. */
+	char * save;
+	char * copy = strdup(arg);
+	if (!*copy) match_all = 1;
+	for (char * p = strtok_r(copy, "\n", &save); p; p = strtok_r(NULL, "\n", &save)) {
+		patterns = realloc(patterns, sizeof(char *) * (pattern_count + 1));
+		pattern_lengths = realloc(pattern_lengths, sizeof(size_t) * (pattern_count + 1));
+		patterns[pattern_count] = p;
+		pattern_lengths[pattern_count] = strlen(p);
+		pattern_count++;
 	}
+}
 
-	return ret;
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-clnr] [-e PATTERN]... [PATTERN] [FILE]...\n"
+			"\n"
+			" -e     \033[3msearch for PATTERN; may be given more than once\033[0m\n"
+			" -c     \033[3mprint only a count of matching lines per file\033[0m\n"
+			" -l     \033[3mprint only the names of files with matches\033[0m\n"
+			" -n     \033[3mprefix lines with their line numbers\033[0m\n"
+			" -r     \033[3msearch directories recursively\033[0m\n"
+			" --stats\033[3m print throughput to stderr when done\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 2;
 }
 
+int main(int argc, char ** argv) {
+	static struct option long_opts[] = {
+		{"stats", no_argument, 0, 'S'},
+		{"help",  no_argument, 0, '?'},
+		{0,0,0,0}
+	};
+
+	argv0 = argv[0];
+
+	int opt, index;
+	while ((opt = getopt_long(argc, argv, "?e:clnr", long_opts, &index)) != -1) {
+		switch (opt) {
+			case 'e':
+				add_pattern(optarg);
+				break;
+			case 'c':
+				opt_count = 1;
+				break;
+			case 'l':
+				opt_list = 1;
+				break;
+			case 'n':
+				opt_number = 1;
+				break;
+			case 'r':
+				opt_recursive = 1;
+				break;
+			case 'S':
+				opt_stats = 1;
+				break;
+			default:
+				return usage(argv);
+		}
+	}
+
+	if (!pattern_count && !match_all) {
+		if (optind == argc) return usage(argv);
+		add_pattern(argv[optind++]);
+	}
+
+	if (!match_all) {
+		if (pattern_count == 1) prepare_single();
+		else prepare_automaton();
+	}
+
+	is_tty = isatty(STDOUT_FILENO) && !opt_count && !opt_list;
+
+	if (optind == argc) {
+		add_job(opt_recursive ? "." : "-");
+	} else {
+		for (int i = optind; i < argc; ++i) {
+			struct stat st;
+			if (opt_recursive && !stat(argv[i], &st) && S_ISDIR(st.st_mode)) {
+				walk(argv[i]);
+			} else {
+				add_job(argv[i]);
+			}
+		}
+	}
+
+	with_names = opt_recursive || argc - optind > 1;
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+	if ((size_t)threads > job_count) threads = job_count;
+
+	int matched = 0;
+	int error = 0;
+
+	if (threads < 2) {
+		for (size_t i = 0; i < job_count; ++i) {
+			grep_file(&jobs[i]);
+			output_flush(&jobs[i].out);
+			matched |= !!jobs[i].matched;
+			error |= jobs[i].error;
+		}
+	} else {
+		pthread_t workers[MAX_THREADS];
+		pipe(done_pipe);
+		for (int i = 0; i < threads; ++i) {
+			pthread_create(&workers[i], NULL, worker, NULL);
+		}
+		/* Print each file's results as soon as it and everything before it is done */
+		for (size_t i = 0; i < job_count; ++i) {
+			while (!jobs[i].done) {
+				/*
+				 * Say we're waiting before looking again, so whoever finishes
+				 * a job next sees it. If a worker took the flag anyway, its
+				 * byte is on the way; read it so the pipe never fills up.
+				 */
+				main_waiting = 1;
+				__sync_synchronize();
+				if (!jobs[i].done || !__sync_lock_test_and_set(&main_waiting, 0)) {
+					char c;
+					read(done_pipe[0], &c, 1);
+				}
+			}
+			output_flush(&jobs[i].out);
+			matched |= !!jobs[i].matched;
+			error |= jobs[i].error;
+		}
+		for (int i = 0; i < threads; ++i) {
+			pthread_join(workers[i], NULL);
+		}
+		close(done_pipe[0]);
+		close(done_pipe[1]);
+	}
+
+	fflush(stdout);
+	gettimeofday(&end, NULL);
+
+	if (opt_stats) {
+		uint64_t elapsed = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_usec - start.tv_usec);
+		if (!elapsed) elapsed = 1;
+		fprintf(stderr, "%zu files, %zu bytes in %llu.%03llu ms, %.1f MB/s\n",
+			job_count, (size_t)bytes_scanned,
+			(unsigned long long)(elapsed / 1000), (unsigned long long)(elapsed % 1000),
+			(double)bytes_scanned / (double)elapsed * 1000000.0 / (1024.0 * 1024.0));
+	}
+
+	if (error) return 2;
+	return matched ? 0 : 1;
+}
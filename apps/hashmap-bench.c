@@ -0,0 +1,201 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * hashmap-bench - compare libtoaru's hashmap with the old chained one
+ *
+ * The old implementation (a fixed number of buckets chosen at
+ * creation, a malloc'd entry per key, and the sdbm string hash)
+ * is kept here as a baseline. Both are created with 10 buckets,
+ * which is what nearly every caller asks for.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <toaru/hashmap.h>
+
+#include "bench.h"
+
+struct chained_entry {
+	char * key;
+	void * value;
+	struct chained_entry * next;
+};
+
+struct chained {
+	int string_keys;
+	size_t size;
+	struct chained_entry ** entries;
+};
+
+static unsigned int sdbm_hash(const char * key) {
+	unsigned int hash = 0;
+	int c;
+	while ((c = *key++)) {
+		hash = c + (hash << 6) + (hash << 16) - hash;
+	}
+	return hash;
+}
+
+static unsigned int chained_hash(struct chained * map, void * key) {
+	return (map->string_keys ? sdbm_hash(key) : (uintptr_t)key) % map->size;
+}
+
+static int chained_comp(struct chained * map, void * a, void * b) {
+	return map->string_keys ? !strcmp(a, b) : a == b;
+}
+
+static struct chained * chained_create(int size, int string_keys) {
+	struct chained * map = malloc(sizeof(struct chained));
+	map->string_keys = string_keys;
+	map->size = size;
+	map->entries = calloc(size, sizeof(struct chained_entry *));
+	return map;
+}
+
+static void chained_set(struct chained * map, void * key, void * value) {
+	struct chained_entry ** x = &map->entries[chained_hash(map, key)];
+	for (; *x; x = &(*x)->next) {
+		if (chained_comp(map, (*x)->key, key)) {
+			(*x)->value = value;
+			return;
+		}
+	}
+	*x = malloc(sizeof(struct chained_entry));
+	(*x)->key = map->string_keys ? strdup(key) : key;
+	(*x)->value = value;
+	(*x)->next = NULL;
+}
+
+static void * chained_get(struct chained * map, void * key) {
+	for (struct chained_entry * x = map->entries[chained_hash(map, key)]; x; x = x->next) {
+		if (chained_comp(map, x->key, key)) return x->value;
+	}
+	return NULL;
+}
+
+static void chained_remove(struct chained * map, void * key) {
+	struct chained_entry ** x = &map->entries[chained_hash(map, key)];
+	for (; *x; x = &(*x)->next) {
+		if (chained_comp(map, (*x)->key, key)) {
+			struct chained_entry * e = *x;
+			*x = e->next;
+			if (map->string_keys) free(e->key);
+			free(e);
+			return;
+		}
+	}
+}
+
+static void chained_free(struct chained * map) {
+	for (size_t i = 0; i < map->size; ++i) {
+		while (map->entries[i]) {
+			struct chained_entry * e = map->entries[i];
+			map->entries[i] = e->next;
+			if (map->string_keys) free(e->key);
+			free(e);
+		}
+	}
+	free(map->entries);
+	free(map);
+}
+
+static int count = 10000;
+static char ** names;
+
+static void * key_for(int string_keys, int i) {
+	return string_keys ? (void *)names[i] : (void *)(uintptr_t)(i * 8 + 8);
+}
+
+static void report(const char * name, const char * op, uint64_t elapsed) {
+	fprintf(stdout, "%-8s %-8s %8llu us  %8.1f ns/op\n", name, op,
+		(unsigned long long)elapsed, (double)elapsed * 1000.0 / (double)count);
+}
+
+static void bench_new(int string_keys) {
+	const char * name = string_keys ? "strings" : "ints";
+	hashmap_t * map = string_keys ? hashmap_create(10) : hashmap_create_int(10);
+	volatile uintptr_t sink = 0;
+
+	uint64_t start = now_us();
+	for (int i = 0; i < count; ++i) hashmap_set(map, key_for(string_keys, i), (void *)(uintptr_t)i);
+	report(name, "insert", now_us() - start);
+
+	start = now_us();
+	for (int i = 0; i < count; ++i) sink += (uintptr_t)hashmap_get(map, key_for(string_keys, i));
+	report(name, "lookup", now_us() - start);
+
+	start = now_us();
+	for (int i = 0; i < count; ++i) hashmap_remove(map, key_for(string_keys, i));
+	report(name, "remove", now_us() - start);
+
+	hashmap_free(map);
+	free(map);
+}
+
+static void bench_old(int string_keys) {
+	const char * name = string_keys ? "strings" : "ints";
+	struct chained * map = chained_create(10, string_keys);
+	volatile uintptr_t sink = 0;
+
+	uint64_t start = now_us();
+	for (int i = 0; i < count; ++i) chained_set(map, key_for(string_keys, i), (void *)(uintptr_t)i);
+	report(name, "insert", now_us() - start);
+
+	start = now_us();
+	for (int i = 0; i < count; ++i) sink += (uintptr_t)chained_get(map, key_for(string_keys, i));
+	report(name, "lookup", now_us() - start);
+
+	start = now_us();
+	for (int i = 0; i < count; ++i) chained_remove(map, key_for(string_keys, i));
+	report(name, "remove", now_us() - start);
+
+	chained_free(map);
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-n COUNT]\n"
+			"\n"
+			" -n     \033[3mnumber of keys (default 10000)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "?n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	if (count < 1) return usage(argv);
+
+	names = malloc(sizeof(char *) * count);
+	for (int i = 0; i < count; ++i) {
+		char tmp[32];
+		snprintf(tmp, sizeof(tmp), "/usr/lib/symbol_%d", i);
+		names[i] = strdup(tmp);
+	}
+
+	fprintf(stdout, "%d keys, chained (old):\n", count);
+	bench_old(0);
+	bench_old(1);
+
+	fprintf(stdout, "%d keys, open addressing:\n", count);
+	bench_new(0);
+	bench_new(1);
+
+	return 0;
+}
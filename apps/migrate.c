@@ -24,6 +24,7 @@
 
 #include <toaru/trace.h>
 #include <toaru/hashmap.h>
+#include <toaru/tar.h>
 #define TRACE_APP_NAME "migrate"
 
 #define TRACE_(...) do { \
@@ -136,6 +137,31 @@ void copy_directory(char * source, char * dest, int mode, int uid, int gid) {
 	chown(dest, uid, gid);
 }
 
+static void extract_progress(const char * name, void * priv) {
+	(void)priv;
+	TRACE_("Extracting %s...", name);
+}
+
+/**
+ * A tar root can be unpacked straight from the ramdisk, which is
+ * much quicker than mounting it and copying each file through tarfs.
+ */
+int extract_root(char * root) {
+	char * path = strdup(root);
+	char * c = strchr(path, ',');
+	if (c) *c = '\0';
+
+	struct tar_options opts = {0};
+	opts.progname = "migrate";
+	opts.directory = "";
+	opts.flags = TAR_SAME_OWNER;
+	opts.progress = extract_progress;
+
+	int status = tar_extract_file(path, &opts);
+	free(path);
+	return status;
+}
+
 void free_ramdisk(char * path) {
 	int fd = open(path, O_RDONLY);
 	ioctl(fd, 0x4001, NULL);
@@ -222,16 +248,27 @@ int main(int argc, char * argv[]) {
 
 	char tmp[1024];
 
-	TRACE_("Remounting root to /dev/base");
-	sprintf(tmp, "mount %s %s /dev/base", root_type, root);
-	system(tmp);
+	if (!strcmp(root_type, "tar")) {
+		/* The current root is a tarfs on this same ramdisk, so it stays readable until we're done */
+		TRACE_("Mounting tmpfs to /");
+		system("mount tmpfs x,755 /");
 
-	TRACE_("Mounting tmpfs to /");
-	system("mount tmpfs x,755 /");
+		TRACE_("Extracting root...");
+		if (extract_root(root)) {
+			TRACE_("Extraction failed; root may be incomplete");
+		}
+	} else {
+		TRACE_("Remounting root to /dev/base");
+		sprintf(tmp, "mount %s %s /dev/base", root_type, root);
+		system(tmp);
 
-	TRACE_("Migrating root...");
-	copy_directory("/dev/base","/",0660,0,0);
-	system("mount tmpfs x,755 /dev/base");
+		TRACE_("Mounting tmpfs to /");
+		system("mount tmpfs x,755 /");
+
+		TRACE_("Migrating root...");
+		copy_directory("/dev/base","/",0660,0,0);
+		system("mount tmpfs x,755 /dev/base");
+	}
 
 	if (strstr(root, "/dev/ram") != NULL) {
 		char * tmp = strdup(root);
@@ -21,6 +21,7 @@
 #include <toaru/confreader.h>
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
+#include <toaru/tar.h>
 
 #define MSK_VERSION "1.0.0"
 #define VAR_PATH "/var/msk"
@@ -289,6 +290,25 @@ static int process_package(list_t * pkgs, char * name) {
 	return 0;
 }
 
+/**
+ * Unpack a tar or tgz package in-process; compression is detected
+ * by libtoaru_tar, which also checks the gzip CRC.
+ */
+static int extract_package(char * pkg) {
+	struct tar_options opts = {0};
+	opts.progname = "msk";
+	opts.directory = confreader_get(msk_manifest, pkg, "destination");
+	opts.flags = TAR_SAME_OWNER;
+
+	int status = tar_extract_file(confreader_get(msk_manifest, pkg, "source"), &opts);
+	if (status) {
+		fprintf(stderr, "extraction of '%s' failed\n", pkg);
+	} else if (verbose) {
+		fprintf(stderr, "  - %zu files, %zu bytes\n", opts.files, opts.bytes);
+	}
+	return status;
+}
+
 static int install_package(char * pkg) {
 
 	char * type = confreader_getd(msk_manifest, pkg, "type", "");
@@ -340,14 +360,8 @@ static int install_package(char * pkg) {
 					confreader_get(msk_manifest, pkg, "destination"));
 		}
 
-		char cmd[1024];
-		sprintf(cmd, "cd %s; tar -xf %s",
-				confreader_get(msk_manifest, pkg, "destination"),
-				confreader_get(msk_manifest, pkg, "source"));
-
 		int status;
-		if ((status = system(cmd))) {
-			fprintf(stderr, "installation command returned %d\n", status);
+		if ((status = extract_package(pkg))) {
 			return status;
 		}
 
@@ -360,14 +374,8 @@ static int install_package(char * pkg) {
 					confreader_get(msk_manifest, pkg, "destination"));
 		}
 
-		char cmd[1024];
-		sprintf(cmd, "cd %s; tar -xzf %s",
-				confreader_get(msk_manifest, pkg, "destination"),
-				confreader_get(msk_manifest, pkg, "source"));
-
 		int status;
-		if ((status = system(cmd))) {
-			fprintf(stderr, "installation command returned %d\n", status);
+		if ((status = extract_package(pkg))) {
 			return status;
 		}
 
@@ -0,0 +1,192 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * pex-bench - measure packet exchange latency and throughput
+ *
+ * Binds a private pex endpoint, forks a client that connects to it,
+ * and times ping-pong round trips and one-way streams in both
+ * directions. Run with -r to force the kernel-copy path so the
+ * shared-memory rings can be compared against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include <toaru/pex.h>
+
+#include "bench.h"
+
+/* Server-to-client messages are sent in windows so neither transport has to drop anything. */
+#define WINDOW 32
+
+static int count = 10000;
+static size_t size = 64;
+
+static void report(const char * name, uint64_t elapsed) {
+	if (!elapsed) elapsed = 1;
+	double secs = (double)elapsed / 1000000.0;
+	fprintf(stdout, "%-12s %8d msgs in " BENCH_MILLIS "  %10.0f msgs/s  %8.2f MB/s\n",
+		name, count, BENCH_MILLIS_ARGS(elapsed),
+		(double)count / secs, (double)count * size / secs / (1024.0 * 1024.0));
+}
+
+static int run_client(char * name) {
+	FILE * server = pex_connect(name);
+	if (!server) {
+		fprintf(stderr, "pex-bench: client could not connect to %s\n", name);
+		return 1;
+	}
+
+	char * buf = malloc(MAX_PACKET_SIZE);
+	memset(buf, 0, MAX_PACKET_SIZE);
+
+	/* Round trips */
+	buf[0] = 'p';
+	uint64_t start = now_us();
+	for (int i = 0; i < count; ++i) {
+		pex_reply(server, size, buf);
+		pex_recv(server, buf);
+	}
+	uint64_t elapsed = now_us() - start;
+	fprintf(stdout, "round trip   %8d msgs, %llu.%03llu us average\n", count,
+		(unsigned long long)(elapsed / count), (unsigned long long)((elapsed * 1000 / count) % 1000));
+
+	/* Client to server */
+	buf[0] = 't';
+	start = now_us();
+	for (int i = 0; i < count; ++i) {
+		pex_reply(server, size, buf);
+	}
+	pex_recv(server, buf);
+	report("to server", now_us() - start);
+
+	/* Server to client */
+	buf[0] = 'd';
+	start = now_us();
+	pex_reply(server, size, buf);
+	for (int i = 0; i < count; ++i) {
+		pex_recv(server, buf);
+		if (i % WINDOW == WINDOW - 1) {
+			buf[0] = 'a';
+			pex_reply(server, 1, buf);
+		}
+	}
+	report("to client", now_us() - start);
+
+	buf[0] = 'q';
+	pex_reply(server, 1, buf);
+
+	fclose(server);
+	return 0;
+}
+
+static void send_to(FILE * server, uintptr_t client, size_t len, char * buf) {
+	while ((ssize_t)pex_send(server, client, len, buf) < 0) {
+		sched_yield();
+	}
+}
+
+static void run_server(FILE * server) {
+	pex_packet_t * p = malloc(PACKET_SIZE);
+	char * buf = malloc(MAX_PACKET_SIZE);
+	memset(buf, 0, MAX_PACKET_SIZE);
+	int received = 0;
+
+	while (1) {
+		pex_listen(server, p);
+		if (!p->size) return; /* Client went away */
+
+		switch (p->data[0]) {
+			case 'p':
+				send_to(server, p->source, size, (char *)p->data);
+				break;
+			case 't':
+				if (++received == count) {
+					send_to(server, p->source, 1, (char *)p->data);
+				}
+				break;
+			case 'd':
+				buf[0] = 'd';
+				for (int i = 0; i < count; ++i) {
+					send_to(server, p->source, size, buf);
+					if (i % WINDOW == WINDOW - 1 && i != count - 1) {
+						do {
+							pex_listen(server, p);
+						} while (p->size && p->data[0] != 'a');
+					}
+				}
+				break;
+			case 'q': {
+				struct pex_client_stats stats;
+				if (!pex_client_stats(server, p->source, &stats)) {
+					fprintf(stdout, "backlog      %u queued, %u dropped, %u coalesced\n",
+						stats.queued, stats.dropped, stats.coalesced);
+				}
+				return;
+			}
+		}
+	}
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-n COUNT] [-s SIZE] [-r]\n"
+			"\n"
+			" -n     \033[3mnumber of messages per test (default 10000)\033[0m\n"
+			" -s     \033[3mmessage size in bytes (default 64)\033[0m\n"
+			" -r     \033[3mdon't use shared-memory rings\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "?n:s:r")) != -1) {
+		switch (opt) {
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'r':
+				setenv("PEX_NO_RING", "1", 1);
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	if (count < 1 || size < 1 || size > MAX_PACKET_SIZE) {
+		return usage(argv);
+	}
+
+	char name[100];
+	sprintf(name, "pex-bench.%d", getpid());
+
+	FILE * server = pex_bind(name);
+	if (!server) {
+		fprintf(stderr, "%s: could not bind %s\n", argv[0], name);
+		return 1;
+	}
+
+	fprintf(stdout, "%s, %zu-byte messages\n", getenv("PEX_NO_RING") ? "kernel queues" : "shared rings", size);
+
+	pid_t child = fork();
+	if (!child) {
+		return run_client(name);
+	}
+
+	run_server(server);
+	waitpid(child, NULL, 0);
+	fclose(server);
+
+	return 0;
+}
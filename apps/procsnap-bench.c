@@ -0,0 +1,140 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * procsnap-bench - time collecting a process listing
+ *
+ * Starts a few hundred idle threads so there is something to list,
+ * then gathers what ps needs about every process over and over:
+ * first by walking /proc and reading each status and cmdline file,
+ * then with single reads of /proc/snapshot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/procsnap.h>
+
+#include "bench.h"
+
+static volatile int done = 0;
+
+static void * idle_thread(void * arg) {
+	while (!done) {
+		usleep(100000);
+	}
+	return NULL;
+}
+
+static size_t read_file(const char * path, char * buf, size_t size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+	ssize_t r = read(fd, buf, size);
+	close(fd);
+	return r > 0 ? r : 0;
+}
+
+/* What ps did before /proc/snapshot */
+static int walk_proc(void) {
+	char path[64];
+	char buf[4096];
+	int count = 0;
+
+	DIR * dirp = opendir("/proc");
+	if (!dirp) return 0;
+
+	struct dirent * ent;
+	while ((ent = readdir(dirp)) != NULL) {
+		if (ent->d_name[0] < '0' || ent->d_name[0] > '9') continue;
+		snprintf(path, sizeof(path), "/proc/%s/status", ent->d_name);
+		if (!read_file(path, buf, sizeof(buf))) continue;
+		snprintf(path, sizeof(path), "/proc/%s/cmdline", ent->d_name);
+		read_file(path, buf, sizeof(buf));
+		count++;
+	}
+
+	closedir(dirp);
+	return count;
+}
+
+static int read_snapshot(char ** buf, size_t * size) {
+	while (1) {
+		size_t got = read_file("/proc/snapshot", *buf, *size);
+		struct proc_snapshot_header * snap = (void *)*buf;
+		if (got < sizeof(struct proc_snapshot_header)) return 0;
+		if (snap->size <= got) return snap->count;
+		*size = snap->size + 4096;
+		*buf = realloc(*buf, *size);
+	}
+}
+
+static void report(const char * name, uint64_t elapsed, int iterations, int count) {
+	fprintf(stdout, "%-10s " BENCH_SECONDS "  %6llu us/listing  %5d processes\n", name,
+		BENCH_SECONDS_ARGS(elapsed), (unsigned long long)(elapsed / iterations), count);
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-t THREADS] [-n ITERATIONS]\n"
+			"\n"
+			" -t     \033[3mhow many idle threads to start (default 300)\033[0m\n"
+			" -n     \033[3mhow many listings to take each way (default 100)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int threads = 300;
+	int iterations = 100;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "?t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'n':
+				iterations = atoi(optarg);
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	if (iterations < 1) return usage(argv);
+
+	pthread_t * tids = malloc(sizeof(pthread_t) * threads);
+	int started = 0;
+	for (; started < threads; ++started) {
+		if (pthread_create(&tids[started], NULL, idle_thread, NULL)) break;
+	}
+
+	int count = 0;
+	uint64_t start = now_us();
+	for (int i = 0; i < iterations; ++i) {
+		count = walk_proc();
+	}
+	report("walk", now_us() - start, iterations, count);
+
+	size_t size = 16384;
+	char * buf = malloc(size);
+	start = now_us();
+	for (int i = 0; i < iterations; ++i) {
+		count = read_snapshot(&buf, &size);
+	}
+	report("snapshot", now_us() - start, iterations, count);
+	free(buf);
+
+	done = 1;
+	for (int i = 0; i < started; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	return 0;
+}
@@ -1,11 +1,14 @@
 /* vim: tabstop=4 shiftwidth=4 noexpandtab
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
- * Copyright (C) 2013-2018 K. Lange
+ * Copyright (C) 2013-2021 K. Lange
  *
  * ps
  *
  * print a list of running processes
+ *
+ * Everything comes from one read of /proc/snapshot, rather than
+ * opening files under /proc for each process.
  */
 
 
@@ -16,13 +19,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <dirent.h>
 #include <pwd.h>
+#include <sys/procsnap.h>
 
 #include <toaru/list.h>
 
-#define LINE_LEN 4096
-
 static int show_all = 0;
 static int show_threads = 0;
 static int show_username = 0;
@@ -54,67 +55,24 @@ void print_username(int uid) {
 	endpwent();
 }
 
-struct process * process_entry(struct dirent *dent) {
-	char tmp[300];
-	FILE * f;
-	char line[LINE_LEN];
-
-	int pid = 0, uid = 0, tgid = 0, mem = 0, shm = 0, vsz = 0;
-	char name[100];
-
-	sprintf(tmp, "/proc/%s/status", dent->d_name);
-	f = fopen(tmp, "r");
-
-	if (!f) {
-		return NULL;
-	}
-
-	line[0] = 0;
-
-	while (fgets(line, LINE_LEN, f) != NULL) {
-		char * n = strstr(line,"\n");
-		if (n) { *n = '\0'; }
-		char * tab = strstr(line,"\t");
-		if (tab) {
-			*tab = '\0';
-			tab++;
-		}
-		if (strstr(line, "Pid:") == line) {
-			pid = atoi(tab);
-		} else if (strstr(line, "Uid:") == line) {
-			uid = atoi(tab);
-		} else if (strstr(line, "Tgid:") == line) {
-			tgid = atoi(tab);
-		} else if (strstr(line, "Name:") == line) {
-			strcpy(name, tab);
-		} else if (strstr(line, "VmSize:") == line) {
-			vsz = atoi(tab);
-		} else if (strstr(line, "RssShmem:") == line) {
-			shm = atoi(tab);
-		} else if (strstr(line, "MemPermille:") == line) {
-			mem = atoi(tab);
-		}
-	}
-
-	fclose(f);
-
+struct process * process_entry(struct proc_snapshot_entry * e, uint64_t mem_total) {
 	if (!show_all) {
 		/* Filter not ours */
-		if (uid != getuid()) return NULL;
+		if (e->uid != (int)getuid()) return NULL;
 	}
 
 	if (!show_threads) {
-		if (tgid != pid) return NULL;
+		if (e->tgid != e->pid) return NULL;
 	}
 
 	struct process * out = malloc(sizeof(struct process));
-	out->uid = uid;
-	out->pid = tgid;
-	out->tid = pid;
-	out->mem = mem;
-	out->shm = shm;
-	out->vsz = vsz;
-	out->process = strdup(name);
+	out->uid = e->uid;
+	out->pid = e->tgid;
+	out->tid = e->pid;
+	out->mem = mem_total ? 1000 * (e->rss + e->shm) / mem_total : 0;
+	out->shm = e->shm;
+	out->vsz = e->rss;
+	out->process = strdup(e->strings);
 	out->command_line = NULL;
 
 	char garbage[1024];
@@ -135,28 +93,51 @@ struct process * process_entry(struct dirent *dent) {
 	endpwent();
 
 	if (collect_commandline) {
-		sprintf(tmp, "/proc/%s/cmdline", dent->d_name);
-		f = fopen(tmp, "r");
-		char foo[1024];
-		int s = fread(foo, 1, 1024, f);
-		if (s > 0) {
-			out->command_line = malloc(s + 1);
-			memset(out->command_line, 0, s + 1);
-			memcpy(out->command_line, foo, s);
-
-			for (int i = 0; i < s; ++i) {
-				if (out->command_line[i] == 30) {
-					out->command_line[i] = ' ';
-				}
+		/* Arguments follow the name, and an empty string ends them */
+		char * arg = e->strings + strlen(e->strings) + 1;
+		size_t size = 0;
+		for (char * a = arg; *a; a += strlen(a) + 1) size += strlen(a) + 1;
+		if (size) {
+			out->command_line = malloc(size);
+			char * c = out->command_line;
+			for (char * a = arg; *a; a += strlen(a) + 1) {
+				if (c != out->command_line) *c++ = ' ';
+				strcpy(c, a);
+				c += strlen(a);
 			}
-
 		}
-		fclose(f);
 	}
 
 	return out;
 }
 
+/*
+ * Read all of /proc/snapshot. It has to come in a single read to be
+ * consistent, so if our buffer was too small we try again with one
+ * the size the header asked for.
+ */
+static struct proc_snapshot_header * read_snapshot(void) {
+	size_t size = 16384;
+	while (1) {
+		int fd = open("/proc/snapshot", O_RDONLY);
+		if (fd < 0) return NULL;
+
+		struct proc_snapshot_header * snap = malloc(size);
+		ssize_t r = read(fd, snap, size);
+		close(fd);
+
+		if (r < (ssize_t)sizeof(struct proc_snapshot_header) || snap->version != PROC_SNAPSHOT_VERSION) {
+			free(snap);
+			return NULL;
+		}
+
+		if (snap->size <= r) return snap;
+
+		size = snap->size + 4096;
+		free(snap);
+	}
+}
+
 void print_header(void) {
 	if (show_username) {
 		printf("%-*s ", widths[2], "USER");
@@ -254,24 +235,21 @@ int main (int argc, char * argv[]) {
 		}
 	}
 
-	/* Open the directory */
-	DIR * dirp = opendir("/proc");
+	struct proc_snapshot_header * snap = read_snapshot();
+	if (!snap) {
+		fprintf(stderr, "%s: could not read /proc/snapshot\n", argv[0]);
+		return 1;
+	}
 
-	/* Read the entries in the directory */
 	list_t * ents_list = list_create();
 
-	struct dirent * ent = readdir(dirp);
-	while (ent != NULL) {
-		if (ent->d_name[0] >= '0' && ent->d_name[0] <= '9') {
-			struct process * p = process_entry(ent);
-			if (p) {
-				list_insert(ents_list, (void *)p);
-			}
+	struct proc_snapshot_entry * e = (struct proc_snapshot_entry *)(snap + 1);
+	for (uint32_t i = 0; i < snap->count; ++i, e = PROC_SNAPSHOT_NEXT(e)) {
+		struct process * p = process_entry(e, snap->mem_total);
+		if (p) {
+			list_insert(ents_list, (void *)p);
 		}
-
-		ent = readdir(dirp);
 	}
-	closedir(dirp);
 
 	print_header();
 	foreach(entry, ents_list) {
@@ -503,8 +503,10 @@ void tab_complete_func(rline_context_t * c) {
 			if (ent->d_name[0] != '.' || compare[0] == '.') {
 				if (!word || strstr(ent->d_name, compare) == ent->d_name) {
 					struct stat statbuf;
-					/* stat it */
-					if (last_slash) {
+					/* stat it, unless the directory listing already told us what it is */
+					if (ent->d_type != DT_UNKNOWN) {
+						statbuf.st_mode = ent->d_type == DT_DIR ? S_IFDIR : 0;
+					} else if (last_slash) {
 						char * x;
 						char * home;
 						if (tmp[0] == '~' && (home = getenv("HOME"))) {
@@ -1377,6 +1379,8 @@ _nope:
 		pipe(last_output);
 
 		struct semaphore s = create_semaphore();
+		fflush(stdout);
+		fflush(stderr);
 		child_pid = fork();
 		if (!child_pid) {
 			set_pgid(0);
@@ -1395,6 +1399,8 @@ _nope:
 		for (int j = 1; j < cmdi; ++j) {
 			int tmp_out[2];
 			pipe(tmp_out);
+			fflush(stdout);
+			fflush(stderr);
 			if (!fork()) {
 				is_subshell = 1;
 				set_pgid(pgid);
@@ -1411,6 +1417,8 @@ _nope:
 			last_output[1] = tmp_out[1];
 		}
 
+		fflush(stdout);
+		fflush(stderr);
 		last_child = fork();
 		if (!last_child) {
 			is_subshell = 1;
@@ -1445,6 +1453,9 @@ _nope:
 	} else {
 		shell_command_t func = shell_find(*arg_starts[0]);
 		if (func) {
+			/* stdout is fully buffered when it isn't a tty; keep the builtin's output on its own side of the redirect */
+			fflush(stdout);
+			fflush(stderr);
 			int old_out = -1;
 			int old_err = -1;
 			if (output_files[0]) {
@@ -1468,11 +1479,15 @@ _nope:
 				}
 			}
 			int result = func(argcs[0], arg_starts[0]);
+			fflush(stdout);
+			fflush(stderr);
 			if (old_out != -1) dup2(old_out, STDOUT_FILENO);
 			if (old_err != -1) dup2(old_err, STDERR_FILENO);
 			return result;
 		} else {
 			struct semaphore s = create_semaphore();
+			fflush(stdout);
+			fflush(stderr);
 			child_pid = fork();
 			if (!child_pid) {
 				set_pgid(0);
@@ -1870,6 +1885,8 @@ uint32_t shell_cmd_if(int argc, char * argv[]) {
 		return 1;
 	}
 
+	fflush(stdout);
+	fflush(stderr);
 	pid_t child_pid = fork();
 	if (!child_pid) {
 		set_pgid(0);
@@ -1894,6 +1911,8 @@ uint32_t shell_cmd_if(int argc, char * argv[]) {
 			}
 			return func(argc, then_args);
 		} else {
+			fflush(stdout);
+			fflush(stderr);
 			child_pid = fork();
 			if (!child_pid) {
 				set_pgid(0);
@@ -1917,6 +1936,8 @@ uint32_t shell_cmd_if(int argc, char * argv[]) {
 			}
 			return func(argc, else_args);
 		} else {
+			fflush(stdout);
+			fflush(stderr);
 			child_pid = fork();
 			if (!child_pid) {
 				set_pgid(0);
@@ -1956,6 +1977,8 @@ uint32_t shell_cmd_while(int argc, char * argv[]) {
 	reset_pgrp();
 
 	do {
+		fflush(stdout);
+		fflush(stderr);
 		pid_t child_pid = fork();
 		if (!child_pid) {
 			set_pgid(0);
@@ -1971,6 +1994,8 @@ uint32_t shell_cmd_while(int argc, char * argv[]) {
 
 		handle_status(ret_code);
 		if (WEXITSTATUS(ret_code) == 0) {
+			fflush(stdout);
+			fflush(stderr);
 			child_pid = fork();
 			if (!child_pid) {
 				set_pgid(0);
@@ -2003,6 +2028,8 @@ uint32_t shell_cmd_export_cmd(int argc, char * argv[]) {
 
 	int pipe_fds[2];
 	pipe(pipe_fds);
+	fflush(stdout);
+	fflush(stderr);
 	pid_t child_pid = fork();
 	if (!child_pid) {
 		set_pgid(0);
@@ -2090,6 +2117,8 @@ uint32_t shell_cmd_not(int argc, char * argv[]) {
 		return 1;
 	}
 	int ret_code = 0;
+	fflush(stdout);
+	fflush(stderr);
 	pid_t child_pid = fork();
 	if (!child_pid) {
 		set_pgid(0);
@@ -2260,6 +2289,8 @@ uint32_t shell_cmd_time(int argc, char * argv[]) {
 	gettimeofday(&start, NULL);
 
 	if (argc > 1) {
+		fflush(stdout);
+		fflush(stderr);
 		pid_t child_pid = fork();
 		if (!child_pid) {
 			set_pgid(0);
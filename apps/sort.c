@@ -5,96 +5,544 @@
  *
  * sort - Sort standard in or files.
  *
- * Currently implemented with a naive insertion sort.
+ * Lines are collected into an array and merge sorted, split across
+ * threads when there are a lot of them. If the input grows past the
+ * memory budget (-S), each full batch is sorted and written out to a
+ * temporary run file, and the runs are merged at the end.
+ *
+ * Keys (-k) are located and, for numeric keys, parsed once when a
+ * line is read, not on every comparison.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
 #include <ctype.h>
-#include <toaru/list.h>
+#include <pthread.h>
+
+#define MAX_KEYS 8
+#define MERGE_FANIN 16
+#define PARALLEL_THRESHOLD 16384
+#define MAX_THREADS 8
+#define DEFAULT_BUDGET (16 * 1024 * 1024)
+
+struct sort_key {
+	int start_field;
+	int end_field; /* 0 for end of line */
+	int numeric;
+	int reverse;
+};
+
+struct span {
+	uint32_t start;
+	uint32_t end;
+	double value;
+};
+
+/* A line and where its keys are; text follows the spans. */
+struct line {
+	size_t len;
+	char * text;
+	struct span spans[];
+};
 
-int compare(const char * a, const char * b) {
+static struct sort_key keys[MAX_KEYS];
+static int key_count = 0;
+static int numeric = 0;
+static int reverse = 0;
+static int unique = 0;
+static int separator = -1;
+
+static char * argv0;
+
+/*
+ * The default ordering: case-insensitive, and runs of
+ * punctuation and spaces don't count.
+ */
+static int compare_text(const char * a, const char * a_end, const char * b, const char * b_end) {
 	while (1) {
-		while (*a == *b || tolower(*a) == tolower(*b)) {
-			if (!*a) return 0;
+		while (a < a_end && b < b_end && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
 			a++;
 			b++;
 		}
 
-		while (*a && !isalnum(*a)) a++;
-		while (*b && !isalnum(*b)) b++;
+		while (a < a_end && !isalnum((unsigned char)*a)) a++;
+		while (b < b_end && !isalnum((unsigned char)*b)) b++;
 
-		if (tolower(*a) == tolower(*b)) continue;
+		if (a == a_end || b == b_end) return (a != a_end) - (b != b_end);
+		if (tolower((unsigned char)*a) == tolower((unsigned char)*b)) continue;
 
-		if (tolower(*a) < tolower(*b)) return -1;
+		if (tolower((unsigned char)*a) < tolower((unsigned char)*b)) return -1;
 		return 1;
 	}
 }
 
+static int compare(const struct line * a, const struct line * b) {
+	for (int i = 0; i < key_count; ++i) {
+		const struct span * x = &a->spans[i];
+		const struct span * y = &b->spans[i];
+		int out;
+		if (keys[i].numeric) {
+			out = (x->value > y->value) - (x->value < y->value);
+		} else {
+			out = compare_text(a->text + x->start, a->text + x->end, b->text + y->start, b->text + y->end);
+		}
+		if (out) return keys[i].reverse ? -out : out;
+	}
+	return 0;
+}
+
+static int is_blank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+/* Offset of the start of a field, counting from 1; fields without -t start with their leading blanks. */
+static size_t field_start(const char * text, size_t len, int field) {
+	size_t i = 0;
+	for (int f = 1; f < field && i < len; ++f) {
+		if (separator >= 0) {
+			while (i < len && text[i] != separator) i++;
+			if (i < len) i++;
+		} else {
+			while (i < len && is_blank(text[i])) i++;
+			while (i < len && !is_blank(text[i])) i++;
+		}
+	}
+	return i;
+}
+
+static size_t field_end(const char * text, size_t len, int field) {
+	size_t i = field_start(text, len, field);
+	if (separator >= 0) {
+		while (i < len && text[i] != separator) i++;
+	} else {
+		while (i < len && is_blank(text[i])) i++;
+		while (i < len && !is_blank(text[i])) i++;
+	}
+	return i;
+}
+
+static struct line * line_create(const char * text, size_t len) {
+	struct line * line = malloc(sizeof(struct line) + sizeof(struct span) * key_count + len + 1);
+	line->len = len;
+	line->text = (char *)&line->spans[key_count];
+	memcpy(line->text, text, len);
+	line->text[len] = '\0';
+
+	for (int i = 0; i < key_count; ++i) {
+		struct span * s = &line->spans[i];
+		s->start = field_start(line->text, len, keys[i].start_field);
+		s->end = keys[i].end_field ? field_end(line->text, len, keys[i].end_field) : len;
+		if (s->end < s->start) s->end = s->start;
+		s->value = 0;
+		if (keys[i].numeric) {
+			char c = line->text[s->end];
+			line->text[s->end] = '\0';
+			s->value = strtod(line->text + s->start, NULL);
+			line->text[s->end] = c;
+		}
+	}
+
+	return line;
+}
+
+/*
+ * Read a line of any length, without its newline.
+ * Returns the length, or -1 at end of file.
+ */
+static ssize_t read_line(FILE * f, char ** buf, size_t * size) {
+	size_t len = 0;
+	while (1) {
+		if (*size - len < 2) {
+			*size = *size ? *size * 2 : 4096;
+			*buf = realloc(*buf, *size);
+		}
+		if (!fgets(*buf + len, *size - len, f)) {
+			return len ? (ssize_t)len : -1;
+		}
+		len += strlen(*buf + len);
+		if (len && (*buf)[len-1] == '\n') {
+			(*buf)[--len] = '\0';
+			return len;
+		}
+	}
+}
+
+static void merge(struct line ** in, struct line ** out, size_t left, size_t mid, size_t right) {
+	size_t i = left, j = mid, k = left;
+	while (i < mid && j < right) {
+		out[k++] = compare(in[j], in[i]) < 0 ? in[j++] : in[i++];
+	}
+	while (i < mid) out[k++] = in[i++];
+	while (j < right) out[k++] = in[j++];
+}
+
+/* Stable merge sort of lines[left,right), using tmp as scratch. */
+static void merge_sort(struct line ** lines, struct line ** tmp, size_t left, size_t right) {
+	if (right - left < 2) return;
+
+	if (right - left <= 16) {
+		for (size_t i = left + 1; i < right; ++i) {
+			struct line * x = lines[i];
+			size_t j = i;
+			while (j > left && compare(x, lines[j-1]) < 0) {
+				lines[j] = lines[j-1];
+				j--;
+			}
+			lines[j] = x;
+		}
+		return;
+	}
+
+	size_t mid = left + (right - left) / 2;
+	merge_sort(lines, tmp, left, mid);
+	merge_sort(lines, tmp, mid, right);
+
+	if (compare(lines[mid], lines[mid-1]) >= 0) return;
+
+	merge(lines, tmp, left, mid, right);
+	memcpy(&lines[left], &tmp[left], sizeof(struct line *) * (right - left));
+}
+
+struct sort_task {
+	struct line ** lines;
+	struct line ** tmp;
+	size_t left;
+	size_t mid;
+	size_t right;
+};
+
+static void * sort_worker(void * arg) {
+	struct sort_task * task = arg;
+	merge_sort(task->lines, task->tmp, task->left, task->right);
+	return NULL;
+}
+
+static void * merge_worker(void * arg) {
+	struct sort_task * task = arg;
+	merge(task->lines, task->tmp, task->left, task->mid, task->right);
+	memcpy(&task->lines[task->left], &task->tmp[task->left], sizeof(struct line *) * (task->right - task->left));
+	return NULL;
+}
+
+/*
+ * Sort a batch of lines. Big batches are cut into one chunk per
+ * thread, and then neighbouring chunks are merged in rounds.
+ */
+static void sort_lines(struct line ** lines, size_t count, int threads) {
+	struct line ** tmp = malloc(sizeof(struct line *) * (count ? count : 1));
+
+	if (count < PARALLEL_THRESHOLD || threads < 2) {
+		merge_sort(lines, tmp, 0, count);
+		free(tmp);
+		return;
+	}
+
+	size_t chunk = (count + threads - 1) / threads;
+	pthread_t thread[MAX_THREADS];
+	struct sort_task tasks[MAX_THREADS];
+
+	for (int i = 0; i < threads; ++i) {
+		tasks[i].lines = lines;
+		tasks[i].tmp = tmp;
+		tasks[i].left = i * chunk < count ? i * chunk : count;
+		tasks[i].right = (i + 1) * chunk < count ? (i + 1) * chunk : count;
+		pthread_create(&thread[i], NULL, sort_worker, &tasks[i]);
+	}
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(thread[i], NULL);
+	}
+
+	for (size_t width = chunk; width < count; width *= 2) {
+		int n = 0;
+		for (size_t left = 0; left + width < count; left += width * 2) {
+			tasks[n].lines = lines;
+			tasks[n].tmp = tmp;
+			tasks[n].left = left;
+			tasks[n].mid = left + width;
+			tasks[n].right = left + width * 2 < count ? left + width * 2 : count;
+			pthread_create(&thread[n], NULL, merge_worker, &tasks[n]);
+			n++;
+		}
+		for (int i = 0; i < n; ++i) {
+			pthread_join(thread[i], NULL);
+		}
+	}
+
+	free(tmp);
+}
+
+/* Writes lines out, dropping duplicates with -u; last is the previous line written, if any. */
+static void output_line(FILE * out, struct line * line, struct line ** last) {
+	if (unique && *last && !compare(*last, line)) {
+		free(line);
+		return;
+	}
+	fwrite(line->text, 1, line->len, out);
+	fputc('\n', out);
+	if (*last) free(*last);
+	*last = line;
+}
+
+/* Sort a batch and write it to a new run file. */
+static FILE * write_run(struct line ** lines, size_t count, int threads) {
+	FILE * run = tmpfile();
+	if (!run) {
+		fprintf(stderr, "%s: can't create temporary file: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+	sort_lines(lines, count, threads);
+	struct line * last = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		output_line(run, lines[i], &last);
+	}
+	if (last) free(last);
+	fflush(run);
+	rewind(run);
+	return run;
+}
+
+/* Merge up to MERGE_FANIN sorted runs into out. */
+static void merge_runs(FILE ** runs, int count, FILE * out) {
+	struct line * heads[MERGE_FANIN];
+	char * buf = NULL;
+	size_t size = 0;
+
+	for (int i = 0; i < count; ++i) {
+		ssize_t len = read_line(runs[i], &buf, &size);
+		heads[i] = len < 0 ? NULL : line_create(buf, len);
+	}
+
+	struct line * last = NULL;
+	while (1) {
+		int best = -1;
+		for (int i = 0; i < count; ++i) {
+			if (heads[i] && (best < 0 || compare(heads[i], heads[best]) < 0)) best = i;
+		}
+		if (best < 0) break;
+
+		output_line(out, heads[best], &last);
+
+		ssize_t len = read_line(runs[best], &buf, &size);
+		heads[best] = len < 0 ? NULL : line_create(buf, len);
+	}
+
+	if (last) free(last);
+	free(buf);
+	for (int i = 0; i < count; ++i) {
+		fclose(runs[i]);
+	}
+}
+
+static int parse_key(char * arg, struct sort_key * key) {
+	char * end;
+	key->start_field = strtol(arg, &end, 10);
+	key->end_field = 0;
+	key->numeric = numeric;
+	key->reverse = reverse;
+	if (key->start_field < 1) return 1;
+
+	if (*end == ',') {
+		key->end_field = strtol(end + 1, &end, 10);
+		if (key->end_field < key->start_field) return 1;
+	}
+
+	for (; *end; end++) {
+		switch (*end) {
+			case 'n': key->numeric = 1; break;
+			case 'r': key->reverse = 1; break;
+			default: return 1;
+		}
+	}
+
+	return 0;
+}
+
+static size_t parse_size(char * arg) {
+	char * end;
+	size_t size = strtoul(arg, &end, 10);
+	switch (*end) {
+		case 'G': case 'g': size *= 1024;
+		/* fallthrough */
+		case 'M': case 'm': size *= 1024;
+		/* fallthrough */
+		case 'K': case 'k': size *= 1024;
+	}
+	return size;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-nru] [-t SEP] [-k FIELD[,FIELD][nr]]... [-S SIZE] [-j THREADS] [FILE]...\n"
+			"\n"
+			" -n     \033[3mcompare numerically\033[0m\n"
+			" -r     \033[3mreverse the order\033[0m\n"
+			" -u     \033[3monly print the first of lines that compare equal\033[0m\n"
+			" -t     \033[3mfields are separated by SEP instead of blanks\033[0m\n"
+			" -k     \033[3msort by fields, counting from 1\033[0m\n"
+			" -S     \033[3mmemory to use before spilling to temporary files (K, M, G)\033[0m\n"
+			" -j     \033[3mnumber of threads to sort with\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
 int main(int argc, char * argv[]) {
-	int reverse = 0;
 	int opt;
+	size_t budget = DEFAULT_BUDGET;
+	int threads = 0;
+	char * key_args[MAX_KEYS];
+	int key_args_count = 0;
 
-	list_t * lines = list_create();
-	list_t * files = list_create();
+	argv0 = argv[0];
 
-	while ((opt = getopt(argc, argv, "r")) != -1) {
+	while ((opt = getopt(argc, argv, "?nrut:k:S:j:")) != -1) {
 		switch (opt) {
+			case 'n':
+				numeric = 1;
+				break;
 			case 'r':
 				reverse = 1;
 				break;
+			case 'u':
+				unique = 1;
+				break;
+			case 't':
+				if (strlen(optarg) != 1) {
+					fprintf(stderr, "%s: separator must be one character\n", argv[0]);
+					return 1;
+				}
+				separator = (unsigned char)optarg[0];
+				break;
+			case 'k':
+				if (key_args_count == MAX_KEYS) {
+					fprintf(stderr, "%s: too many keys\n", argv[0]);
+					return 1;
+				}
+				key_args[key_args_count++] = optarg;
+				break;
+			case 'S':
+				budget = parse_size(optarg);
+				break;
+			case 'j':
+				threads = atoi(optarg);
+				break;
+			case '?':
+				return usage(argv);
 		}
 	}
 
-	if (optind == argc) {
-		/* No arguments */
-		list_insert(files, stdin);
-	} else {
-		while (optind < argc) {
-			FILE * f = fopen(argv[optind], "r");
+	/* Global flags are defaults for keys, so keys are parsed after all of them are seen. */
+	for (int i = 0; i < key_args_count; ++i) {
+		if (parse_key(key_args[i], &keys[key_count++])) {
+			fprintf(stderr, "%s: invalid key: %s\n", argv[0], key_args[i]);
+			return 1;
+		}
+	}
+	if (!key_count) {
+		keys[0].start_field = 1;
+		keys[0].end_field = 0;
+		keys[0].numeric = numeric;
+		keys[0].reverse = reverse;
+		key_count = 1;
+	}
+
+	if (threads < 1) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS) threads = MAX_THREADS;
+
+	size_t capacity = 1024;
+	size_t count = 0;
+	size_t used = 0;
+	struct line ** lines = malloc(sizeof(struct line *) * capacity);
+
+	FILE ** runs = NULL;
+	int run_count = 0;
+
+	char * buf = NULL;
+	size_t size = 0;
+	int status = 0;
+
+	for (int i = optind; i < argc || i == optind; ++i) {
+		FILE * f = stdin;
+		if (i < argc && strcmp(argv[i], "-")) {
+			f = fopen(argv[i], "r");
 			if (!f) {
-				fprintf(stderr, "%s: %s: %s\n", argv[0], argv[optind], strerror(errno));
-			} else {
-				list_insert(files, f);
+				fprintf(stderr, "%s: %s: %s\n", argv[0], argv[i], strerror(errno));
+				status = 1;
+				continue;
 			}
-			optind++;
 		}
-	}
 
-	char line_buf[4096] = {0};
-	foreach (node, files) {
-		FILE * f = node->value;
-		while (!feof(f)) {
-			if (!fgets(line_buf, 4096, f)) {
-				break;
+		ssize_t len;
+		while ((len = read_line(f, &buf, &size)) >= 0) {
+			if (count == capacity) {
+				capacity *= 2;
+				lines = realloc(lines, sizeof(struct line *) * capacity);
 			}
-			if (!strchr(line_buf,'\n')) {
-				fprintf(stderr, "%s: oversized line\n", argv[0]);
+			lines[count++] = line_create(buf, len);
+			used += sizeof(struct line) + sizeof(struct span) * key_count + len + 1 + sizeof(struct line *);
+
+			if (used > budget) {
+				runs = realloc(runs, sizeof(FILE *) * (run_count + 1));
+				runs[run_count++] = write_run(lines, count, threads);
+				count = 0;
+				used = 0;
 			}
-			char * line = strdup(line_buf);
-			node_t * next = NULL;
-			foreach (lnode, lines) {
-				char * cmp = lnode->value;
-				if (reverse ? (compare(cmp, line) < 0) : (compare(line, cmp) < 0)) {
-					next = lnode;
-					break;
-				}
+		}
+
+		if (f != stdin) fclose(f);
+	}
+
+	free(buf);
+
+	if (!run_count) {
+		sort_lines(lines, count, threads);
+		struct line * last = NULL;
+		for (size_t i = 0; i < count; ++i) {
+			output_line(stdout, lines[i], &last);
+		}
+		if (last) free(last);
+		free(lines);
+		return status;
+	}
+
+	if (count) {
+		runs = realloc(runs, sizeof(FILE *) * (run_count + 1));
+		runs[run_count++] = write_run(lines, count, threads);
+	}
+	free(lines);
+
+	/*
+	 * Merge neighbouring runs in groups until one group's worth is left,
+	 * then merge that to the output. Keeping the runs in input order
+	 * keeps the sort stable.
+	 */
+	while (run_count > MERGE_FANIN) {
+		int merged = 0;
+		for (int i = 0; i < run_count; i += MERGE_FANIN) {
+			int n = run_count - i < MERGE_FANIN ? run_count - i : MERGE_FANIN;
+			if (n == 1) {
+				runs[merged++] = runs[i];
+				continue;
 			}
-			if (next) {
-				list_insert_before(lines, next, line);
-			} else {
-				list_insert(lines, line);
+			FILE * out = tmpfile();
+			if (!out) {
+				fprintf(stderr, "%s: can't create temporary file: %s\n", argv[0], strerror(errno));
+				return 1;
 			}
+			merge_runs(&runs[i], n, out);
+			fflush(out);
+			rewind(out);
+			runs[merged++] = out;
 		}
+		run_count = merged;
 	}
 
-	foreach (lnode, lines) {
-		char * line = lnode->value;
-		fprintf(stdout, "%s", line);
-	}
+	merge_runs(runs, run_count, stdout);
+	free(runs);
 
-	return 0;
+	return status;
 }
@@ -0,0 +1,142 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * stdio-bench - measure stdio throughput
+ *
+ * Writes a file of short lines a few different ways, then reads it
+ * back a few different ways, and reports how long each took. The
+ * "write(2)" case makes one system call per line, which is what
+ * stdio used to do for every stream.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "bench.h"
+
+static void report(const char * name, uint64_t elapsed, size_t bytes) {
+	uint64_t kbps = elapsed ? (uint64_t)bytes * 1000000 / 1024 / elapsed : 0;
+	fprintf(stdout, "%-10s " BENCH_SECONDS "  %10zu bytes  %8llu KiB/s\n", name,
+		BENCH_SECONDS_ARGS(elapsed), bytes, (unsigned long long)kbps);
+}
+
+static const char line[] = "The quick brown fox jumps over the lazy dog 0123456789\n";
+
+static size_t write_syscalls(const char * path, int lines) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return 0;
+	size_t bytes = 0;
+	for (int i = 0; i < lines; ++i) {
+		bytes += write(fd, line, sizeof(line) - 1);
+	}
+	close(fd);
+	return bytes;
+}
+
+static size_t write_fputs(const char * path, int lines) {
+	FILE * f = fopen(path, "w");
+	if (!f) return 0;
+	for (int i = 0; i < lines; ++i) {
+		fputs(line, f);
+	}
+	size_t bytes = ftell(f);
+	fclose(f);
+	return bytes;
+}
+
+static size_t write_fprintf(const char * path, int lines) {
+	FILE * f = fopen(path, "w");
+	if (!f) return 0;
+	for (int i = 0; i < lines; ++i) {
+		fprintf(f, "line %d: %s", i, line);
+	}
+	size_t bytes = ftell(f);
+	fclose(f);
+	return bytes;
+}
+
+static size_t read_fgetc(const char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) return 0;
+	size_t bytes = 0;
+	while (fgetc(f) != EOF) bytes++;
+	fclose(f);
+	return bytes;
+}
+
+static size_t read_fgets(const char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) return 0;
+	char buf[256];
+	size_t bytes = 0;
+	while (fgets(buf, sizeof(buf), f)) bytes += strlen(buf);
+	fclose(f);
+	return bytes;
+}
+
+static size_t read_fread(const char * path) {
+	FILE * f = fopen(path, "r");
+	if (!f) return 0;
+	size_t size = 65536;
+	char * buf = malloc(size);
+	size_t bytes = 0, r;
+	while ((r = fread(buf, 1, size, f)) > 0) bytes += r;
+	free(buf);
+	fclose(f);
+	return bytes;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-f FILE] [-n LINES]\n"
+			"\n"
+			" -f     \033[3mscratch file to use (default /tmp/stdio-bench)\033[0m\n"
+			" -n     \033[3mlines to write (default 100000)\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	char * path = "/tmp/stdio-bench";
+	int lines = 100000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "?f:n:")) != -1) {
+		switch (opt) {
+			case 'f':
+				path = optarg;
+				break;
+			case 'n':
+				lines = atoi(optarg);
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	uint64_t start;
+	size_t bytes;
+
+#define RUN(name, expr) do { \
+		start = now_us(); \
+		bytes = expr; \
+		report(name, now_us() - start, bytes); \
+		fflush(stdout); \
+	} while (0)
+
+	RUN("write(2)", write_syscalls(path, lines));
+	RUN("fputs", write_fputs(path, lines));
+	RUN("fprintf", write_fprintf(path, lines));
+	RUN("fgetc", read_fgetc(path));
+	RUN("fgets", read_fgets(path));
+	RUN("fread", read_fread(path));
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,146 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * tar-bench - time package-style extraction of an archive
+ *
+ * Extracts a (usually gzipped) archive twice: once the old way,
+ * inflating the whole thing to a temporary file before unpacking
+ * that, and once through libtoaru_tar's streaming pipeline, which
+ * inflates on a second thread straight into the extractor. Each
+ * copy goes to its own directory under the one given with -d,
+ * which is removed afterwards unless -k is passed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <toaru/inflate.h>
+#include <toaru/tar.h>
+
+#include "bench.h"
+
+static uint8_t _get(struct inflate_context * ctx) {
+	return fgetc(ctx->input_priv);
+}
+
+static void _write(struct inflate_context * ctx, unsigned int sym) {
+	fputc(sym, ctx->output_priv);
+}
+
+static void report(const char * name, uint64_t elapsed, struct tar_options * opts) {
+	fprintf(stdout, "%-10s " BENCH_SECONDS "  %6zu files  %10zu bytes\n", name,
+		BENCH_SECONDS_ARGS(elapsed), opts->files, opts->bytes);
+}
+
+static int run_staged(char * archive, char * dir) {
+	char tmp[1024];
+	snprintf(tmp, sizeof(tmp), "%s/archive.tar", dir);
+
+	uint64_t start = now_us();
+
+	FILE * in = fopen(archive, "r");
+	FILE * out = fopen(tmp, "w");
+	if (!in || !out) {
+		fprintf(stderr, "tar-bench: could not stage %s\n", archive);
+		return 1;
+	}
+
+	struct inflate_context ctx;
+	ctx.input_priv = in;
+	ctx.output_priv = out;
+	ctx.get_input = _get;
+	ctx.write_output = _write;
+	ctx.ring = NULL;
+
+	int status = gzip_decompress(&ctx);
+	fclose(in);
+	fclose(out);
+	if (status) {
+		fprintf(stderr, "tar-bench: %s: not a valid gzip archive\n", archive);
+		return 1;
+	}
+
+	uint64_t inflated = now_us();
+
+	char dest[1024];
+	snprintf(dest, sizeof(dest), "%s/staged", dir);
+	mkdir(dest, 0755);
+
+	struct tar_options opts = {0};
+	opts.progname = "tar-bench";
+	opts.directory = dest;
+	status = tar_extract_file(tmp, &opts);
+	unlink(tmp);
+
+	uint64_t done = now_us();
+	fprintf(stdout, "staged     inflate " BENCH_SECONDS ", extract " BENCH_SECONDS "\n",
+		BENCH_SECONDS_ARGS(inflated - start), BENCH_SECONDS_ARGS(done - inflated));
+	report("staged", done - start, &opts);
+	return status;
+}
+
+static int run_streaming(char * archive, char * dir) {
+	char dest[1024];
+	snprintf(dest, sizeof(dest), "%s/streaming", dir);
+	mkdir(dest, 0755);
+
+	struct tar_options opts = {0};
+	opts.progname = "tar-bench";
+	opts.directory = dest;
+
+	uint64_t start = now_us();
+	int status = tar_extract_file(archive, &opts);
+	report("streaming", now_us() - start, &opts);
+	return status;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr,
+			"usage: %s [-d DIR] [-k] ARCHIVE.tgz\n"
+			"\n"
+			" -d     \033[3mwhere to extract (default /tmp/tar-bench)\033[0m\n"
+			" -k     \033[3mkeep the extracted files\033[0m\n"
+			" -?     \033[3mshow this help text\033[0m\n"
+			"\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	char * dir = "/tmp/tar-bench";
+	int keep = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "?d:k")) != -1) {
+		switch (opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 'k':
+				keep = 1;
+				break;
+			case '?':
+				return usage(argv);
+		}
+	}
+
+	if (optind >= argc) return usage(argv);
+
+	char * archive = argv[optind];
+	mkdir(dir, 0755);
+
+	int status = run_staged(archive, dir);
+	status |= run_streaming(archive, dir);
+
+	if (!keep) {
+		char cmd[1100];
+		snprintf(cmd, sizeof(cmd), "rm -r %s/staged %s/streaming", dir, dir);
+		system(cmd);
+	}
+
+	return status;
+}
@@ -69,6 +69,7 @@ static void usage(char * argv[]) {
 			" -n --no-frame   \033[3mDisable decorations.\033[0m\n"
 			" -g --geometry   \033[3mSet requested terminal size WIDTHxHEIGHT\033[0m\n"
 			" -f --no-ft      \033[3mForce disable the freetype backend.\033[0m\n"
+			"    --bench FILE \033[3mRender FILE as terminal output, report throughput, and exit.\033[0m\n"
 			"\n"
 			" This terminal emulator provides basic support for VT220 escapes and\n"
 			" XTerm extensions, including 256 color support and font effects.\n",
@@ -79,6 +80,7 @@ static void usage(char * argv[]) {
 static int fd_master, fd_slave;
 static FILE * terminal;
 static pid_t child_pid = 0;
+static char * bench_file = NULL; /* Log file to replay with --bench */
 
 static int      scale_fonts    = 0;    /* Whether fonts should be scaled */
 static float    font_scaling   = 1.0;  /* How much they should be scaled by */
@@ -140,11 +142,27 @@ static unsigned long long mouse_ticks = 0;
 static yutani_window_t * window       = NULL; /* GUI window */
 static yutani_t * yctx = NULL;
 
-/* Window flip bounds */
-static int32_t l_x = INT32_MAX;
-static int32_t l_y = INT32_MAX;
-static int32_t r_x = -1;
-static int32_t r_y = -1;
+/*
+ * Window damage
+ *
+ * Drawing accumulates a small set of dirty rectangles, which are
+ * copied to the window and flipped at most once per refresh interval.
+ */
+#define DAMAGE_RECTS 16
+#define FLIP_INTERVAL 16666 /* microseconds, ~60Hz */
+
+struct damage_rect {
+	int32_t l_x, l_y; /* Top left, inclusive */
+	int32_t r_x, r_y; /* Bottom right, exclusive */
+};
+
+static struct damage_rect damage[DAMAGE_RECTS];
+static int damage_count = 0;
+static uint64_t last_flip = 0;
+
+/* Flip statistics, reported by --bench */
+static uint64_t flips_region = 0;
+static uint64_t flips_full = 0;
 
 static uint32_t window_width  = 640;
 static uint32_t window_height = 480;
@@ -201,17 +219,6 @@ static uint64_t get_ticks(void) {
 	return (uint64_t)now.tv_sec * 1000000LL + (uint64_t)now.tv_usec;
 }
 
-static void display_flip(void) {
-	if (l_x != INT32_MAX && l_y != INT32_MAX) {
-		flip(ctx);
-		yutani_flip_region(yctx, window, l_x, l_y, r_x - l_x, r_y - l_y);
-		l_x = INT32_MAX;
-		l_y = INT32_MAX;
-		r_x = -1;
-		r_y = -1;
-	}
-}
-
 /* Returns the lower of two shorts */
 static int32_t min(int32_t a, int32_t b) {
 	return (a < b) ? a : b;
@@ -222,6 +229,113 @@ static int32_t max(int32_t a, int32_t b) {
 	return (a > b) ? a : b;
 }
 
+static int64_t damage_area(int32_t l_x, int32_t l_y, int32_t r_x, int32_t r_y) {
+	return (int64_t)(r_x - l_x) * (r_y - l_y);
+}
+
+/* Mark a region of the window as needing to be flipped. */
+static void mark_damage(int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct damage_rect n = {x, y, x + width, y + height};
+
+	/*
+	 * Fold the new region into an existing one it touches - this
+	 * turns a run of cells into a single strip - or, when the set
+	 * is full, into whichever one grows the least.
+	 */
+	int best = -1;
+	int64_t best_growth = INT64_MAX;
+	for (int i = 0; i < damage_count; ++i) {
+		struct damage_rect * d = &damage[i];
+		if (n.l_x <= d->r_x && d->l_x <= n.r_x && n.l_y <= d->r_y && d->l_y <= n.r_y) {
+			best = i;
+			break;
+		}
+		if (damage_count == DAMAGE_RECTS) {
+			int64_t growth = damage_area(min(d->l_x, n.l_x), min(d->l_y, n.l_y), max(d->r_x, n.r_x), max(d->r_y, n.r_y))
+				- damage_area(d->l_x, d->l_y, d->r_x, d->r_y);
+			if (growth < best_growth) {
+				best = i;
+				best_growth = growth;
+			}
+		}
+	}
+
+	if (best == -1) {
+		damage[damage_count++] = n;
+		return;
+	}
+
+	struct damage_rect * d = &damage[best];
+	d->l_x = min(d->l_x, n.l_x);
+	d->l_y = min(d->l_y, n.l_y);
+	d->r_x = max(d->r_x, n.r_x);
+	d->r_y = max(d->r_y, n.r_y);
+}
+
+static void render_debug_overlay(void);
+
+/* Copy all damaged regions to the window and tell the compositor about them. */
+static void display_flip_now(void) {
+	if (!damage_count) return;
+
+	render_debug_overlay();
+
+	struct damage_rect bounds = {INT32_MAX, INT32_MAX, -1, -1};
+	for (int i = 0; i < damage_count; ++i) {
+		struct damage_rect * d = &damage[i];
+		d->l_x = max(d->l_x, 0);
+		d->l_y = max(d->l_y, 0);
+		d->r_x = min(d->r_x, ctx->width);
+		d->r_y = min(d->r_y, ctx->height);
+		if (d->l_x >= d->r_x || d->l_y >= d->r_y) continue;
+		bounds.l_x = min(bounds.l_x, d->l_x);
+		bounds.l_y = min(bounds.l_y, d->l_y);
+		bounds.r_x = max(bounds.r_x, d->r_x);
+		bounds.r_y = max(bounds.r_y, d->r_y);
+	}
+
+	int count = damage_count;
+	damage_count = 0;
+	last_flip = get_ticks();
+
+	if (bounds.r_x == -1) return;
+
+	if (damage_area(bounds.l_x, bounds.l_y, bounds.r_x, bounds.r_y) * 4 >= damage_area(0, 0, ctx->width, ctx->height) * 3) {
+		/* Most of the window changed, just send all of it. */
+		flip(ctx);
+		yutani_flip(yctx, window);
+		flips_full++;
+		return;
+	}
+
+	/* Only copy what changed, but send the compositor one region covering all of it. */
+	for (int i = 0; i < count; ++i) {
+		struct damage_rect * d = &damage[i];
+		for (int32_t y = d->l_y; y < d->r_y; ++y) {
+			memcpy(&ctx->buffer[y * GFX_S(ctx) + d->l_x * GFX_B(ctx)],
+			       &ctx->backbuffer[y * GFX_S(ctx) + d->l_x * GFX_B(ctx)],
+			       (d->r_x - d->l_x) * GFX_B(ctx));
+		}
+	}
+	yutani_flip_region(yctx, window, bounds.l_x, bounds.l_y, bounds.r_x - bounds.l_x, bounds.r_y - bounds.l_y);
+	flips_region++;
+}
+
+/* Flip damaged regions, unless we already flipped within this refresh interval. */
+static void display_flip(void) {
+	if (!damage_count) return;
+	if (get_ticks() - last_flip < FLIP_INTERVAL) return;
+	display_flip_now();
+}
+
+/* How long the main loop can sleep before pending damage should be flipped, in milliseconds */
+static int display_flip_timeout(int timeout) {
+	if (!damage_count) return timeout;
+	uint64_t elapsed = get_ticks() - last_flip;
+	if (elapsed >= FLIP_INTERVAL) return 0;
+	return min(timeout, (FLIP_INTERVAL - elapsed + 999) / 1000);
+}
+
 /*
  * Convert codepoint to UTF-8
  *
@@ -597,9 +711,7 @@ static void render_decors(void) {
 	 * We do this regardless of whether we drew decorations to catch
 	 * a case where decorations are toggled.
 	 */
-	l_x = 0; l_y = 0;
-	r_x = window->width;
-	r_y = window->height;
+	mark_damage(0, 0, window->width, window->height);
 	display_flip();
 }
 
@@ -616,14 +728,175 @@ static inline void term_set_point(uint16_t x, uint16_t y, uint32_t color ) {
 	}
 }
 
+/*
+ * Glyph cache
+ *
+ * Rendered cells are kept in an LRU cache keyed on everything that
+ * affects their pixels: the codepoint, the resolved foreground and
+ * background colors, and the drawing flags. A hit is just a row-by-row
+ * copy of premultiplied pixels into the window.
+ *
+ * Every slot is two cells wide so wide characters fit; the cache is
+ * thrown out whenever the cell size or renderer changes. Slot pixels
+ * are allocated as they are needed, and at large font sizes there
+ * are fewer slots, so the cache stays within GLYPH_CACHE_BYTES.
+ */
+#define GLYPH_CACHE_SIZE    1024
+#define GLYPH_CACHE_BYTES   (8 * 1024 * 1024)
+#define GLYPH_CACHE_INITIAL 64
+#define GLYPH_CACHE_BUCKETS 2048
+#define GLYPH_CACHE_FLAGS   (ANSI_BOLD | ANSI_UNDERLINE | ANSI_ITALIC | ANSI_BORDER | ANSI_WIDE | ANSI_CROSS)
+
+struct glyph_cache_entry {
+	uint32_t codepoint;
+	uint32_t fg;
+	uint32_t bg;
+	uint32_t flags;
+	int hash_next; /* Next entry in the same bucket, or -1 */
+	int lru_prev;  /* More recently used entry, or -1 */
+	int lru_next;  /* Less recently used entry, or -1 */
+};
+
+static struct glyph_cache_entry glyph_cache[GLYPH_CACHE_SIZE];
+static int glyph_cache_buckets[GLYPH_CACHE_BUCKETS];
+static int glyph_cache_used = 0;      /* Slots handed out so far */
+static int glyph_cache_allocated = 0; /* Slots we have pixels for */
+static int glyph_cache_limit = 0;     /* Slots we may have at this cell size */
+static int glyph_cache_head = -1;     /* Most recently used */
+static int glyph_cache_tail = -1;     /* Least recently used */
+static uint32_t * glyph_cache_pixels = NULL;
+static int glyph_cache_stride = 0;    /* Width of a slot in pixels */
+static gfx_context_t glyph_ctx;       /* Rendering target aimed at one slot */
+
+/* Debug overlay statistics */
+static bool _debug_overlay = 0;
+static uint64_t glyph_cache_hits = 0;
+static uint64_t glyph_cache_misses = 0;
+static uint64_t frame_time_last = 0;
+static uint64_t frame_time_total = 0;
+static uint64_t frame_count = 0;
+
+static void glyph_cache_reset(void) {
+	for (int i = 0; i < GLYPH_CACHE_BUCKETS; ++i) {
+		glyph_cache_buckets[i] = -1;
+	}
+	glyph_cache_used = 0;
+	glyph_cache_head = -1;
+	glyph_cache_tail = -1;
+
+	free(glyph_cache_pixels);
+	glyph_cache_stride = char_width * 2;
+	size_t slot_bytes = sizeof(uint32_t) * glyph_cache_stride * char_height;
+	glyph_cache_limit = GLYPH_CACHE_BYTES / slot_bytes;
+	if (glyph_cache_limit > GLYPH_CACHE_SIZE) glyph_cache_limit = GLYPH_CACHE_SIZE;
+	if (glyph_cache_limit < GLYPH_CACHE_INITIAL) glyph_cache_limit = GLYPH_CACHE_INITIAL;
+	glyph_cache_allocated = GLYPH_CACHE_INITIAL;
+	glyph_cache_pixels = malloc(slot_bytes * glyph_cache_allocated);
+}
+
+/* Make room for another slot's pixels, if we are allowed more slots */
+static int glyph_cache_grow(void) {
+	if (glyph_cache_used < glyph_cache_allocated) return 1;
+	if (glyph_cache_allocated >= glyph_cache_limit) return 0;
+	int allocated = glyph_cache_allocated * 2;
+	if (allocated > glyph_cache_limit) allocated = glyph_cache_limit;
+	uint32_t * pixels = realloc(glyph_cache_pixels, sizeof(uint32_t) * glyph_cache_stride * char_height * allocated);
+	if (!pixels) return 0;
+	glyph_cache_pixels = pixels;
+	glyph_cache_allocated = allocated;
+	return 1;
+}
+
+static unsigned int glyph_cache_hash(uint32_t codepoint, uint32_t fg, uint32_t bg, uint32_t flags) {
+	uint32_t h = codepoint * 0x9E3779B1;
+	h ^= fg + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	h ^= bg + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	h ^= flags + 0x7F4A7C15 + (h << 6) + (h >> 2);
+	return h & (GLYPH_CACHE_BUCKETS - 1);
+}
+
+static uint32_t * glyph_cache_slot(int index) {
+	return &glyph_cache_pixels[index * glyph_cache_stride * char_height];
+}
+
+static void glyph_cache_unlink(int index) {
+	struct glyph_cache_entry * e = &glyph_cache[index];
+	if (e->lru_prev != -1) glyph_cache[e->lru_prev].lru_next = e->lru_next;
+	else glyph_cache_head = e->lru_next;
+	if (e->lru_next != -1) glyph_cache[e->lru_next].lru_prev = e->lru_prev;
+	else glyph_cache_tail = e->lru_prev;
+}
+
+static void glyph_cache_push_front(int index) {
+	struct glyph_cache_entry * e = &glyph_cache[index];
+	e->lru_prev = -1;
+	e->lru_next = glyph_cache_head;
+	if (glyph_cache_head != -1) glyph_cache[glyph_cache_head].lru_prev = index;
+	glyph_cache_head = index;
+	if (glyph_cache_tail == -1) glyph_cache_tail = index;
+}
+
+static int glyph_cache_find(uint32_t codepoint, uint32_t fg, uint32_t bg, uint32_t flags) {
+	int i = glyph_cache_buckets[glyph_cache_hash(codepoint, fg, bg, flags)];
+	while (i != -1) {
+		struct glyph_cache_entry * e = &glyph_cache[i];
+		if (e->codepoint == codepoint && e->fg == fg && e->bg == bg && e->flags == flags) {
+			if (glyph_cache_head != i) {
+				glyph_cache_unlink(i);
+				glyph_cache_push_front(i);
+			}
+			return i;
+		}
+		i = e->hash_next;
+	}
+	return -1;
+}
+
+/* Take a free slot, or evict the least recently used entry, and file it under the new key. */
+static int glyph_cache_insert(uint32_t codepoint, uint32_t fg, uint32_t bg, uint32_t flags) {
+	int index;
+	if (glyph_cache_grow()) {
+		index = glyph_cache_used++;
+	} else {
+		index = glyph_cache_tail;
+		glyph_cache_unlink(index);
+		struct glyph_cache_entry * old = &glyph_cache[index];
+		int * link = &glyph_cache_buckets[glyph_cache_hash(old->codepoint, old->fg, old->bg, old->flags)];
+		while (*link != index) link = &glyph_cache[*link].hash_next;
+		*link = old->hash_next;
+	}
+
+	struct glyph_cache_entry * e = &glyph_cache[index];
+	e->codepoint = codepoint;
+	e->fg = fg;
+	e->bg = bg;
+	e->flags = flags;
+
+	unsigned int bucket = glyph_cache_hash(codepoint, fg, bg, flags);
+	e->hash_next = glyph_cache_buckets[bucket];
+	glyph_cache_buckets[bucket] = index;
+	glyph_cache_push_front(index);
+
+	return index;
+}
+
+/* Set a pixel in the glyph cache slot being rendered */
+static inline void glyph_set_point(uint16_t x, uint16_t y, uint32_t color) {
+	if (_fullscreen) {
+		/* In full screen mode, pre-blend the color over black. */
+		color = alpha_blend_rgba(premultiply(rgba(0,0,0,0xFF)), color);
+	}
+	GFX(&glyph_ctx, x, y) = color;
+}
+
 /* Draw a partial block character. */
-static void draw_semi_block(int c, int x, int y, uint32_t fg, uint32_t bg) {
+static void draw_semi_block(int c, uint32_t fg, uint32_t bg) {
 	bg = premultiply(bg);
 	fg = premultiply(fg);
 	if (c == 0x2580) {
 		for (uint8_t i = 0; i < char_height / 2; ++i) {
 			for (uint8_t j = 0; j < char_width; ++j) {
-				term_set_point(x+j,y+i,fg);
+				glyph_set_point(j,i,fg);
 			}
 		}
 	} else if (c >= 0x2589) {
@@ -631,7 +904,7 @@ static void draw_semi_block(int c, int x, int y, uint32_t fg, uint32_t bg) {
 		int width = char_width - ((c * char_width) / 8);
 		for (uint8_t i = 0; i < char_height; ++i) {
 			for (uint8_t j = 0; j < width; ++j) {
-				term_set_point(x+j, y+i, fg);
+				glyph_set_point(j, i, fg);
 			}
 		}
 	} else {
@@ -639,7 +912,7 @@ static void draw_semi_block(int c, int x, int y, uint32_t fg, uint32_t bg) {
 		int height = char_height - ((c * char_height) / 8);
 		for (uint8_t i = height; i < char_height; ++i) {
 			for (uint8_t j = 0; j < char_width; ++j) {
-				term_set_point(x+j, y+i,fg);
+				glyph_set_point(j, i,fg);
 			}
 		}
 	}
@@ -647,38 +920,19 @@ static void draw_semi_block(int c, int x, int y, uint32_t fg, uint32_t bg) {
 
 #include "apps/ununicode.h"
 
-/* Write a character to the window. */
-static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, uint32_t bg, uint8_t flags) {
-	uint32_t _fg, _bg;
-
-	/* Select foreground color from palette. */
-	if (fg < PALETTE_COLORS) {
-		_fg = term_colors[fg];
-		_fg |= 0xFF << 24;
-	} else {
-		_fg = fg;
-	}
-
-	/* Select background color from aplette. */
-	if (bg < PALETTE_COLORS) {
-		_bg = term_colors[bg];
-		if (flags & ANSI_SPECBG) {
-			_bg |= 0xFF << 24;
-		} else {
-			_bg |= TERM_DEFAULT_OPAC << 24;
+/* Render a character cell into the glyph cache slot selected by glyph_ctx. */
+static void render_glyph(uint32_t val, uint32_t _fg, uint32_t _bg, uint8_t flags, int cell_width) {
+	/* Fill in the background */
+	uint32_t fill = (val >= 0x2580 && val <= 0x258F) ? premultiply(_bg) : _bg;
+	for (uint8_t i = 0; i < char_height; ++i) {
+		for (int j = 0; j < cell_width; ++j) {
+			glyph_set_point(j,i,fill);
 		}
-	} else {
-		_bg = bg;
 	}
 
 	/* Draw block characters */
 	if (val >= 0x2580 && val <= 0x258F) {
-		for (uint8_t i = 0; i < char_height; ++i) {
-			for (uint8_t j = 0; j < char_width; ++j) {
-				term_set_point(x+j,y+i,premultiply(_bg));
-			}
-		}
-		draw_semi_block(val, x, y, _fg, _bg);
+		draw_semi_block(val, _fg, _bg);
 		goto _extra_stuff;
 	}
 
@@ -687,11 +941,6 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 		/* Draw using the Toaru SDF rendering library */
 		char tmp[7];
 		to_eight(val, tmp);
-		for (uint8_t i = 0; i < char_height; ++i) {
-			for (uint8_t j = 0; j < char_width; ++j) {
-				term_set_point(x+j,y+i,_bg);
-			}
-		}
 		if (val != 0 && val != ' ' && _fg != _bg) {
 			int _font = SDF_FONT_MONO;
 			if (flags & ANSI_BOLD && flags & ANSI_ITALIC) {
@@ -701,27 +950,10 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 			} else if (flags & ANSI_ITALIC) {
 				_font = SDF_FONT_MONO_OBLIQUE;
 			}
-			if (_no_frame) {
-				draw_sdf_string_gamma(ctx, x-1, y, tmp, font_size, _fg, _font, font_gamma);
-			} else {
-				draw_sdf_string_gamma(ctx, x+decor_left_width-1, y+decor_top_height+menu_bar_height, tmp, font_size, _fg, _font, font_gamma);
-			}
+			draw_sdf_string_gamma(&glyph_ctx, -1, 0, tmp, font_size, _fg, _font, font_gamma);
 		}
 	} else if (_use_aa && _have_freetype) {
 		/* Draw using freetype extension */
-		if (val == 0xFFFF) { return; } /* Unicode, do not redraw here */
-		for (uint8_t i = 0; i < char_height; ++i) {
-			for (uint8_t j = 0; j < char_width; ++j) {
-				term_set_point(x+j,y+i,_bg);
-			}
-		}
-		if (flags & ANSI_WIDE) {
-			for (uint8_t i = 0; i < char_height; ++i) {
-				for (uint8_t j = char_width; j < 2 * char_width; ++j) {
-					term_set_point(x+j,y+i,_bg);
-				}
-			}
-		}
 		if (val < 32 || val == ' ') {
 			goto _extra_stuff;
 		}
@@ -740,11 +972,7 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 		}
 		freetype_set_font_face(_font);
 		freetype_set_font_size(font_size);
-		if (_no_frame) {
-			freetype_draw_char(ctx, x, y + char_offset, _fg, val);
-		} else {
-			freetype_draw_char(ctx, x + decor_left_width, y + char_offset + decor_top_height + menu_bar_height, _fg, val);
-		}
+		freetype_draw_char(&glyph_ctx, 0, char_offset, _fg, val);
 	} else {
 		/* Convert other unicode characters. */
 		if (val > 128) {
@@ -755,9 +983,7 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 		for (uint8_t i = 0; i < char_height; ++i) {
 			for (uint8_t j = 0; j < char_width; ++j) {
 				if (c[i] & (1 << (15-j))) {
-					term_set_point(x+j,y+i,_fg);
-				} else {
-					term_set_point(x+j,y+i,_bg);
+					glyph_set_point(j,i,_fg);
 				}
 			}
 		}
@@ -767,49 +993,118 @@ static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, u
 _extra_stuff:
 	if (flags & ANSI_UNDERLINE) {
 		for (uint8_t i = 0; i < char_width; ++i) {
-			term_set_point(x + i, y + char_height - 1, _fg);
+			glyph_set_point(i, char_height - 1, _fg);
 		}
 	}
 	if (flags & ANSI_CROSS) {
 		for (uint8_t i = 0; i < char_width; ++i) {
-			term_set_point(x + i, y + char_height - 7, _fg);
+			glyph_set_point(i, char_height - 7, _fg);
 		}
 	}
 	if (flags & ANSI_BORDER) {
 		for (uint8_t i = 0; i < char_height; ++i) {
-			term_set_point(x , y + i, _fg);
-			term_set_point(x + (char_width - 1), y + i, _fg);
+			glyph_set_point(0, i, _fg);
+			glyph_set_point(char_width - 1, i, _fg);
 		}
 		for (uint8_t j = 0; j < char_width; ++j) {
-			term_set_point(x + j, y, _fg);
-			term_set_point(x + j, y + (char_height - 1), _fg);
+			glyph_set_point(j, 0, _fg);
+			glyph_set_point(j, char_height - 1, _fg);
 		}
 	}
+}
 
-	/* Calculate the bounds of the updated region of the window */
-	if (!_no_frame) {
-		l_x = min(l_x, decor_left_width + x);
-		l_y = min(l_y, decor_top_height+menu_bar_height + y);
+/* Write a character to the window. */
+static void term_write_char(uint32_t val, uint16_t x, uint16_t y, uint32_t fg, uint32_t bg, uint8_t flags) {
+	uint32_t _fg, _bg;
+
+	/* Select foreground color from palette. */
+	if (fg < PALETTE_COLORS) {
+		_fg = term_colors[fg];
+		_fg |= 0xFF << 24;
+	} else {
+		_fg = fg;
+	}
 
-		if (flags & ANSI_WIDE) {
-			r_x = max(r_x, decor_left_width + x + char_width * 2);
-			r_y = max(r_y, decor_top_height+menu_bar_height + y + char_height * 2);
+	/* Select background color from aplette. */
+	if (bg < PALETTE_COLORS) {
+		_bg = term_colors[bg];
+		if (flags & ANSI_SPECBG) {
+			_bg |= 0xFF << 24;
 		} else {
-			r_x = max(r_x, decor_left_width + x + char_width);
-			r_y = max(r_y, decor_top_height+menu_bar_height + y + char_height);
+			_bg |= TERM_DEFAULT_OPAC << 24;
 		}
 	} else {
-		l_x = min(l_x, x);
-		l_y = min(l_y, y);
+		_bg = bg;
+	}
 
-		if (flags & ANSI_WIDE) {
-			r_x = max(r_x, x + char_width * 2);
-			r_y = max(r_y, y + char_height * 2);
-		} else {
-			r_x = max(r_x, x + char_width);
-			r_y = max(r_y, y + char_height);
+	/* Freetype draws wide characters across both cells; do not redraw the second one here */
+	if (_use_aa && _have_freetype && val == 0xFFFF) return;
+
+	int cell_width = (flags & ANSI_WIDE) ? char_width * 2 : char_width;
+	uint32_t key_flags = flags & GLYPH_CACHE_FLAGS;
+
+	int index = glyph_cache_find(val, _fg, _bg, key_flags);
+	if (index == -1) {
+		glyph_cache_misses++;
+		index = glyph_cache_insert(val, _fg, _bg, key_flags);
+		glyph_ctx.width  = cell_width;
+		glyph_ctx.height = char_height;
+		glyph_ctx.depth  = 32;
+		glyph_ctx.stride = glyph_cache_stride * sizeof(uint32_t);
+		glyph_ctx.size   = glyph_ctx.stride * char_height;
+		glyph_ctx.buffer = (char *)glyph_cache_slot(index);
+		glyph_ctx.backbuffer = glyph_ctx.buffer;
+		glyph_ctx.clips = NULL;
+		render_glyph(val, _fg, _bg, flags, cell_width);
+	} else {
+		glyph_cache_hits++;
+	}
+
+	/* Copy the cell into the window, a row at a time */
+	int dst_x = x + (_no_frame ? 0 : decor_left_width);
+	int dst_y = y + (_no_frame ? 0 : decor_top_height + menu_bar_height);
+	int copy_width = min(cell_width, (int)ctx->width - dst_x);
+	if (copy_width > 0) {
+		uint32_t * src = glyph_cache_slot(index);
+		for (int i = 0; i < char_height && dst_y + i < ctx->height; ++i) {
+			memcpy(&GFX(ctx, dst_x, dst_y + i), &src[i * glyph_cache_stride], copy_width * sizeof(uint32_t));
 		}
 	}
+
+	mark_damage(dst_x, dst_y, cell_width, char_height);
+}
+
+/*
+ * Debug overlay: glyph cache occupancy and hit rate, and
+ * how long the last batch of terminal output took to render.
+ */
+#define DEBUG_OVERLAY_WIDTH  330
+#define DEBUG_OVERLAY_HEIGHT 40
+
+static void render_debug_overlay(void) {
+	if (!_debug_overlay) return;
+
+	int x = (_no_frame ? 0 : decor_left_width) + window_width - DEBUG_OVERLAY_WIDTH;
+	int y = _no_frame ? 0 : decor_top_height + menu_bar_height;
+	if (x < 0) x = 0;
+
+	draw_rectangle_solid(ctx, x, y, DEBUG_OVERLAY_WIDTH, DEBUG_OVERLAY_HEIGHT, rgba(0,0,0,200));
+
+	char line[100];
+	uint64_t lookups = glyph_cache_hits + glyph_cache_misses;
+	snprintf(line, 100, "glyphs: %d/%d cached, %d.%d%% hits",
+		glyph_cache_used, glyph_cache_limit,
+		lookups ? (int)(glyph_cache_hits * 100 / lookups) : 0,
+		lookups ? (int)(glyph_cache_hits * 1000 / lookups % 10) : 0);
+	draw_sdf_string(ctx, x + 4, y + 2, line, 14, rgb(255,255,255), SDF_FONT_MONO);
+
+	uint64_t average = frame_count ? frame_time_total / frame_count : 0;
+	snprintf(line, 100, "frame: %d.%03dms, average %d.%03dms",
+		(int)(frame_time_last / 1000), (int)(frame_time_last % 1000),
+		(int)(average / 1000), (int)(average % 1000));
+	draw_sdf_string(ctx, x + 4, y + 20, line, 14, rgb(255,255,255), SDF_FONT_MONO);
+
+	mark_damage(x, y, DEBUG_OVERLAY_WIDTH, DEBUG_OVERLAY_HEIGHT);
 }
 
 /* Set a terminal cell */
@@ -843,15 +1138,9 @@ static void redraw_cell_image(uint16_t x, uint16_t y, term_cell_t * cell) {
 
 	/* Update bounds */
 	if (!_no_frame) {
-		l_x = min(l_x, decor_left_width + x * char_width);
-		l_y = min(l_y, decor_top_height+menu_bar_height + y * char_height);
-		r_x = max(r_x, decor_left_width + x * char_width + char_width);
-		r_y = max(r_y, decor_top_height+menu_bar_height + y * char_height + char_height);
+		mark_damage(decor_left_width + x * char_width, decor_top_height+menu_bar_height + y * char_height, char_width, char_height);
 	} else {
-		l_x = min(l_x, x * char_width);
-		l_y = min(l_y, y * char_height);
-		r_x = max(r_x, x * char_width + char_width);
-		r_y = max(r_y, y * char_height + char_height);
+		mark_damage(x * char_width, y * char_height, char_width, char_height);
 	}
 }
 
@@ -1127,6 +1416,13 @@ static void term_shift_region(int top, int height, int how_much) {
 			size_t siz = count * char_height * GFX_W(ctx) * GFX_B(ctx);
 			memmove((void*)dst, (void*)src, siz);
 		}
+
+		/* The moved rows need to be flipped along with the cleared ones */
+		if (!_no_frame) {
+			mark_damage(decor_left_width, decor_top_height + menu_bar_height + top * char_height, term_width * char_width, height * char_height);
+		} else {
+			mark_damage(0, top * char_height, term_width * char_width, height * char_height);
+		}
 	}
 
 	/* Clear new lines at bottom */
@@ -1145,9 +1441,6 @@ static void term_scroll(int how_much) {
 
 	/* Remove image data for image cells that are no longer on screen. */
 	flush_unused_images();
-
-	/* Flip the entire window. */
-	yutani_flip(yctx, window);
 }
 
 static void insert_delete_lines(int how_many) {
@@ -1802,6 +2095,9 @@ static void reinit(void) {
 		char_height = 20;
 	}
 
+	/* Cached glyphs are the wrong size or from the wrong renderer now */
+	glyph_cache_reset();
+
 	int old_width  = term_width;
 	int old_height = term_height;
 
@@ -1914,7 +2210,8 @@ static void resize_finish(int width, int height) {
 
 	/* We are done resizing. */
 	yutani_window_resize_done(yctx, window);
-	yutani_flip(yctx, window);
+	mark_damage(0, 0, window->width, window->height);
+	display_flip_now();
 }
 
 /* Insert a mouse event sequence into the PTY */
@@ -2176,6 +2473,17 @@ static void _menu_action_toggle_sdf(struct MenuEntry * self) {
 	reinit();
 }
 
+static void _menu_action_toggle_debug_overlay(struct MenuEntry * self) {
+	_debug_overlay = !(_debug_overlay);
+	menu_update_title(self, _debug_overlay ? "Hide debug overlay" : "Show debug overlay");
+	glyph_cache_hits = 0;
+	glyph_cache_misses = 0;
+	frame_time_total = 0;
+	frame_count = 0;
+	term_redraw_all();
+	display_flip();
+}
+
 static void _menu_action_toggle_free_size(struct MenuEntry * self) {
 	_free_size = !(_free_size);
 	menu_update_title(self, _free_size ? "Snap to Cell Size" : "Freely Resize");
@@ -2221,6 +2529,45 @@ static void render_decors_callback(struct menu_bar * self) {
 	render_decors();
 }
 
+/*
+ * Feed a file through the terminal the same way the main loop
+ * feeds it pty output, and report how fast it rendered and how
+ * many flips the compositor was sent.
+ */
+static int run_bench(char * argv[]) {
+	FILE * f = fopen(bench_file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], bench_file, strerror(errno));
+		return 1;
+	}
+
+	unsigned char buf[4096];
+	size_t total = 0;
+	uint64_t start = get_ticks();
+
+	size_t r;
+	while ((r = fread(buf, 1, 4096, f)) > 0) {
+		for (size_t i = 0; i < r; ++i) {
+			ansi_put(ansi_state, buf[i]);
+		}
+		display_flip();
+		total += r;
+	}
+	display_flip_now();
+
+	uint64_t elapsed = get_ticks() - start;
+	fclose(f);
+
+	uint64_t rate = elapsed ? (uint64_t)total * 1000000 / elapsed : 0;
+	fprintf(stderr, "%s: %zu bytes in %d.%03ds, %d.%02d MiB/s, %d region flips, %d full flips\n",
+		bench_file, total,
+		(int)(elapsed / 1000000), (int)(elapsed / 1000 % 1000),
+		(int)(rate >> 20), (int)((rate & 0xFFFFF) * 100 >> 20),
+		(int)flips_region, (int)flips_full);
+
+	return 0;
+}
+
 int main(int argc, char ** argv) {
 
 	window_width  = char_width * 80;
@@ -2235,6 +2582,7 @@ int main(int argc, char ** argv) {
 		{"no-frame",   no_argument,       0, 'n'},
 		{"geometry",   required_argument, 0, 'g'},
 		{"no-ft",      no_argument,       0, 'f'},
+		{"bench",      required_argument, 0, 'B'},
 		{0,0,0,0}
 	};
 
@@ -2256,6 +2604,9 @@ int main(int argc, char ** argv) {
 			case 'f':
 				_force_no_ft = 1;
 				break;
+			case 'B':
+				bench_file = optarg;
+				break;
 			case 'F':
 				_fullscreen = 1;
 				_no_frame = 1;
@@ -2377,6 +2728,7 @@ int main(int argc, char ** argv) {
 	menu_insert(m, menu_create_normal(NULL, NULL, _free_size ? "Snap to Cell Size" : "Freely Resize", _menu_action_toggle_free_size));
 	menu_insert(m, menu_create_separator());
 	menu_insert(m, menu_create_normal(NULL, NULL, "Redraw", _menu_action_redraw));
+	menu_insert(m, menu_create_normal(NULL, NULL, "Show debug overlay", _menu_action_toggle_debug_overlay));
 	menu_set_insert(terminal_menu_bar.set, "view", m);
 
 	m = menu_create();
@@ -2404,6 +2756,10 @@ int main(int argc, char ** argv) {
 	/* Initialize the terminal buffer and ANSI library for the first time. */
 	reinit();
 
+	if (bench_file) {
+		return run_bench(argv);
+	}
+
 	/* Run thread to handle asynchronous writes to the tty */
 	pthread_t input_buffer_thread;
 	pipe(input_buffer_semaphore);
@@ -2457,7 +2813,7 @@ int main(int argc, char ** argv) {
 
 			/* Wait for something to happen. */
 			int res[] = {0,0};
-			fswait3(2,fds,200,res);
+			fswait3(2,fds,display_flip_timeout(200),res);
 
 			/* Check if the child application has closed. */
 			check_for_exit();
@@ -2465,16 +2821,23 @@ int main(int argc, char ** argv) {
 
 			if (res[1]) {
 				/* Read from PTY */
+				uint64_t frame_start = get_ticks();
 				ssize_t r = read(fd_master, buf, 4096);
 				for (ssize_t i = 0; i < r; ++i) {
 					ansi_put(ansi_state, buf[i]);
 				}
 				display_flip();
+				frame_time_last = get_ticks() - frame_start;
+				frame_time_total += frame_time_last;
+				frame_count++;
 			}
 			if (res[0]) {
 				/* Handle Yutani events. */
 				handle_incoming();
 			}
+
+			/* Flip anything that was held back by the rate limit */
+			display_flip();
 		}
 	}
 
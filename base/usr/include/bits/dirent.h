@@ -2,21 +2,49 @@
 
 #include <_cheader.h>
 #include <stdint.h>
+#include <stddef.h>
 
 _Begin_C_Header
 
 typedef struct dirent {
 	uint32_t d_ino;
 	char d_name[256];
+	unsigned char d_type;
 } dirent;
 
+/* As returned by getdents: d_reclen bytes each */
+struct packed_dirent {
+	uint32_t d_ino;
+	uint16_t d_reclen;
+	uint8_t  d_type;
+	char     d_name[];
+} __attribute__((packed));
+
+#define DT_UNKNOWN 0
+#define DT_FIFO    1
+#define DT_CHR     2
+#define DT_DIR     4
+#define DT_BLK     6
+#define DT_REG     8
+#define DT_LNK     10
+
+#define DIRENT_BUFSIZ 4096
+
 typedef struct DIR {
 	int fd;
 	int cur_entry;
+	size_t buf_used;
+	size_t buf_pos;
+	struct dirent ent;
+	char buf[DIRENT_BUFSIZ];
 } DIR;
 
 DIR * opendir (const char * dirname);
 int closedir (DIR * dir);
 struct dirent * readdir (DIR * dirp);
+void rewinddir (DIR * dirp);
+
+/* Fill @p buf with packed entries; returns bytes used, 0 at the end */
+long getdents (int fd, void * buf, size_t size);
 
 _End_C_Header
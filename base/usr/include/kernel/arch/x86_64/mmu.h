@@ -8,6 +8,9 @@
 #define MMU_FLAG_SPEC         0x10
 #define MMU_FLAG_WC           (MMU_FLAG_NOCACHE | MMU_FLAG_WRITETHROUGH | MMU_FLAG_SPEC)
 #define MMU_FLAG_NOEXECUTE    0x20
+#define MMU_FLAG_SHARED       0x40 /* Frame belongs to the page cache */
+#define MMU_FLAG_SHM          0x80 /* Frame belongs to a shared memory chunk */
+#define MMU_FLAG_DEVICE       0x100 /* Frame is device memory */
 
 #define MMU_GET_MAKE 0x01
 
@@ -20,6 +23,9 @@ uintptr_t mmu_first_frame(void);
 void mmu_frame_allocate(union PML * page, unsigned int flags);
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr);
 void mmu_frame_free(union PML * page);
+void mmu_frame_unmap(union PML * page);
+void mmu_frame_release(uintptr_t frame_addr);
+void mmu_map_shared(uintptr_t virtAddr, uintptr_t frame);
 uintptr_t mmu_map_to_physical(uintptr_t virtAddr);
 union PML * mmu_get_page(uintptr_t virtAddr, int flags);
 void mmu_set_directory(union PML * new_pml);
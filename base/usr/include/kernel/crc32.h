@@ -0,0 +1,12 @@
+/**
+ * @brief CRC-32 checksums (the gzip / PNG polynomial).
+ *
+ * Same interface as userspace's libtoaru_crc32: start with a @c crc
+ * of 0 and feed each result back in to continue it.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+extern uint32_t crc32_update(uint32_t crc, const void * data, size_t len);
@@ -6,6 +6,9 @@
  * very straightforward API: Point @c gzip_inputPtr at your gzip data,
  * point @c gzip_outputPtr where you want the output to go, and then
  * run @c gzip_decompress().
+ *
+ * Returns 0 on success, 1 for a malformed stream, and 2 if the output
+ * doesn't match the CRC and length in the gzip trailer.
  */
 #pragma once
 
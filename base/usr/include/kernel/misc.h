@@ -2,6 +2,7 @@
 #include <kernel/types.h>
 
 size_t arch_cpu_mhz(void);
+uint64_t arch_perf_timer(void);
 
 const char * arch_get_cmdline(void);
 const char * arch_get_loader(void);
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/vfs.h>
+
+#define PAGECACHE_STATIC 0x01 /* Filesystem contents never change; cache all reads */
+
+void pagecache_install(void);
+void pagecache_register(read_type_t read, int flags);
+int pagecache_mappable(fs_node_t * node);
+int pagecache_cached_reads(fs_node_t * node);
+
+uint64_t pagecache_read(fs_node_t * node, uint64_t offset, uint64_t size, uint8_t * buffer);
+void pagecache_write(fs_node_t * node, uint64_t offset, uint64_t size, uint8_t * buffer);
+void pagecache_forget(fs_node_t * node);
+
+long pagecache_mmap(fs_node_t * node, uintptr_t address, size_t length, uint64_t offset);
+
+/* For the MMU, as address spaces holding shared pages are cloned and freed */
+void pagecache_ref(uintptr_t frame);
+int pagecache_unref(uintptr_t frame);
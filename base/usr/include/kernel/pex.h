@@ -0,0 +1,85 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ *
+ * Shared-memory message rings for packetfs clients.
+ *
+ * A client can give packetfs a shared memory region (IOCTL_PACKETFS_RING)
+ * holding one single-producer, single-consumer ring in each direction.
+ * Messages then go straight through the rings; the kernel only looks at
+ * the ring indices to answer fswait, and the producer only calls into the
+ * kernel (IOCTL_PACKETFS_DOORBELL) when the consumer may be asleep.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define PEX_RING_SIZE     0x10000    /* Bytes of message data in each direction, power of two */
+#define PEX_RING_SHM_SIZE (0x1000 + 2 * PEX_RING_SIZE)
+#define PEX_RING_PAD      0xFFFFFFFF /* Record length meaning "skip to the start of the ring" */
+
+/*
+ * Records are a uint32_t length followed by the message, padded to
+ * eight bytes, and never wrap around the end of the ring.
+ * head and tail are free-running byte counters.
+ */
+struct pex_ring {
+	volatile uint32_t head;    /* Written by the producer */
+	volatile uint32_t tail;    /* Written by the consumer */
+	volatile uint32_t waiting; /* Set when the consumer may be asleep */
+	volatile uint32_t blocked; /* Set while the producer is waiting for room */
+};
+
+/*
+ * A producer waiting for room (a server with a backlog, or a client
+ * replying into a full ring) is woken by the consumer's doorbell, or by
+ * fswait noticing, once its ring is at least half empty again, rather
+ * than after every message taken out. The flag stays set until it has
+ * written what it was holding, so whether to wake it never depends on timing.
+ */
+#define PEX_RING_ROOMY(ring) (PEX_RING_SIZE - ((ring)->head - (ring)->tail) >= PEX_RING_SIZE / 2)
+
+/* First page of the shared region; the to_server data follows it, then the to_client data. */
+struct pex_ring_shared {
+	struct pex_ring to_server;
+	struct pex_ring to_client;
+};
+
+#define PEX_RING_DATA_SERVER(shared) ((char *)(shared) + 0x1000)
+#define PEX_RING_DATA_CLIENT(shared) ((char *)(shared) + 0x1000 + PEX_RING_SIZE)
+
+/*
+ * Queued to the server, from the client, when a ring is set up.
+ * The server maps the region by key and accepts it with
+ * IOCTL_PACKETFS_RING_ACCEPT, after which broadcasts from the
+ * kernel skip the client and the server writes to its ring instead.
+ */
+#define PEX_RING_MAGIC 0x474E4952 /* RING */
+
+struct pex_ring_announce {
+	uint32_t magic;
+	char key[60];
+};
+
+/*
+ * Messages for a client that is not keeping up are held in a backlog
+ * of up to this many messages (IOCTL_PACKETFS_DEPTH changes it) rather
+ * than being dropped. A message sent with IOCTL_PACKETFS_SEND_COALESCE
+ * replaces any backlogged message that starts with the same key_size
+ * bytes, for things like resize offers where only the latest matters.
+ */
+#define PEX_DEFAULT_DEPTH 256
+
+struct pex_coalesce {
+	uintptr_t target;  /* Client, or 0 to broadcast */
+	uint32_t key_size; /* Leading bytes that identify the message */
+	uint32_t size;
+	void * data;
+};
+
+/* IOCTL_PACKETFS_CLIENT_STATS; the server fills in everything after client */
+struct pex_client_stats {
+	uintptr_t client;
+	uint32_t queued;       /* Messages in the backlog */
+	uint32_t queued_bytes;
+	uint32_t dropped;      /* Lost because the backlog was full */
+	uint32_t coalesced;    /* Replaced by newer copies */
+};
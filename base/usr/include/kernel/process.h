@@ -19,6 +19,8 @@ typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
+	size_t rss; /* Resident user pages, kept up to date by the MMU */
+	size_t shm; /* Pages of shared memory mapped */
 } page_directory_t;
 
 typedef struct {
@@ -105,6 +107,15 @@ typedef struct process {
 	struct timeval start;
 	int awoken_index;
 
+	struct {
+		uint64_t user;        /* TSC cycles spent in userspace */
+		uint64_t system;      /* ... and in the kernel */
+		uint64_t mark;        /* When we were last charged for time */
+		uint64_t last_run;    /* When we were last switched to */
+		uint64_t voluntary;   /* Switches away to wait for something */
+		uint64_t involuntary; /* Switches away while still runnable */
+	} usage;
+
 	thread_t thread;
 	thread_t signal_state;
 	image_t image;
@@ -177,6 +188,7 @@ extern unsigned long process_append_fd(process_t * proc, fs_node_t * node);
 extern long process_move_fd(process_t * proc, long src, long dest);
 extern void initialize_process_tree(void);
 extern process_t * process_from_pid(pid_t pid);
+extern void process_foreach(void (*func)(process_t * proc, void * ctx), void * ctx);
 
 extern void process_delete(process_t * proc);
 extern void make_process_ready(volatile process_t * proc);
@@ -187,6 +199,7 @@ extern int sleep_on(list_t * queue);
 extern int process_alert_node(process_t * process, void * value);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 extern void switch_task(uint8_t reschedule);
+extern void process_charge_time(int user);
 extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout);
 extern process_t * process_get_parent(process_t * process);
 extern int process_is_ready(process_t * proc);
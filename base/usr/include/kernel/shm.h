@@ -38,4 +38,6 @@ extern int    shm_release(char * path);
 /* Other exposed functions */
 extern void shm_install(void);
 extern void shm_release_all(process_t * proc);
+extern shm_chunk_t * shm_chunk_get(char * path);
+extern void shm_chunk_put(shm_chunk_t * chunk);
 
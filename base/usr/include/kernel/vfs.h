@@ -58,6 +58,8 @@ typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
 typedef int (*chown_type_t) (struct fs_node *, int, int);
 typedef void (*truncate_type_t) (struct fs_node *);
+typedef int (*dirent_emit_t) (void * ctx, uint64_t ino, const char * name, int type);
+typedef long (*getdents_type_t) (struct fs_node *, uint64_t index, dirent_emit_t emit, void * ctx);
 
 typedef struct fs_node {
 	char name[256];         /* The filename. */
@@ -101,6 +103,8 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 
 	chown_type_t chown;
+
+	getdents_type_t getdents;
 } fs_node_t;
 
 struct dirent {
@@ -108,6 +112,22 @@ struct dirent {
 	char name[256];         /* The filename. */
 };
 
+/* Entries as packed into a user buffer by getdents */
+struct packed_dirent {
+	uint32_t d_ino;
+	uint16_t d_reclen;      /* Bytes to the next entry */
+	uint8_t  d_type;        /* DT_* */
+	char     d_name[];      /* Nul-terminated */
+} __attribute__((packed));
+
+#define DT_UNKNOWN 0
+#define DT_FIFO    1
+#define DT_CHR     2
+#define DT_DIR     4
+#define DT_BLK     6
+#define DT_REG     8
+#define DT_LNK     10
+
 struct stat  {
 	uint16_t  st_dev;
 	uint16_t  st_ino;
@@ -140,6 +160,7 @@ uint64_t write_fs(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buff
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, uint64_t index);
+long getdents_fs(fs_node_t *node, uint64_t index, dirent_emit_t emit, void * ctx);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 int mkdir_fs(char *name, uint16_t permission);
 int create_file_fs(char *name, uint16_t permission);
@@ -163,6 +184,13 @@ int vfs_register(const char * name, vfs_mount_callback callback);
 int vfs_mount_type(const char * type, const char * arg, const char * mountpoint);
 void vfs_lock(fs_node_t * node);
 
+#define DCACHE_STATIC 0x01 /* Filesystem contents never change; cache everything */
+void vfs_dcache_install(void);
+void vfs_dcache_register(finddir_type_t finddir, int flags);
+fs_node_t * vfs_dcache_finddir(fs_node_t * parent, char * name, int leaf);
+void vfs_dcache_invalidate(fs_node_t * parent, char * name);
+void vfs_dcache_flush(void);
+
 /* Debug purposes only, please */
 void debug_print_vfs_tree(void);
 
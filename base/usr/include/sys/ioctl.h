@@ -11,5 +11,11 @@
 #define IOCTLTTYNAME  0x4F01
 #define IOCTLTTYLOGIN 0x4F02
 
-#define IOCTL_PACKETFS_QUEUED 0x5050
+#define IOCTL_PACKETFS_QUEUED        0x5050
+#define IOCTL_PACKETFS_RING          0x5051
+#define IOCTL_PACKETFS_RING_ACCEPT   0x5052
+#define IOCTL_PACKETFS_DOORBELL      0x5053
+#define IOCTL_PACKETFS_CLIENT_STATS  0x5054
+#define IOCTL_PACKETFS_DEPTH         0x5055
+#define IOCTL_PACKETFS_SEND_COALESCE 0x5056
 
@@ -1,3 +1,12 @@
 #pragma once
 
-/* Nothing here, we don't have an mmap implementation yet? */
+#include <_cheader.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+/* There is no general mmap yet; this maps file pages read-only at a fixed address */
+extern int mapfile(int fd, void * addr, size_t length, off_t offset);
+
+_End_C_Header
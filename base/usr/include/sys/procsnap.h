@@ -0,0 +1,48 @@
+#pragma once
+
+/**
+ * Layout of /proc/snapshot, a binary view of every process, taken all
+ * at once. Read it with a single read() into a buffer big enough for
+ * header.size bytes; anything else may mix two different snapshots.
+ */
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define PROC_SNAPSHOT_VERSION 1
+
+struct proc_snapshot_header {
+	uint32_t version;
+	uint32_t size;      /* Bytes in the whole snapshot, this header included */
+	uint32_t count;     /* Records following the header */
+	uint32_t _reserved;
+	uint64_t mem_total; /* kB of usable memory */
+};
+
+struct proc_snapshot_entry {
+	uint32_t reclen;    /* Bytes in this record, strings and padding included */
+	int32_t  pid;
+	int32_t  tgid;
+	int32_t  ppid;
+	int32_t  pgid;
+	int32_t  sid;
+	int32_t  uid;
+	int32_t  last_core;
+	char     state;     /* As in /proc/<pid>/status */
+	char     _pad[7];
+	uint64_t rss;       /* kB */
+	uint64_t shm;       /* kB */
+	uint64_t utime;     /* Microseconds spent in userspace */
+	uint64_t stime;     /* Microseconds spent in the kernel */
+	uint64_t voluntary;
+	uint64_t involuntary;
+	/* The process name, then each command line argument, each
+	 * nul-terminated; an empty string ends the list. */
+	char     strings[];
+};
+
+#define PROC_SNAPSHOT_NEXT(e) ((struct proc_snapshot_entry *)((char *)(e) + (e)->reclen))
+
+_End_C_Header
@@ -87,6 +87,8 @@ DECL_SYSCALL1(setuid, unsigned int);
 DECL_SYSCALL5(getsockopt,int,int,int,void*,size_t*);
 DECL_SYSCALL0(reboot);
 DECL_SYSCALL3(readdir, int, int, void *);
+DECL_SYSCALL3(getdents, int, void *, size_t);
+DECL_SYSCALL4(mapfile, int, void *, size_t, long);
 DECL_SYSCALL1(chdir, char *);
 DECL_SYSCALL2(getcwd, char *, size_t);
 DECL_SYSCALL3(clone, uintptr_t, uintptr_t, void *);
@@ -65,3 +65,5 @@
 #define SYS_SETPGID 63
 #define SYS_GETPGID 64
 #define SYS_FSWAIT3 65
+#define SYS_GETDENTS 66
+#define SYS_MAPFILE 67
@@ -0,0 +1,33 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * CRC-32 (the gzip / PNG / zlib polynomial).
+ */
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+/**
+ * Continue a CRC over @p len more bytes. Start with a @p crc of 0;
+ * the return value is the finished CRC of everything so far and can
+ * be passed back in to continue with the next piece.
+ */
+extern uint32_t crc32_update(uint32_t crc, const void * data, size_t len);
+
+/**
+ * CRC of a single buffer.
+ */
+extern uint32_t crc32(const void * data, size_t len);
+
+/**
+ * Name of the implementation picked for this CPU ("pclmul" or "slice8").
+ */
+extern const char * crc32_implementation(void);
+
+_End_C_Header
@@ -42,8 +42,7 @@ typedef struct context {
 	uint32_t size;
 	char *   buffer;
 	char *   backbuffer;
-	char *   clips;
-	int32_t  clips_size;
+	struct gfx_clip * clips; /* Rectangle list from gfx_add_clip, or NULL to draw everywhere */
 	uint32_t stride;
 } gfx_context_t;
 
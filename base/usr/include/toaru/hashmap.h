@@ -19,10 +19,12 @@ typedef int (*hashmap_comp_t) (void * a, void * b);
 typedef void (*hashmap_free_t) (void *);
 typedef void * (*hashmap_dupe_t) (void *);
 
+/* Slots are stored inline; distance is how far from home plus one, or 0 if empty */
 typedef struct hashmap_entry {
 	char * key;
 	void * value;
-	struct hashmap_entry * next;
+	unsigned int hash;
+	unsigned int distance;
 } hashmap_entry_t;
 
 typedef struct hashmap {
@@ -30,9 +32,10 @@ typedef struct hashmap {
 	hashmap_comp_t hash_comp;
 	hashmap_dupe_t hash_key_dup;
 	hashmap_free_t hash_key_free;
-	hashmap_free_t hash_val_free;
-	size_t         size;
-	hashmap_entry_t ** entries;
+	hashmap_free_t hash_val_free; /* Unused; values belong to the caller */
+	size_t         size;  /* Number of slots, always a power of two */
+	size_t         count; /* Number of slots in use */
+	hashmap_entry_t * entries;
 } hashmap_t;
 
 extern hashmap_t * hashmap_create(int size);
@@ -27,11 +27,23 @@ struct inflate_context {
 	int bit_buffer;
 	int buffer_size;
 
-	/* Output ringbuffer for backwards lookups */
+	/* Output ringbuffer for backwards lookups; NULL uses a shared one, for one decompression at a time */
 	struct huff_ring * ring;
 };
 
+/**
+ * Allocate a ringbuffer for one context, for decompressing on more
+ * than one thread at once. Release it with free().
+ */
+struct huff_ring * inflate_ring_create(void);
+
 int deflate_decompress(struct inflate_context * ctx);
+
+/**
+ * Decompress a gzip stream. Returns 0 on success, 1 if the stream
+ * is malformed, and 2 if the output doesn't match the CRC and size
+ * recorded in the trailer.
+ */
 int gzip_decompress(struct inflate_context * ctx);
 
 _End_C_Header
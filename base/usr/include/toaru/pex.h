@@ -3,6 +3,7 @@
 #include <_cheader.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <kernel/pex.h>
 
 _Begin_C_Header
 
@@ -21,6 +22,8 @@ typedef struct pex_header {
 
 extern size_t pex_send(FILE * sock, uintptr_t rcpt, size_t size, char * blob);
 extern size_t pex_broadcast(FILE * sock, size_t size, char * blob);
+extern size_t pex_send_coalesce(FILE * sock, uintptr_t rcpt, size_t key, size_t size, char * blob);
+extern size_t pex_broadcast_coalesce(FILE * sock, size_t key, size_t size, char * blob);
 extern size_t pex_listen(FILE * sock, pex_packet_t * packet);
 
 extern size_t pex_reply(FILE * sock, size_t size, char * blob);
@@ -30,4 +33,7 @@ extern size_t pex_query(FILE * sock);
 extern FILE * pex_bind(char * target);
 extern FILE * pex_connect(char * target);
 
+extern int pex_set_depth(FILE * sock, size_t depth);
+extern int pex_client_stats(FILE * sock, uintptr_t client, struct pex_client_stats * stats);
+
 _End_C_Header
@@ -0,0 +1,56 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * Streaming extraction of (optionally gzipped) ustar archives.
+ */
+#pragma once
+
+#include <_cheader.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+#define TAR_LIST       (1 << 0) /* Print member names instead of extracting */
+#define TAR_VERBOSE    (1 << 1) /* Print member names while extracting (with sizes and types when listing) */
+#define TAR_STDOUT     (1 << 2) /* Write file contents to stdout */
+#define TAR_SAME_OWNER (1 << 3) /* Give extracted files the owner recorded in the archive */
+
+struct tar_options {
+	int flags;
+
+	/* Extract relative to this directory instead of the working directory */
+	const char * directory;
+
+	/* Prefix for error messages; "tar" if not set */
+	const char * progname;
+
+	/* If set, only members this returns non-zero for are extracted or listed */
+	int (*filter)(const char * name, void * priv);
+
+	/* If set, called with the name of each member as it is extracted */
+	void (*progress)(const char * name, void * priv);
+
+	void * priv;
+
+	/* Filled in by tar_extract: members handled and file bytes written */
+	size_t files;
+	size_t bytes;
+};
+
+/**
+ * Extract an archive read from @p fd. Compressed archives are detected
+ * and inflated on a second thread, straight into the extractor.
+ *
+ * Returns 0 on success, 1 if any member could not be extracted or the
+ * archive is malformed, and 2 if the compressed data is corrupt.
+ */
+extern int tar_extract(int fd, struct tar_options * opts);
+
+/**
+ * As above, reading from the file at @p path, or stdin for "-".
+ */
+extern int tar_extract_file(const char * path, struct tar_options * opts);
+
+_End_C_Header
@@ -78,18 +78,32 @@ static int yutani_is_closing_animation[] = {
 /* Debug Options */
 #define YUTANI_DEBUG_WINDOW_BOUNDS 1
 #define YUTANI_DEBUG_WINDOW_SHAPES 1
+#define YUTANI_DEBUG_OVERLAY 1
 
 /* Command line flag values */
 struct {
 	int nested;
 	int nest_width;
 	int nest_height;
+	int threads;      /* Composition threads, 0 for one per CPU */
+	int bench_frames; /* Render this many synthetic frames and exit */
 } yutani_options = {
 	.nested = 0,
 	.nest_width = 640,
 	.nest_height = 480,
+	.threads = 0,
+	.bench_frames = 0,
 };
 
+/*
+ * Part of a row of a window that is fully opaque, [left, right).
+ * Used to find windows that are completely hidden behind others.
+ */
+typedef struct {
+	int32_t left;
+	int32_t right;
+} yutani_opaque_span_t;
+
 /*
  * Server window definitions
  */
@@ -129,6 +143,7 @@ typedef struct YutaniServerWindow {
 	/* Window animations */
 	uint64_t anim_mode;
 	uint64_t anim_start;
+	int anim_frame; /* Set at the start of each rendered frame */
 
 	/* Alpha shaping threshold */
 	int alpha_threshold;
@@ -154,8 +169,52 @@ typedef struct YutaniServerWindow {
 
 	/* Window opacity */
 	int opacity;
+
+	/* Opaque span of each row, and the rows that need to be rescanned */
+	yutani_opaque_span_t * opaque;
+	int32_t opaque_dirty_top;
+	int32_t opaque_dirty_bottom;
+
+	/* Flips received; those whose damage the frame being drawn collected; those presented */
+	volatile uint32_t flips;
+	uint32_t flips_seen;
+	volatile uint32_t flips_presented;
 } yutani_server_window_t;
 
+/* Frames are paced to this interval, in microseconds */
+#define YUTANI_FRAME_INTERVAL 16666
+
+/*
+ * Frame time histogram buckets, by upper bound in milliseconds;
+ * the last bucket takes everything slower.
+ */
+#define YUTANI_FRAME_BUCKETS 6
+#define YUTANI_FRAME_BUCKET_LIMITS {2, 4, 8, 16, 33, 0}
+
+/* Counters for the last rendered frame, for the debug overlay */
+typedef struct {
+	int windows_considered;
+	int windows_blitted;
+	int windows_skipped;
+	uint64_t pixels_blended;
+	int threads;
+	int tiles;
+	uint64_t compose_us;
+
+	/* Whole frames, from damage collection to the flip, since startup */
+	uint64_t frame_us;
+	uint32_t frames;
+	uint32_t frames_late; /* Took longer than YUTANI_FRAME_INTERVAL */
+	uint32_t frame_histogram[YUTANI_FRAME_BUCKETS];
+} yutani_frame_stats_t;
+
+/* A client waiting to hear that a frame was presented */
+typedef struct {
+	yutani_server_window_t * window;
+	uintptr_t owner;
+	uint32_t flip; /* Answered once this many of the window's flips have been presented */
+} yutani_frame_callback_t;
+
 typedef struct YutaniGlobals {
 	/* Display resolution */
 	unsigned int width;
@@ -202,6 +261,20 @@ typedef struct YutaniGlobals {
 	list_t * update_list;
 	volatile int update_list_lock;
 
+	/* Damage being rendered in the current frame */
+	list_t * frame_damage;
+
+	/*
+	 * The render thread sleeps on this pipe when there is nothing
+	 * to draw; render_idle says whether anyone needs to write to it.
+	 */
+	int wake_pipe[2];
+	volatile int render_idle;
+
+	/* Pending frame-done callbacks */
+	list_t * frame_callbacks;
+	volatile int frame_callbacks_lock;
+
 	/* Mouse cursors */
 	sprite_t mouse_sprite;
 	sprite_t mouse_sprite_drag;
@@ -278,6 +351,9 @@ typedef struct YutaniGlobals {
 	/* Toggles for debugging window locations */
 	int debug_bounds;
 	int debug_shapes;
+	int debug_overlay;
+
+	yutani_frame_stats_t frame_stats;
 
 	/* If the next rendered frame should be saved as a screenshot */
 	int screenshot_frame;
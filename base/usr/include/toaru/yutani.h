@@ -238,6 +238,16 @@ struct yutani_msg_special_request {
 	uint32_t request;
 };
 
+struct yutani_msg_frame_callback {
+	yutani_wid_t wid;
+};
+
+struct yutani_msg_frame_done {
+	yutani_wid_t wid;
+	uint32_t frame;  /* Compositor frame counter */
+	uint64_t time;   /* When the frame was presented, in milliseconds since the server started */
+};
+
 struct yutani_msg_clipboard {
 	uint32_t size;
 	char content[];
@@ -288,6 +298,8 @@ struct yutani_msg_clipboard {
 
 #define YUTANI_MSG_CLIPBOARD           0x00000060
 
+#define YUTANI_MSG_FRAME_CALLBACK      0x00000070
+
 #define YUTANI_MSG_GOODBYE             0x000000F0
 
 /* Special request (eg. one-off single-shot requests like "please maximize me" */
@@ -296,6 +308,7 @@ struct yutani_msg_clipboard {
 /* Server responses */
 #define YUTANI_MSG_WELCOME             0x00010001
 #define YUTANI_MSG_WINDOW_INIT         0x00010002
+#define YUTANI_MSG_FRAME_DONE          0x00010003
 
 /*
  * YUTANI_ZORDER
@@ -528,6 +541,7 @@ extern void yutani_window_resize_start(yutani_t * yctx, yutani_window_t * window
 extern void yutani_special_request(yutani_t * yctx, yutani_window_t * window, uint32_t request);
 extern void yutani_special_request_wid(yutani_t * yctx, yutani_wid_t wid, uint32_t request);
 extern void yutani_set_clipboard(yutani_t * yctx, char * content);
+extern void yutani_frame_callback(yutani_t * yctx, yutani_window_t * window);
 extern FILE * yutani_open_clipboard(yutani_t * yctx);
 
 extern gfx_context_t * init_graphics_yutani(yutani_window_t * window);
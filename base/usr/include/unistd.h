@@ -105,4 +105,8 @@ extern int truncate(const char *, off_t);
 #define _PC_PATH_MAX 1
 extern long pathconf(const char *path, int name);
 
+#define _SC_NPROCESSORS_CONF 1
+#define _SC_NPROCESSORS_ONLN 2
+extern long sysconf(int name);
+
 _End_C_Header
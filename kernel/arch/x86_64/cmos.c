@@ -142,6 +142,15 @@ size_t arch_cpu_mhz(void) {
 	return tsc_mhz;
 }
 
+/**
+ * @brief Cheap high-resolution timestamp, in TSC cycles.
+ *
+ * Divide differences by @c arch_cpu_mhz for microseconds.
+ */
+uint64_t arch_perf_timer(void) {
+	return read_tsc();
+}
+
 void arch_clock_initialize(void) {
 	boot_time = read_cmos();
 	uintptr_t end_lo, end_hi;
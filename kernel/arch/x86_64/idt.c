@@ -155,6 +155,10 @@ void irq_uninstall_handler(size_t irq) {
 }
 
 struct regs * isr_handler(struct regs * r) {
+	/* Time up to here was spent in userspace; the rest is the kernel's */
+	int from_user = this_core->current_process && r->cs != 0x08;
+	if (from_user) process_charge_time(1);
+
 	switch (r->int_no) {
 		case 14: /* Page fault */ {
 			uintptr_t faulting_address;
@@ -204,6 +208,7 @@ struct regs * isr_handler(struct regs * r) {
 		case 127: /* syscall */ {
 			syscall_handler(r);
 			asm volatile("sti");
+			if (from_user) process_charge_time(0);
 			return r;
 		}
 		case 39: {
@@ -243,6 +248,7 @@ done:
 		switch_next();
 	}
 
+	if (from_user) process_charge_time(0);
 	return r;
 }
 
@@ -195,8 +195,9 @@ void mount_multiboot_ramdisks(struct multiboot * mboot) {
 			gzip_inputPtr = (void*)data;
 			gzip_outputPtr = mmu_map_from_physical(physicalAddress);
 			/* Do the deed */
-			if (gzip_decompress()) {
-				printf("gzip: failed to decompress payload, skipping\n");
+			int status = gzip_decompress();
+			if (status) {
+				printf("gzip: %s, skipping\n", status == 2 ? "payload is corrupt (CRC mismatch)" : "failed to decompress payload");
 				continue;
 			}
 			ramdisk_mount(physicalAddress, decompressedSize);
@@ -10,6 +10,7 @@
 #include <kernel/process.h>
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
+#include <kernel/pagecache.h>
 #include <kernel/arch/x86_64/pml.h>
 #include <kernel/arch/x86_64/mmu.h>
 
@@ -39,6 +40,12 @@ static uint32_t nframes;
 #define KERNEL_PML_ACCESS 0x03
 #define    LARGE_PAGE_BIT 0x80
 
+/* Software bits in a user PTE saying who owns the frame behind it */
+#define PML_PRIVATE 0
+#define PML_SHARED  1 /* The page cache */
+#define PML_SHM     2 /* A shared memory chunk */
+#define PML_DEVICE  3 /* Nobody; device memory */
+
 #define PDP_MASK 0x3fffffffUL
 #define  PD_MASK 0x1fffffUL
 #define  PT_MASK PAGE_LOW_MASK
@@ -124,13 +131,46 @@ uintptr_t mmu_first_frame(void) {
 	return (uintptr_t)-1;
 }
 
+/**
+ * @brief Keep the current address space's memory counters up to date.
+ *
+ * Called whenever a user page changes hands; @p was and @p now are the
+ * PML_ kinds before and after, or -1 for a page that isn't mapped.
+ * Private and page cache pages count as resident, shared memory has
+ * its own counter, and device memory isn't counted at all.
+ */
+static void mmu_account(int was, int now) {
+	if (was == now) return;
+
+	volatile process_t * proc = this_core->current_process;
+	if (!proc || !proc->thread.page_directory) return;
+	page_directory_t * dir = proc->thread.page_directory;
+	if (dir->directory != this_core->current_pml) return;
+
+	if (was == PML_PRIVATE || was == PML_SHARED) __sync_fetch_and_sub(&dir->rss, 1);
+	if (was == PML_SHM) __sync_fetch_and_sub(&dir->shm, 1);
+	if (now == PML_PRIVATE || now == PML_SHARED) __sync_fetch_and_add(&dir->rss, 1);
+	if (now == PML_SHM) __sync_fetch_and_add(&dir->shm, 1);
+}
+
 /**
  * @brief Set the flags for a page, and allocate a frame for it if needed.
  *
  * Sets the page bits based on the the value of @p flags.
  * If @p page->bits.page is unset, a new frame will be allocated.
+ * A page mapped from the page cache gets a private copy of its frame
+ * unless @p flags still asks for @c MMU_FLAG_SHARED.
  */
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
+	int was = (page->bits.present && page->bits.user) ? (int)page->bits._available2 : -1;
+
+	if (was == PML_SHARED && !(flags & MMU_FLAG_SHARED)) {
+		uintptr_t old = page->bits.page;
+		uintptr_t index = mmu_allocate_a_frame();
+		memcpy(mmu_map_from_physical(index << PAGE_SHIFT), mmu_map_from_physical(old << PAGE_SHIFT), PAGE_SIZE);
+		page->bits.page = index;
+		if (pagecache_unref(old)) mmu_frame_release(old << PAGE_SHIFT);
+	}
 	if (page->bits.page == 0) {
 		spin_lock(frame_alloc_lock);
 		uintptr_t index = mmu_first_frame();
@@ -146,6 +186,59 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	page->bits.writethrough  = (flags & MMU_FLAG_WRITETHROUGH)  ? 1 : 0;
 	page->bits.size     = (flags & MMU_FLAG_SPEC) ? 1 : 0;
 	page->bits.nx       = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	page->bits._available2 =
+		(flags & MMU_FLAG_SHARED) ? PML_SHARED :
+		(flags & MMU_FLAG_SHM)    ? PML_SHM :
+		(flags & MMU_FLAG_DEVICE) ? PML_DEVICE : PML_PRIVATE;
+
+	mmu_account(was, page->bits.user ? (int)page->bits._available2 : -1);
+}
+
+/**
+ * @brief Unmap a user page without freeing its frame.
+ *
+ * For frames that belong to someone else, like shared memory chunks.
+ */
+void mmu_frame_unmap(union PML * page) {
+	if (page->bits.present && page->bits.user) {
+		mmu_account(page->bits._available2, -1);
+	}
+	page->bits.present = 0;
+}
+
+/**
+ * @brief Free a single frame.
+ *
+ * Takes the allocator lock, unlike @c mmu_frame_clear.
+ */
+void mmu_frame_release(uintptr_t frame_addr) {
+	spin_lock(frame_alloc_lock);
+	mmu_frame_clear(frame_addr);
+	spin_unlock(frame_alloc_lock);
+}
+
+/**
+ * @brief Map a page cache frame read-only at a user address.
+ *
+ * Whatever was mapped there before is released. The caller passes
+ * on a reference to the frame it got from the page cache.
+ *
+ * @param virtAddr Page-aligned user address
+ * @param frame    Frame index, not an address
+ */
+void mmu_map_shared(uintptr_t virtAddr, uintptr_t frame) {
+	union PML * page = mmu_get_page(virtAddr, MMU_GET_MAKE);
+	if (page->bits.present && page->bits.user && page->bits.page) {
+		uintptr_t old = page->bits.page;
+		if (page->bits._available2 == PML_SHARED) {
+			if (pagecache_unref(old)) mmu_frame_release(old << PAGE_SHIFT);
+		} else if (page->bits._available2 == PML_PRIVATE) {
+			mmu_frame_release(old << PAGE_SHIFT);
+		}
+	}
+	page->bits.page = frame;
+	mmu_frame_allocate(page, MMU_FLAG_SHARED);
+	mmu_invalidate(virtAddr);
 }
 
 /**
@@ -154,7 +247,7 @@ void mmu_frame_allocate(union PML * page, unsigned int flags) {
 void mmu_frame_map_address(union PML * page, unsigned int flags, uintptr_t physAddr) {
 	mmu_frame_set(physAddr);
 	page->bits.page = physAddr >> PAGE_SHIFT;
-	mmu_frame_allocate(page, flags);
+	mmu_frame_allocate(page, flags | MMU_FLAG_DEVICE);
 }
 
 /* Initial memory maps loaded by boostrap */
@@ -365,7 +458,11 @@ union PML * mmu_clone(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user && pt_in[l].bits._available2 == PML_SHARED) {
+										/* Page cache frames are shared read-only, not copied */
+										pt_out[l].raw = pt_in[l].raw;
+										pagecache_ref(pt_in[l].bits.page);
+									} else if (pt_in[l].bits.user) {
 										char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
 										spin_lock(frame_alloc_lock);
 										uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
@@ -569,7 +666,11 @@ void mmu_free(union PML * from) {
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
 									/* Free only user pages */
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user && pt_in[l].bits._available2 == PML_SHARED) {
+										if (pagecache_unref(pt_in[l].bits.page)) {
+											mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+										}
+									} else if (pt_in[l].bits.user) {
 										mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
 									}
 								}
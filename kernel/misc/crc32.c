@@ -0,0 +1,78 @@
+/**
+ * @file  kernel/misc/crc32.c
+ * @brief CRC-32 checksums.
+ *
+ * Slicing-by-8 version of the usual table-driven CRC: eight tables
+ * let us take a 64-bit word per step. Userspace also has a PCLMULQDQ
+ * path, but the kernel doesn't touch the vector registers, so this is
+ * all we have here. The tables are built on first use.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/crc32.h>
+
+#define CRC32_POLY 0xEDB88320
+
+static uint32_t crc_table[8][256];
+static volatile int crc_ready = 0;
+static volatile int crc_latch[1] = {0};
+
+static void crc32_init(void) {
+	while (__sync_lock_test_and_set(crc_latch, 0x01));
+
+	if (!crc_ready) {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int j = 0; j < 8; ++j) {
+				c = (c & 1) ? (c >> 1) ^ CRC32_POLY : (c >> 1);
+			}
+			crc_table[0][i] = c;
+		}
+
+		for (uint32_t i = 0; i < 256; ++i) {
+			for (int t = 1; t < 8; ++t) {
+				crc_table[t][i] = (crc_table[t-1][i] >> 8) ^ crc_table[0][crc_table[t-1][i] & 0xFF];
+			}
+		}
+
+		__atomic_store_n(&crc_ready, 1, __ATOMIC_RELEASE);
+	}
+
+	__sync_lock_release(crc_latch);
+}
+
+uint32_t crc32_update(uint32_t crc, const void * data, size_t len) {
+	const uint8_t * buf = data;
+
+	if (!__atomic_load_n(&crc_ready, __ATOMIC_ACQUIRE)) crc32_init();
+
+	crc = ~crc;
+
+	while (len >= 8) {
+		uint32_t one, two;
+		__builtin_memcpy(&one, buf, 4);
+		__builtin_memcpy(&two, buf + 4, 4);
+		one ^= crc;
+		crc = crc_table[7][one & 0xFF] ^
+		      crc_table[6][(one >> 8) & 0xFF] ^
+		      crc_table[5][(one >> 16) & 0xFF] ^
+		      crc_table[4][one >> 24] ^
+		      crc_table[3][two & 0xFF] ^
+		      crc_table[2][(two >> 8) & 0xFF] ^
+		      crc_table[1][(two >> 16) & 0xFF] ^
+		      crc_table[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+	}
+
+	return ~crc;
+}
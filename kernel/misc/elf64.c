@@ -17,6 +17,30 @@
 #include <kernel/process.h>
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
+#include <kernel/pagecache.h>
+
+/**
+ * @brief Map a read-only segment straight from the page cache.
+ *
+ * Every process running the same binary then shares the segment's
+ * frames. Only works for segments with nothing to zero-fill whose
+ * file offset lines up with their address, and mustn't replace the
+ * tail of an earlier segment sharing the first page.
+ *
+ * @param loaded End of the segments loaded so far.
+ * @returns 1 if the segment was mapped, 0 if it should be loaded privately.
+ */
+static int elf_map_shared(fs_node_t * file, Elf64_Phdr * phdr, uintptr_t loaded) {
+	if (phdr->p_flags & PF_W) return 0;
+	if (phdr->p_filesz != phdr->p_memsz) return 0;
+	if ((phdr->p_vaddr & 0xFFF) != (phdr->p_offset & 0xFFF)) return 0;
+	if ((phdr->p_vaddr & ~0xFFFUL) < ((loaded + 0xFFF) & ~0xFFFUL)) return 0;
+	if (!pagecache_mappable(file)) return 0;
+
+	uintptr_t start = phdr->p_vaddr & ~0xFFFUL;
+	size_t length = ((phdr->p_vaddr + phdr->p_memsz + 0xFFF) & ~0xFFFUL) - start;
+	return pagecache_mmap(file, start, length, phdr->p_offset & ~0xFFFUL) == 0;
+}
 
 static Elf64_Shdr * elf_getSection(Elf64_Header * this, Elf64_Word index) {
 	return (Elf64_Shdr*)((uintptr_t)this + this->e_shoff + index * this->e_shentsize);
@@ -123,7 +147,7 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 
 	mmu_set_directory(NULL);
 	process_release_directory(this_core->current_process->thread.page_directory);
-	this_core->current_process->thread.page_directory = malloc(sizeof(page_directory_t));
+	this_core->current_process->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL);
@@ -133,15 +157,18 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 		Elf64_Phdr phdr;
 		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
 		if (phdr.p_type == PT_LOAD) {
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
-				mmu_invalidate(i);
-			}
+			if (!elf_map_shared(file, &phdr, heapBase)) {
+				/* This also takes private copies of anything a failed attempt did map */
+				for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
+					union PML * page = mmu_get_page(i, MMU_GET_MAKE);
+					mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+					mmu_invalidate(i);
+				}
 
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
-			for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
-				*(char*)(phdr.p_vaddr + i) = 0;
+				read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
+				for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
+					*(char*)(phdr.p_vaddr + i) = 0;
+				}
 			}
 
 			if (phdr.p_vaddr + phdr.p_memsz > heapBase) {
@@ -16,6 +16,7 @@
  */
 #include <stdint.h>
 #include <stddef.h>
+#include <kernel/crc32.h>
 
 static uint8_t bit_buffer = 0;
 static char buffer_size = 0;
@@ -476,15 +477,18 @@ int gzip_decompress(void) {
 	}
 	(void)crc16;
 
+	uint8_t * output = gzip_outputPtr;
 	int status = deflate_decompress();
+	if (status) return status;
 
-	/* Read CRC and decompressed size from end of input */
-	unsigned int crc32 = read_32le();
+	/* Read CRC and decompressed size from end of input, and check them against what we wrote */
+	unsigned int expected_crc = read_32le();
 	unsigned int dsize = read_32le();
 
-	(void)crc32;
-	(void)dsize;
+	size_t written = gzip_outputPtr - output;
+	if (dsize != (uint32_t)written) return 2;
+	if (expected_crc != crc32_update(0, output, written)) return 2;
 
-	return status;
+	return 0;
 }
 
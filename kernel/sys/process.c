@@ -81,6 +81,7 @@ static spin_lock_t sleep_lock = { 0 };
  */
 void switch_next(void) {
 	this_core->previous_process = this_core->current_process;
+	process_charge_time(0);
 
 	/* Get the next available process, discarded anything in the queue
 	 * marked as finished. */
@@ -115,6 +116,9 @@ void switch_next(void) {
 	/* Mark the process as running and started. */
 	__sync_or_and_fetch(&this_core->current_process->flags, PROC_FLAG_STARTED);
 
+	this_core->current_process->usage.mark = arch_perf_timer();
+	this_core->current_process->usage.last_run = this_core->current_process->usage.mark;
+
 	/* Jump to next */
 	arch_restore_context(&this_core->current_process->thread);
 	__builtin_unreachable();
@@ -180,12 +184,38 @@ void switch_task(uint8_t reschedule) {
 	 *      picks it up before we saved the thread context or the FPU state... */
 	if (reschedule) {
 		make_process_ready((process_t*)this_core->current_process);
+		this_core->current_process->usage.involuntary++;
+	} else {
+		this_core->current_process->usage.voluntary++;
 	}
 
 	/* @ref switch_next() does not return. */
 	switch_next();
 }
 
+/**
+ * @brief Charge the current thread for the time since it was last charged.
+ *
+ * Called on the way into the kernel from userspace, on the way back
+ * out, and when switching away from a thread.
+ *
+ * @param user Whether that time was spent in userspace.
+ */
+void process_charge_time(int user) {
+	volatile process_t * proc = this_core->current_process;
+	if (!proc) return;
+
+	uint64_t now = arch_perf_timer();
+	if (proc->usage.mark) {
+		if (user) {
+			proc->usage.user += now - proc->usage.mark;
+		} else {
+			proc->usage.system += now - proc->usage.mark;
+		}
+	}
+	proc->usage.mark = now;
+}
+
 /**
  * @brief Initial scheduler datastructures.
  *
@@ -224,6 +254,20 @@ int is_valid_process(process_t * process) {
 	return 0;
 }
 
+/**
+ * @brief Call @p func for every process, with the process list locked.
+ *
+ * Processes can't come or go while this runs, so callers get a
+ * consistent view of the whole system. @p func must not sleep.
+ */
+void process_foreach(void (*func)(process_t * proc, void * ctx), void * ctx) {
+	spin_lock(tree_lock);
+	foreach(lnode, process_list) {
+		func((process_t *)lnode->value, ctx);
+	}
+	spin_unlock(tree_lock);
+}
+
 /**
  * @brief Allocate a new file descriptor.
  *
@@ -338,7 +382,7 @@ process_t * spawn_kidle(int bsp) {
 	idle->shm_mappings = list_create("process shm mappings (kidle)",idle);
 	idle->signal_queue = list_create("process signal queue (kidle)",idle);
 	gettimeofday(&idle->start, NULL);
-	idle->thread.page_directory = malloc(sizeof(page_directory_t));
+	idle->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	idle->thread.page_directory->refcount = 1;
 	idle->thread.page_directory->directory = mmu_clone(this_core->current_pml);
 	spin_init(idle->thread.page_directory->lock);
@@ -394,7 +438,7 @@ process_t * spawn_init(void) {
 
 	init->timed_sleep_node = NULL;
 
-	init->thread.page_directory = malloc(sizeof(page_directory_t));
+	init->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
 	init->thread.page_directory->directory = this_core->current_pml;
 	spin_init(init->thread.page_directory->lock);
@@ -910,15 +954,30 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 
 	spin_lock(process->sched_lock);
 	process->node_waits = list_create("process fswaiters",process);
+	int ready = -1;
+	index = 0;
 	if (*n) {
 		do {
-			if (selectwait_fs(*n, process) < 0) {
+			int result = selectwait_fs(*n, process);
+			if (result < 0) {
 				printf("bad selectwait?\n");
+			} else if (result > 0 && ready == -1) {
+				ready = index;
 			}
 			n++;
+			index++;
 		} while (*n);
 	}
 
+	if (ready != -1) {
+		/* Became ready after the check above but before anything could alert us */
+		list_free(process->node_waits);
+		free(process->node_waits);
+		process->node_waits = NULL;
+		spin_unlock(process->sched_lock);
+		return ready;
+	}
+
 	if (timeout > 0) {
 		unsigned long s, ss;
 		relative_time(0, timeout * 1000, &s, &ss);
@@ -1064,9 +1123,10 @@ pid_t fork(void) {
 	process_t * parent = (process_t*)this_core->current_process;
 	union PML * directory = mmu_clone(parent->thread.page_directory->directory);
 	process_t * new_proc = spawn_process(parent, 0);
-	new_proc->thread.page_directory = malloc(sizeof(page_directory_t));
+	new_proc->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
+	new_proc->thread.page_directory->rss = mmu_count_user(directory);
 	spin_init(new_proc->thread.page_directory->lock);
 
 	struct regs r;
@@ -1143,7 +1203,7 @@ process_t * spawn_worker_thread(void (*entrypoint)(void * argp), const char * na
 	proc->job         = proc->id;
 	proc->session     = proc->id;
 
-	proc->thread.page_directory = malloc(sizeof(page_directory_t));
+	proc->thread.page_directory = calloc(1, sizeof(page_directory_t));
 	proc->thread.page_directory->refcount = 1;
 	proc->thread.page_directory->directory = mmu_clone(mmu_get_kernel_directory());
 	spin_init(proc->thread.page_directory->lock);
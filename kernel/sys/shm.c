@@ -181,7 +181,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 				for (unsigned int i = 0; i < chunk->num_frames; ++i) {
 					union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
 					page->bits.page = chunk->frames[i];
-					mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+					mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_SHM);
 					mmu_invalidate(last_address + (i << 12));
 					mapping->vaddrs[i] = last_address + (i << 12);
 				}
@@ -202,7 +202,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 			for (unsigned int i = 0; i < chunk->num_frames; ++i) {
 				union PML * page = mmu_get_page(last_address + (i << 12), MMU_GET_MAKE);
 				page->bits.page = chunk->frames[i];
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+				mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_SHM);
 				mmu_invalidate(last_address + (i << 12));
 				mapping->vaddrs[i] = last_address + (i << 12);
 			}
@@ -218,7 +218,7 @@ static void * map_in (shm_chunk_t * chunk, volatile process_t * volatile proc) {
 
 		union PML * page = mmu_get_page(new_vpage, MMU_GET_MAKE);
 		page->bits.page = chunk->frames[i];
-		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE | MMU_FLAG_SHM);
 		mmu_invalidate(new_vpage);
 		mapping->vaddrs[i] = new_vpage;
 	}
@@ -311,7 +311,7 @@ int shm_release (char * path) {
 	/* Clear the mappings from the process's address space */
 	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
 		union PML * page = mmu_get_page(mapping->vaddrs[i], 0);
-		page->bits.present = 0;
+		mmu_frame_unmap(page);
 	}
 
 	/* Clean up */
@@ -324,6 +324,31 @@ int shm_release (char * path) {
 	return 0;
 }
 
+/**
+ * @brief Take a kernel reference to a named chunk.
+ *
+ * Lets a device look at memory it shares with userspace; the chunk
+ * stays allocated until shm_chunk_put, even if every process releases it.
+ */
+shm_chunk_t * shm_chunk_get(char * path) {
+	spin_lock(bsl);
+
+	shm_node_t * node = get_node(path, 0);
+	shm_chunk_t * chunk = node ? node->chunk : NULL;
+	if (chunk) {
+		chunk->ref_count++;
+	}
+
+	spin_unlock(bsl);
+	return chunk;
+}
+
+void shm_chunk_put(shm_chunk_t * chunk) {
+	spin_lock(bsl);
+	release_chunk(chunk);
+	spin_unlock(bsl);
+}
+
 /* This function should only be called if the process's address space
  * is about to be destroyed -- chunks will not be unmounted therefrom ! */
 void shm_release_all (process_t * proc) {
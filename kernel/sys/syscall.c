@@ -18,6 +18,7 @@
 #include <kernel/time.h>
 #include <kernel/syscall.h>
 #include <kernel/misc.h>
+#include <kernel/pagecache.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -396,6 +397,80 @@ static long sys_readdir(int fd, long index, struct dirent * entry) {
 	return -EBADF;
 }
 
+struct getdents_buffer {
+	char * buf;
+	size_t size;
+	size_t used;
+	int full;
+};
+
+static int getdents_emit(void * ctx, uint64_t ino, const char * name, int type) {
+	struct getdents_buffer * b = ctx;
+	size_t len = strlen(name) + 1;
+	size_t reclen = (sizeof(struct packed_dirent) + len + 3) & ~3;
+
+	if (b->used + reclen > b->size) {
+		b->full = 1;
+		return 0;
+	}
+
+	struct packed_dirent * ent = (struct packed_dirent *)(b->buf + b->used);
+	ent->d_ino = ino;
+	ent->d_reclen = reclen;
+	ent->d_type = type;
+	memcpy(ent->d_name, name, len);
+	b->used += reclen;
+	return 1;
+}
+
+#define GETDENTS_MAX 65536
+
+/**
+ * Fill @p buf with as many packed directory entries as fit,
+ * continuing from where the last call on this descriptor left off.
+ * Returns the number of bytes used, 0 at the end of the directory.
+ */
+static long sys_getdents(int fd, void * buf, size_t size) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	PTR_VALIDATE(buf);
+	if (!(FD_ENTRY(fd)->flags & FS_DIRECTORY)) return -ENOTDIR;
+
+	if (size > GETDENTS_MAX) size = GETDENTS_MAX;
+	struct getdents_buffer b = { malloc(size), size, 0, 0 };
+
+	long count = getdents_fs(FD_ENTRY(fd), FD_OFFSET(fd), getdents_emit, &b);
+	if (count > 0) {
+		FD_OFFSET(fd) += count;
+		memcpy(buf, b.buf, b.used);
+	}
+	free(b.buf);
+
+	if (count < 0) return count;
+	if (count == 0 && b.full) return -EINVAL; /* Not even one entry fit */
+	return b.used;
+}
+
+/**
+ * Map part of a file read-only at a fixed, page-aligned address.
+ * The pages come from the page cache and are shared with everyone
+ * else mapping them; ld.so uses this for library text.
+ */
+static long sys_mapfile(int fd, uintptr_t addr, size_t length, long offset) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (!(FD_MODE(fd) & 01)) return -EACCES;
+	if (!length || offset < 0) return -EINVAL;
+	if (addr + length < addr || addr + length > 0x800000000000UL) return -EINVAL;
+	/* Device and SHM mappings live here and are not ours to replace */
+	if (addr < 0x400000000UL && addr + length > 0x100000000UL) return -EINVAL;
+
+	volatile process_t * volatile proc = this_core->current_process;
+	if (proc->group != 0) proc = process_from_pid(proc->group);
+	spin_lock(proc->image.lock);
+	long out = pagecache_mmap(FD_ENTRY(fd), addr, (length + 0xFFF) & ~0xFFFUL, offset);
+	spin_unlock(proc->image.lock);
+	return out;
+}
+
 static long sys_mkdir(char * path, uint64_t mode) {
 	return mkdir_fs(path, mode);
 }
@@ -891,6 +966,8 @@ static long (*syscalls[])() = {
 	[SYS_GETUID]       = sys_getuid,
 	[SYS_SETUID]       = sys_setuid,
 	[SYS_READDIR]      = sys_readdir,
+	[SYS_GETDENTS]     = sys_getdents,
+	[SYS_MAPFILE]      = sys_mapfile,
 	[SYS_CHDIR]        = sys_chdir,
 	[SYS_GETCWD]       = sys_getcwd,
 	[SYS_SETHOSTNAME]  = sys_sethostname,
@@ -0,0 +1,341 @@
+/**
+ * @file  kernel/vfs/dcache.c
+ * @brief Directory entry cache for path resolution.
+ *
+ * Remembers what a directory's @c finddir returned for a name, so
+ * that repeated lookups through the same directories (exec, stat
+ * storms from ls and du, the dynamic linker's library search) don't
+ * have to ask the filesystem again. Misses are cached too, as
+ * negative entries.
+ *
+ * Entries are keyed on the parent's identity - its finddir method,
+ * device pointer and inode - and the name. Only filesystems that
+ * register their finddir methods are cached, since things like
+ * procfs make up their answers on the spot. Filesystems whose
+ * contents never change (tarfs) can have any entry cached; for the
+ * rest we only keep misses and directories or symlinks we pass
+ * through on the way to something else, as a file's size and times
+ * live in the node and would go stale.
+ *
+ * The VFS calls @c vfs_dcache_invalidate after anything that adds
+ * or removes a name, and @c vfs_dcache_flush when a directory goes
+ * away or something is mounted. Lookups that raced with one of
+ * those don't get to insert their (possibly stale) result.
+ *
+ * Counters are available from /proc/dcache.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/procfs.h>
+#include <kernel/spinlock.h>
+
+#define DCACHE_ENTRIES     1024
+#define DCACHE_BUCKETS     256
+#define DCACHE_NAME_MAX    48
+#define DCACHE_FILESYSTEMS 8
+
+struct dcache_entry {
+	int next;             /* Next entry in this bucket, or -1 */
+	int bucket;           /* Bucket we are chained into, or -1 if unused */
+	int referenced;       /* Second chance for the clock sweep */
+	uint32_t hash;
+	finddir_type_t finddir;
+	void * device;
+	uint64_t inode;
+	char name[DCACHE_NAME_MAX];
+	fs_node_t * node;     /* NULL for a negative entry */
+};
+
+static struct dcache_entry entries[DCACHE_ENTRIES];
+static int buckets[DCACHE_BUCKETS];
+static int clock_hand = 0;
+static int initialized = 0;
+
+static struct {
+	finddir_type_t finddir;
+	int flags;
+} filesystems[DCACHE_FILESYSTEMS];
+static int filesystem_count = 0;
+
+static struct {
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t invalidations;
+	uint64_t flushes;
+	size_t   used;
+	size_t   negative;
+} stats;
+
+/* Bumped by every invalidation; lookups only insert if it didn't move */
+static uint64_t generation = 0;
+
+static spin_lock_t dcache_lock = { 0 };
+
+static uint32_t dcache_hash(fs_node_t * parent, const char * name) {
+	uint32_t h = 2166136261U;
+	while (*name) {
+		h = (h ^ (uint8_t)*name++) * 16777619U;
+	}
+	h ^= (uint32_t)((uintptr_t)parent->device >> 4);
+	h ^= (uint32_t)(parent->inode * 2654435761U);
+	return h;
+}
+
+static int dcache_flags(fs_node_t * parent) {
+	for (int i = 0; i < filesystem_count; ++i) {
+		if (filesystems[i].finddir == parent->finddir) return filesystems[i].flags;
+	}
+	return -1;
+}
+
+static int dcache_matches(struct dcache_entry * e, fs_node_t * parent, uint32_t hash, const char * name) {
+	return e->hash == hash && e->finddir == parent->finddir &&
+		e->device == parent->device && e->inode == parent->inode &&
+		!strcmp(e->name, name);
+}
+
+static int dcache_find(fs_node_t * parent, uint32_t hash, const char * name) {
+	for (int i = buckets[hash % DCACHE_BUCKETS]; i != -1; i = entries[i].next) {
+		if (dcache_matches(&entries[i], parent, hash, name)) return i;
+	}
+	return -1;
+}
+
+/* Unchain and release an entry; called with the lock held */
+static void dcache_drop(int i) {
+	struct dcache_entry * e = &entries[i];
+	int * link = &buckets[e->bucket];
+	while (*link != i) link = &entries[*link].next;
+	*link = e->next;
+
+	if (e->node) {
+		free(e->node);
+	} else {
+		stats.negative--;
+	}
+	e->node = NULL;
+	e->bucket = -1;
+	e->next = -1;
+	stats.used--;
+}
+
+/* Find a slot for a new entry, evicting with a clock sweep if we're full */
+static int dcache_victim(void) {
+	while (1) {
+		struct dcache_entry * e = &entries[clock_hand];
+		int i = clock_hand;
+		clock_hand = (clock_hand + 1) % DCACHE_ENTRIES;
+		if (e->bucket == -1) return i;
+		if (e->referenced) {
+			e->referenced = 0;
+			continue;
+		}
+		dcache_drop(i);
+		stats.evictions++;
+		return i;
+	}
+}
+
+static void dcache_insert(fs_node_t * parent, uint32_t hash, const char * name, fs_node_t * node) {
+	if (dcache_find(parent, hash, name) != -1) return;
+
+	int i = dcache_victim();
+	struct dcache_entry * e = &entries[i];
+	e->hash = hash;
+	e->finddir = parent->finddir;
+	e->device = parent->device;
+	e->inode = parent->inode;
+	strcpy(e->name, name);
+	e->node = node;
+	e->referenced = 0;
+	e->bucket = hash % DCACHE_BUCKETS;
+	e->next = buckets[e->bucket];
+	buckets[e->bucket] = i;
+
+	stats.used++;
+	if (!node) stats.negative++;
+}
+
+static void dcache_init(void) {
+	for (int i = 0; i < DCACHE_BUCKETS; ++i) {
+		buckets[i] = -1;
+	}
+	for (int i = 0; i < DCACHE_ENTRIES; ++i) {
+		entries[i].bucket = -1;
+		entries[i].next = -1;
+		entries[i].node = NULL;
+	}
+	initialized = 1;
+}
+
+/**
+ * @brief Allow lookups through directories with this finddir to be cached.
+ *
+ * @param finddir The filesystem's directory finddir method.
+ * @param flags   DCACHE_STATIC if the filesystem's contents never change.
+ */
+void vfs_dcache_register(finddir_type_t finddir, int flags) {
+	spin_lock(dcache_lock);
+	if (!initialized) dcache_init();
+	if (filesystem_count < DCACHE_FILESYSTEMS) {
+		filesystems[filesystem_count].finddir = finddir;
+		filesystems[filesystem_count].flags = flags;
+		filesystem_count++;
+	} else {
+		printf("dcache: too many filesystems registered\n");
+	}
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Look up @p name in @p parent, through the cache where we can.
+ *
+ * Behaves like @c finddir_fs. @p leaf says whether this is the last
+ * component of the path, in which case the node will be handed back
+ * to the caller rather than just looked through.
+ *
+ * @returns A node the caller owns, or NULL if there is no such entry.
+ */
+fs_node_t * vfs_dcache_finddir(fs_node_t * parent, char * name, int leaf) {
+	if (!parent || !(parent->flags & FS_DIRECTORY) || !parent->finddir) return NULL;
+
+	int flags = initialized ? dcache_flags(parent) : -1;
+	if (flags == -1 || strlen(name) >= DCACHE_NAME_MAX) {
+		return finddir_fs(parent, name);
+	}
+
+	/* Positive entries for mutable filesystems may only be passed through */
+	int positive_ok = (flags & DCACHE_STATIC) || !leaf;
+
+	uint32_t hash = dcache_hash(parent, name);
+
+	spin_lock(dcache_lock);
+	int i = dcache_find(parent, hash, name);
+	if (i != -1 && (!entries[i].node || positive_ok)) {
+		struct dcache_entry * e = &entries[i];
+		e->referenced = 1;
+		fs_node_t * out = NULL;
+		if (e->node) {
+			out = malloc(sizeof(fs_node_t));
+			memcpy(out, e->node, sizeof(fs_node_t));
+			stats.hits++;
+		} else {
+			stats.negative_hits++;
+		}
+		spin_unlock(dcache_lock);
+		return out;
+	}
+	stats.misses++;
+	uint64_t gen = generation;
+	spin_unlock(dcache_lock);
+
+	fs_node_t * out = finddir_fs(parent, name);
+
+	fs_node_t * copy = NULL;
+	if (out) {
+		if (!positive_ok) return out;
+		if (!(flags & DCACHE_STATIC) && !(out->flags & (FS_DIRECTORY | FS_SYMLINK))) return out;
+		copy = malloc(sizeof(fs_node_t));
+		memcpy(copy, out, sizeof(fs_node_t));
+	}
+
+	spin_lock(dcache_lock);
+	if (gen == generation) {
+		dcache_insert(parent, hash, name, copy);
+		copy = NULL;
+	}
+	spin_unlock(dcache_lock);
+
+	if (copy) free(copy);
+	return out;
+}
+
+/**
+ * @brief Forget anything cached about @p name in @p parent.
+ *
+ * Call after creating or removing a name in a directory.
+ */
+void vfs_dcache_invalidate(fs_node_t * parent, char * name) {
+	if (!parent || !initialized) return;
+
+	uint32_t hash = dcache_hash(parent, name);
+
+	spin_lock(dcache_lock);
+	generation++;
+	stats.invalidations++;
+	int i = dcache_find(parent, hash, name);
+	if (i != -1) dcache_drop(i);
+	spin_unlock(dcache_lock);
+}
+
+/**
+ * @brief Drop every cached entry.
+ *
+ * Used when a directory is removed, as anything cached beneath it
+ * is keyed on an identity that may be reused, and on mount.
+ */
+void vfs_dcache_flush(void) {
+	if (!initialized) return;
+
+	spin_lock(dcache_lock);
+	generation++;
+	stats.flushes++;
+	for (int i = 0; i < DCACHE_ENTRIES; ++i) {
+		if (entries[i].bucket != -1) dcache_drop(i);
+	}
+	spin_unlock(dcache_lock);
+}
+
+static uint64_t dcache_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
+	char buf[1024];
+
+	spin_lock(dcache_lock);
+	snprintf(buf, 1000,
+		"Entries: %zu\n"
+		"Capacity: %d\n"
+		"Negative: %zu\n"
+		"Hits: %lu\n"
+		"NegativeHits: %lu\n"
+		"Misses: %lu\n"
+		"Evictions: %lu\n"
+		"Invalidations: %lu\n"
+		"Flushes: %lu\n"
+		, stats.used, DCACHE_ENTRIES, stats.negative,
+		stats.hits, stats.negative_hits, stats.misses,
+		stats.evictions, stats.invalidations, stats.flushes);
+	spin_unlock(dcache_lock);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	return size;
+}
+
+static struct procfs_entry dcache_entry = {
+	0,
+	"dcache",
+	dcache_func,
+};
+
+/**
+ * @brief Set up the cache and its /proc entry.
+ */
+void vfs_dcache_install(void) {
+	spin_lock(dcache_lock);
+	if (!initialized) dcache_init();
+	spin_unlock(dcache_lock);
+
+	procfs_install(&dcache_entry);
+}
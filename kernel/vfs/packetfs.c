@@ -9,6 +9,17 @@
  * Care must be taken to ensure that this is backed by an atomic
  * stream; the legacy pseudo-pipe interface is used at the moment.
  *
+ * Clients may also hand us a shared memory region with a message
+ * ring in each direction (see kernel/pex.h). Traffic through the
+ * rings never touches the pipes; we just check the ring indices
+ * for fswait and pass doorbells along to sleeping peers.
+ *
+ * Messages from the server to a client whose pipe is full go into a
+ * per-client backlog, bounded by the exchange's depth, and are moved
+ * into the pipe as the client reads. Coalescable messages replace an
+ * older backlogged copy with the same key. The server can see how
+ * each client is doing with IOCTL_PACKETFS_CLIENT_STATS.
+ *
  * @bug We leak kernel heap addresses directly to userspace as the
  *      client identifiers in PEX messages. We should probably do
  *      something else. I'm also reasonably certain a server can
@@ -29,9 +40,15 @@
 #include <kernel/pipe.h>
 #include <kernel/spinlock.h>
 #include <kernel/process.h>
+#include <kernel/shm.h>
+#include <kernel/mmu.h>
+#include <kernel/pex.h>
 
 #include <sys/ioctl.h>
 
+extern void ptr_validate(void * ptr, const char * syscall);
+#define validate(o) ptr_validate(o,"ioctl")
+
 #define MAX_PACKET_SIZE 1024
 #define debug_print(x, ...) do { if (0) {printf("packetfs.c [%s] ", #x); printf(__VA_ARGS__); printf("\n"); } } while (0)
 
@@ -47,11 +64,18 @@ typedef struct packet_exchange {
 	spin_lock_t lock;
 	fs_node_t * server_pipe;
 	list_t * clients;
+	size_t depth; /* Backlog limit for each client */
 } pex_ex_t;
 
 typedef struct packet_client {
 	pex_ex_t * parent;
 	fs_node_t * pipe;
+	shm_chunk_t * ring_chunk;      /* Shared ring region, or NULL */
+	struct pex_ring_shared * ring; /* Kernel mapping of its first page */
+	int ring_accepted;             /* Server delivers to this client through the ring */
+	spin_lock_t lock;              /* Protects the backlog and stats */
+	list_t * backlog;              /* backlog_t's waiting for room in the pipe */
+	struct pex_client_stats stats;
 } pex_client_t;
 
 
@@ -61,6 +85,11 @@ typedef struct packet {
 	uint8_t     data[];
 } packet_t;
 
+typedef struct backlog_entry {
+	size_t key; /* Leading bytes identifying a coalescable message, or 0 */
+	packet_t * packet;
+} backlog_t;
+
 typedef struct server_write_header {
 	pex_client_t * target;
 	uint8_t data[];
@@ -96,13 +125,28 @@ static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * d
 	free(packet);
 }
 
-static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
+static void free_backlog_entry(pex_client_t * c, backlog_t * b) {
+	c->stats.queued_bytes -= b->packet->size;
+	free(b->packet);
+	free(b);
+}
 
-	/* Verify there is space on the client */
-	if (pipe_unsize(c->pipe) < (int)p_size) {
-		return -1;
+/* Move as much of the backlog into the client's pipe as will fit. Call with c->lock held. */
+static void flush_backlog(pex_client_t * c) {
+	while (c->backlog->length) {
+		backlog_t * b = c->backlog->head->value;
+		size_t p_size = b->packet->size + sizeof(struct packet);
+		if (pipe_unsize(c->pipe) < (int)p_size) break;
+
+		free(list_dequeue(c->backlog));
+		write_fs(c->pipe, 0, p_size, (uint8_t *)b->packet);
+		free_backlog_entry(c, b);
 	}
+	c->stats.queued = c->backlog->length;
+}
+
+static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * data, size_t key) {
+	size_t p_size = size + sizeof(struct packet);
 
 	if ((uintptr_t)c < 0x800000000) {
 		printf("suspicious pex client received: %p\n", (void*)c);
@@ -114,19 +158,119 @@ static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * da
 	packet->source = NULL;
 	packet->size = size;
 
-	write_fs(c->pipe, 0, p_size, (uint8_t *)packet);
+	spin_lock(c->lock);
+	flush_backlog(c);
 
-	free(packet);
+	/* Straight into the pipe if there's room and nothing is ahead of us */
+	if (!c->backlog->length && pipe_unsize(c->pipe) >= (int)p_size) {
+		write_fs(c->pipe, 0, p_size, (uint8_t *)packet);
+		spin_unlock(c->lock);
+		free(packet);
+		return size;
+	}
+
+	/* Only the newest copy of a coalescable message needs to be delivered */
+	if (key) {
+		foreach(n, c->backlog) {
+			backlog_t * b = n->value;
+			if (b->key == key && !memcmp(b->packet->data, data, key)) {
+				list_delete(c->backlog, n);
+				free(n);
+				free_backlog_entry(c, b);
+				c->stats.coalesced++;
+				break;
+			}
+		}
+	}
+
+	if (c->backlog->length >= c->parent->depth) {
+		c->stats.dropped++;
+		c->stats.queued = c->backlog->length;
+		spin_unlock(c->lock);
+		free(packet);
+		return -1;
+	}
+
+	backlog_t * b = malloc(sizeof(backlog_t));
+	b->key = key;
+	b->packet = packet;
+	list_insert(c->backlog, b);
+	c->stats.queued = c->backlog->length;
+	c->stats.queued_bytes += size;
+
+	spin_unlock(c->lock);
 	return size;
 }
 
+static void broadcast(pex_ex_t * p, size_t size, void * data, size_t key) {
+	spin_lock(p->lock);
+	foreach(f, p->clients) {
+		pex_client_t * c = f->value;
+		if (c->ring_accepted) continue; /* The server broadcasts to rings itself */
+		debug_print(INFO, "Sending to client %p", f->value);
+		send_to_client(p, c, size, data, key);
+	}
+	spin_unlock(p->lock);
+	debug_print(INFO, "Done broadcasting to clients.");
+}
+
 static pex_client_t * create_client(pex_ex_t * p) {
 	pex_client_t * out = malloc(sizeof(pex_client_t));
 	out->parent = p;
 	out->pipe = make_pipe(4096);
+	out->ring_chunk = NULL;
+	out->ring = NULL;
+	out->ring_accepted = 0;
+	spin_init(out->lock);
+	out->backlog = list_create("pex client backlog", out);
+	memset(&out->stats, 0, sizeof(struct pex_client_stats));
 	return out;
 }
 
+static int ring_pending(struct pex_ring * ring) {
+	return ring->head != ring->tail;
+}
+
+/* The server has a backlog for this client, and the client has made room for it */
+static int ring_unblocked(struct pex_ring * ring) {
+	return ring->blocked && PEX_RING_ROOMY(ring);
+}
+
+/*
+ * Find a client of this exchange from a (userspace-supplied) identifier.
+ * Call with p->lock held, and keep holding it while using the client:
+ * close_client frees it once it is off the list.
+ */
+static pex_client_t * find_client(pex_ex_t * p, void * id) {
+	foreach(f, p->clients) {
+		if (f->value == id) return f->value;
+	}
+	return NULL;
+}
+
+static int attach_ring(pex_client_t * c, char * key) {
+	if (c->ring_chunk) return -EEXIST;
+	if (strlen(key) >= sizeof(((struct pex_ring_announce *)0)->key)) return -EINVAL;
+
+	shm_chunk_t * chunk = shm_chunk_get(key);
+	if (!chunk) return -ENOENT;
+	if (chunk->num_frames * 0x1000 < PEX_RING_SHM_SIZE) {
+		shm_chunk_put(chunk);
+		return -EINVAL;
+	}
+
+	c->ring = mmu_map_from_physical(chunk->frames[0] << 12);
+	c->ring_chunk = chunk;
+
+	/* Let the server know so it can map the ring too */
+	struct pex_ring_announce announce = {0};
+	announce.magic = PEX_RING_MAGIC;
+	strcpy(announce.key, key);
+	send_to_server(c->parent, c, sizeof(announce), &announce);
+
+	return 0;
+}
+
 static uint64_t read_server(fs_node_t * node, uint64_t offset, uint64_t size, uint8_t * buffer) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	debug_print(INFO, "[pex] server read(...)");
@@ -160,20 +304,53 @@ static uint64_t write_server(fs_node_t * node, uint64_t offset, uint64_t size, u
 
 	if (head->target == NULL) {
 		/* Brodcast packet */
-		spin_lock(p->lock);
-		foreach(f, p->clients) {
-			debug_print(INFO, "Sending to client %p", f->value);
-			send_to_client(p, (pex_client_t *)f->value, size - sizeof(header_t), head->data);
-		}
-		spin_unlock(p->lock);
-		debug_print(INFO, "Done broadcasting to clients.");
+		broadcast(p, size - sizeof(header_t), head->data, 0);
 		return size;
 	} else if (head->target->parent != p) {
 		debug_print(WARNING, "[pex] Invalid packet from server? (pid=%d)", this_core->current_process->id);
 		return -1;
 	}
 
-	return send_to_client(p, head->target, size - sizeof(header_t), head->data) + sizeof(header_t);
+	return send_to_client(p, head->target, size - sizeof(header_t), head->data, 0) + sizeof(header_t);
+}
+
+static int send_coalesce(pex_ex_t * p, struct pex_coalesce * req) {
+	validate(req->data);
+	if (req->size > MAX_PACKET_SIZE || req->key_size > req->size) return -EINVAL;
+
+	if (!req->target) {
+		broadcast(p, req->size, req->data, req->key_size);
+		return req->size;
+	}
+
+	spin_lock(p->lock);
+	pex_client_t * c = find_client(p, (void *)req->target);
+	int out = c ? send_to_client(p, c, req->size, req->data, req->key_size) : -EINVAL;
+	spin_unlock(p->lock);
+	return out;
+}
+
+static int client_stats(pex_ex_t * p, struct pex_client_stats * out) {
+	struct pex_client_stats stats;
+	int found = 0;
+
+	spin_lock(p->lock);
+	foreach(f, p->clients) {
+		pex_client_t * c = f->value;
+		if (f->value == (void *)out->client) {
+			spin_lock(c->lock);
+			stats = c->stats;
+			spin_unlock(c->lock);
+			found = 1;
+			break;
+		}
+	}
+	spin_unlock(p->lock);
+
+	if (!found) return -EINVAL;
+	stats.client = out->client;
+	*out = stats;
+	return 0;
 }
 
 static int ioctl_server(fs_node_t * node, int request, void * argp) {
@@ -182,6 +359,31 @@ static int ioctl_server(fs_node_t * node, int request, void * argp) {
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
 			return pipe_size(p->server_pipe);
+		case IOCTL_PACKETFS_RING_ACCEPT: {
+			spin_lock(p->lock);
+			pex_client_t * c = find_client(p, argp);
+			int out = (c && c->ring) ? 0 : -EINVAL;
+			if (!out) c->ring_accepted = 1;
+			spin_unlock(p->lock);
+			return out;
+		}
+		case IOCTL_PACKETFS_DOORBELL: {
+			spin_lock(p->lock);
+			pex_client_t * c = find_client(p, argp);
+			if (c) pipe_alert(c->pipe);
+			spin_unlock(p->lock);
+			return c ? 0 : -EINVAL;
+		}
+		case IOCTL_PACKETFS_CLIENT_STATS:
+			validate(argp);
+			return client_stats(p, argp);
+		case IOCTL_PACKETFS_DEPTH:
+			if ((uintptr_t)argp > 4096) return -EINVAL;
+			p->depth = (uintptr_t)argp;
+			return 0;
+		case IOCTL_PACKETFS_SEND_COALESCE:
+			validate(argp);
+			return send_coalesce(p, argp);
 		default:
 			return -1;
 	}
@@ -200,6 +402,11 @@ static uint64_t read_client(fs_node_t * node, uint64_t offset, uint64_t size, ui
 
 	receive_packet(c->pipe, &packet);
 
+	/* That made some room, so bring in whatever was waiting for it */
+	spin_lock(c->lock);
+	flush_backlog(c);
+	spin_unlock(c->lock);
+
 	if (packet->size > size) {
 		debug_print(WARNING, "[pex] Client is not reading enough bytes to hold packet of size %zu", packet->size);
 		return -1;
@@ -240,6 +447,12 @@ static int ioctl_client(fs_node_t * node, int request, void * argp) {
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
 			return pipe_size(c->pipe);
+		case IOCTL_PACKETFS_RING:
+			validate(argp);
+			return attach_ring(c, argp);
+		case IOCTL_PACKETFS_DOORBELL:
+			pipe_alert(c->parent->server_pipe);
+			return 0;
 		default:
 			return -1;
 	}
@@ -265,24 +478,87 @@ static void close_client(fs_node_t * node) {
 
 	send_to_server(p, c, 0, tmp);
 
+	if (c->ring_chunk) {
+		shm_chunk_put(c->ring_chunk);
+	}
+
+	while (c->backlog->length) {
+		node_t * n = list_dequeue(c->backlog);
+		free_backlog_entry(c, n->value);
+		free(n);
+	}
+	free(c->backlog);
+
 	free(c);
 }
 
+/*
+ * Waiting on a ring marks it so the producer knows to ring the
+ * doorbell, which alerts whoever is waiting on the matching pipe.
+ *
+ * The selectcheck ran before we got here, without the mark, so a
+ * producer may have filled the ring in between and seen no reason
+ * to ring. So: register on the pipe, mark, then look at the ring
+ * again, and have fswait return right away if something came in.
+ */
 static int wait_server(fs_node_t * node, void * process) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
-	return selectwait_fs(p->server_pipe, process);
+	int out = selectwait_fs(p->server_pipe, process);
+	if (out < 0) return out;
+	spin_lock(p->lock);
+	foreach(f, p->clients) {
+		pex_client_t * c = f->value;
+		if (c->ring) c->ring->to_server.waiting = 1;
+	}
+	__sync_synchronize();
+	foreach(f, p->clients) {
+		pex_client_t * c = f->value;
+		if (c->ring && (ring_pending(&c->ring->to_server) || ring_unblocked(&c->ring->to_client))) {
+			out = 1;
+			break;
+		}
+	}
+	spin_unlock(p->lock);
+	return out;
 }
 static int check_server(fs_node_t * node) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
-	return selectcheck_fs(p->server_pipe);
+	int out = selectcheck_fs(p->server_pipe);
+	if (out == 0) return 0;
+	spin_lock(p->lock);
+	foreach(f, p->clients) {
+		pex_client_t * c = f->value;
+		if (c->ring && (ring_pending(&c->ring->to_server) || ring_unblocked(&c->ring->to_client))) {
+			out = 0;
+			break;
+		}
+	}
+	spin_unlock(p->lock);
+	return out;
+}
+
+/*
+ * A client with `blocked` set on its own ring is sleeping in a reply
+ * until the server makes room, and is not reading meanwhile, so only
+ * that room (announced by the server's doorbell) should wake it.
+ */
+static int client_ready(pex_client_t * c) {
+	if (c->ring->to_server.blocked) return ring_unblocked(&c->ring->to_server);
+	return ring_pending(&c->ring->to_client);
 }
 
 static int wait_client(fs_node_t * node, void * process) {
 	pex_client_t * c = (pex_client_t *)node->inode;
-	return selectwait_fs(c->pipe, process);
+	int out = selectwait_fs(c->pipe, process);
+	if (out < 0 || !c->ring) return out;
+	c->ring->to_client.waiting = 1;
+	__sync_synchronize();
+	return client_ready(c) ? 1 : out;
 }
 static int check_client(fs_node_t * node) {
 	pex_client_t * c = (pex_client_t *)node->inode;
+	if (c->ring && client_ready(c)) return 0;
+	if (c->ring && c->ring->to_server.blocked) return 1;
 	return selectcheck_fs(c->pipe);
 }
 
@@ -434,6 +710,7 @@ static int create_packetfs(fs_node_t *parent, char *name, uint16_t permission) {
 	new_exchange->fresh = 1;
 	new_exchange->clients = list_create("pex clients",new_exchange);
 	new_exchange->server_pipe = make_pipe(4096);
+	new_exchange->depth = PEX_DEFAULT_DEPTH;
 
 	spin_init(new_exchange->lock);
 	/* XXX Create exchange server pipe */
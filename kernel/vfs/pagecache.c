@@ -0,0 +1,540 @@
+/**
+ * @file  kernel/vfs/pagecache.c
+ * @brief Page cache for file reads and shared file mappings.
+ *
+ * Keeps page-sized chunks of files in physical frames, keyed on the
+ * file's identity - its read method, device pointer and inode - and
+ * the page offset. Filesystems opt in by registering their read
+ * method. Those that never change (tarfs) have all of their reads
+ * served from the cache, with a miss reading several pages ahead in
+ * one request to the filesystem.
+ *
+ * The same frames back read-only shared mappings of files, which is
+ * how the ELF loader and ld.so share the text of executables and
+ * libraries between every process using them. A mapped page holds a
+ * reference for each page table entry pointing at it, and the MMU
+ * marks those entries so that fork shares them and exit drops its
+ * references rather than freeing the frames.
+ *
+ * Files on filesystems that can change (tmpfs) are only cached once
+ * something maps them, and reads bypass the cache. Writes are passed
+ * on to the filesystem and then copied into any cached pages, so
+ * mappings see them. Truncating or unlinking a file detaches its
+ * pages; mapped ones live on until the last mapping goes away.
+ *
+ * Counters are available from /proc/pagecache.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/mmu.h>
+#include <kernel/procfs.h>
+#include <kernel/pagecache.h>
+#include <kernel/spinlock.h>
+
+#define PAGE_SIZE 0x1000UL
+#define PAGE_MASK 0xFFFUL
+
+#define PAGECACHE_BUCKETS     1024
+#define PAGECACHE_MAX_PAGES   4096 /* Start evicting unmapped pages past 16MiB */
+#define PAGECACHE_READAHEAD   16   /* Pages to read at once on a miss */
+#define PAGECACHE_FILESYSTEMS 8
+#define PAGECACHE_RETRIES     4
+
+struct cached_page {
+	struct cached_page * next;       /* Chain in the file table, or a free list */
+	struct cached_page * frame_next; /* Chain in the frame table */
+	node_t lru;
+
+	read_type_t read;
+	void * device;
+	uint64_t inode;
+	uint64_t offset;
+
+	uintptr_t frame;  /* Frame index */
+	unsigned int bucket;
+	int refs;         /* Page table entries, plus readers copying out of it */
+	int referenced;   /* Second chance for eviction */
+	int attached;     /* Still findable by file and offset */
+};
+
+static struct cached_page * buckets[PAGECACHE_BUCKETS];
+static struct cached_page * frame_buckets[PAGECACHE_BUCKETS];
+static list_t lru_list;
+
+static struct {
+	read_type_t read;
+	int flags;
+} filesystems[PAGECACHE_FILESYSTEMS];
+static int filesystem_count = 0;
+
+static struct {
+	size_t   pages;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t readahead;
+	uint64_t evictions;
+	uint64_t mapped;
+} stats;
+
+/* Bumped by every write to a cached filesystem; fills that raced one retry */
+static volatile uint64_t generation = 0;
+
+static spin_lock_t pagecache_lock = { 0 };
+
+static int pagecache_flags(fs_node_t * node) {
+	if (!node->read) return -1;
+	for (int i = 0; i < filesystem_count; ++i) {
+		if (filesystems[i].read == node->read) return filesystems[i].flags;
+	}
+	return -1;
+}
+
+static unsigned int page_hash(fs_node_t * node, uint64_t offset) {
+	uint64_t h = ((uintptr_t)node->device >> 4) ^ (node->inode * 0x9E3779B97F4A7C15UL) ^ ((offset >> 12) * 0xC2B2AE3D27D4EB4FUL);
+	return (unsigned int)(h ^ (h >> 29)) % PAGECACHE_BUCKETS;
+}
+
+static int page_matches(struct cached_page * p, fs_node_t * node) {
+	return p->read == node->read && p->device == node->device && p->inode == node->inode;
+}
+
+static struct cached_page * page_find(fs_node_t * node, uint64_t offset) {
+	for (struct cached_page * p = buckets[page_hash(node, offset)]; p; p = p->next) {
+		if (p->offset == offset && page_matches(p, node)) return p;
+	}
+	return NULL;
+}
+
+static struct cached_page * page_find_frame(uintptr_t frame) {
+	for (struct cached_page * p = frame_buckets[frame % PAGECACHE_BUCKETS]; p; p = p->frame_next) {
+		if (p->frame == frame) return p;
+	}
+	return NULL;
+}
+
+static void frame_table_remove(struct cached_page * p) {
+	struct cached_page ** link = &frame_buckets[p->frame % PAGECACHE_BUCKETS];
+	while (*link != p) link = &(*link)->frame_next;
+	*link = p->frame_next;
+}
+
+/**
+ * Make a page unfindable by file and offset. If nothing has it mapped,
+ * it is pushed onto @p dead for the caller to free once the lock is
+ * dropped; otherwise the last pagecache_unref frees it.
+ */
+static void page_detach(struct cached_page * p, struct cached_page ** dead) {
+	struct cached_page ** link = &buckets[p->bucket];
+	while (*link != p) link = &(*link)->next;
+	*link = p->next;
+
+	list_delete(&lru_list, &p->lru);
+	p->attached = 0;
+	stats.pages--;
+
+	if (!p->refs) {
+		frame_table_remove(p);
+		p->next = *dead;
+		*dead = p;
+	}
+}
+
+/* Free pages collected by page_detach; called without the lock */
+static void pages_free(struct cached_page * dead) {
+	while (dead) {
+		struct cached_page * next = dead->next;
+		mmu_frame_release(dead->frame << 12);
+		free(dead);
+		dead = next;
+	}
+}
+
+/* Evict unmapped pages, oldest first, until we're back under the limit */
+static void pagecache_shrink(struct cached_page ** dead) {
+	size_t scan = lru_list.length * 2;
+	while (stats.pages > PAGECACHE_MAX_PAGES && scan--) {
+		struct cached_page * p = lru_list.head->value;
+		if (p->refs || p->referenced) {
+			p->referenced = 0;
+			list_delete(&lru_list, &p->lru);
+			list_append(&lru_list, &p->lru);
+			continue;
+		}
+		page_detach(p, dead);
+		stats.evictions++;
+	}
+}
+
+/*
+ * Nothing may be allocated or freed with the lock held: the MMU calls
+ * pagecache_unref with the frame allocator locked, and the heap takes
+ * that lock when it grows. Page structures are allocated before taking
+ * the lock, and ones released by pagecache_unref wait here to be freed.
+ */
+static struct cached_page * graveyard = NULL;
+
+static void pages_reap(void) {
+	if (!graveyard) return;
+	spin_lock(pagecache_lock);
+	struct cached_page * dead = graveyard;
+	graveyard = NULL;
+	spin_unlock(pagecache_lock);
+	while (dead) {
+		struct cached_page * next = dead->next;
+		free(dead);
+		dead = next;
+	}
+}
+
+static struct cached_page * page_insert(struct cached_page * p, fs_node_t * node, uint64_t offset, uintptr_t frame) {
+	p->read = node->read;
+	p->device = node->device;
+	p->inode = node->inode;
+	p->offset = offset;
+	p->frame = frame;
+	p->refs = 0;
+	p->referenced = 0;
+	p->attached = 1;
+
+	p->bucket = page_hash(node, offset);
+	p->next = buckets[p->bucket];
+	buckets[p->bucket] = p;
+
+	p->frame_next = frame_buckets[frame % PAGECACHE_BUCKETS];
+	frame_buckets[frame % PAGECACHE_BUCKETS] = p;
+
+	p->lru.value = p;
+	list_append(&lru_list, &p->lru);
+	stats.pages++;
+	return p;
+}
+
+/**
+ * Find the page at @p offset in @p node, reading it (and a few after
+ * it) in if it isn't cached. Returns the page with a reference held,
+ * or NULL if the filesystem couldn't be read.
+ */
+static struct cached_page * pagecache_get(fs_node_t * node, uint64_t offset) {
+	pages_reap();
+
+	for (int attempt = 0; attempt < PAGECACHE_RETRIES; ++attempt) {
+		spin_lock(pagecache_lock);
+		struct cached_page * p = page_find(node, offset);
+		if (p) {
+			p->refs++;
+			p->referenced = 1;
+			stats.hits++;
+			spin_unlock(pagecache_lock);
+			return p;
+		}
+		stats.misses++;
+		uint64_t gen = generation;
+		spin_unlock(pagecache_lock);
+
+		size_t count = 1;
+		if (node->length > offset) {
+			count = (node->length - offset + PAGE_MASK) / PAGE_SIZE;
+			if (count > PAGECACHE_READAHEAD) count = PAGECACHE_READAHEAD;
+		}
+
+		uint8_t * buf = malloc(count * PAGE_SIZE);
+		uint64_t got = node->read(node, offset, count * PAGE_SIZE, buf);
+		if ((int64_t)got < 0) {
+			free(buf);
+			return NULL;
+		}
+		if (got < count * PAGE_SIZE) {
+			memset(buf + got, 0, count * PAGE_SIZE - got);
+		}
+
+		uintptr_t frames[PAGECACHE_READAHEAD];
+		struct cached_page * fresh[PAGECACHE_READAHEAD];
+		for (size_t i = 0; i < count; ++i) {
+			frames[i] = mmu_allocate_a_frame();
+			fresh[i] = malloc(sizeof(struct cached_page));
+			memcpy(mmu_map_from_physical(frames[i] << 12), buf + i * PAGE_SIZE, PAGE_SIZE);
+		}
+		free(buf);
+
+		struct cached_page * dead = NULL;
+		struct cached_page * out = NULL;
+
+		spin_lock(pagecache_lock);
+		if (gen == generation) {
+			for (size_t i = 0; i < count; ++i) {
+				struct cached_page * p = page_find(node, offset + i * PAGE_SIZE);
+				if (!p) {
+					p = page_insert(fresh[i], node, offset + i * PAGE_SIZE, frames[i]);
+					frames[i] = 0;
+					fresh[i] = NULL;
+					if (i) stats.readahead++;
+				}
+				if (!i) {
+					p->refs++;
+					p->referenced = 1;
+					out = p;
+				}
+			}
+			pagecache_shrink(&dead);
+		}
+		spin_unlock(pagecache_lock);
+
+		for (size_t i = 0; i < count; ++i) {
+			if (frames[i]) mmu_frame_release(frames[i] << 12);
+			if (fresh[i]) free(fresh[i]);
+		}
+		pages_free(dead);
+
+		if (out) return out;
+		/* Someone wrote to the file while we were reading it; try again */
+	}
+
+	return NULL;
+}
+
+static void pagecache_put(struct cached_page * p) {
+	int drop = 0;
+	spin_lock(pagecache_lock);
+	p->refs--;
+	if (!p->refs && !p->attached) {
+		frame_table_remove(p);
+		drop = 1;
+	}
+	spin_unlock(pagecache_lock);
+
+	if (drop) {
+		mmu_frame_release(p->frame << 12);
+		free(p);
+	}
+}
+
+/**
+ * @brief Cache pages of files read through this read method.
+ *
+ * @param read  The filesystem's file read method.
+ * @param flags PAGECACHE_STATIC if the filesystem's contents never change.
+ */
+void pagecache_register(read_type_t read, int flags) {
+	spin_lock(pagecache_lock);
+	if (filesystem_count < PAGECACHE_FILESYSTEMS) {
+		filesystems[filesystem_count].read = read;
+		filesystems[filesystem_count].flags = flags;
+		filesystem_count++;
+	} else {
+		printf("pagecache: too many filesystems registered\n");
+	}
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Whether @p node can be mapped with pagecache_mmap.
+ */
+int pagecache_mappable(fs_node_t * node) {
+	return node && (node->flags & FS_FILE) && pagecache_flags(node) != -1;
+}
+
+/**
+ * @brief Whether reads from @p node should go through pagecache_read.
+ */
+int pagecache_cached_reads(fs_node_t * node) {
+	int flags = pagecache_flags(node);
+	return flags != -1 && (flags & PAGECACHE_STATIC);
+}
+
+/**
+ * @brief Read from a file through the cache.
+ *
+ * Same contract as read_fs.
+ */
+uint64_t pagecache_read(fs_node_t * node, uint64_t offset, uint64_t size, uint8_t * buffer) {
+	if (offset >= node->length) return 0;
+	if (size > node->length - offset) size = node->length - offset;
+
+	uint64_t done = 0;
+	while (done < size) {
+		uint64_t at = offset + done;
+		uint64_t in_page = at & PAGE_MASK;
+		uint64_t chunk = PAGE_SIZE - in_page;
+		if (chunk > size - done) chunk = size - done;
+
+		struct cached_page * p = pagecache_get(node, at - in_page);
+		if (!p) {
+			/* Let the filesystem report whatever went wrong */
+			uint64_t ret = node->read(node, at, size - done, buffer + done);
+			if ((int64_t)ret < 0) return done ? done : ret;
+			return done + ret;
+		}
+
+		memcpy(buffer + done, (uint8_t *)mmu_map_from_physical(p->frame << 12) + in_page, chunk);
+		pagecache_put(p);
+		done += chunk;
+	}
+
+	return done;
+}
+
+/**
+ * @brief Update cached pages after @p size bytes were written to @p node.
+ */
+void pagecache_write(fs_node_t * node, uint64_t offset, uint64_t size, uint8_t * buffer) {
+	if (pagecache_flags(node) == -1) return;
+
+	__sync_fetch_and_add(&generation, 1);
+	if (!stats.pages) return;
+
+	spin_lock(pagecache_lock);
+	uint64_t end = offset + size;
+	for (uint64_t page = offset & ~PAGE_MASK; page < end; page += PAGE_SIZE) {
+		struct cached_page * p = page_find(node, page);
+		if (!p) continue;
+		uint64_t from = page < offset ? offset : page;
+		uint64_t to = page + PAGE_SIZE > end ? end : page + PAGE_SIZE;
+		memcpy((uint8_t *)mmu_map_from_physical(p->frame << 12) + (from - page), buffer + (from - offset), to - from);
+	}
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Drop all cached pages of @p node.
+ *
+ * Used when a file is truncated or unlinked. Pages that are still
+ * mapped keep their contents until they are unmapped.
+ */
+void pagecache_forget(fs_node_t * node) {
+	if (pagecache_flags(node) == -1) return;
+
+	__sync_fetch_and_add(&generation, 1);
+	if (!stats.pages) return;
+
+	pages_reap();
+
+	struct cached_page * dead = NULL;
+	spin_lock(pagecache_lock);
+	node_t * n = lru_list.head;
+	while (n) {
+		node_t * next = n->next;
+		struct cached_page * p = n->value;
+		if (page_matches(p, node)) page_detach(p, &dead);
+		n = next;
+	}
+	spin_unlock(pagecache_lock);
+
+	pages_free(dead);
+}
+
+/**
+ * @brief Map part of a file read-only into the current address space.
+ *
+ * The pages are shared with the cache and with anyone else mapping
+ * the same part of the file.
+ *
+ * @param node    File to map
+ * @param address Page-aligned user address to map at
+ * @param length  Bytes to map
+ * @param offset  Page-aligned offset into the file
+ * @returns 0 on success, or a negative error.
+ */
+long pagecache_mmap(fs_node_t * node, uintptr_t address, size_t length, uint64_t offset) {
+	if (!pagecache_mappable(node)) return -ENODEV;
+	if ((address & PAGE_MASK) || (offset & PAGE_MASK)) return -EINVAL;
+	if (offset + length > ((node->length + PAGE_MASK) & ~PAGE_MASK)) return -EINVAL;
+
+	for (size_t i = 0; i < length; i += PAGE_SIZE) {
+		struct cached_page * p = pagecache_get(node, offset + i);
+		if (!p) return -EIO;
+		/* The reference we hold now belongs to the page table entry */
+		mmu_map_shared(address + i, p->frame);
+		__sync_fetch_and_add(&stats.mapped, 1);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Take another reference to a mapped cache frame, as on fork.
+ */
+void pagecache_ref(uintptr_t frame) {
+	spin_lock(pagecache_lock);
+	struct cached_page * p = page_find_frame(frame);
+	if (p) p->refs++;
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Drop a reference to a mapped cache frame.
+ *
+ * Does not free the frame itself, as the MMU may be holding the frame
+ * allocator lock.
+ *
+ * @returns 1 if this was the last use of a detached page and the
+ *          caller should free the frame.
+ */
+int pagecache_unref(uintptr_t frame) {
+	int drop = 0;
+	spin_lock(pagecache_lock);
+	struct cached_page * p = page_find_frame(frame);
+	if (p) {
+		p->refs--;
+		if (!p->refs && !p->attached) {
+			frame_table_remove(p);
+			p->next = graveyard;
+			graveyard = p;
+			drop = 1;
+		}
+	}
+	spin_unlock(pagecache_lock);
+	return drop;
+}
+
+static uint64_t pagecache_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
+	char buf[1024];
+
+	spin_lock(pagecache_lock);
+	size_t in_use = 0;
+	foreach(n, &lru_list) {
+		if (((struct cached_page *)n->value)->refs) in_use++;
+	}
+	snprintf(buf, 1000,
+		"Pages: %zu\n"
+		"Capacity: %d\n"
+		"Mapped: %zu\n"
+		"Hits: %lu\n"
+		"Misses: %lu\n"
+		"ReadAhead: %lu\n"
+		"Evictions: %lu\n"
+		"Mappings: %lu\n"
+		, stats.pages, PAGECACHE_MAX_PAGES, in_use,
+		stats.hits, stats.misses, stats.readahead,
+		stats.evictions, stats.mapped);
+	spin_unlock(pagecache_lock);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	return size;
+}
+
+static struct procfs_entry pagecache_entry = {
+	0,
+	"pagecache",
+	pagecache_func,
+};
+
+/**
+ * @brief Set up the page cache's /proc entry.
+ */
+void pagecache_install(void) {
+	procfs_install(&pagecache_entry);
+}
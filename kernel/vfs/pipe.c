@@ -108,6 +108,13 @@ static void pipe_alert_waiters(pipe_device_t * pipe) {
 	spin_unlock(pipe->alert_lock);
 }
 
+/**
+ * @brief Wake processes waiting on this pipe in fswait, without writing to it.
+ */
+void pipe_alert(fs_node_t * node) {
+	pipe_alert_waiters((pipe_device_t *)node->device);
+}
+
 uint64_t read_pipe(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
 	/* Retreive the pipe object associated with this file node */
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
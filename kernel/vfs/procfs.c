@@ -31,6 +31,7 @@
 #include <kernel/syscall.h>
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
+#include <sys/procsnap.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -99,19 +100,13 @@ static uint64_t proc_cmdline_func(fs_node_t *node, uint64_t offset, uint64_t siz
 	return size;
 }
 
-static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
-	char buf[2048];
-	process_t * proc = process_from_pid(node->inode);
-	process_t * parent = process_get_parent(proc);
-
-	if (!proc) {
-		/* wat */
-		return 0;
-	}
-
-	char state = (proc->flags & PROC_FLAG_FINISHED) ? 'Z' :
+static char proc_state(process_t * proc) {
+	return (proc->flags & PROC_FLAG_FINISHED) ? 'Z' :
 		((proc->flags & PROC_FLAG_SUSPENDED) ? 'T' :
 			(process_is_ready(proc) ? 'R' : 'S'));
+}
+
+static char * proc_basename(process_t * proc) {
 	char * name = proc->name + strlen(proc->name) - 1;
 
 	while (1) {
@@ -123,9 +118,30 @@ static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size
 		name--;
 	}
 
-	/* Calculate process memory usage */
-	long mem_usage = mmu_count_user(proc->thread.page_directory->directory) * 4;
-	long shm_usage = mmu_count_shm(proc->thread.page_directory->directory) * 4;
+	return name;
+}
+
+/* TSC cycles to microseconds */
+static uint64_t proc_usecs(uint64_t cycles) {
+	return cycles / arch_cpu_mhz();
+}
+
+static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
+	char buf[2048];
+	process_t * proc = process_from_pid(node->inode);
+	process_t * parent = process_get_parent(proc);
+
+	if (!proc) {
+		/* wat */
+		return 0;
+	}
+
+	char state = proc_state(proc);
+	char * name = proc_basename(proc);
+
+	/* Memory usage is counted by the MMU as pages are mapped and unmapped */
+	long mem_usage = proc->thread.page_directory->rss * 4;
+	long shm_usage = proc->thread.page_directory->shm * 4;
 	long mem_permille = 1000 * (mem_usage + shm_usage) / mmu_total_memory();
 
 	snprintf(buf, 2000,
@@ -150,6 +166,11 @@ static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size
 			"RssShmem:\t %ld kB\n"
 			"MemPermille:\t %ld\n"
 			"LastCore:\t %d\n"
+			"UserTime:\t %lu us\n"
+			"SystemTime:\t %lu us\n"
+			"LastRun:\t %lu us\n"
+			"VoluntarySwitches:\t %lu\n"
+			"InvoluntarySwitches:\t %lu\n"
 			,
 			name,
 			state,
@@ -169,7 +190,12 @@ static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size
 			proc->syscall_registers ? arch_stack_pointer(proc->syscall_registers) : 0,
 			proc->cmdline ? proc->cmdline[0] : "(none)",
 			mem_usage, shm_usage, mem_permille,
-			proc->owner
+			proc->owner,
+			proc_usecs(proc->usage.user),
+			proc_usecs(proc->usage.system),
+			proc_usecs(proc->usage.last_run),
+			proc->usage.voluntary,
+			proc->usage.involuntary
 			);
 
 	size_t _bsize = strlen(buf);
@@ -179,10 +205,54 @@ static uint64_t proc_status_func(fs_node_t *node, uint64_t offset, uint64_t size
 	memcpy(buffer, buf + offset, size);
 	return size;
 }
+/**
+ * One line for tools that want numbers rather than prose:
+ *
+ *   pid (name) state ppid pgid sid tgid uid utime stime rss shm
+ *   voluntary involuntary last_run last_core
+ *
+ * Times are in microseconds and memory in kB.
+ */
+static uint64_t proc_stat_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
+	char buf[512];
+	process_t * proc = process_from_pid(node->inode);
+
+	if (!proc) {
+		return 0;
+	}
+
+	process_t * parent = process_get_parent(proc);
+
+	snprintf(buf, 500, "%d (%s) %c %d %d %d %d %d %lu %lu %zu %zu %lu %lu %lu %d\n",
+		proc->id,
+		proc_basename(proc),
+		proc_state(proc),
+		parent ? parent->id : 0,
+		proc->job,
+		proc->session,
+		proc->group ? proc->group : proc->id,
+		proc->user,
+		proc_usecs(proc->usage.user),
+		proc_usecs(proc->usage.system),
+		proc->thread.page_directory->rss * 4,
+		proc->thread.page_directory->shm * 4,
+		proc->usage.voluntary,
+		proc->usage.involuntary,
+		proc_usecs(proc->usage.last_run),
+		proc->owner);
+
+	size_t _bsize = strlen(buf);
+	if (offset > _bsize) return 0;
+	if (size > _bsize - offset) size = _bsize - offset;
+
+	memcpy(buffer, buf + offset, size);
+	return size;
+}
 
 static struct procfs_entry procdir_entries[] = {
 	{1, "cmdline", proc_cmdline_func},
 	{2, "status",  proc_status_func},
+	{3, "stat",    proc_stat_func},
 };
 
 static struct dirent * readdir_procfs_procdir(fs_node_t *node, uint64_t index) {
@@ -305,6 +375,96 @@ static uint64_t meminfo_func(fs_node_t *node, uint64_t offset, uint64_t size, ui
 	return size;
 }
 
+struct snapshot_builder {
+	char * buf;
+	size_t used;
+	size_t capacity;
+	size_t count;
+};
+
+static void snapshot_reserve(struct snapshot_builder * b, size_t bytes) {
+	if (b->used + bytes <= b->capacity) return;
+	while (b->used + bytes > b->capacity) b->capacity *= 2;
+	b->buf = realloc(b->buf, b->capacity);
+}
+
+static void snapshot_add(process_t * proc, void * ctx) {
+	struct snapshot_builder * b = ctx;
+
+	char * name = proc_basename(proc);
+	size_t strings = strlen(name) + 2;
+	if (proc->cmdline) {
+		for (char ** arg = proc->cmdline; *arg; ++arg) strings += strlen(*arg) + 1;
+	}
+	size_t reclen = (sizeof(struct proc_snapshot_entry) + strings + 7) & ~7UL;
+
+	snapshot_reserve(b, reclen);
+	struct proc_snapshot_entry * e = (struct proc_snapshot_entry *)(b->buf + b->used);
+	memset(e, 0, reclen);
+
+	/* We hold the process list lock, so no process_get_parent */
+	tree_node_t * parent = proc->tree_entry ? proc->tree_entry->parent : NULL;
+
+	e->reclen = reclen;
+	e->pid = proc->id;
+	e->tgid = proc->group ? proc->group : proc->id;
+	e->ppid = parent ? ((process_t *)parent->value)->id : 0;
+	e->pgid = proc->job;
+	e->sid = proc->session;
+	e->uid = proc->user;
+	e->last_core = proc->owner;
+	e->state = proc_state(proc);
+	if (proc->thread.page_directory) {
+		e->rss = proc->thread.page_directory->rss * 4;
+		e->shm = proc->thread.page_directory->shm * 4;
+	}
+	e->utime = proc_usecs(proc->usage.user);
+	e->stime = proc_usecs(proc->usage.system);
+	e->voluntary = proc->usage.voluntary;
+	e->involuntary = proc->usage.involuntary;
+
+	char * out = e->strings;
+	strcpy(out, name);
+	out += strlen(name) + 1;
+	if (proc->cmdline) {
+		for (char ** arg = proc->cmdline; *arg; ++arg) {
+			strcpy(out, *arg);
+			out += strlen(*arg) + 1;
+		}
+	}
+
+	b->used += reclen;
+	b->count++;
+}
+
+/**
+ * Binary records for every process, described in <sys/procsnap.h>.
+ * Each read takes a fresh snapshot under the process list lock, so
+ * readers should fetch the whole thing at once.
+ */
+static uint64_t snapshot_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
+	struct snapshot_builder b = { malloc(4096), sizeof(struct proc_snapshot_header), 4096, 0 };
+
+	process_foreach(snapshot_add, &b);
+
+	struct proc_snapshot_header * header = (struct proc_snapshot_header *)b.buf;
+	header->version = PROC_SNAPSHOT_VERSION;
+	header->size = b.used;
+	header->count = b.count;
+	header->_reserved = 0;
+	header->mem_total = mmu_total_memory();
+
+	if (offset > b.used) {
+		size = 0;
+	} else if (size > b.used - offset) {
+		size = b.used - offset;
+	}
+
+	memcpy(buffer, b.buf + offset, size);
+	free(b.buf);
+	return size;
+}
+
 #ifdef __x86_64__
 static uint64_t pat_func(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffer) {
 	char buf[1024];
@@ -675,6 +835,7 @@ static struct procfs_entry std_entries[] = {
 	{-12,"pat",      pat_func},
 	{-13,"pci",      pci_func},
 #endif
+	{-14,"snapshot", snapshot_func},
 };
 
 static list_t * extended_entries = NULL;
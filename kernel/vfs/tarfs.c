@@ -11,6 +11,7 @@
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <kernel/pagecache.h>
 
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
@@ -289,6 +290,84 @@ static struct dirent * readdir_tarfs(fs_node_t *node, uint64_t index) {
 	return NULL;
 }
 
+static int dtype_from_ustar(struct ustar * file) {
+	switch (file->type[0]) {
+		case '5': return DT_DIR;
+		case '2': return DT_LNK;
+		default:  return DT_REG;
+	}
+}
+
+/**
+ * Emit the members directly under @p prefix, starting from the
+ * @p index'th, in a single pass over the archive from @p offset.
+ */
+static long getdents_tar_prefix(struct tarfs * self, unsigned int offset, const char * prefix, uint64_t index, dirent_emit_t emit, void * ctx) {
+	long count = 0;
+
+	if (index == 0) {
+		if (!emit(ctx, 0, ".", DT_DIR)) return count;
+		count++; index++;
+	}
+
+	if (index == 1) {
+		if (!emit(ctx, 0, "..", DT_DIR)) return count;
+		count++; index++;
+	}
+
+	index -= 2;
+
+	size_t prefix_len = strlen(prefix);
+	struct ustar * file = malloc(sizeof(struct ustar));
+	while (offset < self->length) {
+		if (!ustar_from_offset(self, offset, file)) break;
+
+		char filename_workspace[256];
+		memset(filename_workspace, 0, 256);
+		strncat(filename_workspace, file->prefix, 155);
+		strncat(filename_workspace, file->filename, 100);
+
+		char * name = filename_workspace + prefix_len;
+		if (startswith(filename_workspace, prefix) && !count_slashes(name)) {
+			char * slash = strstr(name, "/");
+			if (slash) *slash = '\0'; /* remove trailing slash */
+			if (strlen(name)) {
+				if (index) {
+					index--;
+				} else {
+					if (!emit(ctx, offset, name, dtype_from_ustar(file))) break;
+					count++;
+				}
+			}
+		}
+
+		offset += 512;
+		offset += round_to_512(interpret_size(file));
+	}
+
+	free(file);
+	return count;
+}
+
+static long getdents_tarfs(fs_node_t *node, uint64_t index, dirent_emit_t emit, void * ctx) {
+	struct tarfs * self = node->device;
+
+	struct ustar * file = malloc(sizeof(struct ustar));
+	ustar_from_offset(self, node->inode, file);
+
+	char my_filename[256];
+	memset(my_filename, 0, 256);
+	strncat(my_filename, file->prefix, 155);
+	strncat(my_filename, file->filename, 100);
+	free(file);
+
+	return getdents_tar_prefix(self, node->inode, my_filename, index, emit, ctx);
+}
+
+static long getdents_tar_root(fs_node_t *node, uint64_t index, dirent_emit_t emit, void * ctx) {
+	return getdents_tar_prefix(node->device, 0, "", index, emit, ctx);
+}
+
 static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
 
@@ -377,6 +456,7 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 		fs->flags = FS_DIRECTORY;
 		fs->readdir = readdir_tarfs;
 		fs->finddir = finddir_tarfs;
+		fs->getdents = getdents_tarfs;
 	} else if (file->type[0] == '1') {
 		//debug_print(ERROR, "Hardlink detected");
 		/* go through file and find target, reassign inode to point to that */
@@ -479,6 +559,7 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->mask    = 0555;
 	root->readdir = readdir_tar_root;
 	root->finddir = finddir_tar_root;
+	root->getdents = getdents_tar_root;
 	root->flags   = FS_DIRECTORY;
 	root->device  = self;
 
@@ -487,6 +568,9 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 
 int tarfs_register_init(void) {
 	vfs_register("tar", tar_mount);
+	vfs_dcache_register(finddir_tar_root, DCACHE_STATIC);
+	vfs_dcache_register(finddir_tarfs, DCACHE_STATIC);
+	pagecache_register(read_tarfs, PAGECACHE_STATIC);
 	return 0;
 }
 
@@ -21,6 +21,7 @@
 #include <kernel/tmpfs.h>
 #include <kernel/spinlock.h>
 #include <kernel/mmu.h>
+#include <kernel/pagecache.h>
 #include <kernel/time.h>
 
 /* 4KB */
@@ -377,6 +378,35 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 	return NULL;
 }
 
+static long getdents_tmpfs(fs_node_t * node, uint64_t index, dirent_emit_t emit, void * ctx) {
+	struct tmpfs_dir * d = (struct tmpfs_dir *)node->device;
+	long count = 0;
+
+	if (index == 0) {
+		if (!emit(ctx, 0, ".", DT_DIR)) return count;
+		count++; index++;
+	}
+
+	if (index == 1) {
+		if (!emit(ctx, 0, "..", DT_DIR)) return count;
+		count++; index++;
+	}
+
+	uint64_t i = 2;
+
+	spin_lock(tmpfs_lock);
+	foreach(f, d->files) {
+		if (i++ < index) continue;
+		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
+		int type = t->type == TMPFS_TYPE_DIR ? DT_DIR : t->type == TMPFS_TYPE_LINK ? DT_LNK : DT_REG;
+		if (!emit(ctx, (uint64_t)t, t->name, type)) break;
+		count++;
+	}
+	spin_unlock(tmpfs_lock);
+
+	return count;
+}
+
 static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
 	if (!name) return NULL;
 
@@ -506,6 +536,7 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	fnode->close   = NULL;
 	fnode->readdir = readdir_tmpfs;
 	fnode->finddir = finddir_tmpfs;
+	fnode->getdents = getdents_tmpfs;
 	fnode->create  = create_tmpfs;
 	fnode->unlink  = unlink_tmpfs;
 	fnode->mkdir   = mkdir_tmpfs;
@@ -552,5 +583,7 @@ fs_node_t * tmpfs_mount(const char * device, const char * mount_path) {
 void tmpfs_register_init(void) {
 	buf_space = (void*)valloc(BLOCKSIZE);
 	vfs_register("tmpfs", tmpfs_mount);
+	vfs_dcache_register(finddir_tmpfs, 0);
+	pagecache_register(read_tmpfs, 0);
 }
 
@@ -19,6 +19,7 @@
 #include <kernel/vfs.h>
 #include <kernel/time.h>
 #include <kernel/process.h>
+#include <kernel/pagecache.h>
 
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
@@ -125,6 +126,9 @@ int selectcheck_fs(fs_node_t * node) {
 
 /**
  * @brief Inform a node that it should alert the current_process.
+ *
+ * @returns 0 once registered, or a positive value if the node found it
+ *          was ready after all, in which case fswait returns right away.
  */
 int selectwait_fs(fs_node_t * node, void * process) {
 	if (!node) return -ENOENT;
@@ -149,6 +153,9 @@ uint64_t read_fs(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buffe
 	if (!node) return -ENOENT;
 
 	if (node->read) {
+		if (pagecache_cached_reads(node)) {
+			return pagecache_read(node, offset, size, buffer);
+		}
 		uint64_t ret = node->read(node, offset, size, buffer);
 		return ret;
 	} else {
@@ -170,6 +177,7 @@ uint64_t write_fs(fs_node_t *node, uint64_t offset, uint64_t size, uint8_t *buff
 
 	if (node->write) {
 		uint64_t ret = node->write(node, offset, size, buffer);
+		if ((int64_t)ret > 0) pagecache_write(node, offset, ret, buffer);
 		return ret;
 	} else {
 		return -EROFS;
@@ -186,6 +194,7 @@ void truncate_fs(fs_node_t * node) {
 
 	if (node->truncate) {
 		node->truncate(node);
+		pagecache_forget(node);
 	}
 }
 
@@ -289,6 +298,42 @@ struct dirent *readdir_fs(fs_node_t *node, uint64_t index) {
 	}
 }
 
+/**
+ * @brief Read a batch of directory entries.
+ *
+ * Calls @p emit for each entry from @p index on, until it returns 0
+ * (the caller is out of space, and that entry wasn't taken) or the
+ * directory runs out. Filesystems that can walk a directory in one
+ * pass provide a getdents method; for the rest we call readdir for
+ * each index in turn.
+ *
+ * @param node  Directory to read
+ * @param index Entry to start from
+ * @param emit  Called with each entry's inode, name and DT_* type
+ * @param ctx   Passed through to @p emit
+ * @returns The number of entries @p emit took, or a negative error.
+ */
+long getdents_fs(fs_node_t *node, uint64_t index, dirent_emit_t emit, void * ctx) {
+	if (!node) return -EBADF;
+	if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+
+	if (node->getdents) {
+		return node->getdents(node, index, emit, ctx);
+	}
+
+	long count = 0;
+	while (node->readdir) {
+		struct dirent * ent = node->readdir(node, index + count);
+		if (!ent) break;
+		int taken = emit(ctx, ent->ino, ent->name, DT_UNKNOWN);
+		free(ent);
+		if (!taken) break;
+		count++;
+	}
+
+	return count;
+}
+
 /**
  * @brief Find the requested file in the directory and return an fs_node for it
  *
@@ -375,6 +420,7 @@ int create_file_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		vfs_dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -424,7 +470,22 @@ int unlink_fs(char * name) {
 
 	int ret = 0;
 	if (parent->unlink) {
+		/* Entries beneath a removed directory are keyed on it, so those need to go too */
+		fs_node_t * victim = finddir_fs(parent, f_path);
+		int was_dir = victim && (victim->flags & FS_DIRECTORY);
+
 		ret = parent->unlink(parent, f_path);
+
+		if (victim) {
+			if (!ret) pagecache_forget(victim);
+			free(victim);
+		}
+
+		if (was_dir) {
+			vfs_dcache_flush();
+		} else {
+			vfs_dcache_invalidate(parent, f_path);
+		}
 	} else {
 		ret = -EINVAL;
 	}
@@ -490,6 +551,7 @@ int mkdir_fs(char *name, uint16_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		vfs_dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EROFS;
 	}
@@ -542,6 +604,7 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		vfs_dcache_invalidate(parent, f_path);
 	} else {
 		ret = -EINVAL;
 	}
@@ -694,6 +757,9 @@ void vfs_install(void) {
 	tree_set_root(fs_tree, root);
 
 	fs_types = hashmap_create(5);
+
+	vfs_dcache_install();
+	pagecache_install();
 }
 
 int vfs_register(const char * name, vfs_mount_callback callback) {
@@ -825,6 +891,10 @@ void * vfs_mount(const char * path, fs_node_t * local_root) {
 
 	free(p);
 	spin_unlock(tmp_vfs_lock);
+
+	/* Anything we cached along this path is now hidden by the mount */
+	vfs_dcache_flush();
+
 	return ret_val;
 }
 
@@ -1066,7 +1136,7 @@ fs_node_t *kopen_recur(const char *filename, uint64_t flags, uint64_t symlink_de
 		}
 		/* We are still searching... */
 		debug_print(INFO, "... Searching for %s", path_offset);
-		fs_node_t * node_next = finddir_fs(node_ptr, path_offset);
+		fs_node_t * node_next = vfs_dcache_finddir(node_ptr, path_offset, depth + 1 == path_depth);
 		free(node_ptr); /* Always a clone or an unopened thing */
 		node_ptr = node_next;
 		/* Search the active directory for the requested directory */
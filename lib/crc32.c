@@ -0,0 +1,184 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * libtoaru_crc32: CRC-32 checksums
+ *
+ * The portable path is "slicing-by-8": eight lookup tables let us
+ * consume a whole 64-bit word per step instead of a byte at a time.
+ *
+ * CPUs with PCLMULQDQ get carry-less multiply folding instead, which
+ * keeps four 128-bit accumulators going over 64-byte blocks, folds
+ * them down to one, and finishes with a Barrett reduction. Anything
+ * too short for that, and any tail, goes through the tables. Which
+ * path to use is decided once, when the library is loaded.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#ifndef NO_SSE
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include <toaru/crc32.h>
+
+#define CRC32_POLY 0xEDB88320
+
+static uint32_t crc_table[8][256];
+
+/* Both implementations take and return the CRC in its inverted (running) form. */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t * buf, size_t len) {
+	while (len >= 8) {
+		uint32_t one, two;
+		memcpy(&one, buf, 4);
+		memcpy(&two, buf + 4, 4);
+		one ^= crc;
+		crc = crc_table[7][one & 0xFF] ^
+		      crc_table[6][(one >> 8) & 0xFF] ^
+		      crc_table[5][(one >> 16) & 0xFF] ^
+		      crc_table[4][one >> 24] ^
+		      crc_table[3][two & 0xFF] ^
+		      crc_table[2][(two >> 8) & 0xFF] ^
+		      crc_table[1][(two >> 16) & 0xFF] ^
+		      crc_table[0][two >> 24];
+		buf += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		crc = (crc >> 8) ^ crc_table[0][(crc ^ *buf++) & 0xFF];
+	}
+
+	return crc;
+}
+
+#ifndef NO_SSE
+/*
+ * Folding constants for the reflected polynomial: x^(4*128+32) and
+ * x^(4*128-32) mod P for the four-way fold, the same at 128 bits
+ * for the single fold, x^64 mod P for the 64-to-32 step, and
+ * P' and P for the Barrett reduction.
+ */
+static const uint64_t crc_k1k2[2] = {0x0154442bd4, 0x01c6e41596};
+static const uint64_t crc_k3k4[2] = {0x01751997d0, 0x00ccaa009e};
+static const uint64_t crc_k5k0[2] = {0x0163cd6124, 0x0000000000};
+static const uint64_t crc_poly[2] = {0x01db710641, 0x01f7011641};
+
+#define FOLD(x, k, next) \
+	_mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), next)
+
+/* @p len must be a multiple of 16 and at least 64. */
+__attribute__((target("pclmul,sse2")))
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t * buf, size_t len) {
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	__m128i k  = _mm_loadu_si128((const __m128i *)crc_k1k2);
+
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) {
+		x1 = FOLD(x1, k, _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = FOLD(x2, k, _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = FOLD(x3, k, _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = FOLD(x4, k, _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+		buf += 64;
+		len -= 64;
+	}
+
+	/* Four accumulators down to one */
+	k = _mm_loadu_si128((const __m128i *)crc_k3k4);
+	x1 = FOLD(x1, k, x2);
+	x1 = FOLD(x1, k, x3);
+	x1 = FOLD(x1, k, x4);
+
+	while (len >= 16) {
+		x1 = FOLD(x1, k, _mm_loadu_si128((const __m128i *)buf));
+		buf += 16;
+		len -= 16;
+	}
+
+	/* 128 bits down to 64 */
+	__m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+	x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+	k  = _mm_loadl_epi64((const __m128i *)crc_k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask);
+	x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	k  = _mm_loadu_si128((const __m128i *)crc_poly);
+	x2 = _mm_and_si128(x1, mask);
+	x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+	x2 = _mm_and_si128(x2, mask);
+	x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+#undef FOLD
+
+static int have_pclmul = 0;
+#endif
+
+__attribute__((constructor))
+static void crc32_init(void) {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int j = 0; j < 8; ++j) {
+			c = (c & 1) ? (c >> 1) ^ CRC32_POLY : (c >> 1);
+		}
+		crc_table[0][i] = c;
+	}
+
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int t = 1; t < 8; ++t) {
+			crc_table[t][i] = (crc_table[t-1][i] >> 8) ^ crc_table[0][crc_table[t-1][i] & 0xFF];
+		}
+	}
+
+#ifndef NO_SSE
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		have_pclmul = !!(ecx & bit_PCLMUL);
+	}
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void * data, size_t len) {
+	const uint8_t * buf = data;
+	crc = ~crc;
+
+#ifndef NO_SSE
+	if (have_pclmul && len >= 64) {
+		size_t blocks = len & ~(size_t)15;
+		crc = crc32_pclmul(crc, buf, blocks);
+		buf += blocks;
+		len -= blocks;
+	}
+#endif
+
+	return ~crc32_slice8(crc, buf, len);
+}
+
+uint32_t crc32(const void * data, size_t len) {
+	return crc32_update(0, data, len);
+}
+
+const char * crc32_implementation(void) {
+#ifndef NO_SSE
+	if (have_pclmul) return "pclmul";
+#endif
+	return "slice8";
+}
@@ -41,45 +41,154 @@ static inline uint16_t max16(uint16_t a, uint16_t b) {
 }
 
 
-static int _is_in_clip(gfx_context_t * ctx, int32_t y) {
-	if (!ctx->clips) return 1;
-	if (y < 0 || y >= ctx->clips_size) return 1;
-	return ctx->clips[y];
+/*
+ * Clipping
+ *
+ * A clip is a list of rectangles. Drawing functions don't look at the
+ * rectangles directly: the first time a clipped context is drawn to
+ * after the list changes, the rectangles are flattened into a sorted,
+ * non-overlapping list of [start,end) spans for every row, and each
+ * row of a drawing operation just walks its spans.
+ */
+struct gfx_clip_rect {
+	int32_t x, y, w, h;
+};
+
+struct gfx_clip {
+	struct gfx_clip_rect * rects;
+	int32_t count;
+	int32_t rects_size;
+
+	int32_t rows;       /* Height the span table was built for, or -1 if stale */
+	int32_t width;      /* Width the span table was built for */
+	int32_t * row_span; /* Index of each row's first span; rows+1 entries */
+	int32_t * spans;    /* [start,end) pairs */
+	int32_t spans_size;
+};
+
+static void _clip_build(gfx_context_t * ctx) {
+	struct gfx_clip * clip = ctx->clips;
+
+	if (clip->rows != ctx->height) {
+		clip->row_span = realloc(clip->row_span, sizeof(int32_t) * (ctx->height + 1));
+	}
+	clip->rows  = ctx->height;
+	clip->width = ctx->width;
+
+	int32_t n = 0;
+	for (int32_t y = 0; y < clip->rows; ++y) {
+		clip->row_span[y] = n;
+		for (int32_t i = 0; i < clip->count; ++i) {
+			struct gfx_clip_rect * r = &clip->rects[i];
+			if (y < r->y || y >= r->y + r->h) continue;
+			int32_t start = max(r->x, 0);
+			int32_t end   = min(r->x + r->w, ctx->width);
+			if (start >= end) continue;
+
+			if (n * 2 + 2 > clip->spans_size) {
+				clip->spans_size = clip->spans_size ? clip->spans_size * 2 : 64;
+				clip->spans = realloc(clip->spans, sizeof(int32_t) * clip->spans_size);
+			}
+
+			/* Insert in order of start, then merge with whatever now overlaps it. */
+			int32_t * row = &clip->spans[clip->row_span[y] * 2];
+			int32_t j = n - clip->row_span[y];
+			while (j > 0 && row[j * 2 - 2] > start) {
+				row[j * 2]     = row[j * 2 - 2];
+				row[j * 2 + 1] = row[j * 2 - 1];
+				j--;
+			}
+			row[j * 2]     = start;
+			row[j * 2 + 1] = end;
+			n++;
+
+			int32_t out = 0;
+			for (int32_t k = 1; k < n - clip->row_span[y]; ++k) {
+				if (row[k * 2] <= row[out * 2 + 1]) {
+					row[out * 2 + 1] = max(row[out * 2 + 1], row[k * 2 + 1]);
+				} else {
+					out++;
+					row[out * 2]     = row[k * 2];
+					row[out * 2 + 1] = row[k * 2 + 1];
+				}
+			}
+			n = clip->row_span[y] + out + 1;
+		}
+	}
+	clip->row_span[clip->rows] = n;
 }
 
+/* Visible spans of a row, as [start,end) pairs. Without a clip the whole row is one span. */
+static int32_t _clip_spans(gfx_context_t * ctx, int32_t y, const int32_t ** spans) {
+	static const int32_t _whole_row[2] = {0, INT32_MAX};
+	struct gfx_clip * clip = ctx->clips;
+	if (!clip) {
+		*spans = _whole_row;
+		return 1;
+	}
+	if (clip->rows != ctx->height || clip->width != ctx->width) {
+		_clip_build(ctx);
+	}
+	if (y < 0 || y >= clip->rows) return 0;
+	*spans = &clip->spans[clip->row_span[y] * 2];
+	return clip->row_span[y + 1] - clip->row_span[y];
+}
 
-void gfx_add_clip(gfx_context_t * ctx, int32_t x, int32_t y, int32_t w, int32_t h) {
-	(void)x;
-	(void)w; // TODO Horizontal clipping
+static int _is_in_clip(gfx_context_t * ctx, int32_t x, int32_t y) {
+	const int32_t * spans;
+	int32_t n = _clip_spans(ctx, y, &spans);
+	for (int32_t i = 0; i < n; ++i) {
+		if (x < spans[i * 2]) return 0;
+		if (x < spans[i * 2 + 1]) return 1;
+	}
+	return 0;
+}
+
+static struct gfx_clip * _clip_create(gfx_context_t * ctx) {
 	if (!ctx->clips) {
-		ctx->clips = malloc(ctx->height);
-		memset(ctx->clips, 0, ctx->height);
-		ctx->clips_size = ctx->height;
+		ctx->clips = calloc(1, sizeof(struct gfx_clip));
+		ctx->clips->rows = -1;
 	}
-	for (int i = max(y,0); i < min(y+h,ctx->clips_size); ++i) {
-		ctx->clips[i] = 1;
+	return ctx->clips;
+}
+
+void gfx_add_clip(gfx_context_t * ctx, int32_t x, int32_t y, int32_t w, int32_t h) {
+	struct gfx_clip * clip = _clip_create(ctx);
+	if (w <= 0 || h <= 0) return;
+	if (clip->count == clip->rects_size) {
+		clip->rects_size = clip->rects_size ? clip->rects_size * 2 : 16;
+		clip->rects = realloc(clip->rects, sizeof(struct gfx_clip_rect) * clip->rects_size);
 	}
+	clip->rects[clip->count++] = (struct gfx_clip_rect){x, y, w, h};
+	clip->rows = -1;
 }
 
 void gfx_clear_clip(gfx_context_t * ctx) {
 	if (ctx->clips) {
-		memset(ctx->clips, 0, ctx->clips_size);
+		ctx->clips->count = 0;
+		ctx->clips->rows = -1;
 	}
 }
 
 void gfx_no_clip(gfx_context_t * ctx) {
-	void * tmp = ctx->clips;
+	struct gfx_clip * tmp = ctx->clips;
 	if (!tmp) return;
 	ctx->clips = NULL;
+	free(tmp->rects);
+	free(tmp->row_span);
+	free(tmp->spans);
 	free(tmp);
 }
 
 /* Pointer to graphics memory */
 void flip(gfx_context_t * ctx) {
 	if (ctx->clips) {
-		for (size_t i = 0; i < ctx->height; ++i) {
-			if (_is_in_clip(ctx,i)) {
-				memcpy(&ctx->buffer[i*GFX_S(ctx)], &ctx->backbuffer[i*GFX_S(ctx)], 4 * ctx->width);
+		for (int32_t y = 0; y < ctx->height; ++y) {
+			const int32_t * spans;
+			int32_t n = _clip_spans(ctx, y, &spans);
+			for (int32_t i = 0; i < n; ++i) {
+				size_t offset = y * GFX_S(ctx) + spans[i * 2] * GFX_B(ctx);
+				memcpy(&ctx->buffer[offset], &ctx->backbuffer[offset], (spans[i * 2 + 1] - spans[i * 2]) * GFX_B(ctx));
 			}
 		}
 	} else {
@@ -145,10 +254,15 @@ gfx_context_t * init_graphics_subregion(gfx_context_t * base, int x, int y, int
 	out->buffer = base->buffer + (base->stride * y) + x * 4;
 
 	if (base->clips) {
-		for (int _y = 0; _y < height; ++_y) {
-			if (_is_in_clip(base, y + _y)) {
-				gfx_add_clip(out,0,_y,width,1);
-			}
+		/* Inherit the parts of the base clip that overlap this region */
+		_clip_create(out);
+		for (int32_t i = 0; i < base->clips->count; ++i) {
+			struct gfx_clip_rect * r = &base->clips->rects[i];
+			int32_t left   = max(r->x, x);
+			int32_t top    = max(r->y, y);
+			int32_t right  = min(r->x + r->w, x + width);
+			int32_t bottom = min(r->y + r->h, y + height);
+			gfx_add_clip(out, left - x, top - y, right - left, bottom - top);
 		}
 	}
 
@@ -165,12 +279,6 @@ void reinit_graphics_fullscreen(gfx_context_t * out) {
 
 	out->size   = GFX_H(out) * GFX_S(out);
 
-	if (out->clips && out->clips_size != out->height) {
-		free(out->clips);
-		out->clips = NULL;
-		out->clips_size = 0;
-	}
-
 	if (out->buffer != out->backbuffer) {
 		ioctl(framebuffer_fd, IO_VID_ADDR,   &out->buffer);
 		out->backbuffer = realloc(out->backbuffer, GFX_S(out) * GFX_H(out));
@@ -330,9 +438,12 @@ static void _box_blur_horizontal(gfx_context_t * _src, int radius) {
 			}
 		}
 
-		if (!_is_in_clip(_src, y)) continue;
-		for (int x = 0; x < w; x++) {
-			GFX(_src,x,y) = out_color[x];
+		const int32_t * spans;
+		int32_t n = _clip_spans(_src, y, &spans);
+		for (int32_t i = 0; i < n; ++i) {
+			for (int x = spans[i * 2]; x < min(spans[i * 2 + 1], w); x++) {
+				GFX(_src,x,y) = out_color[x];
+			}
 		}
 	}
 
@@ -384,7 +495,7 @@ static void _box_blur_vertical(gfx_context_t * _src, int radius) {
 		}
 
 		for (int y = 0; y < h; y++) {
-			if (!_is_in_clip(_src, y)) continue;
+			if (_src->clips && !_is_in_clip(_src, x, y)) continue;
 			GFX(_src,x,y) = out_color[y];
 		}
 	}
@@ -581,125 +692,97 @@ __attribute__((constructor)) static void _masks(void) {
 }
 #endif
 
+/* Draw the part of one row of a sprite that lands in [left,right) of the context row. */
 __attribute__((__force_align_arg_pointer__))
-void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
-
-	int32_t _left   = max(x, 0);
-	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
+static void _draw_sprite_span(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, int32_t row, int32_t left, int32_t right) {
+	int32_t _y = row - y;
 	if (sprite->alpha == ALPHA_MASK) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y), SMASKS(sprite, _x, _y));
-			}
+		for (int32_t _x = left; _x < right; ++_x) {
+			GFX(ctx, _x, row) = alpha_blend(GFX(ctx, _x, row), SPRITE(sprite, _x - x, _y), SMASKS(sprite, _x - x, _y));
 		}
 	} else if (sprite->alpha == ALPHA_EMBEDDED) {
 		/* Alpha embedded is the most important step. */
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
 #ifdef NO_SSE
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
+		for (int32_t _x = left; _x < right; ++_x) {
+			GFX(ctx, _x, row) = alpha_blend_rgba(GFX(ctx, _x, row), SPRITE(sprite, _x - x, _y));
+		}
 #else
-			uint16_t _x = 0;
-
-			/* Ensure alignment */
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (!((uintptr_t)&GFX(ctx, x + _x, y + _y) & 15))
-					break;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-			for (; _x < sprite->width - 3; _x += 4) {
-				if (x + _x < _left || y + _y < _top || y + _y > _bottom) {
-					continue;
-				}
-				if (x + _x + 3 > _right)
-					break;
+		int32_t _x = left;
 
-				__m128i d = _mm_load_si128((void *)&GFX(ctx, x + _x, y + _y));
-				__m128i s = _mm_loadu_si128((void *)&SPRITE(sprite, _x, _y));
+		/* Ensure alignment */
+		for (; _x < right && ((uintptr_t)&GFX(ctx, _x, row) & 15); ++_x) {
+			GFX(ctx, _x, row) = alpha_blend_rgba(GFX(ctx, _x, row), SPRITE(sprite, _x - x, _y));
+		}
+		for (; _x + 3 < right; _x += 4) {
+			__m128i d = _mm_load_si128((void *)&GFX(ctx, _x, row));
+			__m128i s = _mm_loadu_si128((void *)&SPRITE(sprite, _x - x, _y));
 
-				__m128i d_l, d_h;
-				__m128i s_l, s_h;
+			__m128i d_l, d_h;
+			__m128i s_l, s_h;
 
-				// unpack destination
-				d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
-				d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
+			// unpack destination
+			d_l = _mm_unpacklo_epi8(d, _mm_setzero_si128());
+			d_h = _mm_unpackhi_epi8(d, _mm_setzero_si128());
 
-				// unpack source
-				s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
-				s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
+			// unpack source
+			s_l = _mm_unpacklo_epi8(s, _mm_setzero_si128());
+			s_h = _mm_unpackhi_epi8(s, _mm_setzero_si128());
 
-				__m128i a_l, a_h;
-				__m128i t_l, t_h;
+			__m128i a_l, a_h;
+			__m128i t_l, t_h;
 
-				// extract source alpha RGBA → AAAA
-				a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
-				a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+			// extract source alpha RGBA → AAAA
+			a_l = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_l, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+			a_h = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_h, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
 
-				// negate source alpha
-				t_l = _mm_xor_si128(a_l, mask00ff);
-				t_h = _mm_xor_si128(a_h, mask00ff);
+			// negate source alpha
+			t_l = _mm_xor_si128(a_l, mask00ff);
+			t_h = _mm_xor_si128(a_h, mask00ff);
 
-				// apply source alpha to destination
-				d_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_l,t_l),mask0080),mask0101);
-				d_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_h,t_h),mask0080),mask0101);
+			// apply source alpha to destination
+			d_l = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_l,t_l),mask0080),mask0101);
+			d_h = _mm_mulhi_epu16(_mm_adds_epu16(_mm_mullo_epi16(d_h,t_h),mask0080),mask0101);
 
-				// combine source and destination
-				d_l = _mm_adds_epu8(s_l,d_l);
-				d_h = _mm_adds_epu8(s_h,d_h);
+			// combine source and destination
+			d_l = _mm_adds_epu8(s_l,d_l);
+			d_h = _mm_adds_epu8(s_h,d_h);
 
-				// pack low + high and write back to memory
-				_mm_storeu_si128((void*)&GFX(ctx, x + _x, y + _y), _mm_packus_epi16(d_l,d_h));
-			}
-			for (; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-			}
-#endif
+			// pack low + high and write back to memory
+			_mm_store_si128((void*)&GFX(ctx, _x, row), _mm_packus_epi16(d_l,d_h));
 		}
+		for (; _x < right; ++_x) {
+			GFX(ctx, _x, row) = alpha_blend_rgba(GFX(ctx, _x, row), SPRITE(sprite, _x - x, _y));
+		}
+#endif
 	} else if (sprite->alpha == ALPHA_INDEXED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				if (SPRITE(sprite, _x, _y) != sprite->blank) {
-					GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
-				}
+		for (int32_t _x = left; _x < right; ++_x) {
+			if (SPRITE(sprite, _x - x, _y) != sprite->blank) {
+				GFX(ctx, _x, row) = SPRITE(sprite, _x - x, _y) | 0xFF000000;
 			}
 		}
 	} else if (sprite->alpha == ALPHA_FORCE_SLOW_EMBEDDED) {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-#if 1
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), SPRITE(sprite, _x, _y));
-#else
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(rgba(255,255,0,255), SPRITE(sprite, _x, _y));
-#endif
-			}
+		for (int32_t _x = left; _x < right; ++_x) {
+			GFX(ctx, _x, row) = alpha_blend_rgba(GFX(ctx, _x, row), SPRITE(sprite, _x - x, _y));
 		}
 	} else {
-		for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-			if (!_is_in_clip(ctx, y + _y)) continue;
-			for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-				if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-					continue;
-				GFX(ctx, x + _x, y + _y) = SPRITE(sprite, _x, _y) | 0xFF000000;
-			}
+		for (int32_t _x = left; _x < right; ++_x) {
+			GFX(ctx, _x, row) = SPRITE(sprite, _x - x, _y) | 0xFF000000;
+		}
+	}
+}
+
+void draw_sprite(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y) {
+	int32_t _left   = max(x, 0);
+	int32_t _top    = max(y, 0);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		const int32_t * spans;
+		int32_t n = _clip_spans(ctx, _y, &spans);
+		for (int32_t i = 0; i < n && spans[i * 2] < _right; ++i) {
+			int32_t l = max(spans[i * 2], _left);
+			int32_t r = min(spans[i * 2 + 1], _right);
+			if (l < r) _draw_sprite_span(ctx, sprite, x, y, _y, l, r);
 		}
 	}
 }
@@ -793,21 +876,30 @@ uint32_t getBilinearFilteredPixelColor(sprite_t * tex, double u, double v) {
 	return rgb(r_RED,r_GRE,r_BLU) & (0xFFFFFF + ((uint32_t)r_ALP << 24));
 }
 
+/*
+ * The remaining drawing functions visit the visible spans of each row
+ * between _left and _right with this; each span is [l,r).
+ */
+#define FOR_EACH_SPAN(ctx, row, l, r) \
+	const int32_t * spans; \
+	int32_t n = _clip_spans(ctx, row, &spans); \
+	for (int32_t i = 0, l, r; i < n && spans[i * 2] < _right; ++i) \
+		if ((l = max(spans[i * 2], _left)) < (r = min(spans[i * 2 + 1], _right)))
+
 void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			if (sprite->alpha > 0) {
-				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
-				GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), n_color);
-			} else {
-				GFX(ctx, x + _x, y + _y) = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)(_x - x) / (double)width, (double)(_y - y)/(double)height);
+				if (sprite->alpha > 0) {
+					GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), n_color);
+				} else {
+					GFX(ctx, _x, _y) = n_color;
+				}
 			}
 		}
 	}
@@ -816,17 +908,16 @@ void draw_sprite_scaled(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = SPRITE(sprite, _x, _y);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				uint32_t n_color = SPRITE(sprite, _x - x, _y - y);
+				uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
+				f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
+				GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), f_color);
+			}
 		}
 	}
 }
@@ -834,16 +925,15 @@ void draw_sprite_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_
 void draw_sprite_alpha_paint(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, float alpha, uint32_t c) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + sprite->width,  ctx->width - 1);
-	int32_t _bottom = min(y + sprite->height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < sprite->height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < sprite->width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = SPRITE(sprite, _x, _y);
-			uint32_t f_color = rgb(_ALP(n_color) * alpha, 0, 0);
-			GFX(ctx, x + _x, y + _y) = alpha_blend(GFX(ctx, x + _x, y + _y), c, f_color);
+	int32_t _right  = min(x + sprite->width,  ctx->width);
+	int32_t _bottom = min(y + sprite->height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				uint32_t n_color = SPRITE(sprite, _x - x, _y - y);
+				uint32_t f_color = rgb(_ALP(n_color) * alpha, 0, 0);
+				GFX(ctx, _x, _y) = alpha_blend(GFX(ctx, _x, _y), c, f_color);
+			}
 		}
 	}
 }
@@ -851,17 +941,16 @@ void draw_sprite_alpha_paint(gfx_context_t * ctx, sprite_t * sprite, int32_t x,
 void draw_sprite_scaled_alpha(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32_t y, uint16_t width, uint16_t height, float alpha) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)_x / (double)width, (double)_y/(double)height);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				uint32_t n_color = getBilinearFilteredPixelColor(sprite, (double)(_x - x) / (double)width, (double)(_y - y)/(double)height);
+				uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
+				f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
+				GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), f_color);
+			}
 		}
 	}
 }
@@ -878,14 +967,13 @@ uint32_t interp_colors(uint32_t bottom, uint32_t top, uint8_t interp) {
 void draw_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), color);
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), color);
+			}
 		}
 	}
 }
@@ -893,14 +981,13 @@ void draw_rectangle(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, u
 void draw_rectangle_solid(gfx_context_t * ctx, int32_t x, int32_t y, uint16_t width, uint16_t height, uint32_t color) {
 	int32_t _left   = max(x, 0);
 	int32_t _top    = max(y, 0);
-	int32_t _right  = min(x + width,  ctx->width - 1);
-	int32_t _bottom = min(y + height, ctx->height - 1);
-	for (uint16_t _y = 0; _y < height; ++_y) {
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (uint16_t _x = 0; _x < width; ++_x) {
-			if (x + _x < _left || x + _x > _right || y + _y < _top || y + _y > _bottom)
-				continue;
-			GFX(ctx, x + _x, y + _y) = color;
+	int32_t _right  = min(x + width,  ctx->width);
+	int32_t _bottom = min(y + height, ctx->height);
+	for (int32_t _y = _top; _y < _bottom; ++_y) {
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				GFX(ctx, _x, _y) = color;
+			}
 		}
 	}
 }
@@ -1097,24 +1184,21 @@ void draw_sprite_rotate(gfx_context_t * ctx, sprite_t * sprite, int32_t x, int32
 	_c = cos(-rotation);
 
 	/* Calculate bounds */
-	int32_t _left   = min(min(ul_x, ll_x), min(ur_x, lr_x));
-	int32_t _top    = min(min(ul_y, ll_y), min(ur_y, lr_y));
-	int32_t _right  = max(max(ul_x, ll_x), max(ur_x, lr_x));
-	int32_t _bottom = max(max(ul_y, ll_y), max(ur_y, lr_y));
+	int32_t _left   = max(x + min(min(ul_x, ll_x), min(ur_x, lr_x)), 0);
+	int32_t _top    = max(y + min(min(ul_y, ll_y), min(ur_y, lr_y)), 0);
+	int32_t _right  = min(x + max(max(ul_x, ll_x), max(ur_x, lr_x)), ctx->width);
+	int32_t _bottom = min(y + max(max(ul_y, ll_y), max(ur_y, lr_y)), ctx->height);
 
 	for (int32_t _y = _top; _y < _bottom; ++_y) {
-		if (_y + y < 0) continue;
-		if (_y + y  >= ctx->height) break;
-		if (!_is_in_clip(ctx, y + _y)) continue;
-		for (int32_t _x = _left; _x < _right; ++_x) {
-			if (_x + x < 0) continue;
-			if (_x + x >= ctx->width) break;
-			double u, v;
-			calc_rotation(_x + originx, _y + originy, originx, originy, _s, _c, &u, &v);
-			uint32_t n_color = getBilinearFilteredPixelColor(sprite, u / (double)sprite->width, v/(double)sprite->height);
-			uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
-			f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
-			GFX(ctx, x + _x, y + _y) = alpha_blend_rgba(GFX(ctx, x + _x, y + _y), f_color);
+		FOR_EACH_SPAN(ctx, _y, l, r) {
+			for (int32_t _x = l; _x < r; ++_x) {
+				double u, v;
+				calc_rotation(_x - x + originx, _y - y + originy, originx, originy, _s, _c, &u, &v);
+				uint32_t n_color = getBilinearFilteredPixelColor(sprite, u / (double)sprite->width, v/(double)sprite->height);
+				uint32_t f_color = premultiply((n_color & 0xFFFFFF) | ((uint32_t)(255 * alpha) << 24));
+				f_color = (f_color & 0xFFFFFF) | ((uint32_t)(alpha * _ALP(n_color)) << 24);
+				GFX(ctx, _x, _y) = alpha_blend_rgba(GFX(ctx, _x, _y), f_color);
+			}
 		}
 	}
 }
@@ -2,21 +2,63 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2013-2018 K. Lange
+ *
+ * Open-addressing hash table with Robin Hood probing.
+ *
+ * Entries live directly in a power-of-two array, which doubles
+ * when it gets three quarters full. On insert, an entry that has
+ * probed further from its home slot than the one it lands on takes
+ * that slot and the other moves on, so probe lengths stay short and
+ * a lookup can stop as soon as it passes where its key would be.
+ * Removal shifts the following entries back, so there are no
+ * tombstones.
  */
-
+#include <stdint.h>
 #include <toaru/list.h>
 #include <toaru/hashmap.h>
 
+#define HASHMAP_MIN_SIZE 8
+#define HASHMAP_WORD_ONES  0x0101010101010101ULL
+#define HASHMAP_WORD_HIGHS 0x8080808080808080ULL
+#define HASHMAP_PAGE_SIZE  4096
+
+/*
+ * Hash a string eight bytes at a time.
+ *
+ * Each eight-byte chunk of the string is read as one word, with the
+ * final chunk zero-filled past the terminator, so the result doesn't
+ * depend on alignment. We never read past the terminator into
+ * another page.
+ */
 unsigned int hashmap_string_hash(void * _key) {
-	unsigned int hash = 0;
-	char * key = (char *)_key;
-	int c;
-	/* This is the so-called "sdbm" hash. It comes from a piece of
-	 * public domain code from a clone of ndbm. */
-	while ((c = *key++)) {
-		hash = c + (hash << 6) + (hash << 16) - hash;
+	const unsigned char * key = _key;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (1) {
+		uint64_t word = 0;
+		if (((uintptr_t)key & (HASHMAP_PAGE_SIZE - 1)) <= HASHMAP_PAGE_SIZE - sizeof(uint64_t)) {
+			__builtin_memcpy(&word, key, sizeof(uint64_t));
+		} else {
+			for (unsigned int i = 0; i < sizeof(uint64_t) && key[i]; ++i) {
+				word |= (uint64_t)key[i] << (i * 8);
+			}
+		}
+
+		uint64_t zero = (word - HASHMAP_WORD_ONES) & ~word & HASHMAP_WORD_HIGHS;
+		if (zero) {
+			unsigned int bytes = __builtin_ctzll(zero) / 8;
+			word = bytes ? word & (~0ULL >> (64 - bytes * 8)) : 0;
+			hash = (hash ^ word ^ bytes) * 0x9E3779B97F4A7C15ULL;
+			break;
+		}
+
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+		key += sizeof(uint64_t);
 	}
-	return hash;
+
+	hash ^= hash >> 29;
+	return (unsigned int)(hash ^ (hash >> 32));
 }
 
 int hashmap_string_comp(void * a, void * b) {
@@ -44,25 +86,39 @@ static void hashmap_int_free(void * ptr) {
 	return;
 }
 
+/* Integer keys hash to themselves, so spread them over the low bits we index by. */
+static unsigned int hashmap_mix(unsigned int hash) {
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash;
+}
 
-hashmap_t * hashmap_create(int size) {
+static hashmap_t * hashmap_alloc(int size) {
 	hashmap_t * map = malloc(sizeof(hashmap_t));
 
+	map->size = HASHMAP_MIN_SIZE;
+	while (map->size < (size_t)size) map->size *= 2;
+	map->count = 0;
+	map->entries = calloc(map->size, sizeof(hashmap_entry_t));
+
+	return map;
+}
+
+hashmap_t * hashmap_create(int size) {
+	hashmap_t * map = hashmap_alloc(size);
+
 	map->hash_func     = &hashmap_string_hash;
 	map->hash_comp     = &hashmap_string_comp;
 	map->hash_key_dup  = &hashmap_string_dupe;
 	map->hash_key_free = &free;
 	map->hash_val_free = &free;
 
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
-
 	return map;
 }
 
 hashmap_t * hashmap_create_int(int size) {
-	hashmap_t * map = malloc(sizeof(hashmap_t));
+	hashmap_t * map = hashmap_alloc(size);
 
 	map->hash_func     = &hashmap_int_hash;
 	map->hash_comp     = &hashmap_int_comp;
@@ -70,121 +126,111 @@ hashmap_t * hashmap_create_int(int size) {
 	map->hash_key_free = &hashmap_int_free;
 	map->hash_val_free = &free;
 
-	map->size = size;
-	map->entries = malloc(sizeof(hashmap_entry_t *) * size);
-	memset(map->entries, 0x00, sizeof(hashmap_entry_t *) * size);
-
 	return map;
 }
 
+static hashmap_entry_t * hashmap_find(hashmap_t * map, void * key, unsigned int hash) {
+	size_t mask = map->size - 1;
+	size_t i = hash & mask;
+
+	for (unsigned int distance = 1; ; ++distance, i = (i + 1) & mask) {
+		hashmap_entry_t * x = &map->entries[i];
+		/* An empty slot, or one closer to home than we'd be: it isn't here. */
+		if (x->distance < distance) return NULL;
+		if (x->hash == hash && map->hash_comp(x->key, key)) return x;
+	}
+}
+
+static void hashmap_place(hashmap_t * map, hashmap_entry_t entry) {
+	size_t mask = map->size - 1;
+	size_t i = entry.hash & mask;
+
+	for (entry.distance = 1; ; ++entry.distance, i = (i + 1) & mask) {
+		hashmap_entry_t * x = &map->entries[i];
+		if (!x->distance) {
+			*x = entry;
+			return;
+		}
+		if (x->distance < entry.distance) {
+			hashmap_entry_t tmp = *x;
+			*x = entry;
+			entry = tmp;
+		}
+	}
+}
+
+static void hashmap_grow(hashmap_t * map) {
+	hashmap_entry_t * old = map->entries;
+	size_t old_size = map->size;
+
+	map->size *= 2;
+	map->entries = calloc(map->size, sizeof(hashmap_entry_t));
+
+	for (size_t i = 0; i < old_size; ++i) {
+		if (old[i].distance) hashmap_place(map, old[i]);
+	}
+
+	free(old);
+}
+
 void * hashmap_set(hashmap_t * map, void * key, void * value) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-		map->entries[hash] = e;
-		return NULL;
-	} else {
-		hashmap_entry_t * p = NULL;
-		do {
-			if (map->hash_comp(x->key, key)) {
-				void * out = x->value;
-				x->value = value;
-				return out;
-			} else {
-				p = x;
-				x = x->next;
-			}
-		} while (x);
-		hashmap_entry_t * e = malloc(sizeof(hashmap_entry_t));
-		e->key   = map->hash_key_dup(key);
-		e->value = value;
-		e->next = NULL;
-
-		p->next = e;
-		return NULL;
+	unsigned int hash = hashmap_mix(map->hash_func(key));
+
+	hashmap_entry_t * x = hashmap_find(map, key, hash);
+	if (x) {
+		void * out = x->value;
+		x->value = value;
+		return out;
 	}
+
+	if ((map->count + 1) * 4 > map->size * 3) hashmap_grow(map);
+
+	hashmap_entry_t e;
+	e.key   = map->hash_key_dup(key);
+	e.value = value;
+	e.hash  = hash;
+	hashmap_place(map, e);
+	map->count++;
+
+	return NULL;
 }
 
 void * hashmap_get(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return x->value;
-			}
-			x = x->next;
-		} while (x);
-		return NULL;
-	}
+	hashmap_entry_t * x = hashmap_find(map, key, hashmap_mix(map->hash_func(key)));
+	return x ? x->value : NULL;
 }
 
 void * hashmap_remove(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return NULL;
-	} else {
-		if (map->hash_comp(x->key, key)) {
-			void * out = x->value;
-			map->entries[hash] = x->next;
-			map->hash_key_free(x->key);
-			map->hash_val_free(x);
-			return out;
-		} else {
-			hashmap_entry_t * p = x;
-			x = x->next;
-			do {
-				if (map->hash_comp(x->key, key)) {
-					void * out = x->value;
-					p->next = x->next;
-					map->hash_key_free(x->key);
-					map->hash_val_free(x);
-					return out;
-				}
-				p = x;
-				x = x->next;
-			} while (x);
-		}
-		return NULL;
+	hashmap_entry_t * x = hashmap_find(map, key, hashmap_mix(map->hash_func(key)));
+	if (!x) return NULL;
+
+	void * out = x->value;
+	map->hash_key_free(x->key);
+
+	/* Pull the rest of the run back a slot, until an entry that's already home. */
+	size_t mask = map->size - 1;
+	size_t i = x - map->entries;
+	while (map->entries[(i + 1) & mask].distance > 1) {
+		map->entries[i] = map->entries[(i + 1) & mask];
+		map->entries[i].distance--;
+		i = (i + 1) & mask;
 	}
+	memset(&map->entries[i], 0, sizeof(hashmap_entry_t));
+	map->count--;
+
+	return out;
 }
 
 int hashmap_has(hashmap_t * map, void * key) {
-	unsigned int hash = map->hash_func(key) % map->size;
-
-	hashmap_entry_t * x = map->entries[hash];
-	if (!x) {
-		return 0;
-	} else {
-		do {
-			if (map->hash_comp(x->key, key)) {
-				return 1;
-			}
-			x = x->next;
-		} while (x);
-		return 0;
-	}
-
+	return hashmap_find(map, key, hashmap_mix(map->hash_func(key))) != NULL;
 }
 
 list_t * hashmap_keys(hashmap_t * map) {
 	list_t * l = list_create();
 
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->key);
-			x = x->next;
+		if (map->entries[i].distance) {
+			list_insert(l, map->entries[i].key);
 		}
 	}
 
@@ -195,10 +241,8 @@ list_t * hashmap_values(hashmap_t * map) {
 	list_t * l = list_create();
 
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i];
-		while (x) {
-			list_insert(l, x->value);
-			x = x->next;
+		if (map->entries[i].distance) {
+			list_insert(l, map->entries[i].value);
 		}
 	}
 
@@ -207,20 +251,13 @@ list_t * hashmap_values(hashmap_t * map) {
 
 void hashmap_free(hashmap_t * map) {
 	for (unsigned int i = 0; i < map->size; ++i) {
-		hashmap_entry_t * x = map->entries[i], * p;
-		while (x) {
-			p = x;
-			x = x->next;
-			map->hash_key_free(p->key);
-			map->hash_val_free(p);
+		if (map->entries[i].distance) {
+			map->hash_key_free(map->entries[i].key);
 		}
 	}
 	free(map->entries);
 }
 
 int hashmap_is_empty(hashmap_t * map) {
-	for (unsigned int i = 0; i < map->size; ++i) {
-		if (map->entries[i]) return 0;
-	}
-	return 1;
+	return !map->count;
 }
@@ -9,7 +9,10 @@
 #include <stddef.h>
 
 #ifndef _BOOT_LOADER
+#include <stdlib.h>
+#include <sched.h>
 #include <toaru/inflate.h>
+#include <toaru/crc32.h>
 #endif
 
 /**
@@ -365,6 +368,23 @@ static int uncompressed(struct inflate_context * ctx) {
 
 static struct huff_ring data = {0, {0}};
 
+#ifndef _BOOT_LOADER
+/**
+ * Allocate a ring for a context of its own, so more than one thread
+ * can decompress at once; the caller frees it.
+ */
+struct huff_ring * inflate_ring_create(void) {
+	return calloc(1, sizeof(struct huff_ring));
+}
+#endif
+
+/*
+ * The fixed tables are shared and the same every time, so build them
+ * once; rebuilding them under another thread's decoder would break it.
+ */
+static volatile int fixed_built = 0;
+static volatile int fixed_lock = 0;
+
 /**
  * Decompress DEFLATE-compressed data.
  */
@@ -372,7 +392,19 @@ int deflate_decompress(struct inflate_context * ctx) {
 	ctx->bit_buffer = 0;
 	ctx->buffer_size = 0;
 
-	build_fixed();
+	if (!fixed_built) {
+#ifndef _BOOT_LOADER
+		while (__sync_lock_test_and_set(&fixed_lock, 1)) sched_yield();
+#endif
+		if (!fixed_built) {
+			build_fixed();
+			__sync_synchronize();
+			fixed_built = 1;
+		}
+#ifndef _BOOT_LOADER
+		__sync_lock_release(&fixed_lock);
+#endif
+	}
 
 	if (!ctx->ring) {
 		ctx->ring = &data;
@@ -423,6 +455,38 @@ static unsigned int read_32le(struct inflate_context * ctx) {
 	return (d << 24) | (c << 16) | (b << 8) | (a << 0);
 }
 
+#ifndef _BOOT_LOADER
+/**
+ * While decompressing a gzip stream, output passes through here on
+ * its way to the caller so we can check it against the trailer.
+ * Bytes are collected and run through the CRC in batches, since
+ * the fast paths only pay off on more than a few bytes at a time.
+ */
+#define GZIP_CRC_BATCH 4096
+
+struct gzip_check {
+	struct inflate_context inner;  /* Must be first; this is what inflate sees */
+	struct inflate_context * outer;
+	uint32_t crc;
+	uint32_t size;
+	size_t pending;
+	uint8_t batch[GZIP_CRC_BATCH];
+};
+
+static void gzip_check_flush(struct gzip_check * check) {
+	check->crc = crc32_update(check->crc, check->batch, check->pending);
+	check->pending = 0;
+}
+
+static void gzip_check_write(struct inflate_context * ctx, unsigned int sym) {
+	struct gzip_check * check = (struct gzip_check *)ctx;
+	check->batch[check->pending++] = sym;
+	check->size++;
+	if (check->pending == GZIP_CRC_BATCH) gzip_check_flush(check);
+	check->outer->write_output(check->outer, sym);
+}
+#endif
+
 int gzip_decompress(struct inflate_context * ctx) {
 
 	/* Read gzip headers */
@@ -468,6 +532,28 @@ int gzip_decompress(struct inflate_context * ctx) {
 	}
 	(void)crc16;
 
+#ifndef _BOOT_LOADER
+	struct gzip_check check;
+	check.inner = *ctx;
+	check.inner.write_output = gzip_check_write;
+	check.outer = ctx;
+	check.crc = 0;
+	check.size = 0;
+	check.pending = 0;
+
+	int status = deflate_decompress(&check.inner);
+	if (status) return status;
+	gzip_check_flush(&check);
+
+	/* Read CRC and decompressed size from end of input */
+	unsigned int expected_crc = read_32le(&check.inner);
+	unsigned int dsize = read_32le(&check.inner);
+
+	/* dsize is the length mod 2^32, which is also what we counted */
+	if (expected_crc != check.crc || dsize != check.size) return 2;
+
+	return 0;
+#else
 	int status = deflate_decompress(ctx);
 
 	/* Read CRC and decompressed size from end of input */
@@ -478,4 +564,5 @@ int gzip_decompress(struct inflate_context * ctx) {
 	(void)dsize;
 
 	return status;
+#endif
 }
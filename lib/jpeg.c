@@ -3,9 +3,20 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2018 K. Lange
  *
- * libtoaru_jpeg: Decode simple JPEGs.
+ * libtoaru_jpeg: Decode JPEGs.
  *
- * Adapted from Raul Aguaviva's Python "micro JPEG visualizer":
+ * Supports baseline and progressive Huffman-coded images with
+ * one (grayscale) or three (YCbCr) components, any chroma
+ * subsampling, and restart intervals.
+ *
+ * All decoder state lives in a struct jpeg_ctx allocated for each
+ * call, so separate threads can decode images at the same time.
+ *
+ * The inverse DCT is the separable AAN ("ifast") algorithm in
+ * fixed point; with SSE2 both passes work on all eight columns
+ * (then rows) of a block at once in 16-bit lanes.
+ *
+ * Originally adapted from Raul Aguaviva's Python "micro JPEG visualizer":
  *
  * MIT License
  *
@@ -34,12 +45,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 
 #include <toaru/graphics.h>
 
 #ifndef NO_SSE
-#include <xmmintrin.h>
 #include <emmintrin.h>
 #endif
 
@@ -50,18 +59,10 @@
 #define TRACE(...)
 #endif
 
-static sprite_t * sprite = NULL;
-
-/* Byte swap short (because JPEG uses big-endian values) */
-static void swap16(uint16_t * val) {
-	char * a = (char *)val;
-	char b = a[0];
-	a[0] = a[1];
-	a[1] = b;
-}
-
-/* JPEG compontent zig-zag ordering */
-static int zigzag[] = {
+/* Natural (row-major) position of each zig-zag ordered coefficient.
+ * The extra entries absorb runs that overshoot the end of a block
+ * in corrupt streams. */
+static const uint8_t zigzag[80] = {
 	 0,  1,  8, 16,  9,  2,  3, 10,
 	17, 24, 32, 25, 18, 11,  4,  5,
 	12, 19, 26, 33, 40, 48, 41, 34,
@@ -69,11 +70,91 @@ static int zigzag[] = {
 	35, 42, 49, 56, 57, 50, 43, 36,
 	29, 22, 15, 23, 30, 37, 44, 51,
 	58, 59, 52, 45, 38, 31, 39, 46,
-	53, 60, 61, 54, 47, 55, 62, 63
+	53, 60, 61, 54, 47, 55, 62, 63,
+	63, 63, 63, 63, 63, 63, 63, 63,
+	63, 63, 63, 63, 63, 63, 63, 63,
+};
+
+/*
+ * AAN scale factors, in natural order, scaled by 2^14:
+ *   aanscales[u*8+v] = scale[u] * scale[v]
+ *   scale[0] = 1, scale[k] = cos(k*PI/16) * sqrt(2)
+ * These are folded into the quantization tables so the IDCT
+ * itself only needs five multiplies per 1-D transform.
+ */
+static const uint16_t aanscales[64] = {
+	16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+	22725, 31521, 29692, 26722, 22725, 17855, 12299,  6270,
+	21407, 29692, 27969, 25172, 21407, 16819, 11585,  5906,
+	19266, 26722, 25172, 22654, 19266, 15137, 10426,  5315,
+	16384, 22725, 21407, 19266, 16384, 12873,  8867,  4520,
+	12873, 17855, 16819, 15137, 12873, 10114,  6967,  3552,
+	 8867, 12299, 11585, 10426,  8867,  6967,  4799,  2446,
+	 4520,  6270,  5906,  5315,  4520,  3552,  2446,  1247,
+};
+
+/* Fixed-point IDCT parameters */
+#define CONST_BITS 8
+#define PASS1_BITS 2
+
+#define FIX_1_082392200 277
+#define FIX_1_414213562 362
+#define FIX_1_847759065 473
+#define FIX_2_613125930 669
+
+/* Number of bits resolved by the Huffman lookahead table */
+#define HUFF_LOOKAHEAD 9
+
+struct huffman_table {
+	uint8_t lookup_len[1 << HUFF_LOOKAHEAD]; /* Code length for short codes, 0 if longer */
+	uint8_t lookup_sym[1 << HUFF_LOOKAHEAD]; /* Symbol for short codes */
+	int32_t maxcode[18];  /* Largest code of each length, -1 if none */
+	int32_t mincode[17];  /* Smallest code of each length */
+	int32_t valptr[17];   /* Index of the first symbol of each length */
+	uint8_t symbols[256];
+};
+
+struct jpeg_component {
+	int id;
+	int h, v;          /* Sampling factors */
+	int tq;            /* Quantization table */
+	int td, ta;        /* DC and AC Huffman tables for the current scan */
+	int dc_pred;       /* DC predictor */
+	int bw, bh;        /* Blocks per line and column, padded out to whole MCUs */
+	int cw, ch;        /* Blocks per line and column that actually hold image data */
+	int16_t * coeffs;  /* Coefficients for every block, when not decoding directly */
+	uint8_t * plane;   /* Decoded samples, bw*8 by bh*8 */
 };
 
-static uint8_t quant_mapping[3] = {0};
-static uint8_t quant[8][64];
+/**
+ * All of the state for decoding one image.
+ */
+struct jpeg_ctx {
+	const uint8_t * data;  /* Whole file contents */
+	size_t size;
+	size_t pos;            /* Read position in data */
+
+	uint64_t bit_buf;      /* Entropy-coded bits, MSB first */
+	int bit_count;         /* Valid bits in the above */
+	int marker;            /* Marker reached in the entropy-coded data, or 0 */
+
+	int width, height;
+	int progressive;
+	int rgb;               /* Components are R, G, B rather than Y, Cb, Cr */
+	int ncomps;
+	int hmax, vmax;
+	int mcux, mcuy;        /* MCUs per line and column */
+	int restart_interval;
+	int eobrun;
+
+	struct jpeg_component comps[3];
+	struct jpeg_component * scan[3]; /* Components in the current scan */
+	int scan_ncomps;
+	int ss, se, ah, al;    /* Spectral selection and successive approximation */
+
+	uint16_t quant[4][64];        /* Quantization tables, natural order, AAN-scaled */
+	struct huffman_table huff[8]; /* 0-3 DC, 4-7 AC */
+};
 
 static int clamp(int col) {
 	if (col > 255) return 255;
@@ -81,431 +162,803 @@ static int clamp(int col) {
 	return col;
 }
 
-/* YCbCr to RGB conversion */
-static void color_conversion(
-		float Y, float Cb, float Cr,
-		int *R, int *G, int *B
-	) {
-	float r = (Cr*(2.0-2.0*0.299) + Y);
-	float b = (Cb*(2.0-2.0*0.114) + Y);
-	float g = (Y - 0.144 * b - 0.229 * r) / 0.587;
-
-	*R = clamp(r + 128);
-	*G = clamp(g + 128);
-	*B = clamp(b + 128);
+static int read_16(struct jpeg_ctx * j) {
+	if (j->pos + 2 > j->size) return 0;
+	int v = (j->data[j->pos] << 8) | j->data[j->pos+1];
+	j->pos += 2;
+	return v;
 }
 
-static int xy_to_lin(int x, int y) {
-	return x + y * 8;
+static int read_8(struct jpeg_ctx * j) {
+	if (j->pos >= j->size) return 0;
+	return j->data[j->pos++];
 }
 
-struct huffman_table {
-	uint8_t lengths[16];
-	uint8_t elements[256];
-} huffman_tables[256] = {0};
-
-struct stream {
-	FILE * file;
-	uint8_t byte;
-	int have;
-	int pos;
-};
-
-static void define_quant_table(FILE * f, int len) {
-
+static int define_quant_table(struct jpeg_ctx * j, int len) {
 	TRACE("Defining quant table");
-	while (len > 0) {
-		uint8_t hdr;
-		fread(&hdr, 1, 1, f);
-		fread(&quant[(hdr) & 0xF], 64, 1, f);
-		len -= 65;
+	size_t end = j->pos + len;
+	while (j->pos < end) {
+		int hdr = read_8(j);
+		int precision = hdr >> 4;
+		if (precision > 1) return 1;
+		uint16_t * q = j->quant[hdr & 3];
+		for (int i = 0; i < 64; ++i) {
+			int val = precision ? read_16(j) : read_8(j);
+			int n = zigzag[i];
+			int scaled = (val * aanscales[n] + (1 << (13 - PASS1_BITS))) >> (14 - PASS1_BITS);
+			/* 16-bit tables can go past what the (signed) 16-bit IDCT can hold */
+			q[n] = scaled > INT16_MAX ? INT16_MAX : scaled;
+		}
 	}
-	TRACE("Done");
+	j->pos = end;
+	return 0;
 }
 
-static void baseline_dct(FILE * f, int len) {
-
-	struct dct {
-		uint8_t  hdr;
-		uint16_t height;
-		uint16_t width;
-		uint8_t  components;
-	} __attribute__((packed)) dct;
+static int start_of_frame(struct jpeg_ctx * j, sprite_t * sprite, int len) {
+	size_t end = j->pos + len;
+
+	int precision = read_8(j);
+	j->height = read_16(j);
+	j->width = read_16(j);
+	j->ncomps = read_8(j);
+
+	if (precision != 8) return 1;
+	if (j->ncomps != 1 && j->ncomps != 3) return 1;
+	if (!j->width || !j->height) return 1;
+
+	TRACE("Image dimensions are %d×%d", j->width, j->height);
+
+	j->hmax = j->vmax = 1;
+	for (int i = 0; i < j->ncomps; ++i) {
+		struct jpeg_component * c = &j->comps[i];
+		c->id = read_8(j);
+		int samp = read_8(j);
+		c->h = samp >> 4;
+		c->v = samp & 0xF;
+		c->tq = read_8(j) & 3;
+		if (c->h < 1 || c->h > 4 || c->v < 1 || c->v > 4) return 1;
+		if (c->h > j->hmax) j->hmax = c->h;
+		if (c->v > j->vmax) j->vmax = c->v;
+	}
 
-	fread(&dct, sizeof(struct dct), 1, f);
+	/* Adobe's encoder marks untransformed RGB by naming the components */
+	j->rgb = j->ncomps == 3 && j->comps[0].id == 'R' && j->comps[1].id == 'G' && j->comps[2].id == 'B';
 
-	/* Read image dimensions, each as big-endian 16-bit values */
-	uint16_t h = dct.height;
-	uint16_t w = dct.width;
-	swap16(&h);
-	swap16(&w);
-	dct.height = h;
-	dct.width = w;
+	j->mcux = (j->width  + 8 * j->hmax - 1) / (8 * j->hmax);
+	j->mcuy = (j->height + 8 * j->vmax - 1) / (8 * j->vmax);
 
-	/* We read 7 bytes */
-	len -= sizeof(struct dct);
+	for (int i = 0; i < j->ncomps; ++i) {
+		struct jpeg_component * c = &j->comps[i];
+		c->bw = j->mcux * c->h;
+		c->bh = j->mcuy * c->v;
+		c->cw = ((j->width  * c->h + j->hmax - 1) / j->hmax + 7) / 8;
+		c->ch = ((j->height * c->v + j->vmax - 1) / j->vmax + 7) / 8;
+		c->plane = malloc(c->bw * 8 * c->bh * 8);
+		if (!c->plane) return 1;
+	}
 
-	TRACE("Image dimensions are %d×%d", dct.width, dct.height);
-	sprite->width  = dct.width;
-	sprite->height = dct.height;
+	sprite->width  = j->width;
+	sprite->height = j->height;
 	sprite->bitmap = malloc(sizeof(uint32_t) * sprite->width * sprite->height);
 	sprite->masks = NULL;
 	sprite->alpha = 0;
 	sprite->blank = 0;
 
-	TRACE("Loading quantization mappings...");
-	for (int i = 0; i < dct.components; ++i) {
-		/* Quant mapping */
-		struct {
-			uint8_t id;
-			uint8_t samp;
-			uint8_t qtb_id;
-		} __attribute__((packed)) tmp;
-
-		fread(&tmp, sizeof(tmp), 1, f);
+	j->pos = end;
+	return 0;
+}
 
-		/* There should only be three of these for the images we support. */
-		if (i > 3) {
-			abort();
+static int define_huffman_table(struct jpeg_ctx * j, int len) {
+	TRACE("Loading Huffman tables...");
+	size_t end = j->pos + len;
+	while (j->pos < end) {
+		int hdr = read_8(j);
+		if ((hdr >> 4) > 1) return 1;
+		int is_ac = hdr >> 4;
+		struct huffman_table * t = &j->huff[(is_ac ? 4 : 0) + (hdr & 3)];
+
+		uint8_t lengths[17];
+		int total = 0;
+		for (int i = 1; i <= 16; ++i) {
+			lengths[i] = read_8(j);
+			total += lengths[i];
 		}
+		if (total > 256 || j->pos + total > j->size) return 1;
+		memcpy(t->symbols, &j->data[j->pos], total);
+		j->pos += total;
 
-		quant_mapping[i] = tmp.qtb_id;
-
-		/* 3 bytes were read */
-		len -= 3;
-	}
+		/* DC symbols are magnitudes, which get_bits can only take up to 16 of */
+		for (int i = 0; i < total; ++i) {
+			if (!is_ac && t->symbols[i] > 16) return 1;
+		}
 
-	/* Skip whatever else might be in this section */
-	if (len > 0) {
-		fseek(f, len, SEEK_CUR);
+		/* Assign canonical codes and fill the lookahead table */
+		memset(t->lookup_len, 0, sizeof(t->lookup_len));
+		int code = 0, k = 0;
+		for (int l = 1; l <= 16; ++l) {
+			t->valptr[l] = k;
+			t->mincode[l] = code;
+			/* Only 2^l codes of length l exist; more would overrun the lookahead table */
+			if (code + lengths[l] > (1 << l)) return 1;
+			for (int i = 0; i < lengths[l]; ++i, ++k, ++code) {
+				if (l <= HUFF_LOOKAHEAD) {
+					int shift = HUFF_LOOKAHEAD - l;
+					for (int n = 0; n < (1 << shift); ++n) {
+						t->lookup_len[(code << shift) | n] = l;
+						t->lookup_sym[(code << shift) | n] = t->symbols[k];
+					}
+				}
+			}
+			t->maxcode[l] = lengths[l] ? code - 1 : -1;
+			code <<= 1;
+		}
+		t->maxcode[17] = 0x7FFFFFFF;
 	}
+	j->pos = end;
+	return 0;
 }
 
-static void define_huffman_table(FILE * f, int len) {
-
-	TRACE("Loading Huffman tables...");
-	while (len > 0) {
-		/* Read header ID */
-		uint8_t hdr;
-		fread(&hdr, 1, 1, f);
-		len--;
-
-		/* Read length table */
-		fread(huffman_tables[hdr].lengths, 16, 1, f);
-		len -= 16;
-
-		/* Read Huffman table entries */
-		int o = 0;
-		for (int i = 0; i < 16; ++i) {
-			int l = huffman_tables[hdr].lengths[i];
-			fread(&huffman_tables[hdr].elements[o], l, 1, f);
-			o += l;
-			len -= l;
+/**
+ * Top up the bit buffer from the entropy-coded data.
+ * Stuffed zero bytes after 0xFF are dropped; when a real marker
+ * is reached it is recorded and zeros are fed from then on.
+ */
+static void fill_bits(struct jpeg_ctx * j) {
+	while (j->bit_count <= 56) {
+		uint64_t b = 0;
+		if (!j->marker && j->pos < j->size) {
+			b = j->data[j->pos];
+			if (b == 0xFF) {
+				int next = (j->pos + 1 < j->size) ? j->data[j->pos + 1] : 0xD9;
+				if (next == 0x00) {
+					j->pos += 2;
+				} else {
+					j->marker = next;
+					b = 0;
+				}
+			} else {
+				j->pos++;
+			}
 		}
+		j->bit_buf |= b << (56 - j->bit_count);
+		j->bit_count += 8;
 	}
+}
 
-	/* Skip rest of section */
-	if (len > 0) {
-		fseek(f, len, SEEK_CUR);
-	}
+static inline int get_bits(struct jpeg_ctx * j, int n) {
+	if (!n) return 0;
+	if (j->bit_count < n) fill_bits(j);
+	int v = j->bit_buf >> (64 - n);
+	j->bit_buf <<= n;
+	j->bit_count -= n;
+	return v;
 }
 
-struct idct {
-	float base[64];
-};
+static inline int get_bit(struct jpeg_ctx * j) {
+	return get_bits(j, 1);
+}
 
-/**
- * norm_coeff[0] = 0.35355339059
- * norm_coeff[1] = 0.5
- */
-static float cosines[8][8] = {
-	{ 0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059,0.35355339059 },
-	{ 0.490392640202,0.415734806151,0.27778511651,0.0975451610081,-0.0975451610081,-0.27778511651,-0.415734806151,-0.490392640202 },
-	{ 0.461939766256,0.191341716183,-0.191341716183,-0.461939766256,-0.461939766256,-0.191341716183,0.191341716183,0.461939766256 },
-	{ 0.415734806151,-0.0975451610081,-0.490392640202,-0.27778511651,0.27778511651,0.490392640202,0.0975451610081,-0.415734806151 },
-	{ 0.353553390593,-0.353553390593,-0.353553390593,0.353553390593,0.353553390593,-0.353553390593,-0.353553390593,0.353553390593 },
-	{ 0.27778511651,-0.490392640202,0.0975451610081,0.415734806151,-0.415734806151,-0.0975451610081,0.490392640202,-0.27778511651 },
-	{ 0.191341716183,-0.461939766256,0.461939766256,-0.191341716183,-0.191341716183,0.461939766256,-0.461939766256,0.191341716183 },
-	{ 0.0975451610081,-0.27778511651,0.415734806151,-0.490392640202,0.490392640202,-0.415734806151,0.27778511651,-0.0975451610081 },
-};
+/* Read @p n bits and sign-extend them as a coefficient value */
+static inline int receive_extend(struct jpeg_ctx * j, int n) {
+	if (!n) return 0;
+	int v = get_bits(j, n);
+	if (v < (1 << (n - 1))) v -= (1 << n) - 1;
+	return v;
+}
 
-static float premul[8][8][8][8]= {{{{0}}}};
+/*
+ * Read a Huffman code; codes of up to HUFF_LOOKAHEAD bits are
+ * resolved with one table lookup, longer ones by code length.
+ */
+static inline int get_code(struct jpeg_ctx * j, struct huffman_table * t) {
+	if (j->bit_count < 16) fill_bits(j);
+
+	int look = j->bit_buf >> (64 - HUFF_LOOKAHEAD);
+	int len = t->lookup_len[look];
+	if (len) {
+		j->bit_buf <<= len;
+		j->bit_count -= len;
+		return t->lookup_sym[look];
+	}
 
-static void add_idc(struct idct * self, int n, int m, int coeff) {
-#ifdef NO_SSE
-	for (int y = 0; y < 8; ++y) {
-		for (int x = 0; x < 8; ++x) {
-			self->base[xy_to_lin(x, y)] += premul[n][m][y][x] * coeff;
+	for (int l = HUFF_LOOKAHEAD + 1; l <= 16; ++l) {
+		int32_t code = j->bit_buf >> (64 - l);
+		if (code <= t->maxcode[l]) {
+			j->bit_buf <<= l;
+			j->bit_count -= l;
+			return t->symbols[(t->valptr[l] + code - t->mincode[l]) & 0xFF];
 		}
 	}
-#else
-	__m128 c = _mm_set_ps(coeff,coeff,coeff,coeff);
-	for (int y = 0; y < 8; ++y) {
-		__m128 a, b;
-		/* base[y][x] = base[y][x] + premul[n][m][y][x] * coeff */
-
-		/* x = 0..3 */
-		a = _mm_load_ps(&premul[n][m][y][0]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(0,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(0,y)], a);
-
-		/* x = 4..7 */
-		a = _mm_load_ps(&premul[n][m][y][4]);
-		a = _mm_mul_ps(a,c);
-		b = _mm_load_ps(&self->base[xy_to_lin(4,y)]);
-		a = _mm_add_ps(a,b);
-		_mm_store_ps(&self->base[xy_to_lin(4,y)], a);
-	}
-#endif
-}
 
-static void add_zigzag(struct idct * self, int zi, int coeff) {
-	int i = zigzag[zi];
-	int n = i & 0x7;
-	int m = i >> 3;
-	add_idc(self, n, m, coeff);
+	/* Invalid */
+	return 0;
 }
 
-/* Read a bit from the stream */
-static int get_bit(struct stream * st) {
-	while ((st->pos >> 3) >= st->have) {
-		/* We have finished using the current byte and need to read another one */
-		int t = fgetc(st->file);
-		if (t < 0) {
-			/* EOF */
-			st->byte = 0;
+/* Sequential: a whole block in one go */
+static void decode_block(struct jpeg_ctx * j, struct jpeg_component * c, int16_t * blk) {
+	int t = get_code(j, &j->huff[c->td]);
+	c->dc_pred += receive_extend(j, t);
+	blk[0] = c->dc_pred;
+
+	struct huffman_table * ac = &j->huff[4 + c->ta];
+	for (int k = 1; k < 64; ) {
+		int rs = get_code(j, ac);
+		int r = rs >> 4;
+		int s = rs & 0xF;
+		if (s) {
+			k += r;
+			blk[zigzag[k]] = receive_extend(j, s);
+			k++;
 		} else {
-			st->byte = t;
+			if (r != 15) break;
+			k += 16;
 		}
-
-		if (st->byte == 0xFF) {
-			/*
-			 * If we see 0xFF, it's followed by a 0x00
-			 * that should be skipped.
-			 */
-			int tmp = fgetc(st->file);
-			if (tmp != 0) {
-				/*
-				 * If it's *not*, we reached the end of the file - but
-				 * this shouldn't happen.
-				 */
-				st->byte = 0;
-			}
-		}
-
-		/* We've seen a new byte */
-		st->have++;
 	}
-
-	/* Extract appropriate bit from this byte */
-	uint8_t b = st->byte;
-	int s = 7 - (st->pos & 0x7);
-
-	/* We move forward one position in the bit stream */
-	st->pos += 1;
-	return (b >> s) & 1;
 }
 
-/* Advance forward and get the n'th next bit */
-static int get_bitn(struct stream * st, int l) {
-	int val = 0;
-	for (int i = 0; i < l; ++i) {
-		val = val * 2 + get_bit(st);
+/* Progressive: first DC scan, or a refinement bit */
+static void decode_block_dc(struct jpeg_ctx * j, struct jpeg_component * c, int16_t * blk) {
+	if (j->ah == 0) {
+		int t = get_code(j, &j->huff[c->td]);
+		c->dc_pred += receive_extend(j, t);
+		blk[0] = c->dc_pred * (1 << j->al);
+	} else if (get_bit(j)) {
+		blk[0] |= (1 << j->al);
 	}
-	return val;
 }
 
-/*
- * Read a Huffman code by reading bits and using
- * the Huffman table.
- */
-static int get_code(struct huffman_table * table, struct stream * st) {
-	int val = 0;
-	int off = 0;
-	int ini = 0;
-
-	for (int i = 0; i < 16; ++i) {
-		val = val * 2 + get_bit(st);
-		if (table->lengths[i] > 0) {
-			if (val - ini < table->lengths[i]) {
-				return table->elements[off + val - ini];
-			}
-			ini = ini + table->lengths[i];
-			off += table->lengths[i];
-		}
-		ini *= 2;
+/* Progressive: first AC scan over the band ss..se */
+static void decode_block_ac_first(struct jpeg_ctx * j, struct jpeg_component * c, int16_t * blk) {
+	if (j->eobrun) {
+		j->eobrun--;
+		return;
 	}
 
-	/* Invalid */
-	return -1;
+	struct huffman_table * ac = &j->huff[4 + c->ta];
+	for (int k = j->ss; k <= j->se; ) {
+		int rs = get_code(j, ac);
+		int r = rs >> 4;
+		int s = rs & 0xF;
+		if (s) {
+			k += r;
+			blk[zigzag[k]] = receive_extend(j, s) * (1 << j->al);
+			k++;
+		} else if (r < 15) {
+			j->eobrun = (1 << r) - 1;
+			if (r) j->eobrun += get_bits(j, r);
+			break;
+		} else {
+			k += 16;
+		}
+	}
 }
 
-/* Decode Huffman codes to values */
-static int decode(int code, int bits) {
-	int l = 1L << (code - 1);
-	if (bits >= l) {
-		return bits;
-	} else {
-		return bits - (2 * l - 1);
+/* Progressive: AC refinement, adding one bit to every nonzero coefficient in the band */
+static void refine_coeff(struct jpeg_ctx * j, int16_t * coef, int p1) {
+	if (get_bit(j) && !(*coef & p1)) {
+		*coef += (*coef >= 0) ? p1 : -p1;
 	}
 }
 
-/* Build IDCT matrix */
-static struct idct * build_matrix(struct idct * i, struct stream * st, int idx, uint8_t * quant, int oldcoeff, int * outcoeff) {
-	memset(i, 0, sizeof(struct idct));
+static void decode_block_ac_refine(struct jpeg_ctx * j, struct jpeg_component * c, int16_t * blk) {
+	int p1 = 1 << j->al;
+	int k = j->ss;
+
+	if (!j->eobrun) {
+		struct huffman_table * ac = &j->huff[4 + c->ta];
+		for (; k <= j->se; k++) {
+			int rs = get_code(j, ac);
+			int r = rs >> 4;
+			int s = rs & 0xF;
+			if (s) {
+				s = get_bit(j) ? p1 : -p1;
+			} else if (r != 15) {
+				j->eobrun = 1 << r;
+				if (r) j->eobrun += get_bits(j, r);
+				break;
+			}
 
-	int code = get_code(&huffman_tables[idx], st);
-	int bits = get_bitn(st, code);
-	int dccoeff = decode(code, bits) + oldcoeff;
+			/* Skip r zero coefficients, refining nonzero ones as we pass them */
+			while (k <= j->se) {
+				int16_t * coef = &blk[zigzag[k]];
+				if (*coef) {
+					refine_coeff(j, coef, p1);
+				} else {
+					if (r == 0) break;
+					r--;
+				}
+				k++;
+			}
 
-	add_zigzag(i, 0, dccoeff * quant[0]);
-	int l = 1;
+			if (s && k <= j->se) blk[zigzag[k]] = s;
+		}
+	}
 
-	while (l < 64) {
-		code = get_code(&huffman_tables[16+idx], st);
-		if (code == 0) break;
-		if (code > 15) {
-			l += (code >> 4);
-			code = code & 0xF;
+	if (j->eobrun) {
+		for (; k <= j->se; k++) {
+			int16_t * coef = &blk[zigzag[k]];
+			if (*coef) refine_coeff(j, coef, p1);
 		}
-		bits = get_bitn(st, code);
-		int coeff = decode(code, bits);
-		add_zigzag(i, l, coeff * quant[l]);
-		l += 1;
+		j->eobrun--;
 	}
+}
 
-	*outcoeff = dccoeff;
-	return i;
+#ifndef NO_SSE
+/*
+ * SSE2 implementation: each register holds one row of eight
+ * 16-bit values, so one 1-D pass transforms all eight columns.
+ * MULTIPLY(v, c) is (v * c) >> 8, done as mulhi((v << 2), c << 6).
+ */
+#define PRE_MULTIPLY_SCALE_BITS 2
+#define CONST_SHIFT (16 - PRE_MULTIPLY_SCALE_BITS - CONST_BITS)
+
+#define TRANSPOSE_8x8(r0,r1,r2,r3,r4,r5,r6,r7) do { \
+	__m128i t0 = _mm_unpacklo_epi16(r0, r1); \
+	__m128i t1 = _mm_unpackhi_epi16(r0, r1); \
+	__m128i t2 = _mm_unpacklo_epi16(r2, r3); \
+	__m128i t3 = _mm_unpackhi_epi16(r2, r3); \
+	__m128i t4 = _mm_unpacklo_epi16(r4, r5); \
+	__m128i t5 = _mm_unpackhi_epi16(r4, r5); \
+	__m128i t6 = _mm_unpacklo_epi16(r6, r7); \
+	__m128i t7 = _mm_unpackhi_epi16(r6, r7); \
+	__m128i u0 = _mm_unpacklo_epi32(t0, t2); \
+	__m128i u1 = _mm_unpackhi_epi32(t0, t2); \
+	__m128i u2 = _mm_unpacklo_epi32(t1, t3); \
+	__m128i u3 = _mm_unpackhi_epi32(t1, t3); \
+	__m128i u4 = _mm_unpacklo_epi32(t4, t6); \
+	__m128i u5 = _mm_unpackhi_epi32(t4, t6); \
+	__m128i u6 = _mm_unpacklo_epi32(t5, t7); \
+	__m128i u7 = _mm_unpackhi_epi32(t5, t7); \
+	r0 = _mm_unpacklo_epi64(u0, u4); \
+	r1 = _mm_unpackhi_epi64(u0, u4); \
+	r2 = _mm_unpacklo_epi64(u1, u5); \
+	r3 = _mm_unpackhi_epi64(u1, u5); \
+	r4 = _mm_unpacklo_epi64(u2, u6); \
+	r5 = _mm_unpackhi_epi64(u2, u6); \
+	r6 = _mm_unpacklo_epi64(u3, u7); \
+	r7 = _mm_unpackhi_epi64(u3, u7); \
+} while (0)
+
+#define IDCT_1D(r0,r1,r2,r3,r4,r5,r6,r7) do { \
+	__m128i tmp10 = _mm_add_epi16(r0, r4); \
+	__m128i tmp11 = _mm_sub_epi16(r0, r4); \
+	__m128i tmp13 = _mm_add_epi16(r2, r6); \
+	__m128i tmp12 = _mm_sub_epi16(_mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(r2, r6), PRE_MULTIPLY_SCALE_BITS), f1_414), tmp13); \
+	__m128i tmp0 = _mm_add_epi16(tmp10, tmp13); \
+	__m128i tmp3 = _mm_sub_epi16(tmp10, tmp13); \
+	__m128i tmp1 = _mm_add_epi16(tmp11, tmp12); \
+	__m128i tmp2 = _mm_sub_epi16(tmp11, tmp12); \
+	__m128i z13 = _mm_add_epi16(r5, r3); \
+	__m128i z10 = _mm_sub_epi16(r5, r3); \
+	__m128i z11 = _mm_add_epi16(r1, r7); \
+	__m128i z12 = _mm_sub_epi16(r1, r7); \
+	__m128i tmp7 = _mm_add_epi16(z11, z13); \
+	tmp11 = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(z11, z13), PRE_MULTIPLY_SCALE_BITS), f1_414); \
+	__m128i z5 = _mm_mulhi_epi16(_mm_slli_epi16(_mm_add_epi16(z10, z12), PRE_MULTIPLY_SCALE_BITS), f1_847); \
+	tmp10 = _mm_sub_epi16(_mm_mulhi_epi16(_mm_slli_epi16(z12, PRE_MULTIPLY_SCALE_BITS), f1_082), z5); \
+	tmp12 = _mm_sub_epi16(z5, _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(z10, PRE_MULTIPLY_SCALE_BITS), f1_613), z10)); \
+	__m128i tmp6 = _mm_sub_epi16(tmp12, tmp7); \
+	__m128i tmp5 = _mm_sub_epi16(tmp11, tmp6); \
+	__m128i tmp4 = _mm_add_epi16(tmp10, tmp5); \
+	r0 = _mm_add_epi16(tmp0, tmp7); \
+	r7 = _mm_sub_epi16(tmp0, tmp7); \
+	r1 = _mm_add_epi16(tmp1, tmp6); \
+	r6 = _mm_sub_epi16(tmp1, tmp6); \
+	r2 = _mm_add_epi16(tmp2, tmp5); \
+	r5 = _mm_sub_epi16(tmp2, tmp5); \
+	r4 = _mm_add_epi16(tmp3, tmp4); \
+	r3 = _mm_sub_epi16(tmp3, tmp4); \
+} while (0)
+
+static void idct_block(const int16_t * in, const uint16_t * q, uint8_t * out, int stride) {
+	const __m128i f1_414 = _mm_set1_epi16(FIX_1_414213562 << CONST_SHIFT);
+	const __m128i f1_847 = _mm_set1_epi16(FIX_1_847759065 << CONST_SHIFT);
+	const __m128i f1_082 = _mm_set1_epi16(FIX_1_082392200 << CONST_SHIFT);
+	const __m128i f1_613 = _mm_set1_epi16((FIX_2_613125930 - 256) << CONST_SHIFT);
+
+#define DEQUANT(n) _mm_mullo_epi16(_mm_loadu_si128((const __m128i *)&in[n*8]), _mm_loadu_si128((const __m128i *)&q[n*8]))
+	__m128i r0 = DEQUANT(0), r1 = DEQUANT(1), r2 = DEQUANT(2), r3 = DEQUANT(3);
+	__m128i r4 = DEQUANT(4), r5 = DEQUANT(5), r6 = DEQUANT(6), r7 = DEQUANT(7);
+#undef DEQUANT
+
+	/* Columns, then rows */
+	IDCT_1D(r0,r1,r2,r3,r4,r5,r6,r7);
+	TRANSPOSE_8x8(r0,r1,r2,r3,r4,r5,r6,r7);
+	IDCT_1D(r0,r1,r2,r3,r4,r5,r6,r7);
+	TRANSPOSE_8x8(r0,r1,r2,r3,r4,r5,r6,r7);
+
+	/* Descale, level shift, and saturate to bytes */
+	const __m128i round = _mm_set1_epi16(1 << (PASS1_BITS + 2));
+	const __m128i center = _mm_set1_epi16(128);
+#define OUTPUT(a,b,n) do { \
+	__m128i x = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(a, round), PASS1_BITS + 3), center); \
+	__m128i y = _mm_add_epi16(_mm_srai_epi16(_mm_add_epi16(b, round), PASS1_BITS + 3), center); \
+	__m128i p = _mm_packus_epi16(x, y); \
+	_mm_storel_epi64((__m128i *)&out[stride * n], p); \
+	_mm_storel_epi64((__m128i *)&out[stride * (n + 1)], _mm_srli_si128(p, 8)); \
+} while (0)
+	OUTPUT(r0, r1, 0);
+	OUTPUT(r2, r3, 2);
+	OUTPUT(r4, r5, 4);
+	OUTPUT(r6, r7, 6);
+#undef OUTPUT
+}
+#else
+#define MULTIPLY(v,c) ((int16_t)(((v) * (c)) >> CONST_BITS))
+
+static void idct_1d(int16_t * d, int step) {
+	int16_t tmp10 = d[0*step] + d[4*step];
+	int16_t tmp11 = d[0*step] - d[4*step];
+	int16_t tmp13 = d[2*step] + d[6*step];
+	int16_t tmp12 = MULTIPLY((int16_t)(d[2*step] - d[6*step]), FIX_1_414213562) - tmp13;
+
+	int16_t tmp0 = tmp10 + tmp13;
+	int16_t tmp3 = tmp10 - tmp13;
+	int16_t tmp1 = tmp11 + tmp12;
+	int16_t tmp2 = tmp11 - tmp12;
+
+	int16_t z13 = d[5*step] + d[3*step];
+	int16_t z10 = d[5*step] - d[3*step];
+	int16_t z11 = d[1*step] + d[7*step];
+	int16_t z12 = d[1*step] - d[7*step];
+
+	int16_t tmp7 = z11 + z13;
+	tmp11 = MULTIPLY((int16_t)(z11 - z13), FIX_1_414213562);
+	int16_t z5 = MULTIPLY((int16_t)(z10 + z12), FIX_1_847759065);
+	tmp10 = MULTIPLY(z12, FIX_1_082392200) - z5;
+	tmp12 = z5 - MULTIPLY(z10, FIX_2_613125930);
+
+	int16_t tmp6 = tmp12 - tmp7;
+	int16_t tmp5 = tmp11 - tmp6;
+	int16_t tmp4 = tmp10 + tmp5;
+
+	d[0*step] = tmp0 + tmp7;
+	d[7*step] = tmp0 - tmp7;
+	d[1*step] = tmp1 + tmp6;
+	d[6*step] = tmp1 - tmp6;
+	d[2*step] = tmp2 + tmp5;
+	d[5*step] = tmp2 - tmp5;
+	d[4*step] = tmp3 + tmp4;
+	d[3*step] = tmp3 - tmp4;
 }
 
-/* Set pixel in sprite buffer with bounds checking */
-static void set_pixel(int x, int y, uint32_t color) {
-	if ((x < sprite->width) && (y < sprite->height)) {
-		SPRITE(sprite,x,y) = color;
+static void idct_block(const int16_t * in, const uint16_t * q, uint8_t * out, int stride) {
+	int16_t ws[64];
+	for (int i = 0; i < 64; ++i) ws[i] = in[i] * q[i];
+	for (int x = 0; x < 8; ++x) idct_1d(&ws[x], 8);
+	for (int y = 0; y < 8; ++y) idct_1d(&ws[y*8], 1);
+	for (int y = 0; y < 8; ++y) {
+		for (int x = 0; x < 8; ++x) {
+			out[y * stride + x] = clamp(((ws[y*8+x] + (1 << (PASS1_BITS + 2))) >> (PASS1_BITS + 3)) + 128);
+		}
 	}
 }
+#endif
 
-/* Concvert YCbCr values to RGB pixels */
-static void draw_matrix(int x, int y, struct idct * L, struct idct * cb, struct idct * cr) {
-	for (int yy = 0; yy < 8; ++yy) {
-		for (int xx = 0; xx < 8; ++xx) {
-			int o = xy_to_lin(xx,yy);
-			int r, g, b;
-			color_conversion(L->base[o], cb->base[o], cr->base[o], &r, &g, &b);
-			uint32_t c = 0xFF000000 | (r << 16) | (g << 8) | b;
-			set_pixel((x * 8 + xx), (y * 8 + yy), c);
+/**
+ * Start a new restart interval: drop leftover bits, step past
+ * the RSTn marker, and reset the predictors.
+ */
+static void process_restart(struct jpeg_ctx * j) {
+	j->bit_buf = 0;
+	j->bit_count = 0;
+
+	if (j->marker >= 0xD0 && j->marker <= 0xD7) {
+		j->pos += 2;
+		j->marker = 0;
+	} else if (!j->marker) {
+		while (j->pos + 1 < j->size) {
+			if (j->data[j->pos] == 0xFF && j->data[j->pos+1] >= 0xD0 && j->data[j->pos+1] <= 0xD7) {
+				j->pos += 2;
+				break;
+			}
+			j->pos++;
 		}
 	}
+
+	for (int i = 0; i < j->ncomps; ++i) {
+		j->comps[i].dc_pred = 0;
+	}
+	j->eobrun = 0;
 }
 
-static void start_of_scan(FILE * f, int len) {
+static void decode_scan_block(struct jpeg_ctx * j, struct jpeg_component * c, int bx, int by, int direct) {
+	if (direct) {
+		int16_t blk[64] = {0};
+		decode_block(j, c, blk);
+		idct_block(blk, j->quant[c->tq], &c->plane[(by * 8) * (c->bw * 8) + bx * 8], c->bw * 8);
+		return;
+	}
 
-	TRACE("Reading image data");
+	int16_t * blk = &c->coeffs[(by * c->bw + bx) * 64];
+	if (!j->progressive) {
+		decode_block(j, c, blk);
+	} else if (j->ss == 0) {
+		decode_block_dc(j, c, blk);
+	} else if (j->ah == 0) {
+		decode_block_ac_first(j, c, blk);
+	} else {
+		decode_block_ac_refine(j, c, blk);
+	}
+}
 
-	/* Skip header */
-	fseek(f, len, SEEK_CUR);
+static int start_of_scan(struct jpeg_ctx * j, int len) {
+	TRACE("Reading image data");
+	size_t end = j->pos + len;
+
+	if (!j->comps[0].plane) return 1;
+
+	j->scan_ncomps = read_8(j);
+	if (j->scan_ncomps < 1 || j->scan_ncomps > j->ncomps) return 1;
+	for (int i = 0; i < j->scan_ncomps; ++i) {
+		int id = read_8(j);
+		int tables = read_8(j);
+		j->scan[i] = NULL;
+		for (int n = 0; n < j->ncomps; ++n) {
+			if (j->comps[n].id == id) j->scan[i] = &j->comps[n];
+		}
+		if (!j->scan[i]) return 1;
+		j->scan[i]->td = (tables >> 4) & 3;
+		j->scan[i]->ta = tables & 3;
+	}
+	j->ss = read_8(j);
+	j->se = read_8(j);
+	int a = read_8(j);
+	j->ah = a >> 4;
+	j->al = a & 0xF;
+	j->pos = end;
+
+	if (j->se > 63 || j->ss > j->se) return 1;
+
+	/* A single baseline scan with every component can go straight to pixels;
+	 * otherwise coefficients are refined or collected over several scans
+	 * and transformed once the last one is done. */
+	int direct = !j->progressive && j->scan_ncomps == j->ncomps;
+	if (!direct) {
+		for (int i = 0; i < j->scan_ncomps; ++i) {
+			struct jpeg_component * c = j->scan[i];
+			if (!c->coeffs) {
+				c->coeffs = calloc(c->bw * c->bh * 64, sizeof(int16_t));
+				if (!c->coeffs) return 1;
+			}
+		}
+	}
 
 	/* Initialize bit stream */
-	struct stream _st = {0};
-	_st.file = f;
-	struct stream * st = &_st;
-
-	int old_lum = 0;
-	int old_crd = 0;
-	int old_cbd = 0;
-	for (int y = 0; y < sprite->height / 8 + !!(sprite->height & 0x7); ++y) {
-		TRACE("Star row %d", y );
-		for (int x = 0; x < sprite->width / 8 + !!(sprite->width & 0x7); ++x) {
-			if (y >= 134) {
-				TRACE("Start col %d", x);
-			}
+	j->bit_buf = 0;
+	j->bit_count = 0;
+	j->marker = 0;
+	j->eobrun = 0;
+	for (int i = 0; i < j->ncomps; ++i) {
+		j->comps[i].dc_pred = 0;
+	}
 
-			/* Build matrices */
-			struct idct matL, matCr, matCb;
-			build_matrix(&matL,  st, 0, quant[quant_mapping[0]], old_lum, &old_lum);
-			build_matrix(&matCb, st, 1, quant[quant_mapping[1]], old_cbd, &old_cbd);
-			build_matrix(&matCr, st, 1, quant[quant_mapping[2]], old_crd, &old_crd);
+	int todo = j->restart_interval;
+	if (j->scan_ncomps == 1) {
+		/* Non-interleaved: blocks in raster order over the component itself */
+		struct jpeg_component * c = j->scan[0];
+		for (int by = 0; by < c->ch; ++by) {
+			for (int bx = 0; bx < c->cw; ++bx) {
+				if (j->restart_interval && !todo--) {
+					process_restart(j);
+					todo = j->restart_interval - 1;
+				}
+				decode_scan_block(j, c, bx, by, direct);
+			}
+		}
+	} else {
+		for (int my = 0; my < j->mcuy; ++my) {
+			for (int mx = 0; mx < j->mcux; ++mx) {
+				if (j->restart_interval && !todo--) {
+					process_restart(j);
+					todo = j->restart_interval - 1;
+				}
+				for (int i = 0; i < j->scan_ncomps; ++i) {
+					struct jpeg_component * c = j->scan[i];
+					for (int v = 0; v < c->v; ++v) {
+						for (int h = 0; h < c->h; ++h) {
+							decode_scan_block(j, c, mx * c->h + h, my * c->v + v, direct);
+						}
+					}
+				}
+			}
+		}
+	}
 
-			if (y >= 134) {
-				TRACE("Draw col %d", x);
+	/* Find the marker that follows the entropy-coded data */
+	if (!j->marker) {
+		while (j->pos + 1 < j->size) {
+			if (j->data[j->pos] == 0xFF) {
+				int next = j->data[j->pos+1];
+				if (next != 0x00 && next != 0xFF && !(next >= 0xD0 && next <= 0xD7)) break;
 			}
-			draw_matrix(x, y, &matL, &matCb, &matCr);
+			j->pos++;
 		}
 	}
+	j->marker = 0;
 
 	TRACE("Done.");
+	return 0;
 }
 
-int load_sprite_jpg(sprite_t * tsprite, char * filename) {
-	FILE * f = fopen(filename, "r");
-	if (!f) {
-		return 1;
+/**
+ * Inverse transform any blocks that were collected as coefficients.
+ */
+static void finish_coefficients(struct jpeg_ctx * j) {
+	for (int i = 0; i < j->ncomps; ++i) {
+		struct jpeg_component * c = &j->comps[i];
+		if (!c->coeffs) continue;
+		int stride = c->bw * 8;
+		for (int by = 0; by < c->bh; ++by) {
+			for (int bx = 0; bx < c->bw; ++bx) {
+				idct_block(&c->coeffs[(by * c->bw + bx) * 64], j->quant[c->tq], &c->plane[by * 8 * stride + bx * 8], stride);
+			}
+		}
 	}
+}
 
-	sprite = tsprite;
+/**
+ * Upsample the chroma planes as needed and convert to RGB.
+ *   R = Y + 1.402 Cr
+ *   G = Y - 0.344136 Cb - 0.714136 Cr
+ *   B = Y + 1.772 Cb
+ * in 16.16 fixed point.
+ */
+static void color_conversion(struct jpeg_ctx * j, sprite_t * sprite) {
+	int width = j->width;
+
+	if (j->ncomps == 1) {
+		struct jpeg_component * c = &j->comps[0];
+		for (int y = 0; y < j->height; ++y) {
+			uint8_t * Y = &c->plane[y * c->bw * 8];
+			uint32_t * out = &SPRITE(sprite, 0, y);
+			for (int x = 0; x < width; ++x) {
+				out[x] = 0xFF000000 | (Y[x] << 16) | (Y[x] << 8) | Y[x];
+			}
+		}
+		return;
+	}
 
-	memset(huffman_tables, 0, sizeof(huffman_tables));
+	/* Column of each component sample for every output pixel */
+	int * xmap = malloc(sizeof(int) * width * 3);
+	for (int i = 0; i < 3; ++i) {
+		for (int x = 0; x < width; ++x) {
+			xmap[i * width + x] = x * j->comps[i].h / j->hmax;
+		}
+	}
 
-	if (premul[0][0][0][0] == 0.0) {
-		for (int n = 0; n < 8; ++n) {
-			for (int m = 0; m < 8; ++m) {
-				for (int y = 0; y < 8; ++y) {
-					for (int x = 0; x < 8; ++x) {
-						premul[n][m][y][x] = cosines[n][x] * cosines[m][y];
-					}
-				}
+	for (int y = 0; y < j->height; ++y) {
+		const uint8_t * rows[3];
+		for (int i = 0; i < 3; ++i) {
+			struct jpeg_component * c = &j->comps[i];
+			rows[i] = &c->plane[(y * c->v / j->vmax) * c->bw * 8];
+		}
+		uint32_t * out = &SPRITE(sprite, 0, y);
+		const int * xy = xmap, * xcb = xmap + width, * xcr = xmap + width * 2;
+		if (j->rgb) {
+			for (int x = 0; x < width; ++x) {
+				out[x] = 0xFF000000 | (rows[0][xy[x]] << 16) | (rows[1][xcb[x]] << 8) | rows[2][xcr[x]];
 			}
+			continue;
+		}
+		for (int x = 0; x < width; ++x) {
+			int Y  = rows[0][xy[x]];
+			int cb = rows[1][xcb[x]] - 128;
+			int cr = rows[2][xcr[x]] - 128;
+			int r = Y + ((91881 * cr + 32768) >> 16);
+			int g = Y - ((22554 * cb + 46802 * cr - 32768) >> 16);
+			int b = Y + ((116130 * cb + 32768) >> 16);
+			out[x] = 0xFF000000 | (clamp(r) << 16) | (clamp(g) << 8) | clamp(b);
 		}
 	}
 
-	while (1) {
+	free(xmap);
+}
 
-		/* Read a header */
-		uint16_t hdr;
-		int r = fread(&hdr, 2, 1, f);
-		if (r <= 0) {
-			/* EOF */
-			break;
-		}
+static int decode_jpeg(struct jpeg_ctx * j, sprite_t * sprite) {
+	int seen_frame = 0;
+	int seen_scan = 0;
 
-		/* These headers are stored big-endian */
-		swap16(&hdr);
+	if (read_16(j) != 0xFFD8) return 1;
 
-		if (hdr == 0xffd8) {
-			/* No data */
-			continue;
-		} else if (hdr == 0xffd9) {
+	while (j->pos + 4 <= j->size) {
+		/* Skip fill bytes */
+		if (j->data[j->pos] != 0xFF) return 1;
+		while (j->pos < j->size && j->data[j->pos] == 0xFF) j->pos++;
+		int hdr = read_8(j);
+
+		if (hdr == 0xD9) {
 			/* End of file */
 			break;
-		} else {
-			/* Regular sections with data start with a length */
-			uint16_t len;
-			fread(&len, 2, 1, f);
-			swap16(&len);
-
-			/* Subtract two because the length includes itself */
-			len -= 2;
-
-			if (hdr == 0xffdb) {
-				define_quant_table(f, len);
-			} else if (hdr == 0xffc0) {
-				baseline_dct(f, len);
-			} else if (hdr == 0xffc4) {
-				define_huffman_table(f, len);
-			} else if (hdr == 0xffda) {
-				start_of_scan(f, len);
-				/* End immediately after reading the data */
+		} else if (hdr == 0xD8 || (hdr >= 0xD0 && hdr <= 0xD7) || hdr == 0x01) {
+			/* No data */
+			continue;
+		}
+
+		/* Regular sections with data start with a length, which includes itself */
+		int len = read_16(j) - 2;
+		if (len < 0 || j->pos + len > j->size) return 1;
+
+		int status = 0;
+		switch (hdr) {
+			case 0xC0: /* Baseline */
+			case 0xC1: /* Extended sequential */
+			case 0xC2: /* Progressive */
+				if (seen_frame) return 1;
+				seen_frame = 1;
+				j->progressive = (hdr == 0xC2);
+				status = start_of_frame(j, sprite, len);
 				break;
-			} else {
+			case 0xDB:
+				status = define_quant_table(j, len);
+				break;
+			case 0xC4:
+				status = define_huffman_table(j, len);
+				break;
+			case 0xDD:
+				j->restart_interval = read_16(j);
+				j->pos += len - 2;
+				break;
+			case 0xDA:
+				if (!seen_frame) return 1;
+				seen_scan = 1;
+				status = start_of_scan(j, len);
+				break;
+			case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+			case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+				TRACE("Unsupported frame type %x\n", hdr);
+				return 1;
+			default:
 				TRACE("Unknown header\n");
-				fseek(f, len, SEEK_CUR);
-			}
+				j->pos += len;
+				break;
 		}
+		if (status) return status;
 	}
 
-	fclose(f);
+	if (!seen_scan) return 1;
 
+	finish_coefficients(j);
+	color_conversion(j, sprite);
 	return 0;
 }
+
+int load_sprite_jpg(sprite_t * sprite, char * filename) {
+	FILE * f = fopen(filename, "r");
+	if (!f) {
+		return 1;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	uint8_t * data = malloc(size > 0 ? size : 1);
+	if (!data || fread(data, 1, size, f) != (size_t)size) {
+		free(data);
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+
+	struct jpeg_ctx * j = calloc(1, sizeof(struct jpeg_ctx));
+	j->data = data;
+	j->size = size;
+
+	sprite->bitmap = NULL;
+	int status = decode_jpeg(j, sprite);
+
+	if (status && sprite->bitmap) {
+		free(sprite->bitmap);
+		sprite->bitmap = NULL;
+	}
+
+	for (int i = 0; i < 3; ++i) {
+		free(j->comps[i].plane);
+		free(j->comps[i].coeffs);
+	}
+	free(j);
+	free(data);
+
+	return status;
+}
@@ -0,0 +1,80 @@
+/* Kuroko bindings for libtoaru_crc32 */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <toaru/crc32.h>
+#include <kuroko/kuroko.h>
+#include <kuroko/vm.h>
+#include <kuroko/value.h>
+#include <kuroko/object.h>
+
+static KrkInstance * module;
+
+/**
+ * crc32(data, crc=0)
+ *
+ * data may be bytes or str; pass a previous result as crc to continue it.
+ */
+static KrkValue _crc32_crc32(int argc, KrkValue argv[], int hasKw) {
+	if (argc < 1 || argc > 2) return krk_runtimeError(vm.exceptions->argumentError, "crc32() takes one or two arguments");
+
+	uint32_t crc = 0;
+	if (argc > 1) {
+		if (!IS_INTEGER(argv[1])) return krk_runtimeError(vm.exceptions->typeError, "crc argument should be int, not '%s'", krk_typeName(argv[1]));
+		crc = AS_INTEGER(argv[1]);
+	}
+
+	if (IS_BYTES(argv[0])) {
+		crc = crc32_update(crc, AS_BYTES(argv[0])->bytes, AS_BYTES(argv[0])->length);
+	} else if (IS_STRING(argv[0])) {
+		crc = crc32_update(crc, AS_STRING(argv[0])->chars, AS_STRING(argv[0])->length);
+	} else {
+		return krk_runtimeError(vm.exceptions->typeError, "data argument should be bytes or str, not '%s'", krk_typeName(argv[0]));
+	}
+
+	return INTEGER_VAL(crc);
+}
+
+/**
+ * file(path)
+ *
+ * CRC of a whole file, without bringing its contents into the VM.
+ */
+static KrkValue _crc32_file(int argc, KrkValue argv[], int hasKw) {
+	if (argc != 1 || !IS_STRING(argv[0])) return krk_runtimeError(vm.exceptions->typeError, "expected str for path");
+
+	FILE * f = fopen(AS_CSTRING(argv[0]), "r");
+	if (!f) return krk_runtimeError(vm.exceptions->ioError, "%s: %s", AS_CSTRING(argv[0]), strerror(errno));
+
+	char * buf = malloc(65536);
+	uint32_t crc = 0;
+	size_t r;
+	while ((r = fread(buf, 1, 65536, f)) > 0) {
+		crc = crc32_update(crc, buf, r);
+	}
+	int failed = ferror(f);
+	free(buf);
+	fclose(f);
+
+	if (failed) return krk_runtimeError(vm.exceptions->ioError, "%s: read error", AS_CSTRING(argv[0]));
+	return INTEGER_VAL(crc);
+}
+
+static KrkValue _crc32_implementation(int argc, KrkValue argv[], int hasKw) {
+	const char * name = crc32_implementation();
+	return OBJECT_VAL(krk_copyString(name, strlen(name)));
+}
+
+KrkValue krk_module_onload__crc32(void) {
+	module = krk_newInstance(vm.baseClasses->moduleClass);
+	krk_push(OBJECT_VAL(module));
+
+	krk_defineNative(&module->fields, "crc32", _crc32_crc32);
+	krk_defineNative(&module->fields, "file", _crc32_file);
+	krk_defineNative(&module->fields, "implementation", _crc32_implementation);
+
+	assert(AS_INSTANCE(krk_pop()) == module);
+	return OBJECT_VAL(module);
+}
@@ -7,6 +7,22 @@
  *
  * Provides a friendly interface to the "Packet Exchange"
  * functionality provided by the packetfs kernel module.
+ *
+ * Clients set up a shared-memory ring pair with the server when
+ * they connect (unless PEX_NO_RING is set in the environment), and
+ * after that messages in both directions go through the rings
+ * instead of being copied through the kernel. Everything here
+ * falls back to the plain packetfs interface when there is no ring.
+ *
+ * Like packetfs does for its pipes, a server holds messages for a
+ * client whose ring is full in a backlog instead of dropping them,
+ * and the client rings the doorbell when it has made room.
+ *
+ * A server may send from more than one thread (the compositor's
+ * render thread does), so the ring list and the rings themselves are
+ * guarded by a lock, taken around every lookup and held for as long
+ * as the connection is in use. Nothing sleeps with it held. A single
+ * thread is still expected to do the listening (or the receiving).
  */
 #include <alloca.h>
 #include <assert.h>
@@ -15,35 +31,462 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 #include <sys/ioctl.h>
+#include <sys/shm.h>
+#include <sys/fswait.h>
 
 #include <toaru/pex.h>
 
+#define RING_RECORD(size) (((size) + sizeof(uint32_t) + 7) & ~7)
+
+/* Server side: a message waiting for room in a client's ring */
+struct pex_backlog {
+	struct pex_backlog * next;
+	size_t key;  /* Leading bytes identifying a coalescable message, or 0 */
+	size_t size;
+	char data[];
+};
+
+/*
+ * One of these for each ring we have mapped: on the client, one per
+ * connection; on the server, one per client that set one up.
+ */
+struct pex_ring_conn {
+	int fd;
+	uintptr_t client; /* Client id on the server side, 0 on the client side */
+	struct pex_ring_shared * shared;
+	int closing;      /* Server side: the client is gone, finish draining its ring */
+	char key[60];
+	struct pex_backlog * backlog;
+	struct pex_client_stats stats;
+	struct pex_ring_conn * next;
+};
+
+static struct pex_ring_conn * rings = NULL;
+static int ring_counter = 0;
+static size_t backlog_depth = PEX_DEFAULT_DEPTH;
+static volatile int rings_lock = 0;
+
+static void rings_acquire(void) {
+	while (__sync_lock_test_and_set(&rings_lock, 1)) {
+		sched_yield();
+	}
+}
+
+static void rings_release(void) {
+	__sync_lock_release(&rings_lock);
+}
+
+static struct pex_ring_conn * ring_find(int fd, uintptr_t client) {
+	for (struct pex_ring_conn * r = rings; r; r = r->next) {
+		if (r->fd == fd && r->client == client) return r;
+	}
+	return NULL;
+}
+
+static void ring_remove(struct pex_ring_conn * conn) {
+	struct pex_ring_conn ** r = &rings;
+	while (*r != conn) r = &(*r)->next;
+	*r = conn->next;
+	shm_release(conn->key);
+	while (conn->backlog) {
+		struct pex_backlog * b = conn->backlog;
+		conn->backlog = b->next;
+		free(b);
+	}
+	free(conn);
+}
+
+static int ring_write(struct pex_ring * ring, char * data, size_t size, void * blob) {
+	uint32_t need = RING_RECORD(size);
+	uint32_t head = ring->head;
+	uint32_t offset = head & (PEX_RING_SIZE - 1);
+	uint32_t contiguous = PEX_RING_SIZE - offset;
+	uint32_t total = need + (contiguous < need ? contiguous : 0);
+
+	if (PEX_RING_SIZE - (head - ring->tail) < total) return -1;
+
+	if (contiguous < need) {
+		*(uint32_t *)&data[offset] = PEX_RING_PAD;
+		head += contiguous;
+		offset = 0;
+	}
+
+	*(uint32_t *)&data[offset] = size;
+	memcpy(&data[offset + sizeof(uint32_t)], blob, size);
+
+	__sync_synchronize();
+	ring->head = head + need;
+	return 0;
+}
+
+static ssize_t ring_read(struct pex_ring * ring, char * data, void * blob, size_t max) {
+	uint32_t tail = ring->tail;
+	if (tail == ring->head) return -1;
+	__sync_synchronize();
+
+	uint32_t offset = tail & (PEX_RING_SIZE - 1);
+	uint32_t size = *(uint32_t *)&data[offset];
+	if (size == PEX_RING_PAD) {
+		tail += PEX_RING_SIZE - offset;
+		offset = 0;
+		size = *(uint32_t *)&data[offset];
+	}
+
+	/* The other end can write anything here; don't follow a bad length off the end of the ring. */
+	if (size > MAX_PACKET_SIZE || offset + RING_RECORD(size) > PEX_RING_SIZE) {
+		ring->tail = ring->head;
+		return -1;
+	}
+
+	memcpy(blob, &data[offset + sizeof(uint32_t)], size < max ? size : max);
+
+	__sync_synchronize();
+	ring->tail = tail + RING_RECORD(size);
+	return size;
+}
+
+/* Let the other side know there's something in the ring, if it might be asleep. */
+static void ring_doorbell(int fd, struct pex_ring * ring, uintptr_t client) {
+	__sync_synchronize();
+	if (ring->waiting) {
+		ring->waiting = 0;
+		ioctl(fd, IOCTL_PACKETFS_DOORBELL, (void *)client);
+	}
+}
+
+/*
+ * We took something out of the ring; if the producer is waiting for
+ * room and there's now plenty of it, tell it. The producer set
+ * `blocked` before its last look at the ring, and we moved `tail`
+ * before this look at `blocked`, so one of us always sees the other.
+ */
+static void ring_consumed(int fd, struct pex_ring * ring, uintptr_t client) {
+	__sync_synchronize();
+	if (ring->blocked && PEX_RING_ROOMY(ring)) {
+		ioctl(fd, IOCTL_PACKETFS_DOORBELL, (void *)client);
+	}
+}
+
+/* Server side: move as much of a client's backlog into its ring as will fit. */
+static void ring_flush(struct pex_ring_conn * conn) {
+	struct pex_ring * ring = &conn->shared->to_client;
+	int wrote = 0;
+
+	while (conn->backlog) {
+		struct pex_backlog * b = conn->backlog;
+		if (ring_write(ring, PEX_RING_DATA_CLIENT(conn->shared), b->size, b->data) < 0) {
+			/* Ask for a doorbell, then try once more in case the client emptied it in between. */
+			ring->blocked = 1;
+			__sync_synchronize();
+			if (ring_write(ring, PEX_RING_DATA_CLIENT(conn->shared), b->size, b->data) < 0) break;
+		}
+		conn->backlog = b->next;
+		conn->stats.queued--;
+		conn->stats.queued_bytes -= b->size;
+		free(b);
+		wrote = 1;
+	}
+
+	if (!conn->backlog) ring->blocked = 0;
+	if (wrote) ring_doorbell(conn->fd, ring, conn->client);
+}
+
+/* Server side: send to a client through its ring, or its backlog if the ring is full. */
+static int ring_send(struct pex_ring_conn * conn, size_t key, size_t size, char * blob) {
+	ring_flush(conn);
+
+	if (!conn->backlog && ring_write(&conn->shared->to_client, PEX_RING_DATA_CLIENT(conn->shared), size, blob) == 0) {
+		ring_doorbell(conn->fd, &conn->shared->to_client, conn->client);
+		return 0;
+	}
+
+	struct pex_backlog ** b = &conn->backlog;
+	if (key) {
+		for (; *b; b = &(*b)->next) {
+			if ((*b)->key == key && !memcmp((*b)->data, blob, key)) {
+				struct pex_backlog * old = *b;
+				*b = old->next;
+				conn->stats.queued--;
+				conn->stats.queued_bytes -= old->size;
+				conn->stats.coalesced++;
+				free(old);
+				break;
+			}
+		}
+	}
+
+	if (conn->stats.queued >= backlog_depth) {
+		conn->stats.dropped++;
+		return -1;
+	}
+
+	while (*b) b = &(*b)->next;
+	*b = malloc(sizeof(struct pex_backlog) + size);
+	(*b)->next = NULL;
+	(*b)->key = key;
+	(*b)->size = size;
+	memcpy((*b)->data, blob, size);
+	conn->stats.queued++;
+	conn->stats.queued_bytes += size;
+
+	/* Make sure someone comes back for it */
+	ring_flush(conn);
+	return 0;
+}
+
+/* Server side: a client announced a ring; map it and start using it. */
+static void ring_accept(int fd, uintptr_t client, struct pex_ring_announce * announce) {
+	size_t size = 0;
+	struct pex_ring_shared * shared = shm_obtain(announce->key, &size);
+	if (!shared) return;
+	if (size < PEX_RING_SHM_SIZE || ioctl(fd, IOCTL_PACKETFS_RING_ACCEPT, (void *)client) < 0) {
+		shm_release(announce->key);
+		return;
+	}
+
+	struct pex_ring_conn * conn = calloc(1, sizeof(struct pex_ring_conn));
+	conn->fd = fd;
+	conn->client = client;
+	conn->shared = shared;
+	memcpy(conn->key, announce->key, sizeof(conn->key));
+	conn->key[sizeof(conn->key)-1] = '\0';
+	conn->next = rings;
+	rings = conn;
+}
+
+/* Client side: set up a ring for a new connection. */
+static void ring_connect(int fd) {
+	/* A previous connection may have had this descriptor. */
+	rings_acquire();
+	struct pex_ring_conn * old = ring_find(fd, 0);
+	if (old) ring_remove(old);
+	rings_release();
+
+	if (getenv("PEX_NO_RING")) return;
+
+	struct pex_ring_conn * conn = calloc(1, sizeof(struct pex_ring_conn));
+	snprintf(conn->key, sizeof(conn->key), "sys.pex.%d.%d", getpid(), ring_counter++);
+
+	size_t size = PEX_RING_SHM_SIZE;
+	conn->shared = shm_obtain(conn->key, &size);
+	if (!conn->shared) {
+		free(conn);
+		return;
+	}
+	memset(conn->shared, 0, sizeof(struct pex_ring_shared));
+
+	if (ioctl(fd, IOCTL_PACKETFS_RING, conn->key) < 0) {
+		shm_release(conn->key);
+		free(conn);
+		return;
+	}
+
+	conn->fd = fd;
+	rings_acquire();
+	conn->next = rings;
+	rings = conn;
+	rings_release();
+}
+
 size_t pex_send(FILE * sock, uintptr_t rcpt, size_t size, char * blob) {
 	assert(size <= MAX_PACKET_SIZE);
-	pex_header_t * broadcast = malloc(sizeof(pex_header_t) + size);
+
+	if (rcpt) {
+		rings_acquire();
+		struct pex_ring_conn * conn = ring_find(fileno(sock), rcpt);
+		if (conn) {
+			int out = ring_send(conn, 0, size, blob);
+			rings_release();
+			return out < 0 ? (size_t)-1 : sizeof(pex_header_t) + size;
+		}
+		rings_release();
+	}
+
+	pex_header_t * broadcast = alloca(sizeof(pex_header_t) + size);
 	broadcast->target = rcpt;
 	memcpy(broadcast->data, blob, size);
-	size_t out = write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
-	free(broadcast);
-	return out;
+	return write(fileno(sock), broadcast, sizeof(pex_header_t) + size);
+}
+
+size_t pex_send_coalesce(FILE * sock, uintptr_t rcpt, size_t key, size_t size, char * blob) {
+	assert(size <= MAX_PACKET_SIZE && key <= size);
+
+	if (rcpt) {
+		rings_acquire();
+		struct pex_ring_conn * conn = ring_find(fileno(sock), rcpt);
+		if (conn) {
+			int out = ring_send(conn, key, size, blob);
+			rings_release();
+			return out < 0 ? (size_t)-1 : sizeof(pex_header_t) + size;
+		}
+		rings_release();
+	}
+
+	struct pex_coalesce req = {rcpt, key, size, blob};
+	return ioctl(fileno(sock), IOCTL_PACKETFS_SEND_COALESCE, &req);
+}
+
+/* packetfs skips clients whose rings we accepted, so those get it here */
+static void ring_broadcast(int fd, size_t key, size_t size, char * blob) {
+	rings_acquire();
+	for (struct pex_ring_conn * conn = rings; conn; conn = conn->next) {
+		if (conn->fd != fd || !conn->client || conn->closing) continue;
+		ring_send(conn, key, size, blob);
+	}
+	rings_release();
 }
 
 size_t pex_broadcast(FILE * sock, size_t size, char * blob) {
-	return pex_send(sock, 0, size, blob);
+	size_t out = pex_send(sock, 0, size, blob);
+	ring_broadcast(fileno(sock), 0, size, blob);
+	return out;
+}
+
+size_t pex_broadcast_coalesce(FILE * sock, size_t key, size_t size, char * blob) {
+	size_t out = pex_send_coalesce(sock, 0, key, size, blob);
+	ring_broadcast(fileno(sock), key, size, blob);
+	return out;
+}
+
+/* Does this server have any client rings to look at? */
+static int ring_any_client(int fd) {
+	for (struct pex_ring_conn * r = rings; r; r = r->next) {
+		if (r->fd == fd && r->client) return 1;
+	}
+	return 0;
 }
 
 size_t pex_listen(FILE * sock, pex_packet_t * packet) {
-	return read(fileno(sock), packet, PACKET_SIZE);
+	int fd = fileno(sock);
+
+	while (1) {
+		rings_acquire();
+
+		/* Clients may have made room for their backlogs since we last looked */
+		for (struct pex_ring_conn * r = rings; r; r = r->next) {
+			if (r->fd == fd && r->backlog) ring_flush(r);
+		}
+
+		/*
+		 * Kernel-queued packets first: ring announcements, disconnects,
+		 * and clients without rings. Without any rings, just block here.
+		 */
+		if (!ring_any_client(fd) || ioctl(fd, IOCTL_PACKETFS_QUEUED, NULL) > 0) {
+			rings_release();
+			size_t size = read(fd, packet, PACKET_SIZE);
+			if ((ssize_t)size <= 0) return size;
+
+			rings_acquire();
+			struct pex_ring_announce * announce = (void *)packet->data;
+			if (packet->size == sizeof(struct pex_ring_announce) && announce->magic == PEX_RING_MAGIC) {
+				ring_accept(fd, packet->source, announce);
+				rings_release();
+				continue;
+			}
+
+			struct pex_ring_conn * conn = ring_find(fd, packet->source);
+			if (packet->size == 0 && conn) {
+				/* Deliver the disconnect once everything it sent has been handled */
+				conn->closing = 1;
+				rings_release();
+				continue;
+			}
+
+			rings_release();
+			return size;
+		}
+
+		/* Then the rings. Whichever one we take a message from goes to the back of the line. */
+		for (struct pex_ring_conn ** r = &rings; *r; r = &(*r)->next) {
+			struct pex_ring_conn * conn = *r;
+			if (conn->fd != fd || !conn->client) continue;
+
+			ssize_t size = ring_read(&conn->shared->to_server, PEX_RING_DATA_SERVER(conn->shared), packet->data, MAX_PACKET_SIZE);
+			if (size < 0 && !conn->closing) continue;
+
+			packet->source = conn->client;
+			if (size < 0) {
+				packet->size = 0;
+				ring_remove(conn);
+				rings_release();
+				return sizeof(pex_packet_t);
+			}
+			packet->size = size;
+			ring_consumed(fd, &conn->shared->to_server, conn->client);
+
+			if (conn->next) {
+				*r = conn->next;
+				struct pex_ring_conn ** tail = r;
+				while (*tail) tail = &(*tail)->next;
+				*tail = conn;
+				conn->next = NULL;
+			}
+
+			rings_release();
+			return sizeof(pex_packet_t) + size;
+		}
+		rings_release();
+
+		/* Nothing anywhere; the kernel marks the rings as waiting for us. */
+		fswait(1, &fd);
+	}
 }
 
 size_t pex_reply(FILE * sock, size_t size, char * blob) {
-	return write(fileno(sock), blob, size);
+	int fd = fileno(sock);
+
+	while (1) {
+		rings_acquire();
+		struct pex_ring_conn * conn = ring_find(fd, 0);
+		if (!conn) {
+			rings_release();
+			return write(fd, blob, size);
+		}
+
+		struct pex_ring * ring = &conn->shared->to_server;
+		int out = ring_write(ring, PEX_RING_DATA_SERVER(conn->shared), size, blob);
+		if (out < 0) {
+			/* Ask for a doorbell, then try once more in case the server emptied it in between. */
+			ring->blocked = 1;
+			__sync_synchronize();
+			out = ring_write(ring, PEX_RING_DATA_SERVER(conn->shared), size, blob);
+		}
+		if (out == 0) ring->blocked = 0;
+		ring_doorbell(fd, ring, 0);
+		rings_release();
+
+		if (out == 0) return size;
+
+		/* Like a write to a full pipe, sleep until the server has made room. */
+		fswait(1, &fd);
+	}
 }
 
 size_t pex_recv(FILE * sock, char * blob) {
-	memset(blob, 0, MAX_PACKET_SIZE);
-	return read(fileno(sock), blob, MAX_PACKET_SIZE);
+	int fd = fileno(sock);
+
+	while (1) {
+		rings_acquire();
+		struct pex_ring_conn * conn = ring_find(fd, 0);
+
+		/* Anything the kernel queued came before the server accepted our ring */
+		if (!conn || ioctl(fd, IOCTL_PACKETFS_QUEUED, NULL) > 0) {
+			rings_release();
+			return read(fd, blob, MAX_PACKET_SIZE);
+		}
+
+		ssize_t size = ring_read(&conn->shared->to_client, PEX_RING_DATA_CLIENT(conn->shared), blob, MAX_PACKET_SIZE);
+		if (size >= 0) {
+			ring_consumed(fd, &conn->shared->to_client, 0);
+			rings_release();
+			return size;
+		}
+		rings_release();
+
+		fswait(1, &fd);
+	}
 }
 
 FILE * pex_connect(char * target) {
@@ -53,6 +496,7 @@ FILE * pex_connect(char * target) {
 	FILE * out = fopen(tmp, "r+");
 	if (out) {
 		setbuf(out, NULL);
+		ring_connect(fileno(out));
 	}
 	return out;
 }
@@ -69,5 +513,34 @@ FILE * pex_bind(char * target) {
 }
 
 size_t pex_query(FILE * sock) {
-	return ioctl(fileno(sock), IOCTL_PACKETFS_QUEUED, NULL);
+	size_t out = ioctl(fileno(sock), IOCTL_PACKETFS_QUEUED, NULL);
+	rings_acquire();
+	struct pex_ring_conn * conn = ring_find(fileno(sock), 0);
+	if (conn) {
+		out += conn->shared->to_client.head - conn->shared->to_client.tail;
+	}
+	rings_release();
+	return out;
+}
+
+int pex_set_depth(FILE * sock, size_t depth) {
+	backlog_depth = depth;
+	return ioctl(fileno(sock), IOCTL_PACKETFS_DEPTH, (void *)depth);
+}
+
+int pex_client_stats(FILE * sock, uintptr_t client, struct pex_client_stats * stats) {
+	stats->client = client;
+	int out = ioctl(fileno(sock), IOCTL_PACKETFS_CLIENT_STATS, stats);
+	if (out < 0) return out;
+
+	rings_acquire();
+	struct pex_ring_conn * conn = ring_find(fileno(sock), client);
+	if (conn && client) {
+		stats->queued       += conn->stats.queued;
+		stats->queued_bytes += conn->stats.queued_bytes;
+		stats->dropped      += conn->stats.dropped;
+		stats->coalesced    += conn->stats.coalesced;
+	}
+	rings_release();
+	return 0;
 }
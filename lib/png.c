@@ -4,12 +4,24 @@
  * Copyright (C) 2020 K. Lange
  *
  * libtoaru_png: PNG decoder
+ *
+ * Decompressed image data is collected one scanline at a time.
+ * Each completed scanline is unfiltered in place against the
+ * previous scanline of the same pass, and then converted to
+ * premultiplied ARGB and written out to the sprite in one go.
+ *
+ * Set PNG_TIMING in the environment to have decode times
+ * reported on stderr.
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <emmintrin.h>
 
 #include <toaru/graphics.h>
 #include <toaru/inflate.h>
+#include <toaru/crc32.h>
 
 /**
  * Read 32-bit big-endian value from file.
@@ -44,18 +56,20 @@ static char*  reorder_type(unsigned int type) {
 	return out;
 }
 
+/**
+ * Scanline buffers are padded at the end so the vector loops
+ * can always work on whole 16-byte blocks.
+ */
+#define SCANLINE_PAD 16
+
 /**
  * Internal PNG decoder state for use with inflate.
  */
 struct png_ctx {
 	FILE * f;          /* File being decoded. */
 	sprite_t * sprite; /* Sprite being generated. */
-	int y;             /* Cursor pointers for writing out bitmap data */
-	int x;
-	char buffer[4];   /* A buffer to hold a pixel's worth of data until it can
-	                     be written out to the image with the right filter. */
-	int  buf_off;     /* How much data is in the above buffer */
 	int seen_ihdr;    /* Whether the IHDR was seen; for error handling */
+	int inflated;     /* Whether the image data has already been decompressed */
 
 	unsigned int width;   /* Image width (dup from sprite) */
 	unsigned int height;  /* Image height (dup from sprite) */
@@ -63,10 +77,27 @@ struct png_ctx {
 	int color_type;       /* PNG color type */
 	int compression;      /* Compression method (must be 0) */
 	int filter;           /* Filter method (must be 0) */
-	int interlace;        /* Interlace method (we only support 0) */
+	int interlace;        /* Interlace method (0 for none, 1 for Adam7) */
+	int bpp;              /* Bytes per complete pixel */
 
+	uint8_t * idat;       /* Contents of the current IDAT chunk */
+	size_t idat_cap;      /* Allocated size of the above */
+	size_t idat_off;      /* Read offset into the above */
+	size_t idat_len;      /* Amount of the above that was read from the file */
 	unsigned int size;    /* Remaining IDAT chunk size */
-	int sf;               /* Current scanline filter type */
+	int crc_error;        /* An IDAT didn't match its CRC */
+
+	uint8_t * scanline;   /* Scanline being collected */
+	uint8_t * prior;      /* Previous (unfiltered) scanline from the same pass */
+	size_t row_bytes;     /* Size of a scanline in the current pass, sans filter byte */
+	size_t row_off;       /* Bytes collected for the current scanline */
+	int sf;               /* Current scanline filter type, -1 if not yet read */
+
+	int pass;             /* Current Adam7 pass, always 0 for non-interlaced images */
+	unsigned int pass_w;  /* Width of the current pass in pixels */
+	unsigned int pass_h;  /* Height of the current pass in rows */
+	unsigned int pass_y;  /* Current row within the pass */
+	int done;             /* All scanlines have been written out */
 };
 
 /* PNG chunk types */
@@ -81,6 +112,57 @@ struct png_ctx {
 #define PNG_FILTER_AVG   3
 #define PNG_FILTER_PAETH 4
 
+/**
+ * Adam7 pass geometry: starting column and row, and the
+ * horizontal and vertical distance between pixels.
+ * Non-interlaced images are treated as a single pass
+ * using the extra final entry.
+ */
+#define PNG_NO_INTERLACE 7
+static const int adam7_x[]  = {0, 4, 0, 2, 0, 1, 0, 0};
+static const int adam7_y[]  = {0, 0, 4, 0, 2, 0, 1, 0};
+static const int adam7_dx[] = {8, 8, 4, 4, 2, 2, 1, 1};
+static const int adam7_dy[] = {8, 8, 8, 4, 4, 2, 2, 1};
+
+/**
+ * CRC of the IDAT chunk in the chunk buffer, which covers
+ * the chunk type as well as its data.
+ */
+static uint32_t idat_crc(struct png_ctx * c) {
+	return crc32_update(crc32("IDAT", 4), c->idat, c->idat_len);
+}
+
+/**
+ * Load the next IDAT chunk into the chunk buffer.
+ */
+static int next_idat(struct png_ctx * c) {
+	/* Check the CRC32 from the end of this IDAT */
+	unsigned int check = read_32(c->f);
+	if (check != idat_crc(c)) c->crc_error = 1;
+
+	/* Read the next IDAT chunk header */
+	unsigned int size = read_32(c->f);
+	unsigned int type = read_32(c->f);
+
+	if (type != PNG_IDAT) {
+		/* This isn't an IDAT? That's wrong! */
+		fprintf(stderr, "And this is the wrong type (0x%x), I'm just bailing.\n", type);
+		fprintf(stderr, "size read was 0x%x\n", size);
+		exit(0);
+	}
+
+	if (size > c->idat_cap) {
+		c->idat_cap = size;
+		c->idat = realloc(c->idat, c->idat_cap);
+	}
+
+	c->size = fread(c->idat, 1, size, c->f);
+	c->idat_len = c->size;
+	c->idat_off = 0;
+
+	return c->size != size;
+}
+
 /**
  * Read a byte from the IDAT chunk.
  * Tracks when an IDAT has been read to completion and
@@ -89,274 +171,346 @@ struct png_ctx {
 static uint8_t _get(struct inflate_context * ctx) {
 	struct png_ctx * c = (ctx->input_priv);
 	if (c->size == 0) {
+		/* If this was EOF, we should handle that error case... probably... */
+		if (next_idat(c)) fprintf(stderr, "This is probably not good.\n");
+		if (c->size == 0) return 0;
+	}
 
-		/* Read the CRC32 from the end of this IDAT */
-		unsigned int check = read_32(c->f);
-		(void)check; /* ... and in theory check it... */
+	c->size--;
+	return c->idat[c->idat_off++];
+}
 
-		/* Read the next IDAT chunk header */
-		unsigned int size = read_32(c->f);
-		unsigned int type = read_32(c->f);
+/*
+ * Pixels are moved in and out of vector registers whole, so the
+ * left and upper-left neighbours can be carried along in registers
+ * instead of being read back out of memory. These are always
+ * inlined with a constant @p bpp so the switch disappears.
+ */
+static inline __attribute__((always_inline)) __m128i load_px(const uint8_t * p, int bpp) {
+	uint32_t v = 0;
+	switch (bpp) {
+		case 4: memcpy(&v, p, 4); break;
+		case 3: v = p[0] | (p[1] << 8) | (p[2] << 16); break;
+	}
+	return _mm_cvtsi32_si128(v);
+}
 
-		c->size = size;
+static inline __attribute__((always_inline)) void store_px(uint8_t * p, __m128i px, int bpp) {
+	uint32_t v = _mm_cvtsi128_si32(px);
+	switch (bpp) {
+		case 4: memcpy(p, &v, 4); break;
+		case 3: p[0] = v; p[1] = v >> 8; p[2] = v >> 16; break;
+	}
+}
 
-		if (type != PNG_IDAT) {
-			/* This isn't an IDAT? That's wrong! */
-			fprintf(stderr, "And this is the wrong type (0x%x), I'm just bailing.\n", type);
-			fprintf(stderr, "size read was 0x%x\n", size);
-			exit(0);
-		}
+/**
+ * Up: add the byte above; trivially parallel.
+ */
+static void unfilter_up(uint8_t * cur, const uint8_t * prior, size_t len) {
+	for (size_t i = 0; i < len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)&cur[i]);
+		__m128i b = _mm_loadu_si128((const __m128i *)&prior[i]);
+		_mm_storeu_si128((__m128i *)&cur[i], _mm_add_epi8(a, b));
 	}
+}
 
-	/* Read one byte from the input */
-	c->size--;
-	int i = fgetc(c->f);
+/**
+ * Sub: add the byte one pixel to the left.
+ *
+ * For four-byte pixels, a 16-byte block is a prefix sum over
+ * four pixels, which takes two shifted adds plus the carry of
+ * the last pixel from the previous block.
+ */
+static void unfilter_sub(uint8_t * cur, size_t len, int bpp) {
+	if (bpp == 4) {
+		__m128i last = _mm_setzero_si128();
+		for (size_t i = 0; i < len; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *)&cur[i]);
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+			x = _mm_add_epi8(x, last);
+			_mm_storeu_si128((__m128i *)&cur[i], x);
+			last = _mm_shuffle_epi32(x, _MM_SHUFFLE(3,3,3,3));
+		}
+	} else if (bpp == 3) {
+		__m128i a = _mm_setzero_si128();
+		for (size_t i = 0; i < len; i += 3) {
+			a = _mm_add_epi8(a, load_px(&cur[i], 3));
+			store_px(&cur[i], a, 3);
+		}
+	} else {
+		for (size_t i = bpp; i < len; ++i) {
+			cur[i] += cur[i - bpp];
+		}
+	}
+}
 
-	/* If this was EOF, we should handle that error case... probably... */
-	if (i < 0) fprintf(stderr, "This is probably not good.\n");
+/**
+ * Avg: add the floor of the average of left and above.
+ * pavgb rounds up, so the low bit of (a ^ b) is taken back off.
+ */
+static inline __attribute__((always_inline)) void unfilter_avg_px(uint8_t * cur, const uint8_t * prior, size_t len, int bpp) {
+	__m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128();
+	for (size_t i = 0; i < len; i += bpp) {
+		__m128i b = load_px(&prior[i], bpp);
+		__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(load_px(&cur[i], bpp), avg);
+		store_px(&cur[i], a, bpp);
+	}
+}
 
-	return i;
+static void unfilter_avg(uint8_t * cur, const uint8_t * prior, size_t len, int bpp) {
+	if (bpp == 4) {
+		unfilter_avg_px(cur, prior, len, 4);
+	} else if (bpp == 3) {
+		unfilter_avg_px(cur, prior, len, 3);
+	} else {
+		for (int i = 0; i < bpp; ++i) {
+			cur[i] += prior[i] >> 1;
+		}
+		for (size_t i = bpp; i < len; ++i) {
+			cur[i] += (cur[i - bpp] + prior[i]) >> 1;
+		}
+	}
 }
 
 /**
  * Paeth predictor
  * Described in section 6.6 of the RFC
+ *
+ * With p = a + b - c, the three distances reduce to
+ * |b - c|, |a - c| and |a + b - 2c|; the comparisons
+ * become masks instead of branches.
  */
-#define ABS(a) ((a >= 0) ? (a) : -(a))
-static int paeth(int a, int b, int c) {
-	int p = a + b - c;
-	int pa = ABS(p - a);
-	int pb = ABS(p - b);
-	int pc = ABS(p - c);
-	if (pa <= pb && pa <= pc) return a;
-	else if (pb <= pc) return b;
-	return c;
+static inline __m128i abs_epi16(__m128i x) {
+	return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
 }
 
-static void write_pixel(struct png_ctx * c, uint32_t color) {
-	SPRITE((c->sprite), (c->x), (c->y)) = color;
-
-	/* Reset the short buffer */
-	c->buf_off = 0;
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b) {
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
 
-	/* Advance to next pixel */
-	c->x++;
-	if (c->x == (int)c->width) {
-		/* Advance to next line; next read is scanline filter type */
-		c->x = -1;
-		c->y++;
+static inline __attribute__((always_inline)) void unfilter_paeth_px(uint8_t * cur, const uint8_t * prior, size_t len, int bpp) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i a = zero; /* left, as 16-bit lanes */
+	__m128i c = zero; /* upper left */
+	for (size_t i = 0; i < len; i += bpp) {
+		__m128i b = _mm_unpacklo_epi8(load_px(&prior[i], bpp), zero);
+		__m128i pa = _mm_sub_epi16(b, c);
+		__m128i pb = _mm_sub_epi16(a, c);
+		__m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+		pa = abs_epi16(pa);
+		pb = abs_epi16(pb);
+
+		__m128i use_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+		__m128i pred = select_si128(_mm_cmpgt_epi16(pb, pc), c, b);
+		pred = select_si128(use_a, pred, a);
+
+		__m128i x = _mm_add_epi8(load_px(&cur[i], bpp), _mm_packus_epi16(pred, pred));
+		store_px(&cur[i], x, bpp);
+		a = _mm_unpacklo_epi8(x, zero);
+		c = b;
 	}
 }
 
-static void process_pixel_type_6(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int r = c->buffer[0];
-	unsigned int g = c->buffer[1];
-	unsigned int b = c->buffer[2];
-	unsigned int a = c->buffer[3];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			r += _RED(left);
-			g += _GRE(left);
-			b += _BLU(left);
-			a += _ALP(left);
+static inline int paeth(int a, int b, int c) {
+	int pa = b - c;
+	int pb = a - c;
+	int pc = pa + pb;
+	pa = (pa ^ (pa >> 31)) - (pa >> 31);
+	pb = (pb ^ (pb >> 31)) - (pb >> 31);
+	pc = (pc ^ (pc >> 31)) - (pc >> 31);
+	int not_a = -((pa > pb) | (pa > pc));
+	int use_c = -(pb > pc);
+	int bc = (c & use_c) | (b & ~use_c);
+	return (bc & not_a) | (a & ~not_a);
+}
+
+static void unfilter_paeth(uint8_t * cur, const uint8_t * prior, size_t len, int bpp) {
+	if (bpp == 4) {
+		unfilter_paeth_px(cur, prior, len, 4);
+	} else if (bpp == 3) {
+		unfilter_paeth_px(cur, prior, len, 3);
+	} else {
+		for (int i = 0; i < bpp; ++i) {
+			cur[i] += prior[i];
 		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			r += _RED(up);
-			g += _GRE(up);
-			b += _BLU(up);
-			a += _ALP(up);
+		for (size_t i = bpp; i < len; ++i) {
+			cur[i] += paeth(cur[i - bpp], prior[i], prior[i - bpp]);
 		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		r += ((int)_RED(left) + (int)_RED(up)) / 2;
-		g += ((int)_GRE(left) + (int)_GRE(up)) / 2;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-		a += ((int)_ALP(left) + (int)_ALP(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		r = ((int)r + paeth((int)_RED(left),(int)_RED(up),(int)_RED(upleft))) % 256;
-		g = ((int)g + paeth((int)_GRE(left),(int)_GRE(up),(int)_GRE(upleft))) % 256;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-		a = ((int)a + paeth((int)_ALP(left),(int)_ALP(up),(int)_ALP(upleft))) % 256;
 	}
+}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgba(r,g,b,a));
+/**
+ * Exact x / 255 for 0 <= x <= 65534, as used by premultiply().
+ */
+static inline uint32_t div255(uint32_t x) {
+	return (x + 1 + (x >> 8)) >> 8;
 }
 
-static void process_pixel_type_2(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int r = c->buffer[0];
-	unsigned int g = c->buffer[1];
-	unsigned int b = c->buffer[2];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			r += _RED(left);
-			g += _GRE(left);
-			b += _BLU(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			r += _RED(up);
-			g += _GRE(up);
-			b += _BLU(up);
-		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		r += ((int)_RED(left) + (int)_RED(up)) / 2;
-		g += ((int)_GRE(left) + (int)_GRE(up)) / 2;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		r = ((int)r + paeth((int)_RED(left),(int)_RED(up),(int)_RED(upleft))) % 256;
-		g = ((int)g + paeth((int)_GRE(left),(int)_GRE(up),(int)_GRE(upleft))) % 256;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-	}
+/**
+ * Convert four RGBA pixels to premultiplied BGRA (little-endian ARGB).
+ * The alpha lane is multiplied by 255, which the division undoes.
+ */
+static inline __m128i premultiply_2px(__m128i px, __m128i alpha_lane, __m128i one) {
+	px = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3,0,1,2));
+	px = _mm_shufflehi_epi16(px, _MM_SHUFFLE(3,0,1,2));
+	__m128i a = _mm_shufflelo_epi16(px, _MM_SHUFFLE(3,3,3,3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3,3,3,3));
+	a = _mm_or_si128(a, alpha_lane);
+	__m128i t = _mm_mullo_epi16(px, a);
+	t = _mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8));
+	return _mm_srli_epi16(t, 8);
+}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgb(r,g,b));
+static void convert_rgba(uint32_t * out, const uint8_t * in, unsigned int count) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i alpha_lane = _mm_set_epi16(0xFF,0,0,0,0xFF,0,0,0);
+	__m128i one = _mm_set1_epi16(1);
+	unsigned int x = 0;
+	for (; x + 4 <= count; x += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i *)&in[x * 4]);
+		__m128i lo = premultiply_2px(_mm_unpacklo_epi8(px, zero), alpha_lane, one);
+		__m128i hi = premultiply_2px(_mm_unpackhi_epi8(px, zero), alpha_lane, one);
+		_mm_storeu_si128((__m128i *)&out[x], _mm_packus_epi16(lo, hi));
+	}
+	for (; x < count; ++x) {
+		const uint8_t * p = &in[x * 4];
+		uint32_t a = p[3];
+		out[x] = (a << 24) | (div255(p[0] * a) << 16) | (div255(p[1] * a) << 8) | div255(p[2] * a);
+	}
 }
 
-static void process_pixel_type_4(struct png_ctx * c) {
-	/*
-	 * Obtain pixel data from short buffer;
-	 * For color type 6, this is always in R G B A order in the
-	 * bytestream, so we don't have to worry about subpixel ordering
-	 * or weird color masks.
-	 */
-	unsigned int b = c->buffer[0];
-	unsigned int a = c->buffer[1];
-
-	/* Apply filters */
-	if (c->sf == PNG_FILTER_SUB) {
-		/* Add raw value to the pixel on the left */
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			b += _BLU(left);
-			a += _ALP(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		/* Add raw value to the pixel above */
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			b += _BLU(up);
-			a += _ALP(up);
-		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		/* Add raw value to the average of the pixel above and left */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-		a += ((int)_ALP(left) + (int)_ALP(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		/* Use the Paeth predictor */
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-		a = ((int)a + paeth((int)_ALP(left),(int)_ALP(up),(int)_ALP(upleft))) % 256;
+/**
+ * Convert an unfiltered scanline to premultiplied ARGB and
+ * write it out to its row (and, for interlaced images, columns)
+ * in the sprite.
+ */
+static void write_scanline(struct png_ctx * c) {
+	sprite_t * sprite = c->sprite;
+	int pass = c->interlace ? c->pass : PNG_NO_INTERLACE;
+	int dx = adam7_dx[pass];
+	unsigned int y = adam7_y[pass] + c->pass_y * adam7_dy[pass];
+	uint32_t * out = &SPRITE(sprite, adam7_x[pass], y);
+	const uint8_t * in = c->scanline;
+	unsigned int count = c->pass_w;
+
+	if (c->color_type == 6 && dx == 1) {
+		convert_rgba(out, in, count);
+		return;
 	}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgba(b,b,b,a));
+	for (unsigned int x = 0; x < count; ++x, out += dx) {
+		uint32_t a;
+		switch (c->color_type) {
+			case 6:
+				a = in[3];
+				*out = (a << 24) | (div255(in[0] * a) << 16) | (div255(in[1] * a) << 8) | div255(in[2] * a);
+				in += 4;
+				break;
+			case 2:
+				*out = 0xFF000000 | (in[0] << 16) | (in[1] << 8) | in[2];
+				in += 3;
+				break;
+			case 4:
+				a = div255(in[0] * in[1]);
+				*out = ((uint32_t)in[1] << 24) | (a << 16) | (a << 8) | a;
+				in += 2;
+				break;
+			default:
+				*out = 0xFF000000 | (in[0] << 16) | (in[0] << 8) | in[0];
+				in += 1;
+				break;
+		}
+	}
 }
 
-static void process_pixel_type_0(struct png_ctx * c) {
-	unsigned int b = c->buffer[0];
-	if (c->sf == PNG_FILTER_SUB) {
-		if (c->x > 0) {
-			uint32_t left = SPRITE((c->sprite), (c->x - 1), (c->y));
-			b += _BLU(left);
-		}
-	} else if (c->sf == PNG_FILTER_UP) {
-		if (c->y > 0) {
-			uint32_t up = SPRITE((c->sprite), (c->x), (c->y - 1));
-			b += _BLU(up);
+/**
+ * Set up for the next pass with any pixels in it.
+ * Non-interlaced images have exactly one pass.
+ */
+static void start_pass(struct png_ctx * c) {
+	while (c->pass < 7) {
+		int pass = c->interlace ? c->pass : PNG_NO_INTERLACE;
+		c->pass_w = (c->width  > (unsigned int)adam7_x[pass]) ? (c->width  - adam7_x[pass] + adam7_dx[pass] - 1) / adam7_dx[pass] : 0;
+		c->pass_h = (c->height > (unsigned int)adam7_y[pass]) ? (c->height - adam7_y[pass] + adam7_dy[pass] - 1) / adam7_dy[pass] : 0;
+		c->pass_y = 0;
+		c->row_bytes = c->pass_w * c->bpp;
+		c->row_off = 0;
+		c->sf = -1;
+
+		if (c->pass_w && c->pass_h) {
+			/* The first scanline of each pass has nothing above it. */
+			memset(c->prior, 0, c->row_bytes + SCANLINE_PAD);
+			return;
 		}
-	} else if (c->sf == PNG_FILTER_AVG) {
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		b += ((int)_BLU(left) + (int)_BLU(up)) / 2;
-	} else if (c->sf == PNG_FILTER_PAETH) {
-		uint32_t left = (c->x > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y)) : 0;
-		uint32_t up = (c->y > 0) ? SPRITE((c->sprite), (c->x), (c->y - 1)) : 0;
-		uint32_t upleft = (c->x > 0 && c->y > 0) ? SPRITE((c->sprite), (c->x - 1), (c->y - 1)) : 0;
-		b = ((int)b + paeth((int)_BLU(left),(int)_BLU(up),(int)_BLU(upleft))) % 256;
-	}
 
-	/* Write new pixel to the image */
-	write_pixel(c, rgb(b,b,b));
+		if (!c->interlace) break;
+		c->pass++;
+	}
+	c->done = 1;
 }
 
+/**
+ * Unfilter and emit a completed scanline, then move on to the next.
+ */
+static void finish_scanline(struct png_ctx * c) {
+	switch (c->sf) {
+		case PNG_FILTER_SUB:
+			unfilter_sub(c->scanline, c->row_bytes, c->bpp);
+			break;
+		case PNG_FILTER_UP:
+			unfilter_up(c->scanline, c->prior, c->row_bytes);
+			break;
+		case PNG_FILTER_AVG:
+			unfilter_avg(c->scanline, c->prior, c->row_bytes, c->bpp);
+			break;
+		case PNG_FILTER_PAETH:
+			unfilter_paeth(c->scanline, c->prior, c->row_bytes, c->bpp);
+			break;
+	}
+
+	write_scanline(c);
+
+	/* This scanline is the next one's prior */
+	uint8_t * tmp = c->prior;
+	c->prior = c->scanline;
+	c->scanline = tmp;
+
+	c->row_off = 0;
+	c->sf = -1;
+	c->pass_y++;
+
+	if (c->pass_y == c->pass_h) {
+		if (!c->interlace) {
+			c->done = 1;
+		} else {
+			c->pass++;
+			start_pass(c);
+		}
+	}
+}
 
 /**
  * Handle decompressed output from the inflater
  *
- * Writes pixel data to the image, and applies relevant filters.
+ * Collects bytes into the current scanline; the first byte
+ * of each scanline is its filter type.
  */
 static void _write(struct inflate_context * ctx, unsigned int sym) {
 	struct png_ctx * c = (ctx->input_priv);
 
-	/* Put this byte into the short buffer */
-	c->buffer[c->buf_off] = sym;
-	c->buf_off++;
+	if (c->done) return;
 
-	/* If this is the beginning of a scanline... */
-	if (c->x == -1 && c->buf_off == 1) {
-		/* Then this is the scanline filter type */
+	if (c->sf == -1) {
 		c->sf = sym;
+		return;
+	}
 
-		/* Reset the buffer, advance to the beginning of the actual scanline */
-		c->x = 0;
-		c->buf_off = 0;
-	} else if (c->buf_off == 1 && c->color_type == 0) {
-		process_pixel_type_0(c);
-	} else if (c->buf_off == 2 && c->color_type == 4) {
-		process_pixel_type_4(c);
-	} else if (c->buf_off == 3 && c->color_type == 2) {
-		process_pixel_type_2(c);
-	} else if (c->buf_off == 4 && c->color_type == 6) {
-		process_pixel_type_6(c);
+	c->scanline[c->row_off++] = sym;
+	if (c->row_off == c->row_bytes) {
+		finish_scanline(c);
 	}
 }
 
@@ -370,7 +524,26 @@ static int color_type_has_alpha(int c) {
 	}
 }
 
+static int color_type_bpp(int c) {
+	switch (c) {
+		case 0: return 1;
+		case 2: return 3;
+		case 4: return 2;
+		case 6: return 4;
+		default: return 0;
+	}
+}
+
+static double elapsed_ms(struct timeval * start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
 int load_sprite_png(sprite_t * sprite, char * filename) {
+	struct timeval start;
+	gettimeofday(&start, NULL);
+
 	FILE * f = fopen(filename,"r");
 	if (!f) {
 		fprintf(stderr, "Failed to open file %s\n", filename);
@@ -383,23 +556,21 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 		unsigned char c = fgetc(f);
 		if (c != sig[i]) {
 			fprintf(stderr, "byte %d (%d) does not match expected (%d)\n", i, c, sig[i]);
-			goto _error;
+			fclose(f);
+			return 1;
 		}
 	}
 
 	/* Set up context for future calls to inflate */
-	struct png_ctx c;
+	struct png_ctx c = {0};
 	c.sprite = sprite;
-	c.x = -1;
-	c.y = 0;
 	c.f = f;
-	c.buf_off = 0;
-	c.seen_ihdr = 0;
 
 	while (1) {
 		/* read chunks */
 		unsigned int size = read_32(f);
 		unsigned int type = read_32(f);
+		int check_idat = 0;
 
 		if (feof(f)) break;
 
@@ -407,7 +578,7 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 			case PNG_IHDR:
 				{
 					/* Image should only have one IHDR */
-					if (c.seen_ihdr) return 1;
+					if (c.seen_ihdr) goto _error;
 
 					c.seen_ihdr = 1;
 					c.width = read_32(f); /* 4 */
@@ -419,14 +590,16 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 					c.interlace = fgetc(f); /* 13 */
 
 					/* Invalid / non-standard compression and filter types */
-					if (c.compression != 0) return 1;
-					if (c.filter != 0) return 1;
+					if (c.compression != 0) goto _error;
+					if (c.filter != 0) goto _error;
 
 					/* 0 for none, 1 for Adam7 */
-					if (c.interlace != 0 && c.interlace != 1) return 1;
+					if (c.interlace != 0 && c.interlace != 1) goto _error;
 
-					if (c.bit_depth != 8) return 1; /* Sorry */
-					if (c.color_type < 0 || c.color_type > 6 || (c.color_type & 1)) return 1; /* Sorry, no indexed support */
+					if (c.bit_depth != 8) goto _error; /* Sorry */
+					if (c.color_type < 0 || c.color_type > 6 || (c.color_type & 1)) goto _error; /* Sorry, no indexed support */
+
+					c.bpp = color_type_bpp(c.color_type);
 
 					/* Allocate space */
 					sprite->width  = c.width;
@@ -436,6 +609,10 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 					sprite->alpha = color_type_has_alpha(c.color_type);
 					sprite->blank = 0;
 
+					/* Scanline buffers; no pass is wider than the full image. */
+					c.scanline = calloc(1, c.width * c.bpp + SCANLINE_PAD);
+					c.prior    = calloc(1, c.width * c.bpp + SCANLINE_PAD);
+					start_pass(&c);
 
 					/* Skip */
 					for (unsigned int i = 13; i < size; ++i) fgetc(f);
@@ -444,18 +621,21 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 
 			case PNG_IDAT:
 				{
-					/* First two bytes of IDAT data are ZLIB header */
-					unsigned int cflags = fgetc(f);
-					if ((cflags & 0xF) != 8) {
-						/* Compression type must be 8 */
-						fprintf(stderr, "Expected flags to be 8 but it's 0x%x\n", cflags);
-						return 1;
+					if (!c.seen_ihdr) goto _error;
+
+					/* Image data was one zlib stream across all IDATs; skip any trailing empties */
+					if (c.inflated) {
+						for (unsigned int i = 0; i < size; ++i) fgetc(f);
+						break;
 					}
-					unsigned int aflags = fgetc(f);
-					if (aflags & (1 << 5)) {
-						fprintf(stderr, "There are preset bytes and I don't know what to do.\n");
-						return 1;
+
+					if (size > c.idat_cap) {
+						c.idat_cap = size;
+						c.idat = realloc(c.idat, c.idat_cap);
 					}
+					c.size = fread(c.idat, 1, size, f);
+					c.idat_len = c.size;
+					c.idat_off = 0;
 
 					struct inflate_context ctx;
 					ctx.input_priv = &c;
@@ -464,14 +644,27 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 					ctx.write_output = _write;
 					ctx.ring = NULL; /* use builtin */
 
-					c.size = size - 2; /* 2 for the bytes we already read */
+					/* First two bytes of IDAT data are ZLIB header */
+					unsigned int cflags = _get(&ctx);
+					if ((cflags & 0xF) != 8) {
+						/* Compression type must be 8 */
+						fprintf(stderr, "Expected flags to be 8 but it's 0x%x\n", cflags);
+						goto _error;
+					}
+					unsigned int aflags = _get(&ctx);
+					if (aflags & (1 << 5)) {
+						fprintf(stderr, "There are preset bytes and I don't know what to do.\n");
+						goto _error;
+					}
 
 					deflate_decompress(&ctx);
+					c.inflated = 1;
+					check_idat = 1;
 
 					/* The IDATs contain a ZLIB stream, so they end with an
-					 * adler32 checksum. Skip that. */
-					unsigned int adler = read_32(f);
-					(void)adler;
+					 * adler32 checksum. Skip that, along with anything else
+					 * left over in the final chunk. */
+					c.size = 0;
 				}
 				break;
 			case PNG_IEND:
@@ -479,30 +672,38 @@ int load_sprite_png(sprite_t * sprite, char * filename) {
 				break;
 			default:
 				/* IHDR must be first */
-				if (!c.seen_ihdr) return 1;
+				if (!c.seen_ihdr) goto _error;
 				//fprintf(stderr, "I don't know what this is! %4s 0x%x\n", reorder_type(type), type);
 				/* Skip */
 				for (unsigned int i = 0; i < size; ++i) fgetc(f);
 				break;
 		}
 
-		unsigned int crc32 = read_32(f);
-		(void)crc32;
+		/* We only check the image data; the other chunks are small and read piecemeal. */
+		unsigned int check = read_32(f);
+		if (check_idat && check != idat_crc(&c)) c.crc_error = 1;
+		if (c.crc_error) {
+			fprintf(stderr, "png: %s: image data is corrupt (CRC mismatch)\n", filename);
+			goto _error;
+		}
 	}
 
-	/*
-	 * Data in PNGs is unpremultiplied, but our sprites expect
-	 * premultiplied alpha, so convert the image data
-	 */
-	for (int y = 0; y < sprite->height; ++y) {
-		for (int x = 0; x < sprite->width; ++x) {
-			SPRITE(sprite,x,y) = premultiply(SPRITE(sprite,x,y));
-		}
+	free(c.idat);
+	free(c.scanline);
+	free(c.prior);
+	fclose(f);
+
+	if (getenv("PNG_TIMING")) {
+		fprintf(stderr, "png: %s: %ux%u%s decoded in %.3fms\n", filename,
+			c.width, c.height, c.interlace ? " (interlaced)" : "", elapsed_ms(&start));
 	}
 
 	return 0;
 
 _error:
+	free(c.idat);
+	free(c.scanline);
+	free(c.prior);
 	fclose(f);
 	return 1;
 }
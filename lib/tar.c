@@ -0,0 +1,655 @@
+/* vim: tabstop=4 shiftwidth=4 noexpandtab
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ *
+ * libtoaru_tar: Streaming ustar extraction
+ *
+ * Archives are read in large chunks and parsed in place: headers are
+ * copied out, but file contents are written straight from the chunk
+ * they arrived in, so each write() is as big as the data allows.
+ *
+ * Compressed archives are inflated on a second thread. It fills a
+ * small ring of chunks which the extractor drains, so decompression
+ * of the next chunk overlaps with writing out the last one, and
+ * nothing is ever staged in a temporary file. Once the archive ends
+ * we keep draining so the inflater reaches the gzip trailer and can
+ * check the CRC.
+ *
+ * Supports regular files, directories, symbolic links, hard links
+ * (as copies), GNU long names and the path and linkpath records of
+ * pax extended headers.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <toaru/inflate.h>
+#include <toaru/tar.h>
+
+#define TAR_CHUNK  (256 * 1024) /* Size of input reads and of inflated chunks */
+#define TAR_QUEUE  4            /* Inflated chunks in flight */
+#define TAR_RECORD 512
+#define TAR_PAX_MAX (64 * 1024) /* Largest pax extended header we will read */
+
+struct ustar {
+	char filename[100];
+	char mode[8];
+	char ownerid[8];
+	char groupid[8];
+
+	char size[12];
+	char mtime[12];
+
+	char checksum[8];
+	char type[1];
+	char link[100];
+
+	char ustar[6];
+	char version[2];
+
+	char owner[32];
+	char group[32];
+
+	char dev_major[8];
+	char dev_minor[8];
+
+	char prefix[155];
+	char padding[12];
+};
+
+/*
+ * Either side of the chunk queue sleeps on a pipe while it waits for
+ * the other: it says it's waiting and looks again, and whoever next
+ * moves the queue along takes the flag and writes a byte.
+ */
+struct tar_wait {
+	volatile int waiting;
+	int pipe[2];
+};
+
+struct tar_stream {
+	int fd;
+	int gzip;
+
+	/* Raw input */
+	uint8_t * in;
+	size_t in_len;
+	size_t in_off;
+	int in_eof;
+
+	/* Inflated chunks, from the inflate thread to the extractor */
+	uint8_t * queue[TAR_QUEUE];
+	size_t queue_len[TAR_QUEUE];
+	size_t produced;
+	size_t consumed;
+	int finished;
+	int status;
+	uint8_t * fill;
+	size_t fill_len;
+	struct tar_wait room; /* The inflate thread waits here for a free chunk... */
+	struct tar_wait more; /* ...and the extractor for a full one */
+
+	/* What the extractor is currently reading from */
+	uint8_t * data;
+	size_t len;
+	size_t off;
+	int holding;
+
+	struct tar_options * opts;
+	int errors;
+};
+
+static int tar_read_input(struct tar_stream * ts) {
+	if (ts->in_eof) return 0;
+	ssize_t r;
+	do {
+		r = read(ts->fd, ts->in, TAR_CHUNK);
+	} while (r < 0 && errno == EINTR);
+	if (r <= 0) {
+		ts->in_eof = 1;
+		return 0;
+	}
+	ts->in_len = r;
+	ts->in_off = 0;
+	return 1;
+}
+
+static uint8_t tar_get_input(struct inflate_context * ctx) {
+	struct tar_stream * ts = ctx->input_priv;
+	if (ts->in_off == ts->in_len && !tar_read_input(ts)) return 0xFF; /* Like fgetc's EOF */
+	return ts->in[ts->in_off++];
+}
+
+static void tar_wake(struct tar_wait * w) {
+	__sync_synchronize();
+	if (__sync_lock_test_and_set(&w->waiting, 0)) {
+		char c = 0;
+		write(w->pipe[1], &c, 1);
+	}
+}
+
+/* If a waker took the flag after we found @p ready anyway, its byte is on the way; read it so the pipe stays empty. */
+static void tar_wait_for(struct tar_stream * ts, struct tar_wait * w, int (*ready)(struct tar_stream *)) {
+	while (!ready(ts)) {
+		__atomic_store_n(&w->waiting, 1, __ATOMIC_SEQ_CST);
+		__sync_synchronize();
+		if (!ready(ts) || !__sync_lock_test_and_set(&w->waiting, 0)) {
+			char c;
+			read(w->pipe[0], &c, 1);
+		}
+	}
+}
+
+static int tar_has_room(struct tar_stream * ts) {
+	return ts->produced - __atomic_load_n(&ts->consumed, __ATOMIC_ACQUIRE) < TAR_QUEUE;
+}
+
+static int tar_has_more(struct tar_stream * ts) {
+	return __atomic_load_n(&ts->produced, __ATOMIC_ACQUIRE) != ts->consumed || __atomic_load_n(&ts->finished, __ATOMIC_ACQUIRE);
+}
+
+/* Hand the chunk being filled to the extractor and, if there's more to come, wait for a free one. */
+static void tar_queue_push(struct tar_stream * ts, int more) {
+	size_t produced = ts->produced;
+	ts->queue_len[produced % TAR_QUEUE] = ts->fill_len;
+	__atomic_store_n(&ts->produced, ++produced, __ATOMIC_RELEASE);
+	tar_wake(&ts->more);
+
+	if (!more) return;
+
+	tar_wait_for(ts, &ts->room, tar_has_room);
+	ts->fill = ts->queue[produced % TAR_QUEUE];
+	ts->fill_len = 0;
+}
+
+static void tar_write_output(struct inflate_context * ctx, unsigned int sym) {
+	struct tar_stream * ts = ctx->output_priv;
+	ts->fill[ts->fill_len++] = sym;
+	if (ts->fill_len == TAR_CHUNK) tar_queue_push(ts, 1);
+}
+
+static void * tar_inflate_thread(void * arg) {
+	struct tar_stream * ts = arg;
+
+	struct inflate_context ctx;
+	ctx.input_priv = ts;
+	ctx.output_priv = ts;
+	ctx.get_input = tar_get_input;
+	ctx.write_output = tar_write_output;
+	/* Whoever called us may be inflating something else meanwhile */
+	ctx.ring = inflate_ring_create();
+
+	ts->status = ctx.ring ? gzip_decompress(&ctx) : 1;
+	if (ts->fill_len) tar_queue_push(ts, 0);
+	free(ctx.ring);
+
+	__atomic_store_n(&ts->finished, 1, __ATOMIC_RELEASE);
+	tar_wake(&ts->more);
+	return NULL;
+}
+
+/**
+ * Make sure there's unread data at ts->data + ts->off, and return how
+ * much. Returns 0 at the end of the stream.
+ */
+static size_t tar_avail(struct tar_stream * ts) {
+	if (ts->off < ts->len) return ts->len - ts->off;
+
+	if (!ts->gzip) {
+		if (!tar_read_input(ts)) return 0;
+		ts->data = ts->in;
+		ts->len = ts->in_len;
+		ts->off = 0;
+		return ts->len;
+	}
+
+	size_t consumed = ts->consumed;
+	if (ts->holding) {
+		__atomic_store_n(&ts->consumed, ++consumed, __ATOMIC_RELEASE);
+		ts->holding = 0;
+		tar_wake(&ts->room);
+	}
+
+	tar_wait_for(ts, &ts->more, tar_has_more);
+	if (consumed == __atomic_load_n(&ts->produced, __ATOMIC_ACQUIRE)) return 0;
+
+	size_t slot = consumed % TAR_QUEUE;
+	ts->data = ts->queue[slot];
+	ts->len = ts->queue_len[slot];
+	ts->off = 0;
+	ts->holding = 1;
+	return ts->len;
+}
+
+/* Copy @p len bytes out of the stream; returns how many there were. */
+static size_t tar_read(struct tar_stream * ts, void * buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		size_t avail = tar_avail(ts);
+		if (!avail) break;
+		if (avail > len - done) avail = len - done;
+		memcpy((char *)buf + done, ts->data + ts->off, avail);
+		ts->off += avail;
+		done += avail;
+	}
+	return done;
+}
+
+/* Write @p len bytes of the stream to @p fd, or drop them if it's -1. Returns 0 if the stream ran out. */
+static int tar_copy(struct tar_stream * ts, int fd, size_t len, const char * name) {
+	while (len) {
+		size_t avail = tar_avail(ts);
+		if (!avail) return 0;
+		if (avail > len) avail = len;
+
+		const uint8_t * buf = ts->data + ts->off;
+		size_t left = avail;
+		while (fd >= 0 && left) {
+			ssize_t w = write(fd, buf, left);
+			if (w < 0) {
+				if (errno == EINTR) continue;
+				fprintf(stderr, "%s: %s: %s\n", ts->opts->progname, name, strerror(errno));
+				ts->errors++;
+				fd = -1;
+				break;
+			}
+			buf += w;
+			left -= w;
+		}
+
+		ts->off += avail;
+		len -= avail;
+	}
+	return 1;
+}
+
+static size_t tar_number(const char * field, size_t len) {
+	size_t value = 0;
+
+	/* GNU base-256 for values that don't fit in octal */
+	if ((unsigned char)field[0] & 0x80) {
+		value = field[0] & 0x7F;
+		for (size_t i = 1; i < len; ++i) value = (value << 8) | (unsigned char)field[i];
+		return value;
+	}
+
+	size_t i = 0;
+	while (i < len && field[i] == ' ') i++;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) {
+		value = value * 8 + (field[i] - '0');
+	}
+	return value;
+}
+
+static int tar_is_zero(const struct ustar * header) {
+	const uint8_t * b = (const uint8_t *)header;
+	for (size_t i = 0; i < TAR_RECORD; ++i) {
+		if (b[i]) return 0;
+	}
+	return 1;
+}
+
+/* The checksum is the byte sum of the header with the checksum field read as spaces. */
+static int tar_checksum_ok(const struct ustar * header) {
+	const uint8_t * b = (const uint8_t *)header;
+	unsigned int sum = 0;
+	for (size_t i = 0; i < TAR_RECORD; ++i) {
+		if (i >= offsetof(struct ustar, checksum) && i < offsetof(struct ustar, type)) {
+			sum += ' ';
+		} else {
+			sum += b[i];
+		}
+	}
+	return sum == tar_number(header->checksum, sizeof(header->checksum));
+}
+
+/* Pull the path and linkpath records out of a pax extended header. */
+static void tar_parse_pax(char * data, size_t size, char ** name, char ** link) {
+	size_t off = 0;
+	while (off < size) {
+		/* "LEN KEY=VALUE\n", where LEN counts the whole record */
+		char * end;
+		size_t len = strtoul(data + off, &end, 10);
+		if (!len || len > size - off || end >= data + off + len || *end != ' ') break;
+		char * newline = data + off + len - 1;
+		if (*newline != '\n') break;
+		char * key = end + 1;
+		char * eq = memchr(key, '=', newline - key);
+		if (eq) {
+			char * value = eq + 1;
+			size_t vlen = newline - value;
+			char ** out = NULL;
+			if ((size_t)(eq - key) == 4 && !memcmp(key, "path", 4)) out = name;
+			if ((size_t)(eq - key) == 8 && !memcmp(key, "linkpath", 8)) out = link;
+			if (out) {
+				char * copy = malloc(vlen + 1);
+				if (!copy) break;
+				memcpy(copy, value, vlen);
+				copy[vlen] = '\0';
+				free(*out);
+				*out = copy;
+			}
+		}
+		off += len;
+	}
+}
+
+static char * tar_path(struct tar_stream * ts, const char * name) {
+	const char * dir = ts->opts->directory;
+	char * out = malloc((dir ? strlen(dir) + 1 : 0) + strlen(name) + 1);
+	if (dir) {
+		sprintf(out, "%s/%s", dir, name);
+	} else {
+		strcpy(out, name);
+	}
+	return out;
+}
+
+/* Create any missing directories leading up to @p path. */
+static void tar_make_parents(const char * path) {
+	char * tmp = strdup(path);
+	for (char * c = tmp + 1; *c; ++c) {
+		if (*c == '/') {
+			*c = '\0';
+			mkdir(tmp, 0755);
+			*c = '/';
+		}
+	}
+	free(tmp);
+}
+
+static int tar_open(const char * path, unsigned int mode) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	if (fd < 0 && errno == ENOENT) {
+		tar_make_parents(path);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+	}
+	return fd;
+}
+
+static void tar_error(struct tar_stream * ts, const char * name) {
+	fprintf(stderr, "%s: %s: %s\n", ts->opts->progname, name, strerror(errno));
+	ts->errors++;
+}
+
+static void tar_set_owner(struct tar_stream * ts, const char * path, struct ustar * header) {
+	if (ts->opts->flags & TAR_SAME_OWNER) {
+		chown(path, tar_number(header->ownerid, sizeof(header->ownerid)),
+			tar_number(header->groupid, sizeof(header->groupid)));
+	}
+}
+
+/* Hard links are extracted as copies of the file they point to. */
+static void tar_copy_file(struct tar_stream * ts, const char * target, const char * path, unsigned int mode) {
+	int in = open(target, O_RDONLY);
+	if (in < 0) {
+		tar_error(ts, target);
+		return;
+	}
+	int out = tar_open(path, mode);
+	if (out < 0) {
+		tar_error(ts, path);
+		close(in);
+		return;
+	}
+
+	char * buf = malloc(65536);
+	ssize_t r;
+	while ((r = read(in, buf, 65536)) > 0) {
+		if (write(out, buf, r) != r) {
+			tar_error(ts, path);
+			break;
+		}
+	}
+	free(buf);
+	close(in);
+	close(out);
+}
+
+/* Returns 0 if the stream ended in the middle of this member. */
+static int tar_member(struct tar_stream * ts, struct ustar * header, const char * name, const char * link) {
+	struct tar_options * opts = ts->opts;
+	size_t size = tar_number(header->size, sizeof(header->size));
+	unsigned int mode = tar_number(header->mode, sizeof(header->mode)) & 07777;
+	char type = header->type[0];
+
+	/* Directories and links don't have data, whatever the header says */
+	if (type == '1' || type == '2' || type == '5') size = 0;
+
+	if (opts->filter && !opts->filter(name, opts->priv)) {
+		return tar_copy(ts, -1, size, name);
+	}
+
+	if (opts->flags & TAR_LIST) {
+		if (opts->flags & TAR_VERBOSE) {
+			fprintf(stdout, "%10zu %c %s\n", size, type ? type : '0', name);
+		} else {
+			fprintf(stdout, "%s\n", name);
+		}
+		opts->files++;
+		return tar_copy(ts, -1, size, name);
+	}
+
+	if (opts->flags & TAR_VERBOSE) {
+		fprintf((opts->flags & TAR_STDOUT) ? stderr : stdout, "%s\n", name);
+	}
+	if (opts->progress) opts->progress(name, opts->priv);
+
+	int to_stdout = !!(opts->flags & TAR_STDOUT);
+	char * path = tar_path(ts, name);
+	int ok = 1;
+
+	switch (type) {
+		case '\0':
+		case '0':
+		case '7': {
+			int fd = to_stdout ? STDOUT_FILENO : tar_open(path, mode);
+			if (fd < 0) tar_error(ts, name);
+			ok = tar_copy(ts, fd, size, name);
+			if (fd >= 0 && !to_stdout) {
+				close(fd);
+				chmod(path, mode);
+				tar_set_owner(ts, path, header);
+			}
+			opts->bytes += size;
+			break;
+		}
+		case '5':
+			if (to_stdout || !*name) break;
+			if (mkdir(path, mode) < 0) {
+				if (errno == ENOENT) {
+					tar_make_parents(path);
+					if (mkdir(path, mode) < 0 && errno != EEXIST) tar_error(ts, name);
+				} else if (errno != EEXIST) {
+					tar_error(ts, name);
+				}
+			}
+			tar_set_owner(ts, path, header);
+			break;
+		case '1':
+			if (!to_stdout) {
+				char * target = tar_path(ts, link);
+				tar_copy_file(ts, target, path, mode);
+				tar_set_owner(ts, path, header);
+				free(target);
+			}
+			break;
+		case '2':
+			if (to_stdout) break;
+			if (symlink(link, path) < 0) {
+				/* Replace whatever is there, or make room for it */
+				if (errno == EEXIST) {
+					unlink(path);
+				} else if (errno == ENOENT) {
+					tar_make_parents(path);
+				}
+				if (symlink(link, path) < 0) tar_error(ts, name);
+			}
+			break;
+		default:
+			fprintf(stderr, "%s: %s: unsupported member type '%c'\n", opts->progname, name, type);
+			ts->errors++;
+			ok = tar_copy(ts, -1, size, name);
+			break;
+	}
+
+	opts->files++;
+	free(path);
+	return ok;
+}
+
+static void tar_run(struct tar_stream * ts) {
+	struct ustar header;
+	char * long_name = NULL;
+	char * long_link = NULL;
+
+	while (1) {
+		size_t r = tar_read(ts, &header, TAR_RECORD);
+		if (r == 0) break; /* Missing end-of-archive records; accept it */
+		if (r != TAR_RECORD) goto _truncated;
+		if (tar_is_zero(&header)) break;
+
+		if (!tar_checksum_ok(&header)) {
+			fprintf(stderr, "%s: bad header checksum; not a tar archive?\n", ts->opts->progname);
+			ts->errors++;
+			break;
+		}
+
+		size_t size = tar_number(header.size, sizeof(header.size));
+		size_t padding = (TAR_RECORD - size % TAR_RECORD) % TAR_RECORD;
+		char type = header.type[0];
+
+		if (type == 'L' || type == 'K' || type == 'x') {
+			/* These are read into memory whole, and the size is whatever the header says */
+			size_t limit = type == 'x' ? TAR_PAX_MAX : PATH_MAX;
+			char * data = size <= limit ? malloc(size + 1) : NULL;
+			if (!data) {
+				fprintf(stderr, "%s: skipping oversized extended header (%zu bytes)\n", ts->opts->progname, size);
+				ts->errors++;
+				if (!tar_copy(ts, -1, size, "")) goto _truncated;
+			} else {
+				if (tar_read(ts, data, size) != size) {
+					free(data);
+					goto _truncated;
+				}
+				data[size] = '\0';
+				if (type == 'L') {
+					free(long_name);
+					long_name = data;
+				} else if (type == 'K') {
+					free(long_link);
+					long_link = data;
+				} else {
+					tar_parse_pax(data, size, &long_name, &long_link);
+					free(data);
+				}
+			}
+		} else if (type == 'g') {
+			/* Global pax headers don't carry anything we use */
+			if (!tar_copy(ts, -1, size, "")) goto _truncated;
+		} else {
+			char name[257];
+			char link[101];
+			if (header.prefix[0] && !long_name) {
+				snprintf(name, sizeof(name), "%.155s/%.100s", header.prefix, header.filename);
+			} else {
+				snprintf(name, sizeof(name), "%.100s", header.filename);
+			}
+			snprintf(link, sizeof(link), "%.100s", header.link);
+
+			const char * n = long_name ? long_name : name;
+			while (*n == '/') n++; /* Always extract relative to the target directory */
+
+			if (!tar_member(ts, &header, n, long_link ? long_link : link)) goto _truncated;
+
+			free(long_name);
+			free(long_link);
+			long_name = NULL;
+			long_link = NULL;
+
+			if (type == '1' || type == '2' || type == '5') size = padding = 0;
+		}
+
+		if (!tar_copy(ts, -1, padding, "")) goto _truncated;
+	}
+
+	free(long_name);
+	free(long_link);
+	return;
+
+_truncated:
+	fprintf(stderr, "%s: unexpected end of archive\n", ts->opts->progname);
+	ts->errors++;
+	free(long_name);
+	free(long_link);
+}
+
+int tar_extract(int fd, struct tar_options * opts) {
+	struct tar_stream ts = {0};
+	ts.fd = fd;
+	ts.opts = opts;
+	ts.in = malloc(TAR_CHUNK);
+	if (!opts->progname) opts->progname = "tar";
+
+	/* Peek at the start of the input for the gzip magic */
+	tar_read_input(&ts);
+	ts.gzip = !ts.in_eof && ts.in_len >= 2 && ts.in[0] == 0x1F && ts.in[1] == 0x8B;
+
+	pthread_t inflater;
+	if (ts.gzip) {
+		for (int i = 0; i < TAR_QUEUE; ++i) ts.queue[i] = malloc(TAR_CHUNK);
+		ts.fill = ts.queue[0];
+		pipe(ts.room.pipe);
+		pipe(ts.more.pipe);
+		pthread_create(&inflater, NULL, tar_inflate_thread, &ts);
+	} else {
+		ts.data = ts.in;
+		ts.len = ts.in_len;
+	}
+
+	tar_run(&ts);
+
+	int status = ts.errors ? 1 : 0;
+
+	if (ts.gzip) {
+		/* Drain whatever is left so the inflater can check the trailer */
+		while (tar_avail(&ts)) ts.off = ts.len;
+		pthread_join(inflater, NULL);
+		for (int i = 0; i < TAR_QUEUE; ++i) free(ts.queue[i]);
+		close(ts.room.pipe[0]);
+		close(ts.room.pipe[1]);
+		close(ts.more.pipe[0]);
+		close(ts.more.pipe[1]);
+
+		if (ts.status) {
+			fprintf(stderr, "%s: %s\n", opts->progname,
+				ts.status == 2 ? "crc error in compressed data" : "invalid compressed data");
+			status = 2;
+		}
+	}
+
+	free(ts.in);
+	return status;
+}
+
+int tar_extract_file(const char * path, struct tar_options * opts) {
+	if (!opts->progname) opts->progname = "tar";
+
+	int fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", opts->progname, path, strerror(errno));
+		return 1;
+	}
+
+	int status = tar_extract(fd, opts);
+	if (fd != STDIN_FILENO) close(fd);
+	return status;
+}
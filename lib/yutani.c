@@ -500,6 +500,28 @@ void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content) {
 	memcpy(cl->content, content, strlen(content));
 }
 
+void yutani_msg_buildx_frame_callback(yutani_msg_t * msg, yutani_wid_t wid) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_FRAME_CALLBACK;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_frame_callback);
+
+	struct yutani_msg_frame_callback * fc = (void *)msg->data;
+
+	fc->wid = wid;
+}
+
+void yutani_msg_buildx_frame_done(yutani_msg_t * msg, yutani_wid_t wid, uint32_t frame, uint64_t time) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_FRAME_DONE;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_frame_done);
+
+	struct yutani_msg_frame_done * fd = (void *)msg->data;
+
+	fd->wid = wid;
+	fd->frame = frame;
+	fd->time = time;
+}
+
 int yutani_msg_send(yutani_t * y, yutani_msg_t * msg) {
 	return pex_reply(y->sock, msg->size, (char *)msg);
 }
@@ -1039,6 +1061,23 @@ void yutani_set_clipboard(yutani_t * yctx, char * content) {
 	}
 }
 
+/**
+ * yutani_frame_callback
+ *
+ * Ask for a FRAME_DONE message once the compositor has presented
+ * a frame showing everything flipped to this window so far (right
+ * away if that has already happened). Clients that animate can send
+ * this after each flip and wait for the answer before drawing again,
+ * so they never draw frames that would not be shown.
+ *
+ * Each request is answered once, unless the window closes first.
+ */
+void yutani_frame_callback(yutani_t * yctx, yutani_window_t * window) {
+	yutani_msg_buildx_frame_callback_alloc(m);
+	yutani_msg_buildx_frame_callback(m, window->wid);
+	yutani_msg_send(yctx, m);
+}
+
 /**
  * yutani_open_clipboard
  *
@@ -1093,12 +1132,6 @@ void reinit_graphics_yutani(gfx_context_t * out, yutani_window_t * window) {
 	out->depth  = 32;
 	out->size   = GFX_H(out) * GFX_W(out) * GFX_B(out);
 
-	if (out->clips && out->clips_size != out->height) {
-		free(out->clips);
-		out->clips = NULL;
-		out->clips_size = 0;
-	}
-
 	if (out->buffer == out->backbuffer) {
 		out->buffer = window->buffer;
 		out->backbuffer = out->buffer;
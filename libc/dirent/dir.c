@@ -1,12 +1,14 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdlib.h>
 #include <syscall.h>
 #include <syscall_nums.h>
 #include <errno.h>
 #include <bits/dirent.h>
 
 DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+DEFN_SYSCALL3(getdents, SYS_GETDENTS, int, void *, size_t);
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -18,32 +20,55 @@ DIR * opendir (const char * dirname) {
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
 	dir->cur_entry = -1;
+	dir->buf_used = 0;
+	dir->buf_pos = 0;
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
-struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
+long getdents (int fd, void * buf, size_t size) {
+	__sets_errno(syscall_getdents(fd, buf, size));
+}
 
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+struct dirent * readdir (DIR * dirp) {
+	if (dirp->buf_pos >= dirp->buf_used) {
+		/* Refill with as many entries as the kernel can fit */
+		long ret = syscall_getdents(dirp->fd, dirp->buf, DIRENT_BUFSIZ);
+		if (ret < 0) {
+			errno = -ret;
+			return NULL;
+		}
+		if (ret == 0) {
+			/* end of directory */
+			return NULL;
+		}
+		dirp->buf_used = ret;
+		dirp->buf_pos = 0;
 	}
 
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
+	struct packed_dirent * p = (struct packed_dirent *)(dirp->buf + dirp->buf_pos);
+	dirp->buf_pos += p->d_reclen;
+	dirp->cur_entry++;
+
+	dirp->ent.d_ino = p->d_ino;
+	dirp->ent.d_type = p->d_type;
+	strcpy(dirp->ent.d_name, p->d_name);
+
+	return &dirp->ent;
+}
 
-	return &ent;
+void rewinddir (DIR * dirp) {
+	lseek(dirp->fd, 0, SEEK_SET);
+	dirp->cur_entry = -1;
+	dirp->buf_used = 0;
+	dirp->buf_pos = 0;
 }
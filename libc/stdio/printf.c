@@ -447,15 +447,39 @@ int vasprintf(char ** buf, const char * fmt, va_list args) {
 
 /* Streams */
 
+/*
+ * Collect formatted output in small chunks so the stream sees a few
+ * bulk writes rather than one call per character.
+ */
+struct FileData {
+	FILE * stream;
+	size_t written;
+	char buf[128];
+};
+
 static int cb_fprintf(void * user, char c) {
-	fputc(c,(FILE*)user);
+	struct FileData * data = user;
+	data->buf[data->written++] = c;
+	if (data->written == sizeof(data->buf)) {
+		fwrite(data->buf, 1, data->written, data->stream);
+		data->written = 0;
+	}
 	return 0;
 }
 
+int vfprintf(FILE * stream, const char *fmt, va_list args) {
+	struct FileData data;
+	data.stream = stream;
+	data.written = 0;
+	int out = xvasprintf(cb_fprintf, &data, fmt, args);
+	if (data.written) fwrite(data.buf, 1, data.written, stream);
+	return out;
+}
+
 int fprintf(FILE *stream, const char * fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	int out = xvasprintf(cb_fprintf, stream, fmt, args);
+	int out = vfprintf(stream, fmt, args);
 	va_end(args);
 	return out;
 }
@@ -463,16 +487,11 @@ int fprintf(FILE *stream, const char * fmt, ...) {
 int printf(const char * fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	int out = xvasprintf(cb_fprintf, stdout, fmt, args);
+	int out = vfprintf(stdout, fmt, args);
 	va_end(args);
 	return out;
 }
 
-int vfprintf(FILE * stream, const char *fmt, va_list args) {
-	return xvasprintf(cb_fprintf, stream, fmt, args);
-}
-
 int vprintf(const char *fmt, va_list args) {
-	return xvasprintf(cb_fprintf, stdout, fmt, args);
+	return vfprintf(stdout, fmt, args);
 }
-
@@ -8,23 +8,33 @@
 
 #include <_xlog.h>
 
+/* Buffers handed to us by setvbuf, which we must not free */
+#define STREAM_USER_READ_BUF  0x01
+#define STREAM_USER_WRITE_BUF 0x02
+
+/* What the stream was opened for */
+#define STREAM_CAN_READ       0x04
+#define STREAM_CAN_WRITE      0x08
+
 struct _FILE {
 	int fd;
 
 	char * read_buf;
-	int available;
-	int offset;
-	int read_from;
+	int available;  /* Bytes in read_buf we haven't handed out yet... */
+	int read_from;  /* ...and where they start */
 	int ungetc;
 	int eof;
+	int error;
 	int bufsiz;
-	long last_read_start;
 	char * _name;
 
 	char * write_buf;
 	size_t written;
 	size_t wbufsiz;
 
+	int mode;       /* _IONBF, _IOLBF, _IOFBF, or -1 until first use */
+	int flags;
+
 	struct _FILE * prev;
 	struct _FILE * next;
 };
@@ -33,48 +43,54 @@ FILE _stdin = {
 	.fd = 0,
 	.read_buf = NULL,
 	.available = 0,
-	.offset = 0,
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
+	.error = 0,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
 	.write_buf = NULL,
 	.written = 0,
+
+	.mode = -1,
+	.flags = STREAM_CAN_READ,
 };
 
 FILE _stdout = {
 	.fd = 1,
 	.read_buf = NULL,
 	.available = 0,
-	.offset = 0,
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
+	.error = 0,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
 	.write_buf = NULL,
 	.written = 0,
+
+	.mode = -1,
+	.flags = STREAM_CAN_WRITE,
 };
 
 FILE _stderr = {
 	.fd = 2,
 	.read_buf = NULL,
 	.available = 0,
-	.offset = 0,
 	.read_from = 0,
 	.ungetc = -1,
 	.eof = 0,
-	.last_read_start = 0,
+	.error = 0,
 	.bufsiz = BUFSIZ,
 
 	.wbufsiz = BUFSIZ,
 	.write_buf = NULL,
 	.written = 0,
+
+	.mode = _IOLBF,
+	.flags = STREAM_CAN_WRITE,
 };
 
 FILE * stdin = &_stdin;
@@ -114,100 +130,199 @@ static char * stream_id(FILE * stream) {
 extern int __libc_debug;
 extern char * _argv_0;
 
+/*
+ * Streams start out undecided; the first time one is used, it becomes
+ * line buffered if it's a terminal and fully buffered otherwise.
+ * stderr is always line buffered.
+ */
+static int stream_mode(FILE * stream) {
+	if (stream->mode == -1) {
+		int _errno = errno;
+		stream->mode = isatty(stream->fd) ? _IOLBF : _IOFBF;
+		errno = _errno;
+	}
+	return stream->mode;
+}
+
 int setvbuf(FILE * stream, char * buf, int mode, size_t size) {
-	if (mode != _IOLBF) {
-		return -1; /* Unsupported */
+	if (mode != _IONBF && mode != _IOLBF && mode != _IOFBF) {
+		errno = EINVAL;
+		return -1;
 	}
-	if (buf) {
-		if (stream->read_buf) {
-			free(stream->read_buf);
+	if (buf && size) {
+		/*
+		 * The buffer goes to whichever side the stream was opened for.
+		 * A stream open for both writes through it, and gets a read
+		 * buffer of our own of the same size.
+		 */
+		if (stream->flags & STREAM_CAN_WRITE) {
+			fflush(stream);
+			if (!(stream->flags & STREAM_USER_WRITE_BUF)) free(stream->write_buf);
+			stream->write_buf = buf;
+			stream->wbufsiz = size;
+			stream->flags |= STREAM_USER_WRITE_BUF;
+		}
+		if (stream->flags & STREAM_CAN_READ) {
+			char * read_buf = buf;
+			if (stream->flags & STREAM_CAN_WRITE) {
+				read_buf = (stream->flags & STREAM_USER_READ_BUF) ? NULL : stream->read_buf;
+				read_buf = realloc(read_buf, size);
+				if (!read_buf) return -1;
+				stream->flags &= ~STREAM_USER_READ_BUF;
+			} else {
+				if (!(stream->flags & STREAM_USER_READ_BUF)) free(stream->read_buf);
+				stream->flags |= STREAM_USER_READ_BUF;
+			}
+			stream->read_buf = read_buf;
+			stream->bufsiz = size;
+			stream->available = 0;
+			stream->read_from = 0;
 		}
-		stream->read_buf = buf;
-		stream->bufsiz = size;
 	}
+	stream->mode = mode;
 	return 0;
 }
 
+static size_t write_all(FILE * stream, const char * buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = syscall_write(stream->fd, (char *)buf + done, len - done);
+		if (r <= 0) {
+			if (r < 0) errno = -r;
+			stream->error = 1;
+			break;
+		}
+		done += r;
+	}
+	return done;
+}
+
 int fflush(FILE * stream) {
+	if (!stream) {
+		int out = 0;
+		if (stdout && stdout->written) out |= fflush(stdout);
+		if (stderr && stderr->written) out |= fflush(stderr);
+		for (FILE * f = _head; f; f = f->next) {
+			if (f->written) out |= fflush(f);
+		}
+		return out ? EOF : 0;
+	}
 	if (!stream->write_buf) return EOF;
 	if (stream->written) {
-		syscall_write(stream->fd, stream->write_buf, stream->written);
+		size_t len = stream->written;
 		stream->written = 0;
+		if (write_all(stream, stream->write_buf, len) < len) return EOF;
 	}
 	return 0;
 }
 
-static size_t write_bytes(FILE * f, char * buf, size_t len) {
+/*
+ * Before writing to a stream we've been reading from, put the kernel's
+ * offset back to where the reader thinks it is.
+ */
+static void drop_read_buffer(FILE * f) {
+	if (f->available) {
+		syscall_seek(f->fd, -(long)f->available, SEEK_CUR);
+		f->available = 0;
+		f->read_from = 0;
+	}
+}
+
+static size_t write_bytes(FILE * f, const char * buf, size_t len) {
 	if (!f->write_buf) return 0;
+	if (f->available) drop_read_buffer(f);
 
-	size_t newBytes = 0;
-	while (len > 0) {
-		f->write_buf[f->written++] = *buf;
-		if (f->written == (size_t)f->wbufsiz || *buf == '\n') {
-			fflush(f);
-		}
-		newBytes++;
-		buf++;
-		len--;
+	int mode = stream_mode(f);
+
+	/* Anything that wouldn't fit in the buffer anyway goes straight out */
+	if (len >= f->wbufsiz) {
+		if (fflush(f)) return 0;
+		return write_all(f, buf, len);
+	}
+
+	size_t done = 0;
+	while (done < len) {
+		size_t chunk = f->wbufsiz - f->written;
+		if (chunk > len - done) chunk = len - done;
+		memcpy(&f->write_buf[f->written], buf + done, chunk);
+		f->written += chunk;
+		done += chunk;
+		if (f->written == f->wbufsiz && fflush(f)) return done;
+	}
+
+	if (mode == _IONBF || (mode == _IOLBF && memchr(buf, '\n', len))) {
+		fflush(f);
 	}
 
-	return newBytes;
+	return len;
 }
 
 static size_t read_bytes(FILE * f, char * out, size_t len) {
 	size_t r_out = 0;
 
-	//fprintf(stderr, "%s: Read %d bytes from %s\n", _argv_0, len, stream_id(f));
-	//fprintf(stderr, "%s: off[%d] avail[%d] read[%d]\n", _argv_0, f->offset, f->available, f->read_from);
+	if (f->written) fflush(f);
+
+	if (len && f->ungetc >= 0) {
+		*out++ = f->ungetc;
+		len--;
+		r_out++;
+		f->ungetc = -1;
+	}
 
 	while (len > 0) {
-		if (f->ungetc >= 0) {
-			*out = f->ungetc;
-			len--;
-			out++;
-			r_out++;
-			f->ungetc = -1;
+		if (f->available) {
+			size_t chunk = (size_t)f->available < len ? (size_t)f->available : len;
+			memcpy(out, &f->read_buf[f->read_from], chunk);
+			f->read_from += chunk;
+			f->available -= chunk;
+			out += chunk;
+			len -= chunk;
+			r_out += chunk;
 			continue;
 		}
 
-		if (f->available == 0) {
-			if (f->offset == f->bufsiz) {
-				f->offset = 0;
+		/* About to wait on a terminal; make sure the prompt is out */
+		if (stream_mode(f) != _IOFBF && stdout->written && stream_mode(stdout) != _IOFBF) {
+			fflush(stdout);
+		}
+
+		ssize_t r;
+		if (len >= (size_t)f->bufsiz) {
+			/* Large reads go straight into the caller's memory */
+			r = read(f->fd, out, len);
+			if (r > 0) {
+				out += r;
+				len -= r;
+				r_out += r;
+				continue;
 			}
-			f->last_read_start = syscall_seek(f->fd, 0, SEEK_CUR);
-			ssize_t r = read(fileno(f), &f->read_buf[f->offset], f->bufsiz - f->offset);
-			if (r < 0) {
-				//fprintf(stderr, "error condition\n");
-				return r_out;
-			} else {
-				f->read_from = f->offset;
+		} else {
+			r = read(f->fd, f->read_buf, f->bufsiz);
+			if (r > 0) {
+				f->read_from = 0;
 				f->available = r;
-				f->offset += f->available;
+				continue;
 			}
 		}
 
-		if (f->available == 0) {
-			/* EOF condition */
-			//fprintf(stderr, "%s: no bytes available, returning read value of %d\n", _argv_0, r_out);
+		if (r < 0) {
+			f->error = 1;
+		} else {
 			f->eof = 1;
-			return r_out;
-		}
-
-		//fprintf(stderr, "%s: reading until %d reaches %d or %d reaches 0\n", _argv_0, f->read_from, f->offset, len);
-		while (f->read_from < f->offset && len > 0 && f->available > 0) {
-			*out = f->read_buf[f->read_from];
-			len--;
-			f->read_from++;
-			f->available--;
-			out++;
-			r_out += 1;
 		}
+		return r_out;
 	}
 
-	//fprintf(stderr, "%s: read completed, returning read value of %d\n", _argv_0, r_out);
 	return r_out;
 }
 
+static int stream_access(int flags) {
+	int out = 0;
+	if (!(flags & O_WRONLY) || (flags & O_RDWR)) out |= STREAM_CAN_READ;
+	if (flags & (O_WRONLY | O_RDWR)) out |= STREAM_CAN_WRITE;
+	return out;
+}
+
 static void parse_mode(const char * mode, int * flags_, int * mask_) {
 	const char * x = mode;
 
@@ -256,9 +371,10 @@ FILE * fopen(const char *path, const char *mode) {
 	out->bufsiz = BUFSIZ;
 	out->available = 0;
 	out->read_from = 0;
-	out->offset = 0;
 	out->ungetc = -1;
 	out->eof = 0;
+	out->mode = -1;
+	out->flags = stream_access(flags);
 	out->_name = strdup(path);
 
 	out->write_buf = malloc(BUFSIZ);
@@ -284,9 +400,11 @@ FILE * freopen(const char *path, const char *mode, FILE * stream) {
 		stream->fd = fd;
 		stream->available = 0;
 		stream->read_from = 0;
-		stream->offset = 0;
 		stream->ungetc = -1;
 		stream->eof = 0;
+		stream->error = 0;
+		stream->mode = (stream == &_stderr) ? _IOLBF : -1;
+		stream->flags = (stream->flags & ~(STREAM_CAN_READ | STREAM_CAN_WRITE)) | stream_access(flags);
 		stream->_name = strdup(path);
 		stream->written = 0;
 		if (stream != &_stdin && stream != &_stdout && stream != &_stderr) {
@@ -311,6 +429,9 @@ int ungetc(int c, FILE * stream) {
 }
 
 FILE * fdopen(int fd, const char *mode){
+	int flags, mask;
+	parse_mode(mode, &flags, &mask);
+
 	FILE * out = malloc(sizeof(FILE));
 	memset(out, 0, sizeof(struct _FILE));
 	out->fd = fd;
@@ -318,9 +439,10 @@ FILE * fdopen(int fd, const char *mode){
 	out->bufsiz = BUFSIZ;
 	out->available = 0;
 	out->read_from = 0;
-	out->offset = 0;
 	out->ungetc = -1;
 	out->eof = 0;
+	out->mode = -1;
+	out->flags = stream_access(flags);
 
 	char tmp[30];
 	sprintf(tmp, "fd[%d]", fd);
@@ -345,8 +467,9 @@ int fclose(FILE * stream) {
 	fflush(stream);
 	int out = syscall_close(stream->fd);
 	free(stream->_name);
-	free(stream->read_buf);
-	if (stream->write_buf) free(stream->write_buf);
+	if (!(stream->flags & STREAM_USER_READ_BUF)) free(stream->read_buf);
+	if (stream->write_buf && !(stream->flags & STREAM_USER_WRITE_BUF)) free(stream->write_buf);
+	stream->read_buf = NULL;
 	stream->write_buf = NULL;
 	if (stream == &_stdin || stream == &_stdout || stream == &_stderr) {
 		return out;
@@ -369,21 +492,16 @@ static char * _whence_str(int whence) {
 }
 
 int fseek(FILE * stream, long offset, int whence) {
-	if (_argv_0 && strcmp(_argv_0, "ld.so")) {
-		if (stream->read_from && whence == SEEK_CUR) {
-			if (__libc_debug) {
-				fprintf(stderr, "%s: fseek(%s, %ld, %s)\n", _argv_0, stream->_name, offset, _whence_str(whence));
-				fprintf(stderr, "\033[33;3mWARNING\033[0m: seeking when offset is currently %d\n", stream->read_from);
-				fprintf(stderr, "\033[33;3mWARNING\033[0m: this may not be reflected in kernel\n");
-			}
-			offset = offset + stream->read_from + stream->last_read_start;
-			whence = SEEK_SET;
-		}
+	if (_argv_0 && strcmp(_argv_0, "ld.so") && __libc_debug) {
+		fprintf(stderr, "%s: fseek(%s, %ld, %s)\n", _argv_0, stream->_name, offset, _whence_str(whence));
 	}
 	if (stream->written) {
 		fflush(stream);
 	}
-	stream->offset = 0;
+	if (whence == SEEK_CUR) {
+		/* The kernel is ahead of the reader by whatever is still buffered */
+		offset -= stream->available + (stream->ungetc >= 0);
+	}
 	stream->read_from = 0;
 	stream->available = 0;
 	stream->ungetc = -1;
@@ -404,20 +522,12 @@ long ftell(FILE * stream) {
 	if (stream->written) {
 		fflush(stream);
 	}
-	if (stream->read_from || stream->last_read_start) {
-		return stream->last_read_start + stream->read_from;
-	}
-	stream->offset = 0;
-	stream->read_from = 0;
-	stream->available = 0;
-	stream->ungetc = -1;
-	stream->eof = 0;
 	long resp = syscall_seek(stream->fd, 0, SEEK_CUR);
 	if (resp < 0) {
 		errno = -resp;
 		return -1;
 	}
-	return resp;
+	return resp - stream->available - (stream->ungetc >= 0);
 }
 
 int fgetpos(FILE *stream, fpos_t *pos) {
@@ -433,33 +543,13 @@ int fsetpos(FILE *stream, const fpos_t *pos) {
 }
 
 size_t fread(void *ptr, size_t size, size_t nmemb, FILE * stream) {
-	char * tracking = (char*)ptr;
-	for (size_t i = 0; i < nmemb; ++i) {
-		int r = read_bytes(stream, tracking, size);
-		if (r < 0) {
-			return -1;
-		}
-		tracking += r;
-		if (r < (int)size) {
-			return i;
-		}
-	}
-	return nmemb;
+	if (!size || !nmemb) return 0;
+	return read_bytes(stream, ptr, size * nmemb) / size;
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE * stream) {
-	char * tracking = (char*)ptr;
-	for (size_t i = 0; i < nmemb; ++i) {
-		int r = write_bytes(stream, tracking, size);
-		if (r < 0) {
-			return -1;
-		}
-		tracking += r;
-		if (r < (int)size) {
-			return i;
-		}
-	}
-	return nmemb;
+	if (!size || !nmemb) return 0;
+	return write_bytes(stream, ptr, size * nmemb) / size;
 }
 
 int fileno(FILE * stream) {
@@ -467,9 +557,8 @@ int fileno(FILE * stream) {
 }
 
 int fputs(const char *s, FILE *stream) {
-	while (*s) {
-		fputc(*s++, stream);
-	}
+	size_t len = strlen(s);
+	if (write_bytes(stream, s, len) < len) return EOF;
 	return 0;
 }
 
@@ -482,6 +571,10 @@ int fputc(int c, FILE *stream) {
 int putc(int c, FILE *stream) __attribute__((weak, alias("fputc")));
 
 int fgetc(FILE * stream) {
+	if (stream->available && stream->ungetc < 0) {
+		stream->available--;
+		return (unsigned char)stream->read_buf[stream->read_from++];
+	}
 	char buf[1];
 	int r;
 	r = fread(buf, 1, 1, stream);
@@ -535,7 +628,7 @@ void rewind(FILE *stream) {
 }
 
 void setbuf(FILE * stream, char * buf) {
-	// ...
+	setvbuf(stream, buf, buf ? _IOFBF : _IONBF, BUFSIZ);
 }
 
 int feof(FILE * stream) {
@@ -544,8 +637,9 @@ int feof(FILE * stream) {
 
 void clearerr(FILE * stream) {
 	stream->eof = 0;
+	stream->error = 0;
 }
 
 int ferror(FILE * stream) {
-	return 0; /* TODO */
+	return stream->error;
 }
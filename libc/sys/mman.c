@@ -0,0 +1,10 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+DEFN_SYSCALL4(mapfile, SYS_MAPFILE, int, void *, size_t, long);
+
+int mapfile(int fd, void * addr, size_t length, off_t offset) {
+	__sets_errno(syscall_mapfile(fd, addr, length, offset));
+}
@@ -0,0 +1,27 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static long processor_count(void) {
+	FILE * f = fopen("/proc/cpuinfo", "r");
+	if (!f) return 1;
+	long count = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Processor:", 10)) count++;
+	}
+	fclose(f);
+	return count ? count : 1;
+}
+
+long sysconf(int name) {
+	switch (name) {
+		case _SC_NPROCESSORS_CONF:
+		case _SC_NPROCESSORS_ONLN:
+			return processor_count();
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+}
@@ -6,11 +6,11 @@
  * shared library dependencies.
  *
  * As of writing, this is a simplistic and not-fully-compliant
- * implementation of ELF dynamic linking. It suffers from a number
- * of issues, including not actually sharing libraries (there
- * isn't a sufficient mechanism in the kernel at the moment for
- * doing that - we need something with copy-on-write, preferably
- * an mmap-file mechanism), as well as not handling symbol
+ * implementation of ELF dynamic linking. Read-only segments of the
+ * main object and the libraries it links against are mapped from
+ * the kernel's page cache, so their pages are shared by everything
+ * using them; writable segments, and anything loaded later with
+ * dlopen, are still private copies. It also doesn't handle symbol
  * resolution correctly.
  *
  * However, it's sufficient for our purposes, and works well enough
@@ -30,6 +30,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/sysfunc.h>
+#include <sys/mman.h>
 
 #include <kernel/elf.h>
 
@@ -105,6 +106,7 @@ typedef struct elf_object {
 	size_t init_array_size;
 
 	uintptr_t base;
+	int textrel;
 
 	list_t * dependencies;
 
@@ -272,8 +274,26 @@ static size_t object_calculate_size(elf_t * object) {
 	return end_addr - base_addr;
 }
 
-/* Load an object into memory */
-static uintptr_t object_load(elf_t * object, uintptr_t base) {
+/*
+ * Map a read-only segment from the page cache instead of reading it
+ * in. Segments that need zero-filling, don't line up with their file
+ * offset, or would land on the last page of an earlier one are
+ * loaded normally.
+ */
+static int object_map_shared(elf_t * object, Elf64_Phdr * phdr, uintptr_t base, uintptr_t end_addr) {
+	if (phdr->p_flags & PF_W) return 0;
+	if (phdr->p_filesz != phdr->p_memsz) return 0;
+	if (((base + phdr->p_vaddr) & 0xFFF) != (phdr->p_offset & 0xFFF)) return 0;
+
+	uintptr_t start = (base + phdr->p_vaddr) & ~0xFFFUL;
+	if (start < ((end_addr + 0xFFF) & ~0xFFFUL)) return 0;
+
+	size_t length = base + phdr->p_vaddr + phdr->p_memsz - start;
+	return mapfile(fileno(object->file), (void *)start, length, phdr->p_offset & ~0xFFFUL) == 0;
+}
+
+/* Load an object into memory; @share allows read-only segments to be mapped from the page cache */
+static uintptr_t object_load(elf_t * object, uintptr_t base, int share) {
 
 	uintptr_t end_addr = 0x0;
 
@@ -289,7 +309,7 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 
 		switch (phdr.p_type) {
 			case PT_LOAD:
-				{
+				if (!share || !object_map_shared(object, &phdr, base, end_addr)) {
 					/* Request memory to load this PHDR into */
 					char * args[] = {(char *)(base + phdr.p_vaddr), (char *)phdr.p_memsz};
 					sysfunc(TOARU_SYS_FUNC_MMAP, args);
@@ -304,11 +324,11 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 						*(char *)(phdr.p_vaddr + base + r) = 0;
 						r++;
 					}
+				}
 
-					/* If this expands our end address, be sure to update it */
-					if (end_addr < phdr.p_vaddr + base + phdr.p_memsz) {
-						end_addr = phdr.p_vaddr + base + phdr.p_memsz;
-					}
+				/* If this expands our end address, be sure to update it */
+				if (end_addr < phdr.p_vaddr + base + phdr.p_memsz) {
+					end_addr = phdr.p_vaddr + base + phdr.p_memsz;
 				}
 				break;
 			case PT_DYNAMIC:
@@ -327,6 +347,22 @@ static uintptr_t object_load(elf_t * object, uintptr_t base) {
 	return end_addr;
 }
 
+/*
+ * Objects with text relocations write to their read-only segments,
+ * so those need private, writable copies of anything that was mapped.
+ */
+static void object_unshare(elf_t * object) {
+	for (size_t i = 0; i < object->header.e_phnum; ++i) {
+		Elf64_Phdr phdr;
+		fseek(object->file, object->header.e_phoff + object->header.e_phentsize * i, SEEK_SET);
+		fread(&phdr, object->header.e_phentsize, 1, object->file);
+		if (phdr.p_type == PT_LOAD && !(phdr.p_flags & PF_W)) {
+			char * args[] = {(char *)(object->base + phdr.p_vaddr), (char *)phdr.p_memsz};
+			sysfunc(TOARU_SYS_FUNC_MMAP, args);
+		}
+	}
+}
+
 /* Perform cleanup after loading */
 static int object_postload(elf_t * object) {
 
@@ -360,10 +396,15 @@ static int object_postload(elf_t * object) {
 				case DT_INIT_ARRAYSZ: /* DT_INIT_ARRAYSZ - size of the table of constructors */
 					object->init_array_size = table->d_un.d_val / sizeof(uintptr_t);
 					break;
+				case DT_TEXTREL: /* DT_TEXTREL - relocations apply to read-only segments */
+					object->textrel = 1;
+					break;
 			}
 			table++;
 		}
 
+		if (object->textrel) object_unshare(object);
+
 		/*
 		 * Read through dependencies
 		 * We have to do this separately from the above to make sure
@@ -624,7 +665,7 @@ static void * do_actual_load(const char * filename, elf_t * lib, int flags) {
 	 * but we don't have the functionality available.
 	 */
 	uintptr_t load_addr = (uintptr_t)malloc(lib_size);
-	object_load(lib, load_addr);
+	object_load(lib, load_addr, 0);
 
 	/* Perform cleanup steps */
 	object_postload(lib);
@@ -708,7 +749,7 @@ static elf_t * preload(hashmap_t * libs, list_t * load_libs, char * lib_name) {
 	}
 
 	/* Load PHDRs */
-	end_addr = object_load(lib, end_addr);
+	end_addr = object_load(lib, end_addr, 1);
 
 	/* Extract information */
 	object_postload(lib);
@@ -854,7 +895,7 @@ int main(int argc, char * argv[]) {
 	}
 
 	/* Load the main object */
-	end_addr = object_load(main_obj, 0x0);
+	end_addr = object_load(main_obj, 0x0, 1);
 	object_postload(main_obj);
 	object_find_copy_relocations(main_obj);
 